@@ -7,6 +7,28 @@
 #endif
 #include "errors.h"
 #include "config.h"
+#include "interp.h"
+
+/* Keys of options that only have a long name */
+enum {
+	OPT_THREADS = 256,
+	OPT_EPSILON,
+	OPT_INTERP,
+	OPT_MAXRELERR,
+	OPT_MEMBUDGET,
+	OPT_OUTFMT,
+	OPT_COMPRESSION,
+	OPT_NOJOURNAL,
+	OPT_JOURNALFSYNC,
+	OPT_BINS,
+	OPT_PLANPARTITIONS,
+	OPT_WORKERS,
+	OPT_DRYRUN,
+	OPT_CACHE,
+	OPT_CACHESIZE,
+	OPT_STATE,
+	OPT_SEGMENTS
+};
 
 const char *argp_program_version = LPSD_VERSION;
 const char *argp_program_bug_address = "<m.troebs@gmx.de>";
@@ -30,7 +52,7 @@ static struct argp_option options[] = {
 	{"tmax",    'e', "tmax", 0, "stop time in seconds", 					0},
 	{"fsamp",   'f', "sampl. freq.", 0, "sampling frequency in Hertz",			0},
 	{"gnuplot", 'g', "gnuplot file",  0, "gnuplot file name",				0},
-	{"method",  'h', "0, 1",   0, "method for frequency calculation: 0-LPSD, 1-FFT",	0},
+	{"method",  'h', "0, 1, 2",   0, "method for frequency calculation: 0-LPSD, 1-FFT, 2-cheaper of both per block",	0},
 	{"input",   'i', "input file",  0, "input file name",					0},
 	{"dataset_name", 'D', "name of HDF5 dataset containing the data", 0, "name of HDF5 dataset containing the data", 0 },
 	{"fres",    'j', "FFT freq. res.", 0, "Frequency resolution for FFT", 			0},
@@ -50,6 +72,23 @@ static struct argp_option options[] = {
 	{"scale",   'x', "factor", 0,"scaling factor",						0},
 	{"iter",    'N', "iteration number", 0, "The current iteration of the run",             0}, 
 	{"Jdes",    'J', "Total frequencies", 0, "The total number of calculated freqs",        0},
+	{"threads", OPT_THREADS, "# of threads", 0, "number of compute threads",			0},
+	{"workers", OPT_WORKERS, "N", 0, "number of worker processes sharing the bins of this run", 0},
+	{"epsilon", OPT_EPSILON, "epsilon", 0, "METHOD 1: relative segment length change per block",	0},
+	{"interp",  OPT_INTERP, "linear, cubic, sinc", 0, "METHOD 1: spectral interpolation",	0},
+	{"max-rel-error", OPT_MAXRELERR, "error", 0, "METHOD 1: choose block widths for this relative error", 0},
+	{"memory-budget", OPT_MEMBUDGET, "MB", 0, "memory for in-core FFTs, larger FFTs run out of core", 0},
+	{"output-format", OPT_OUTFMT, "text, hdf5", 0, "format of the output file",		0},
+	{"compression", OPT_COMPRESSION, "0-9", 0, "deflate level of HDF5 output (0: none)",	0},
+	{"no-journal", OPT_NOJOURNAL, 0, 0, "do not checkpoint completed bins to <output>.journal",	0},
+	{"journal-fsync", OPT_JOURNALFSYNC, "s", 0, "seconds between journal syncs (0: every bin/block, -1: never)", 0},
+	{"cache",   OPT_CACHE, "dir", 0, "reuse bins of earlier runs stored in dir, and store the new ones", 0},
+	{"cache-size", OPT_CACHESIZE, "MB", 0, "size limit of the cache, least recently used runs are removed", 0},
+	{"state",   OPT_STATE, "file", 0, "METHOD 0: keep the running sums of the bins in file, a later run only adds new samples", 0},
+	{"segments", OPT_SEGMENTS, "file", 0, "store the DFT of every segment of the exact bins in file, for lpsd-resum", 0},
+	{"bins",    OPT_BINS, "j0:j1", 0, "calculate bins j0..j1-1 of the Jdes bins (instead of -n/-N)",	0},
+	{"plan-partitions", OPT_PLANPARTITIONS, "P", 0, "write " PARTFN " and " DAGFN " for P partitions of equal cost, then exit", 0},
+	{"dry-run", OPT_DRYRUN, 0, 0, "estimate samples, flops, I/O, memory and run time of every method, then exit", 0},
 	{0,0,0,0,0,0}
 };
 
@@ -174,8 +213,73 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		break;	
 	case 'J':
 		arguments->Jdes=atof(arg);	
+		break;
+	case OPT_THREADS:
+		arguments->nthreads=atoi(arg);
+		if (arguments->nthreads < 1) gerror("Number of threads must be at least 1");
+		break;
+	case OPT_DRYRUN:
+		arguments->dry_run=1;
+		break;
+	case OPT_WORKERS:
+		arguments->workers=atoi(arg);
+		if (arguments->workers < 1) gerror("Number of workers must be at least 1");
+		break;
+	case OPT_EPSILON:
+		arguments->epsilon=atof(arg);
+		if ((arguments->epsilon <= 0) || (arguments->epsilon >= 1)) gerror("epsilon must be between 0 and 1");
+		break;
+	case OPT_INTERP:
+		arguments->interp=parse_interp(arg);
+		break;
+	case OPT_MAXRELERR:
+		arguments->max_rel_error=atof(arg);
+		break;
+	case OPT_MEMBUDGET:
+		arguments->memory_budget=atof(arg);
+		if (arguments->memory_budget <= 0) gerror("Memory budget must be positive");
+		break;
+	case OPT_OUTFMT:
+		if (strcmp(arg, "text") == 0) arguments->output_format=OUTFMT_TEXT;
+		else if (strcmp(arg, "hdf5") == 0) arguments->output_format=OUTFMT_HDF5;
+		else gerror1("Unknown output format %s (use text or hdf5)", arg);
+		break;
+	case OPT_COMPRESSION:
+		arguments->compression=atoi(arg);
+		if ((arguments->compression < 0) || (arguments->compression > 9)) gerror("Compression level must be between 0 and 9");
+		break;
+	case OPT_NOJOURNAL:
+		arguments->journal=0;
+		break;
+	case OPT_JOURNALFSYNC:
+		arguments->journal_fsync=atof(arg);
+		break;
+	case OPT_CACHE:
+		strncpy(arguments->cache_dir, arg, FNLEN - 1);
+		break;
+	case OPT_CACHESIZE:
+		arguments->cache_size=atof(arg);
+		if (arguments->cache_size <= 0) gerror("Cache size must be positive");
+		break;
+	case OPT_STATE:
+		strncpy(arguments->state_fn, arg, FNLEN - 1);
+		break;
+	case OPT_SEGMENTS:
+		strncpy(arguments->segments_fn, arg, FNLEN - 1);
+		break;
+	case OPT_BINS:
+		if ((sscanf(arg, "%ld:%ld", &arguments->binrange[0], &arguments->binrange[1]) != 2)
+		    || (arguments->binrange[0] < 0) || (arguments->binrange[1] <= arguments->binrange[0]))
+			gerror1("Bin range %s must be j0:j1 with 0 <= j0 < j1", arg);
+		break;
+	case OPT_PLANPARTITIONS:
+		arguments->plan_partitions=atoi(arg);
+		if (arguments->plan_partitions < 1) gerror("Number of partitions must be at least 1");
+		break;
 		
     	case ARGP_KEY_END:
+		/* a bin range replaces -n and -N */
+		if (arguments->binrange[1] > 0) arguments->nspec = arguments->binrange[1] - arguments->binrange[0];
       		break;
 
 	default:
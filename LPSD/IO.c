@@ -6,6 +6,13 @@
 #include <math.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <glob.h>
+#include <limits.h>
+#include <zlib.h>
 #include "config.h"
 #include "misc.h"
 #include "errors.h"
@@ -15,178 +22,57 @@
 #include "StrParser.h"
 
 
-static FILE *ifp = 0;			/* input file pointer */
-static char curline[DATALEN];		/* currently read input data line */
-static double curdata;			/* contains current data */
-static double curtime;			/* contains current time */
-static double dts;			/* sum of delta t's */
-static double dt2s;			/* sum of delta t^2's */
-static double *data = 0;		/* pointer to all data */
-static int (*read_data) (void);		/* pointer to function reading input data */
-static unsigned int timecol;		/* column 1 contains time in s */
-static unsigned int colA;		/* read data from column A */
-static unsigned int colB;		/* read data from column B */
+static pthread_mutex_t hdf5_lock = PTHREAD_MUTEX_INITIALIZER;	/* serialises HDF5 calls between threads */
+static __thread int hdf5_depth = 0;	/* hdf5_enter calls of this thread not yet left */
+static __thread struct error_cleanup hdf5_cleanup;	/* releases the lock on errors */
 
-static void replaceComma(char *s);
-static int read_t_A_B(void);
-static int read_A_B(void);
-static int read_A(void);
-
-/********************************************************************************
- *	replaces commas by decimal dots						*
- *	parameters:								*
- *		char *s		pointer to string to be changed			*
- ********************************************************************************/
-static void replaceComma(char *s) {
-	unsigned int n;
-	
-	for (n = 0; s[n] > 0; n++)
-		if (s[n] == ',')
-			s[n] = '.';
-
-}
-
-/********************************************************************************
- *	reads time and two columns from a file					*
- *	returns:								*
- *		1 on success							*
- *		0 on failure							*
- ********************************************************************************/
-static int read_t_A_B(void)
+// An error returned to a trap from inside HDF5 calls
+static void hdf5_release(void *arg __attribute__ ((unused)))
 {
-	unsigned int n, ok = 0;
-	char s[DATALEN];
-	char *col;
-	double dataA, dataB;
-	
-	strcpy(&s[0],&curline[0]);
-	col=strtok(s,DATADEL);			/* ATTENTION: s gets altered by strtok */
-	if (sscanf(col,"%lg",&curtime)==1) 
-		ok = 1;
-
-//	printf("time=%f\t",curtime);
-
-	for (n=1; n<colA;n++) col=strtok(NULL,DATADEL);
-	if (sscanf(col,"%lg",&dataA)==1) 
-		ok = 1; else ok=0;
-//	printf("dataA=%f\t",dataA);
-	for (n=0; n<colB-colA;n++) col=strtok(NULL,DATADEL);
-	if (sscanf(col,"%lg",&dataB)==1) 
-		ok = 1; else ok=0;
-//	printf("dataB=%f\n",dataB);
-	curdata=dataB-dataA;
-
-	return (ok);
+    hdf5_depth = 0;
+    pthread_mutex_unlock(&hdf5_lock);
 }
 
-/********************************************************************************
- *	reads time and one column from a file					*
- *	returns:								*
- *		1 on success							*
- *		0 on failure							*
- ********************************************************************************/
-static int read_t_A(void)
+// @brief Take the lock of HDF5 calls; the HDF5 library is not thread-safe unless built so.
+// @brief A thread may nest hdf5_enter, each followed by hdf5_leave.
+void hdf5_enter(void)
 {
-	unsigned int n, ok = 0;
-	char s[DATALEN];
-	char *col;
-	
-	strcpy(&s[0],&curline[0]);
-
-	col=strtok(s,DATADEL);			/* ATTENTION: s gets altered by strtok */
-	if (sscanf(col,"%lg",&curtime)==1) 
-		ok = 1;
-
-//	printf("time=%f\t",curtime);
-
-	for (n=1; n<colA;n++) col=strtok(NULL,DATADEL);
-	if (sscanf(col,"%lg",&curdata)==1) 
-		ok = 1; else ok=0;
-//	printf("dataA=%f\t",curdata);
-	
-	return (ok);
+    if (hdf5_depth++ > 0) return;
+    pthread_mutex_lock(&hdf5_lock);
+    push_cleanup(&hdf5_cleanup, hdf5_release, NULL);
 }
 
-/********************************************************************************
- *	reads two columns from a file						*
- *	returns:								*
- *		1 on success							*
- *		0 on failure							*
- ********************************************************************************/
-static int read_A_B(void)
+void hdf5_leave(void)
 {
-	unsigned int n, ok = 0;
-	char s[DATALEN];
-	char *col;
-	double dataA, dataB;
-
-	strcpy(&s[0],&curline[0]);
-	
-	col=strtok(s,DATADEL);			/* ATTENTION: s gets altered by strtok */
-	for (n=1; n<colA;n++) col=strtok(NULL,DATADEL);
-	if (sscanf(col,"%lg",&dataA)==1) 
-		ok = 1; else ok=0;
-//	printf("dataA=%f\t",dataA);
-	for (n=0; n<colB-colA;n++) col=strtok(NULL,DATADEL);
-	if (sscanf(col,"%lg",&dataB)==1) 
-		ok = 1; else ok=0;
-//	printf("dataB=%f\n",dataB);
-	curdata=dataB-dataA;
-
-	return (ok);
+    if (--hdf5_depth > 0) return;
+    pop_cleanup(&hdf5_cleanup);
+    pthread_mutex_unlock(&hdf5_lock);
 }
 
-/********************************************************************************
- *	reads one column from a file						*
- *	returns:								*
- *		1 on success							*
- *		0 on failure							*
- ********************************************************************************/
-static int read_A(void)
+// Close contents when an error returns to a trap
+static void release_contents(void *contents)
 {
-	unsigned int n, ok = 0;
-	char s[DATALEN];
-	char *col;
-
-	strcpy(&s[0],&curline[0]);
-	
-	col=strtok(s,DATADEL);			/* ATTENTION: s gets altered by strtok */
-	for (n=1; n<colA;n++) col=strtok(NULL,DATADEL);
-	if (sscanf(col,"%lg",&curdata)==1) 
-		ok = 1; else ok=0;
-//	printf("dataA=%f\n",curdata);
-
-	return (ok);
-}
-
-/********************************************************************************
- *	reads one line from a file					*
- *	parameters:								*
- *		int comma		1 if comma is decimal point, 0 otherwise*
- *	returns:								*
- *		2 if first character is comment character #			*
- *		1 on success							*
- *		0 on failure							*
- *		copies line of data into curline				*
- ********************************************************************************/
-static int read_lof(int comma) {
-	int ok=0;
-	
-	if (0 != fgets(&curline[0], DATALEN, ifp)) {		/* read max. DATALEN-1 characters */
-		ok=1;
-		/* replace commas by decimal points */
-		if (comma == 1) replaceComma(curline);
-		/* test for comment character */
-		if (curline[0]=='#') ok=2;
-	}
-	return (ok);
-
+    close_hdf5_contents((struct hdf5_contents*) contents);
 }
 
-/* returns 1 if file fn exists, 0 otherwise */
+/* returns 1 if file fn exists, 0 otherwise; for a list or pattern (see list_input_files) if
+   it names at least one file and all of them exist */
 int exists(char *fn)
 {
-	int ok = 0;
+	int ok = 0, n, i;
+	char **files;
+	FILE *ifp;
+
+	if (is_file_list(fn)) {
+		n = list_input_files(fn, &files);
+		ok = n > 0;
+		for (i = 0; i < n; i++) {
+			if (ok && !exists(files[i])) ok = 0;
+			xfree(files[i]);
+		}
+		if (n > 0) xfree(files);
+		return (ok);
+	}
 	ifp = fopen(fn, "r");
 	if (ifp != 0) {
 		ok = 1;
@@ -195,34 +81,63 @@ int exists(char *fn)
 	return (ok);
 }
 
-
-/********************************************************************************
- *	reads file *fn, counts number of data points and determines mean of data
- *										
- *	Parameters
- *		t	1 first column contains time in s
- *		A	number of column to process
- *		B	number of column to process in combination
- ********************************************************************************
- 	Naming convention	source code	publication
-				fs		f_s
-				ndata		N
- ********************************************************************************/
-void probe_file(unsigned int t, unsigned int A, unsigned int B)
+/* returns 1 if fn is a list of input files (@listfile) or a pattern (*, ?, [) */
+int is_file_list(const char *fn)
 {
-	timecol=t;
-	colA=A,
-	colB=B;
-
-	/* select reading routine */
-	if ((timecol==1) & (colB>0)) read_data=read_t_A_B;
-	else if ((timecol==1) & (colB==0)) read_data=read_t_A;
-	else if ((timecol==0) & (colB>0)) read_data=read_A_B;
-	else if ((timecol==0) & (colB==0)) read_data=read_A;
+	return fn[0] == '@' || strpbrk(fn, "*?[") != NULL;
+}
 
-	if (read_data==NULL) gerror("No file reading routine selected!\n");
+/*
+	expands the input file name fn into a list of files:
+		@listfile	the file names in listfile, one per line (# comments)
+		pattern		the files matching the shell pattern, in alphabetical order
+		otherwise	fn itself
+	returns the number of files; *files and its strings are allocated with xmalloc
+*/
+int list_input_files(const char *fn, char ***files)
+{
+	int n = 0, cap = 16;
+	char line[FNLEN + 2], *s;
+
+	*files = (char**) xmalloc(cap * sizeof(char*));
+	if (fn[0] == '@') {
+		FILE *lfp = fopen(fn + 1, "r");
+		if (lfp == 0) return 0;
+		while (fgets(line, sizeof(line), lfp)) {
+			line[strcspn(line, "\r\n")] = 0;
+			for (s = line; *s == ' ' || *s == '\t'; s++);
+			if (*s == 0 || *s == '#') continue;
+			if (n == cap) {
+				char **more = (char**) xmalloc(2 * cap * sizeof(char*));
+				memcpy(more, *files, cap * sizeof(char*));
+				xfree(*files);
+				*files = more;
+				cap *= 2;
+			}
+			(*files)[n] = (char*) xmalloc(strlen(s) + 1);
+			strcpy((*files)[n++], s);
+		}
+		fclose(lfp);
+	} else if (is_file_list(fn)) {
+		glob_t g;
+		if (glob(fn, 0, NULL, &g) == 0) {
+			xfree(*files);
+			*files = (char**) xmalloc((g.gl_pathc + 1) * sizeof(char*));
+			for (n = 0; n < (int) g.gl_pathc; n++) {
+				(*files)[n] = (char*) xmalloc(strlen(g.gl_pathv[n]) + 1);
+				strcpy((*files)[n], g.gl_pathv[n]);
+			}
+		}
+		globfree(&g);
+	} else {
+		(*files)[n] = (char*) xmalloc(strlen(fn) + 1);
+		strcpy((*files)[n++], fn);
+	}
+	if (n == 0) xfree(*files);
+	return n;
 }
 
+
 /*
 	writes a comment line to *ofp with information on what quantity will be saved in what column
 	
@@ -278,6 +193,9 @@ static void writeHeaderLine(FILE *ofp, tGNUTERM * gt) {
 		case 'i':
 			fprintf(ofp, "Im(PSD)	");
                         break;
+		case 'M':
+			fprintf(ofp, "Method	");
+			break;
 		default:
 			strcpy(&tmp[0],&((*gt).fmt[0]));
 			(*gt).fmt[c+1]=0;
@@ -289,6 +207,21 @@ static void writeHeaderLine(FILE *ofp, tGNUTERM * gt) {
 	fprintf(ofp,"\n");;
 }
 
+/*
+	writes the METHOD 1 block table as comment lines:
+	# Block	j0	j1	segment length	epsilon	probed rel. error	method
+*/
+static void writeBlocks(FILE *ofp, tDATA * data) {
+	int b;
+
+	if ((*data).nblocks == 0) return;
+	fprintf(ofp, "# Blocks: %d (first bin, last bin + 1, segment length, epsilon, probed rel. error, method)\n", (*data).nblocks);
+	for (b = 0; b < (*data).nblocks; b++)
+		fprintf(ofp, "# Block\t%ld\t%ld\t%ld\t%g\t%.3e\t%d\n", (*data).blocks[b].j0, (*data).blocks[b].j1,
+			(*data).blocks[b].nfft, (*data).blocks[b].epsilon, (*data).blocks[b].err,
+			(*data).blocks[b].method);
+}
+
 /*
 	writes the output data that lpsd calculated to file
 	
@@ -347,6 +280,9 @@ static void writeData(FILE *ofp, tCFG * cfg, tDATA * data, tGNUTERM * gt) {
 			case 'i':
 				fprintf(ofp, "%e        ", (*data).psd_imag[i]);
 				break;
+			case 'M':
+				fprintf(ofp, "%d	", (*data).method[i]);
+				break;
 			default:
 				break;
 			}
@@ -416,6 +352,7 @@ static void writeComment(char *dest, tCFG *cfg, tWinInfo *wi, tGNUTERM *gt, tDAT
 	# V	variance of power spectrum
 	# R	resolution bandwidth
 	# b	bin number
+	# M	method used for the bin (0 exact DFT, 1 FFT approximation)
 
 	The format of the output file is stored in gt[gti].fmt
 
@@ -431,12 +368,130 @@ void writeOutputFile(tCFG * cfg, tDATA * data, tGNUTERM * gt, tWinInfo *wi, int
 	writeComment(&cmt[0], cfg, wi, gt, data, argc, argv);
 	fprintf(ofp,"%s",cmt);
 
+	fprintf(ofp, "# Bin range: %ld %ld %d %d (first bin, last bin + 1, Jdes, iter)\n",
+		(*cfg).jfirst, (*cfg).jfirst + (*cfg).nspec, (*cfg).Jdes, (*cfg).iter);
+	writeBlocks(ofp, data);
 	writeHeaderLine(ofp, gt);
 	writeData(ofp, cfg, data, gt);
 	
 	fclose(ofp);
 }
 
+// Scalar and string attributes of the HDF5 output file
+static void write_h5_attr_string(hid_t loc, const char *name, const char *value) {
+	hid_t type = H5Tcopy(H5T_C_S1);
+	H5Tset_size(type, strlen(value) + 1);
+	hid_t space = H5Screate(H5S_SCALAR);
+	hid_t attr = H5Acreate(loc, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+	H5Awrite(attr, type, value);
+	H5Aclose(attr);
+	H5Sclose(space);
+	H5Tclose(type);
+}
+
+static void write_h5_attr(hid_t loc, const char *name, hid_t type, const void *value) {
+	hid_t space = H5Screate(H5S_SCALAR);
+	hid_t attr = H5Acreate(loc, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+	H5Awrite(attr, type, value);
+	H5Aclose(attr);
+	H5Sclose(space);
+}
+
+// @brief Write one output column of n values as a chunked dataset, one chunk at a time
+// @param dcpl: dataset creation properties (chunking, filters)
+static void write_h5_column(hid_t file, const char *name, hid_t type, const void *values,
+			    size_t size, hsize_t n, hid_t dcpl) {
+	hsize_t dims[1] = {n};
+	hid_t space = H5Screate_simple(1, dims, NULL);
+	hid_t dataset = H5Dcreate(file, name, type, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+	if (dataset < 0) gerror1("Could not create dataset %s", (char*) name);
+
+	hsize_t offset[1], count[1];
+	for (offset[0] = 0; offset[0] < n; offset[0] += count[0]) {
+		count[0] = n - offset[0] < OUTCHUNK ? n - offset[0] : OUTCHUNK;
+		hid_t memspace = H5Screate_simple(1, count, NULL);
+		H5Sselect_hyperslab(space, H5S_SELECT_SET, offset, NULL, count, NULL);
+		if (H5Dwrite(dataset, type, memspace, space, H5P_DEFAULT,
+			     (const char*) values + offset[0]*size) < 0)
+			gerror1("Error writing dataset %s", (char*) name);
+		H5Sclose(memspace);
+	}
+	H5Dclose(dataset);
+	H5Sclose(space);
+}
+
+/*
+	writes the output data to an HDF5 file:
+	datasets fspec, psd, ps, avg, nffts, psd_real, psd_imag, method (one value per bin),
+	blocks (METHOD 1/2 block table, see writeBlocks), and the configuration as attributes
+*/
+static void writeOutputFileHDF5(tCFG * cfg, tDATA * data, tGNUTERM * gt, tWinInfo *wi, int argc, char *argv[]) {
+	char c[CLEN];
+	char cmdline[CMTLEN];
+	hsize_t n = (*cfg).nspec;
+
+	hid_t file = H5Fcreate((*cfg).ofn, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+	if (file < 0) gerror1("Error opening %s", (*cfg).ofn);
+
+	// Chunked, optionally shuffled and deflated datasets
+	hsize_t chunk[1] = {n < OUTCHUNK ? n : OUTCHUNK};
+	hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+	H5Pset_chunk(dcpl, 1, chunk);
+	if ((*cfg).compression > 0) {
+		if (!H5Zfilter_avail(H5Z_FILTER_DEFLATE)) gerror("HDF5 library has no deflate filter, use --compression 0");
+		H5Pset_shuffle(dcpl);
+		H5Pset_deflate(dcpl, (*cfg).compression);
+	}
+	write_h5_column(file, "fspec", H5T_NATIVE_DOUBLE, (*data).fspec, sizeof(double), n, dcpl);
+	write_h5_column(file, "psd", H5T_NATIVE_DOUBLE, (*data).psd, sizeof(double), n, dcpl);
+	write_h5_column(file, "ps", H5T_NATIVE_DOUBLE, (*data).ps, sizeof(double), n, dcpl);
+	write_h5_column(file, "avg", H5T_NATIVE_INT, (*data).avg, sizeof(int), n, dcpl);
+	write_h5_column(file, "nffts", H5T_NATIVE_INT, (*data).nffts, sizeof(int), n, dcpl);
+	write_h5_column(file, "psd_real", H5T_NATIVE_DOUBLE, (*data).psd_real, sizeof(double), n, dcpl);
+	write_h5_column(file, "psd_imag", H5T_NATIVE_DOUBLE, (*data).psd_imag, sizeof(double), n, dcpl);
+	write_h5_column(file, "method", H5T_NATIVE_INT, (*data).method, sizeof(int), n, dcpl);
+	H5Pclose(dcpl);
+
+	// Block table, one row per block
+	if ((*data).nblocks > 0) {
+		hsize_t dims[2] = {(*data).nblocks, 6};
+		double *table = (double*) xmalloc(6*(*data).nblocks*sizeof(double));
+		for (int b = 0; b < (*data).nblocks; b++) {
+			table[6*b] = (*data).blocks[b].j0;
+			table[6*b+1] = (*data).blocks[b].j1;
+			table[6*b+2] = (*data).blocks[b].nfft;
+			table[6*b+3] = (*data).blocks[b].epsilon;
+			table[6*b+4] = (*data).blocks[b].err;
+			table[6*b+5] = (*data).blocks[b].method;
+		}
+		hid_t space = H5Screate_simple(2, dims, NULL);
+		hid_t dataset = H5Dcreate(file, "blocks", H5T_NATIVE_DOUBLE, space, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+		H5Dwrite(dataset, H5T_NATIVE_DOUBLE, H5S_ALL, H5S_ALL, H5P_DEFAULT, table);
+		write_h5_attr_string(dataset, "columns", "j0, j1, segment length, epsilon, probed rel. error, method");
+		H5Dclose(dataset);
+		H5Sclose(space);
+		xfree(table);
+	}
+
+	// Configuration
+	printConfig(&c[0], *cfg, *wi, *gt, *data);
+	printCommandLine(&cmdline[0], argc, argv);
+	write_h5_attr_string(file, "version", LPSD_VERSION);
+	write_h5_attr_string(file, "command_line", cmdline);
+	write_h5_attr_string(file, "config", c);
+	write_h5_attr(file, "fsamp", H5T_NATIVE_DOUBLE, &(*cfg).fsamp);
+	write_h5_attr(file, "fmin", H5T_NATIVE_DOUBLE, &(*cfg).fmin);
+	write_h5_attr(file, "fmax", H5T_NATIVE_DOUBLE, &(*cfg).fmax);
+	write_h5_attr(file, "ovlp", H5T_NATIVE_DOUBLE, &(*cfg).ovlp);
+	write_h5_attr(file, "Jdes", H5T_NATIVE_INT, &(*cfg).Jdes);
+	write_h5_attr(file, "nspec", H5T_NATIVE_LONG, &(*cfg).nspec);
+	write_h5_attr(file, "iter", H5T_NATIVE_INT, &(*cfg).iter);
+	write_h5_attr(file, "jfirst", H5T_NATIVE_LONG, &(*cfg).jfirst);
+	write_h5_attr(file, "METHOD", H5T_NATIVE_INT, &(*cfg).METHOD);
+
+	H5Fclose(file);
+}
+
 static double getLSD(tDATA *data, int i) {
 	return sqrt((*data).psd[i]);
 }
@@ -559,6 +614,14 @@ void saveResult(tCFG * cfg, tDATA * data, tGNUTERM * gt, tWinInfo *wi, int argc,
 //	fclose(file1);
 //	printf("mh\n");
 	
+	if ((*cfg).output_format == OUTFMT_HDF5) {
+		/* gnuplot files refer to text columns, so there is none for HDF5 output */
+		hdf5_enter();
+		writeOutputFileHDF5(cfg, data, gt, wi, argc, argv);
+		hdf5_leave();
+		return;
+	}
+
 	/* write output file with colums specified in gt */
 	writeOutputFile(cfg, data, gt, wi, argc, argv);
 
@@ -569,14 +632,147 @@ void saveResult(tCFG * cfg, tDATA * data, tGNUTERM * gt, tWinInfo *wi, int argc,
 	writeGnuplotFile(cfg, data, gt, wi, argc, argv);
 }
 
+// Memory type of SAMPLE_* samples
+static hid_t sample_mem_type(int sample_type)
+{
+    switch (sample_type) {
+    case SAMPLE_FLOAT: return H5T_NATIVE_FLOAT;
+    case SAMPLE_INT16: return H5T_NATIVE_SHORT;
+    case SAMPLE_INT32: return H5T_NATIVE_INT;
+    default: return H5T_NATIVE_DOUBLE;
+    }
+}
+
+// Source file of a virtual input dataset
+struct source_file {
+    char path[PATH_MAX];
+    hsize_t n;			/* samples */
+    double fsamp, t0;		/* attributes, -1 / NAN if absent */
+};
+
+static double read_attr_or(hid_t loc, const char *name, double fallback)
+{
+    double value = fallback;
+    if (H5Aexists(loc, name) > 0) {
+        hid_t attr = H5Aopen(loc, name, H5P_DEFAULT);
+        H5Aread(attr, H5T_NATIVE_DOUBLE, &value);
+        H5Aclose(attr);
+    }
+    return value;
+}
+
+static int compare_t0(const void *a, const void *b)
+{
+    double ta = ((const struct source_file*) a)->t0, tb = ((const struct source_file*) b)->t0;
+    return (ta > tb) - (ta < tb);
+}
+
+// Open the datasets of several files as one virtual dataset in an in-memory file: samples
+// are numbered through the files in the order of their t0 attribute (if all have one) or
+// of the list, and reads across file boundaries are served by HDF5. The files must hold
+// one-dimensional datasets of the same type and sampling frequency (fsamp attribute), and
+// with t0 follow each other without gaps or overlaps.
+static void open_virtual(hid_t *file, hid_t *dataset, char **files, int nfiles, char *dataset_name)
+{
+    struct source_file *src = (struct source_file*) xmalloc(nfiles * sizeof(struct source_file));
+    hid_t type = -1;
+    int i, all_t0 = 1;
+
+    for (i = 0; i < nfiles; i++) {
+        if (!realpath(files[i], src[i].path)) gerror2("Cannot find input file", files[i]);
+        hid_t f = H5Fopen(files[i], H5F_ACC_RDONLY, H5P_DEFAULT);
+        if (f < 0) gerror2("Error opening input file", files[i]);
+        hid_t d = H5Dopen(f, dataset_name, H5P_DEFAULT);
+        if (d < 0) gerror2("Dataset not found in", files[i]);
+        hid_t space = H5Dget_space(d);
+        if (H5Sget_simple_extent_ndims(space) != 1) gerror2("Dataset is not one-dimensional in", files[i]);
+        H5Sget_simple_extent_dims(space, &src[i].n, NULL);
+        H5Sclose(space);
+        hid_t t = H5Dget_type(d);
+        if (type < 0) type = H5Tcopy(t);
+        else if (H5Tequal(type, t) <= 0) gerror2("Sample type differs from the first file in", files[i]);
+        H5Tclose(t);
+        src[i].fsamp = read_attr_or(d, "fsamp", -1);
+        src[i].t0 = read_attr_or(d, "t0", NAN);
+        if (isnan(src[i].t0)) all_t0 = 0;
+        H5Dclose(d);
+        H5Fclose(f);
+    }
+    if (all_t0) qsort(src, nfiles, sizeof(struct source_file), compare_t0);
+
+    // Consistency of the sampling frequency and contiguity of the segments
+    hsize_t total = 0;
+    for (i = 0; i < nfiles; i++) {
+        if (src[i].fsamp > 0 && src[0].fsamp > 0 && fabs(src[i].fsamp / src[0].fsamp - 1) > 1e-9)
+            gerror2("Sampling frequency differs from the first file in", src[i].path);
+        if (i > 0 && all_t0 && src[0].fsamp > 0) {
+            double expected = src[i-1].t0 + src[i-1].n / src[0].fsamp;
+            if (fabs(src[i].t0 - expected) * src[0].fsamp > 0.5) {
+                char msg[PATH_MAX + 100];
+                snprintf(msg, sizeof(msg), "\tt0 = %.9f s, expected %.9f s from %s", src[i].t0, expected, src[i-1].path);
+                message(msg);
+                gerror2(src[i].t0 > expected ? "Gap before input file" : "Overlap with input file", src[i].path);
+            }
+        }
+        total += src[i].n;
+    }
+
+    // Virtual dataset in a file that only lives in memory, named apart from those of other
+    // runs that are open at the same time
+    static long int nvirtual = 0;
+    char vname[48];
+    snprintf(vname, sizeof(vname), "lpsd-virtual-input-%ld", ++nvirtual);
+    hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+    H5Pset_fapl_core(fapl, 1 << 16, 0);
+    *file = H5Fcreate(vname, H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+    H5Pclose(fapl);
+    hid_t vspace = H5Screate_simple(1, &total, NULL);
+    hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    hsize_t offset = 0;
+    for (i = 0; i < nfiles; i++) {
+        hid_t sspace = H5Screate_simple(1, &src[i].n, NULL);
+        H5Sselect_hyperslab(vspace, H5S_SELECT_SET, &offset, NULL, &src[i].n, NULL);
+        H5Pset_virtual(dcpl, vspace, src[i].path, dataset_name, sspace);
+        H5Sclose(sspace);
+        offset += src[i].n;
+    }
+    H5Sselect_all(vspace);
+    hid_t lcpl = H5Pcreate(H5P_LINK_CREATE);
+    H5Pset_create_intermediate_group(lcpl, 1);
+    *dataset = H5Dcreate(*file, dataset_name, type, vspace, lcpl, dcpl, H5P_DEFAULT);
+    if (*dataset < 0) gerror("Error creating the virtual input dataset");
+    H5Pclose(lcpl);
+    H5Pclose(dcpl);
+    H5Sclose(vspace);
+    H5Tclose(type);
+    printf("Input: %d files, %llu samples\n", nfiles, (unsigned long long) total);
+    xfree(src);
+}
+
 // @brief Read the contents of a metadata and return pointer to hdf5_contents struct.
 // @brief This include ids of file, dataset, dataspace, as well as rank/dims info.
 void read_hdf5_file(struct hdf5_contents *contents,
                     char *filename, char *dataset_name)
 {
-    // Open data
-    hid_t file = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
-    hid_t dataset = H5Dopen(file, dataset_name, H5P_DEFAULT);
+    // Open data; a list or pattern of files is opened as one virtual dataset
+    hid_t file, dataset;
+    hdf5_enter();
+    if (is_file_list(filename)) {
+        char **files;
+        int nfiles = list_input_files(filename, &files);
+        if (nfiles == 0) gerror2("No input files match", filename);
+        open_virtual(&file, &dataset, files, nfiles, dataset_name);
+        for (int i = 0; i < nfiles; i++) xfree(files[i]);
+        xfree(files);
+    } else {
+        file = H5Fopen(filename, H5F_ACC_RDONLY, H5P_DEFAULT);
+        if (file < 0) gerror2("Error opening input file", filename);
+        dataset = H5Dopen(file, dataset_name, H5P_DEFAULT);
+        if (dataset < 0) {
+            H5Fclose(file);
+            gerror2("Dataset not found in", filename);
+        }
+    }
     hid_t dataspace = H5Dget_space(dataset);
 
     // Get dims
@@ -584,12 +780,328 @@ void read_hdf5_file(struct hdf5_contents *contents,
     hsize_t dims[rank];
     herr_t status = H5Sget_simple_extent_dims(dataspace, dims, NULL);
 
+    // Keep integer and float32 samples in their storage type (see read_samples)
+    hid_t type = H5Dget_type(dataset);
+    size_t size = H5Tget_size(type);
+    if (H5Tget_class(type) == H5T_FLOAT && size == 4) contents->sample_type = SAMPLE_FLOAT;
+    else if (H5Tget_class(type) == H5T_INTEGER && size == 2 && H5Tget_sign(type) == H5T_SGN_2) contents->sample_type = SAMPLE_INT16;
+    else if (H5Tget_class(type) == H5T_INTEGER && size == 4 && H5Tget_sign(type) == H5T_SGN_2) contents->sample_type = SAMPLE_INT32;
+    else contents->sample_type = SAMPLE_DOUBLE;
+
     // Save info to struct
     contents->file = file;
     contents->dataset = dataset;
     contents->dataspace = dataspace;
     contents->rank = rank;
-    contents->dims = dims;
+    memcpy(contents->dims, dims, rank * sizeof(hsize_t));
+    contents->sample_size = H5Tget_size(sample_mem_type(contents->sample_type));
+    contents->scale = 1;
+
+    // A contiguous, unfiltered dataset in native byte order sits at a fixed
+    // offset of the file and can be mapped instead of read through HDF5
+    contents->map = NULL;
+    contents->samples = NULL;
+    contents->chunk_bytes = 0;
+    contents->cache_bytes = 0;
+    contents->cache = NULL;
+    contents->chunk_decodes = 0;
+    hid_t dcpl = H5Dget_create_plist(dataset);
+    if (rank == 1 && H5Pget_layout(dcpl) == H5D_CHUNKED) {
+        hsize_t chunk_dims[1];
+        H5Pget_chunk(dcpl, 1, chunk_dims);
+        contents->chunk_bytes = chunk_dims[0] * size;
+    }
+    haddr_t address = H5Dget_offset(dataset);
+    if (rank == 1 && H5Pget_layout(dcpl) == H5D_CONTIGUOUS && H5Pget_nfilters(dcpl) == 0
+        && address != HADDR_UNDEF && H5Tequal(type, sample_mem_type(contents->sample_type)) > 0) {
+        int fd = open(filename, O_RDONLY);
+        long int page = sysconf(_SC_PAGESIZE);
+        off_t start = address / page * page;
+        size_t len = address - start + dims[0] * contents->sample_size;
+        void *map = fd >= 0 ? mmap(NULL, len, PROT_READ, MAP_SHARED, fd, start) : MAP_FAILED;
+        if (map != MAP_FAILED) {
+            contents->map = map;
+            contents->map_len = len;
+            contents->samples = (const char*) map + (address - start);
+            madvise(map, len, MADV_SEQUENTIAL);
+        }
+        if (fd >= 0) close(fd);
+    }
+    H5Pclose(dcpl);
+    H5Tclose(type);
+    push_cleanup(&contents->cleanup, release_contents, contents);
+    hdf5_leave();
+}
+
+// @brief Bytes per sample of SAMPLE_* sample_type
+size_t sample_size(int sample_type)
+{
+    hdf5_enter();
+    size_t size = H5Tget_size(sample_mem_type(sample_type));
+    hdf5_leave();
+    return size;
+}
+
+// @brief Open the input of cfg: the samples of input if it has any, else the dataset of cfg->ifn
+// @brief Samples in memory are read in place, as a mapped dataset is; they are not copied
+void open_samples(struct hdf5_contents *contents, tCFG *cfg, const struct sample_buffer *input)
+{
+    if (!input || !input->samples) {
+        read_hdf5_file(contents, cfg->ifn, cfg->dataset_name);
+        return;
+    }
+    memset(contents, 0, sizeof(struct hdf5_contents));
+    contents->file = contents->dataset = contents->dataspace = -1;
+    contents->rank = 1;
+    contents->sample_type = input->sample_type;
+    contents->sample_size = sample_size(input->sample_type);
+    contents->scale = 1;
+    contents->samples = (const char*) input->samples;
+}
+
+// @brief Pointer to sample offset of a mapped dataset (storage type), NULL if not mapped
+const void *map_samples(struct hdf5_contents *contents, hsize_t offset)
+{
+    return contents->samples ? contents->samples + offset * contents->sample_size : NULL;
+}
+
+static int is_prime(size_t n)
+{
+    if (n < 2) return 0;
+    for (size_t d = 2; d * d <= n; d++) if (n % d == 0) return 0;
+    return 1;
+}
+
+// Chunks of a deflated or unfiltered dataset, read with H5Dread_chunk and kept in LRU order
+struct chunk_cache {
+    long int chunk_len;		/* samples per chunk */
+    int deflate;		/* 1 - chunks are deflated */
+    int nslots, nused;
+    int *slot_of;		/* slot of each chunk of the dataset, -1 if not cached */
+    long int *chunk_of;		/* chunk held by each slot */
+    int *prev, *next;		/* LRU list of slots, head is the most recently used */
+    int head, tail;
+    char **data;		/* decoded chunks, allocated when first used */
+    void *raw;			/* chunk as stored in the file */
+    size_t raw_size;
+};
+
+// Release the chunk cache of a dataset
+static void free_chunk_cache(struct hdf5_contents *contents)
+{
+    struct chunk_cache *c = contents->cache;
+    if (!c) return;
+    for (int i = 0; i < c->nslots; i++) if (c->data[i]) xfree(c->data[i]);
+    xfree(c->data);
+    xfree(c->next);
+    xfree(c->prev);
+    xfree(c->chunk_of);
+    xfree(c->slot_of);
+    if (c->raw) xfree(c->raw);
+    xfree(c);
+    contents->cache = NULL;
+}
+
+// @brief Give a chunked dataset a chunk cache of the given size (HDF5's default is 1 MB),
+// @brief so that chunks shared by consecutive or strided reads are decoded once
+// Deflated or unfiltered datasets of native type use the LRU cache of get_chunk, which
+// counts the decoded chunks; other filters go through the chunk cache of HDF5.
+void set_chunk_cache(struct hdf5_contents *contents, size_t bytes)
+{
+    if (contents->chunk_bytes == 0 || bytes <= contents->cache_bytes) return;
+
+    hdf5_enter();
+    hid_t dcpl = H5Dget_create_plist(contents->dataset);
+    hid_t type = H5Dget_type(contents->dataset);
+    int nfilters = H5Pget_nfilters(dcpl), own = 1, deflate = 0;
+    for (int i = 0; i < nfilters; i++) {
+        unsigned int flags, config;
+        size_t nelmts = 0;
+        if (H5Pget_filter2(dcpl, i, &flags, &nelmts, NULL, 0, NULL, &config) == H5Z_FILTER_DEFLATE)
+            deflate = 1;
+        else own = 0;
+    }
+    if (H5Tequal(type, sample_mem_type(contents->sample_type)) <= 0) own = 0;
+    H5Tclose(type);
+    H5Pclose(dcpl);
+
+    if (own) {
+        struct chunk_cache *c = contents->cache;
+        long int chunk_len = contents->chunk_bytes / contents->sample_size;
+        long int nchunks = (contents->dims[0] + chunk_len - 1) / chunk_len;
+        int nslots = bytes / contents->chunk_bytes;
+        if (nslots < 2) nslots = 2;
+        if (nslots > nchunks) nslots = nchunks;
+        if (c && nslots <= c->nslots) {
+            hdf5_leave();
+            return;
+        }
+
+        free_chunk_cache(contents);  /* a larger cache starts empty */
+        c = (struct chunk_cache*) xmalloc(sizeof(struct chunk_cache));
+        c->chunk_len = chunk_len;
+        c->deflate = deflate;
+        c->nused = 0;
+        c->head = c->tail = -1;
+        c->slot_of = (int*) xmalloc(nchunks * sizeof(int));
+        for (long int i = 0; i < nchunks; i++) c->slot_of[i] = -1;
+        c->chunk_of = (long int*) xmalloc(nslots * sizeof(long int));
+        c->prev = (int*) xmalloc(nslots * sizeof(int));
+        c->next = (int*) xmalloc(nslots * sizeof(int));
+        c->data = (char**) xmalloc(nslots * sizeof(char*));
+        for (int i = 0; i < nslots; i++) c->data[i] = NULL;
+        c->raw = NULL;
+        c->raw_size = 0;
+        contents->cache = c;
+        c->nslots = nslots;
+        contents->cache_bytes = bytes;
+        hdf5_leave();
+        return;
+    }
+
+    // HDF5 recommends about 100 hash slots per cached chunk, a prime number of them
+    size_t nslots = 100 * (bytes / contents->chunk_bytes + 1) + 1;
+    if (nslots > (1 << 24)) nslots = 1 << 24;
+    while (!is_prime(nslots)) nslots++;
+
+    char name[FNLEN];
+    H5Iget_name(contents->dataset, name, FNLEN);
+    hid_t dapl = H5Pcreate(H5P_DATASET_ACCESS);
+    H5Pset_chunk_cache(dapl, nslots, bytes, 1.0);  /* read only: evict fully read chunks first */
+    H5Dclose(contents->dataset);
+    contents->dataset = H5Dopen(contents->file, name, dapl);
+    H5Pclose(dapl);
+    if (contents->dataset < 0) gerror1("Error reopening dataset %s", name);
+    contents->cache_bytes = bytes;
+    hdf5_leave();
+}
+
+// @brief Tell the kernel how a mapped dataset will be read (ACCESS_SEQUENTIAL, ACCESS_RANDOM)
+void advise_access(struct hdf5_contents *contents, int access)
+{
+    if (contents->map)
+        madvise(contents->map, contents->map_len, access == ACCESS_RANDOM ? MADV_RANDOM : MADV_SEQUENTIAL);
+}
+
+// Convert n samples of type sample_type at src, with the given stride, to scaled doubles
+static void convert_samples(const char *src, int sample_type, hsize_t stride, hsize_t n,
+                            double scale, double *data_out)
+{
+    hsize_t i;
+    switch (sample_type) {
+    case SAMPLE_FLOAT: {
+        const float *x = (const float*) src;
+        for (i = 0; i < n; i++) data_out[i] = x[i*stride] * scale;
+        break;
+    }
+    case SAMPLE_INT16: {
+        const short *x = (const short*) src;
+        for (i = 0; i < n; i++) data_out[i] = x[i*stride] * scale;
+        break;
+    }
+    case SAMPLE_INT32: {
+        const int *x = (const int*) src;
+        for (i = 0; i < n; i++) data_out[i] = x[i*stride] * scale;
+        break;
+    }
+    default: {
+        const double *x = (const double*) src;
+        if (stride == 1 && scale == 1) memcpy(data_out, x, n * sizeof(double));
+        else for (i = 0; i < n; i++) data_out[i] = x[i*stride] * scale;
+    }
+    }
+}
+
+// Remove slot from the LRU list of the chunk cache
+static void lru_unlink(struct chunk_cache *c, int slot)
+{
+    if (c->prev[slot] >= 0) c->next[c->prev[slot]] = c->next[slot];
+    else c->head = c->next[slot];
+    if (c->next[slot] >= 0) c->prev[c->next[slot]] = c->prev[slot];
+    else c->tail = c->prev[slot];
+}
+
+// Chunk of the cache that holds chunk ch, reading and inflating it if needed; called with
+// hdf5_lock held
+static const char *get_chunk(struct hdf5_contents *contents, long int ch)
+{
+    struct chunk_cache *c = contents->cache;
+    int slot = c->slot_of[ch];
+
+    if (slot == c->head && slot >= 0) return c->data[slot];
+    if (slot >= 0) {
+        lru_unlink(c, slot);
+    } else {
+        // Take a free slot or the least recently used one
+        if (c->nused < c->nslots) slot = c->nused++;
+        else {
+            slot = c->tail;
+            lru_unlink(c, slot);
+            c->slot_of[c->chunk_of[slot]] = -1;
+        }
+        if (!c->data[slot]) c->data[slot] = (char*) xmalloc(contents->chunk_bytes);
+
+        hsize_t offset = ch * c->chunk_len;
+        hsize_t nbytes = 0;
+        uint32_t filter_mask = 0;
+        H5Dget_chunk_storage_size(contents->dataset, &offset, &nbytes);
+        if (nbytes == 0) {
+            memset(c->data[slot], 0, contents->chunk_bytes);  /* never written: fill value */
+        } else {
+            if (nbytes > c->raw_size) {
+                if (c->raw) xfree(c->raw);
+                c->raw = xmalloc(nbytes);
+                c->raw_size = nbytes;
+            }
+            if (H5Dread_chunk(contents->dataset, H5P_DEFAULT, &offset, &filter_mask, c->raw) < 0)
+                gerror("Error reading input chunk");
+            if (c->deflate && !(filter_mask & 1)) {
+                uLongf len = contents->chunk_bytes;
+                if (uncompress((Bytef*) c->data[slot], &len, (const Bytef*) c->raw, nbytes) != Z_OK)
+                    gerror("Error inflating input chunk");
+                contents->chunk_decodes++;
+            } else {
+                memcpy(c->data[slot], c->raw,
+                       nbytes < contents->chunk_bytes ? nbytes : contents->chunk_bytes);
+            }
+        }
+        c->slot_of[ch] = slot;
+        c->chunk_of[slot] = ch;
+    }
+    // Make slot the most recently used
+    c->prev[slot] = -1;
+    c->next[slot] = c->head;
+    if (c->head >= 0) c->prev[c->head] = slot;
+    c->head = slot;
+    if (c->tail < 0) c->tail = slot;
+    return c->data[slot];
+}
+
+// Read n samples from offset with the given stride through the chunk cache, converted
+// to scaled doubles (to_double) or in their storage type
+static void read_cached(struct hdf5_contents *contents, hsize_t offset, hsize_t stride,
+                        hsize_t n, void *data_out, int to_double)
+{
+    long int chunk_len = contents->cache->chunk_len;
+    hsize_t i = 0, pos = offset;
+
+    while (i < n) {
+        long int ch = pos / chunk_len;
+        hsize_t in_chunk = pos - ch * chunk_len;
+        hsize_t m = (chunk_len - in_chunk + stride - 1) / stride;  /* samples in this chunk */
+        if (m > n - i) m = n - i;
+        const char *src = get_chunk(contents, ch) + in_chunk * contents->sample_size;
+        if (to_double)
+            convert_samples(src, contents->sample_type, stride, m, contents->scale, (double*) data_out + i);
+        else if (stride == 1)
+            memcpy((char*) data_out + i * contents->sample_size, src, m * contents->sample_size);
+        else
+            for (hsize_t k = 0; k < m; k++)
+                memcpy((char*) data_out + (i + k) * contents->sample_size,
+                       src + k * stride * contents->sample_size, contents->sample_size);
+        i += m;
+        pos += m * stride;
+    }
 }
 
 
@@ -598,19 +1110,31 @@ void open_hdf5_file(struct hdf5_contents *contents,
                     char *filename, char *dataset_name,
                     hsize_t rank, hsize_t *dims) {
     // Create file in truncation mode
+    hdf5_enter();
     hid_t file = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
 
     // Create dataspace and dataset in file
     hid_t dataspace = H5Screate_simple(rank, dims, NULL);
     hid_t dataset = H5Dcreate(file, dataset_name, H5T_NATIVE_DOUBLE, dataspace,
                               H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    hdf5_leave();
 
     // Save info to struct
     contents->file = file;
     contents->dataset = dataset;
     contents->dataspace = dataspace;
     contents->rank = rank;
-    contents->dims = dims;
+    memcpy(contents->dims, dims, rank * sizeof(hsize_t));
+    contents->sample_type = SAMPLE_DOUBLE;
+    contents->sample_size = sizeof(double);
+    contents->scale = 1;
+    contents->map = NULL;
+    contents->samples = NULL;
+    contents->chunk_bytes = 0;
+    contents->cache_bytes = 0;
+    contents->cache = NULL;
+    contents->chunk_decodes = 0;
+    push_cleanup(&contents->cleanup, release_contents, contents);
 }
 
 
@@ -621,6 +1145,7 @@ void write_to_hdf5(struct hdf5_contents *_contents, double *data,
                    hsize_t data_rank, hsize_t *data_count) {
     // Select hyperslab in file dataspace
     // Keep in mind: offset/count need as many dimensions as contents->rank
+    hdf5_enter();
     herr_t status = H5Sselect_hyperslab(_contents->dataspace, H5S_SELECT_SET,
                                         offset, NULL, count, NULL);
 
@@ -638,6 +1163,7 @@ void write_to_hdf5(struct hdf5_contents *_contents, double *data,
     // Clean-up
     H5Sclose(memspace);
     status = H5Sselect_none(_contents->dataspace);
+    hdf5_leave();
 }
 
 // Wrapper for read_from_dataset_stride with no stride
@@ -662,7 +1188,22 @@ void read_from_dataset_stride(struct hdf5_contents *contents, hsize_t *offset,
                               hsize_t data_rank, hsize_t *data_count,
                               double *data_out)
 {
+    // Mapped datasets need no HDF5 call and no lock
+    if (contents->samples) {
+        convert_samples(contents->samples + offset[0] * contents->sample_size, contents->sample_type,
+                        stride[0], data_count[0], contents->scale, data_out);
+        return;
+    }
+    if (contents->cache) {
+        hdf5_enter();
+        read_cached(contents, offset[0], stride[0], data_count[0], data_out, 1);
+        hdf5_leave();
+        return;
+    }
+
     // Use hyperslab to read partial file contents out
+    // The dataspace selection is shared, so only one thread at a time may read
+    hdf5_enter();
     herr_t status = H5Sselect_hyperslab(contents->dataspace, H5S_SELECT_SET,
                                         offset, stride, count, NULL);
     hid_t memspace = H5Screate_simple(data_rank, data_count, NULL);
@@ -672,12 +1213,49 @@ void read_from_dataset_stride(struct hdf5_contents *contents, hsize_t *offset,
     // Clean up
     H5Sclose(memspace);
     status = H5Sselect_none(contents->dataspace);
+    hdf5_leave();
+
+    if (contents->scale != 1) {
+        hsize_t n = 1;
+        for (int i = 0; i < (int) data_rank; i++) n *= data_count[i];
+        for (hsize_t i = 0; i < n; i++) data_out[i] *= contents->scale;
+    }
+}
+
+// @brief Read count samples of a 1D dataset from offset in their storage type
+// @brief (contents->sample_type, sample_size bytes each), without applying contents->scale
+void read_samples(struct hdf5_contents *contents, hsize_t offset, hsize_t count, void *data_out)
+{
+    if (contents->samples) {
+        memcpy(data_out, map_samples(contents, offset), count * contents->sample_size);
+        return;
+    }
+    if (contents->cache) {
+        hdf5_enter();
+        read_cached(contents, offset, 1, count, data_out, 0);
+        hdf5_leave();
+        return;
+    }
+    hdf5_enter();
+    H5Sselect_hyperslab(contents->dataspace, H5S_SELECT_SET, &offset, NULL, &count, NULL);
+    hid_t memspace = H5Screate_simple(1, &count, NULL);
+    H5Dread(contents->dataset, sample_mem_type(contents->sample_type), memspace, contents->dataspace,
+            H5P_DEFAULT, data_out);
+    H5Sclose(memspace);
+    H5Sselect_none(contents->dataspace);
+    hdf5_leave();
 }
 
 void close_hdf5_contents(struct hdf5_contents *contents)
 {
     // TODO: add if statements (only needed if close_hdf5_contents may be called in different circumstances)
+    pop_cleanup(&contents->cleanup);
+    if (contents->map) munmap(contents->map, contents->map_len);
+    free_chunk_cache(contents);
+    if (contents->file < 0) return;	/* samples in memory (open_samples) */
+    hdf5_enter();
     H5Dclose(contents->dataset);
     H5Sclose(contents->dataspace);
     H5Fclose(contents->file);
+    hdf5_leave();
 }
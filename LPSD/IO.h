@@ -3,26 +3,60 @@
 
 // Custom imports
 #include "hdf5.h"
+#include "errors.h"
 
 // Declarations
 int exists(char *fn);
-void probe_file(unsigned int t, unsigned int A, unsigned int B);
+int is_file_list(const char *fn);
+int list_input_files(const char *fn, char ***files);
 void saveResult(tCFG * cfg, tDATA * data, tGNUTERM * gt, tWinInfo *wi, int argc, char *argv[]);
 int write_gnufile(char *gfn, char *ofn, char *vfn, char *ifn, char *s, 
 			double fmin, double fmax, double dmin, double dmax,
 			char *id, int c);
 
 // HDF5 files related I/O
+#define SAMPLE_DOUBLE 0		/* storage type of the input samples */
+#define SAMPLE_FLOAT 1
+#define SAMPLE_INT16 2
+#define SAMPLE_INT32 3
+struct chunk_cache;
 struct hdf5_contents {
     hid_t file, dataset, dataspace;
     hsize_t rank;
-    hsize_t *dims;
+    hsize_t dims[H5S_MAX_RANK];	/* dimensions of the dataset, first rank entries */
+    int sample_type;		/* SAMPLE_*, read_samples returns this type */
+    size_t sample_size;
+    double scale;		/* read_from_dataset(_stride) multiplies by this, e.g. ulsb */
+    void *map;			/* mmap of a contiguous, unfiltered dataset, NULL if not mapped */
+    size_t map_len;
+    const char *samples;	/* first sample in map */
+    size_t chunk_bytes;		/* bytes per chunk of a chunked dataset, 0 otherwise */
+    size_t cache_bytes;		/* size of its chunk cache */
+    struct chunk_cache *cache;	/* own cache of deflated/unfiltered chunks, see set_chunk_cache */
+    long int chunk_decodes;	/* chunks inflated by the cache */
+    struct error_cleanup cleanup;	/* closes an open file when an error returns to a trap */
+};
+#define ACCESS_SEQUENTIAL 0	/* access patterns for advise_access */
+#define ACCESS_RANDOM 1
+// Samples of the input held in memory by a liblpsd caller, read in place instead of cfg->ifn
+struct sample_buffer {
+    const void *samples;	/* NULL - read the dataset of cfg->ifn */
+    int sample_type;		/* SAMPLE_* */
+    long int n;
 };
 void read_hdf5_file(struct hdf5_contents *contents, char*, char*);
+size_t sample_size(int sample_type);
+void open_samples(struct hdf5_contents *contents, tCFG *cfg, const struct sample_buffer *input);
 void open_hdf5_file(struct hdf5_contents *contents, char*, char*, hsize_t, hsize_t*);
 void write_to_hdf5(struct hdf5_contents*, double*, hsize_t*, hsize_t*, hsize_t, hsize_t*);
 void read_from_dataset(struct hdf5_contents*, hsize_t*, hsize_t*, hsize_t, hsize_t*, double*);
 void read_from_dataset_stride(struct hdf5_contents*, hsize_t*, hsize_t*, hsize_t*, hsize_t, hsize_t*, double*);
+void read_samples(struct hdf5_contents*, hsize_t, hsize_t, void*);
+const void *map_samples(struct hdf5_contents*, hsize_t);
+void advise_access(struct hdf5_contents*, int);
+void set_chunk_cache(struct hdf5_contents*, size_t);
 void close_hdf5_contents(struct hdf5_contents*);
+void hdf5_enter(void);
+void hdf5_leave(void);
 
 #endif
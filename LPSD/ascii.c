@@ -0,0 +1,135 @@
+/********************************************************************************
+    ascii.c
+
+    Parsing of ASCII time series, shared by the column readers of IO.c and
+    lpsd-ingest.
+
+    ascii_strtod handles the common case of at most 19 significant digits and a
+    decimal exponent within +-22 by one integer accumulation and one exact
+    multiplication or division by a power of ten, which rounds correctly.
+    Everything else (more digits, large exponents, nan, inf) goes to strtod.
+
+ ********************************************************************************/
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "config.h"
+#include "ascii.h"
+
+static const double pow10_exact[23] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int
+is_delim (char c)
+{
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+static int
+is_digit (char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+// strtod on a copy of the token, with decimal commas replaced
+static double
+slow_strtod (const char *s, const char **end, int comma)
+{
+    char buf[DOUBLEN + 1], *e;
+    int n;
+
+    for (n = 0; n < DOUBLEN && s[n] && !is_delim(s[n]); n++)
+        buf[n] = (comma && s[n] == ',') ? '.' : s[n];
+    buf[n] = 0;
+    double v = strtod(buf, &e);
+    *end = s + (e - buf);
+    return v;
+}
+
+// @brief Parse a floating point number at s, with ',' as decimal delimiter if comma == 1
+// @param end: set to the first character after the number, s if there is none
+double
+ascii_strtod (const char *s, const char **end, int comma)
+{
+    const char *p = s;
+    uint64_t m = 0;
+    int neg = 0, nd = 0, e = 0, digits = 0, truncated = 0;
+
+    if (*p == '-' || *p == '+') neg = *p++ == '-';
+    for (; is_digit(*p); p++, digits++) {
+        if (nd < 19) {
+            m = m * 10 + (*p - '0');
+            if (m) nd++;
+        } else {
+            e++;
+            truncated = 1;
+        }
+    }
+    if (*p == '.' || (comma && *p == ',')) {
+        for (p++; is_digit(*p); p++, digits++) {
+            if (nd < 19) {
+                m = m * 10 + (*p - '0');
+                if (m) nd++;
+                e--;
+            } else {
+                truncated = 1;
+            }
+        }
+    }
+    if (!digits) return slow_strtod(s, end, comma);
+    if (*p == 'e' || *p == 'E') {
+        const char *q = p + 1;
+        int eneg = 0, x = 0;
+        if (*q == '-' || *q == '+') eneg = *q++ == '-';
+        if (is_digit(*q)) {
+            for (; is_digit(*q); q++) if (x < 10000) x = x * 10 + (*q - '0');
+            e += eneg ? -x : x;
+            p = q;
+        }
+    }
+    if (truncated || m > (1ULL << 53) || e < -22 || e > 22) return slow_strtod(s, end, comma);
+
+    double v = (double) m;
+    v = e < 0 ? v / pow10_exact[-e] : v * pow10_exact[e];
+    *end = p;
+    return neg ? -v : v;
+}
+
+// @brief Read time and data from the line s..end (without the newline)
+// @brief Columns are separated by blanks and tabs as in DATADEL; with cols->timecol
+// @brief the time is the first column, the data is column colA or column colB - column A
+// @return 1 on success, 2 for comment (#) and empty lines, 0 on failure
+int
+ascii_parse_line (const char *s, const char *end, const struct ascii_columns *cols,
+                  double *t, double *x)
+{
+    unsigned int i, last = cols->colA > cols->colB ? cols->colA : cols->colB;
+    double a = 0, b = 0;
+    const char *p = s, *q;
+
+    while (p < end && is_delim(*p)) p++;
+    if (p == end || *p == '#' || *p == '\r') return 2;
+    if (cols->timecol && last < 1) last = 1;
+
+    for (i = 1; i <= last; i++) {
+        while (p < end && is_delim(*p)) p++;
+        if (p == end) return 0;
+        if (i == 1 && cols->timecol) {
+            *t = ascii_strtod(p, &q, cols->comma);
+            if (q == p) return 0;
+        }
+        if (i == cols->colA || i == cols->colB) {
+            double v = ascii_strtod(p, &q, cols->comma);
+            if (q == p) return 0;
+            if (i == cols->colA) a = v;
+            if (i == cols->colB) b = v;
+        }
+        // Like sscanf on a strtok token: ignore the rest of the column
+        while (p < end && !is_delim(*p)) p++;
+    }
+    *x = cols->colB > 0 ? b - a : a;
+    return 1;
+}
@@ -0,0 +1,16 @@
+#ifndef __ascii_h
+#define __ascii_h
+
+// Layout of an ASCII data line, see ascii_parse_line
+struct ascii_columns {
+    unsigned int timecol;	/* 1 - first column contains time in s */
+    unsigned int colA;		/* column of the data (1-based, the time column counts) */
+    unsigned int colB;		/* if > 0, the data is column B - column A */
+    int comma;			/* 1 - comma as decimal delimiter */
+};
+
+double ascii_strtod(const char *s, const char **end, int comma);
+int ascii_parse_line(const char *s, const char *end, const struct ascii_columns *cols,
+                     double *t, double *x);
+
+#endif
@@ -0,0 +1,351 @@
+/********************************************************************************
+    cache.c
+
+    On-disk cache of computed bins (--cache DIR), shared between runs.
+
+    The PSD of bin j depends only on the input samples, the frequency axis
+    (fsamp, fmin, fmax, Jdes), the window, the overlap and the scaling, plus,
+    for the FFT approximation, the block j belongs to and the FFT settings.
+    These are collected in a struct cache_key, with a hash of the input samples
+    of the run; the bins of one key are appended to the file <hash of key>.bins
+    as checksummed journal records with the bin index j, and the blocks of FFT
+    bins to <hash>.blocks. A run restores the bins of its keys it finds there,
+    through the journal, so they are skipped like bins of an interrupted run,
+    and appends the bins it calculated at the end.
+
+    Whole keys are evicted, least recently used first, when the files exceed
+    --cache-size.
+
+ ********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "misc.h"
+#include "errors.h"
+#include "IO.h"
+#include "journal.h"
+#include "cache.h"
+
+#define FNV_PRIME 1099511628211ULL
+
+// @brief FNV-1a hash of len bytes at buf, continuing h (FNV_OFFSET to start)
+uint64_t
+fnv1a (uint64_t h, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char*) buf;
+    while (len--) {
+        h ^= *p++;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+// Hash of the samples 0..nread-1 of the input, as stored
+static uint64_t
+hash_input (tCFG *cfg, const struct sample_buffer *input, long int nread, int *sample_type)
+{
+    struct hdf5_contents contents;
+    long int i, n;
+    uint64_t h = FNV_OFFSET;
+
+    open_samples(&contents, cfg, input);
+    *sample_type = contents.sample_type;
+    void *buf = xmalloc(CACHEHASHBLOCK * contents.sample_size);
+    for (i = 0; i < nread; i += n) {
+        n = nread - i < CACHEHASHBLOCK ? nread - i : CACHEHASHBLOCK;
+        read_samples(&contents, i, n, buf);
+        h = fnv1a(h, buf, n * contents.sample_size);
+    }
+    xfree(buf);
+    close_hdf5_contents(&contents);
+    return h;
+}
+
+// Read the cached bins of variant v in this run's range
+static void
+load_bins (struct result_cache *cache, int v)
+{
+    struct cache_key key;
+    struct journal_record rec[CACHEREAD];
+    long int k, i, n;
+
+    cache->rec[v] = (struct journal_record*) xmalloc(cache->nspec * sizeof(struct journal_record));
+    for (k = 0; k < cache->nspec; k++) cache->rec[v][k].k = -1;
+    int fd = open(cache->fn[v], O_RDONLY);
+    if (fd < 0) return;
+    if (read(fd, &key, sizeof(key)) != sizeof(key) || memcmp(&key, &cache->key[v], sizeof(key)) != 0) {
+        message1("Cache file %s belongs to a different configuration, not using it", cache->fn[v]);
+        cache->fn[v][0] = 0;
+        close(fd);
+        return;
+    }
+    // Records of concurrent runs may be interleaved, each is checked on its own
+    while ((n = read(fd, rec, sizeof(rec)) / (long int) sizeof(struct journal_record)) > 0)
+        for (i = 0; i < n; i++) {
+            k = rec[i].k - cache->jfirst;
+            if (journal_record_valid(&rec[i]) && k >= 0 && k < cache->nspec) cache->rec[v][k] = rec[i];
+        }
+    close(fd);
+    utimes(cache->fn[v], NULL);
+}
+
+static void
+load_blocks (struct result_cache *cache)
+{
+    struct cache_key key;
+    struct stat st;
+
+    cache->nblocks = 0;
+    cache->blocks = NULL;
+    int fd = open(cache->blocks_fn, O_RDONLY);
+    if (fd < 0) return;
+    if (fstat(fd, &st) == 0 && st.st_size > (off_t) sizeof(key)
+        && read(fd, &key, sizeof(key)) == sizeof(key) && memcmp(&key, &cache->key[CACHE_FFT], sizeof(key)) == 0) {
+        cache->nblocks = (st.st_size - sizeof(key)) / sizeof(cache->blocks[0]);
+        cache->blocks = (int64_t (*)[3]) xmalloc(cache->nblocks * sizeof(cache->blocks[0]));
+        if (read(fd, cache->blocks, cache->nblocks * sizeof(cache->blocks[0]))
+            != (ssize_t) (cache->nblocks * sizeof(cache->blocks[0])))
+            cache->nblocks = 0;
+    }
+    close(fd);
+    utimes(cache->blocks_fn, NULL);
+}
+
+// @brief Open the cache in cfg->cache_dir for a run of the bins cfg->jfirst..+nspec-1 on the
+// @brief frequency axis fmin..fmax of all Jdes bins; reads all nread input samples for their hash
+void
+cache_open (struct result_cache *cache, tCFG *cfg, const struct sample_buffer *input,
+            double fmin, double fmax, long int nread, int max_samples_in_memory)
+{
+    int v, sample_type;
+
+    memset(cache, 0, sizeof(struct result_cache));
+    if (!cfg->cache_dir[0]) return;
+    snprintf(cache->dir, sizeof(cache->dir), "%s", cfg->cache_dir);
+    if (mkdir(cache->dir, 0755) != 0 && errno != EEXIST) gerror1("Error creating cache directory %s", cache->dir);
+    cache->jfirst = cfg->jfirst;
+    cache->nspec = cfg->nspec;
+    cache->max_bytes = cfg->cache_size * 1024. * 1024.;
+
+    uint64_t input_hash = hash_input(cfg, input, nread, &sample_type);
+    for (v = CACHE_EXACT; v <= CACHE_FFT; v++) {
+        struct cache_key *key = &cache->key[v];
+        memset(key, 0, sizeof(struct cache_key));
+        memcpy(key->magic, CACHE_MAGIC, 8);
+        key->version = CACHE_VERSION;
+        key->record_size = sizeof(struct journal_record);
+        key->variant = v;
+        key->Jdes = cfg->Jdes;
+        key->WT = cfg->WT;
+        key->sample_type = sample_type;
+        key->fsamp = cfg->fsamp;
+        key->fmin = fmin;
+        key->fmax = fmax;
+        key->ovlp = cfg->ovlp;
+        key->reqPSLL = cfg->reqPSLL;
+        key->ulsb = cfg->ulsb;
+        key->nread = nread;
+        key->input_hash = input_hash;
+        if (v == CACHE_FFT) {
+            key->interp = cfg->interp;
+            key->nthreads = cfg->nthreads;
+            key->max_samples_in_memory = max_samples_in_memory;
+        }
+        unsigned long long h = fnv1a(FNV_OFFSET, key, sizeof(struct cache_key));
+        snprintf(cache->fn[v], sizeof(cache->fn[v]), "%s/%016llx.bins", cache->dir, h);
+        if (v == CACHE_FFT) snprintf(cache->blocks_fn, sizeof(cache->blocks_fn), "%s/%016llx.blocks", cache->dir, h);
+        load_bins(cache, v);
+    }
+    load_blocks(cache);
+    cache->from_cache = (char*) xmalloc(cache->nspec);
+    memset(cache->from_cache, 0, cache->nspec);
+}
+
+// Restore bin k of data from variant v into data and the journal
+static void
+restore_bin (struct result_cache *cache, int v, tDATA *data, long int k, struct journal *jrnl)
+{
+    struct journal_record r = cache->rec[v][k];
+    r.k = k;
+    journal_record_seal(&r);
+    journal_record_restore(&r, data, cache->nspec);
+    journal_append(jrnl, data, k, k + 1);
+    cache->from_cache[k] = 1;
+    cache->restored++;
+}
+
+// @brief Restore the cached exact DFTs of the bins k0..k1-1 of data that are not done yet
+// @return the number of bins restored
+long int
+cache_restore_bins (struct result_cache *cache, tDATA *data, long int k0, long int k1, struct journal *jrnl)
+{
+    long int k, n = 0;
+    if (!cache->dir[0]) return 0;
+    for (k = k0; k < k1; k++) {
+        if (journal_done(jrnl, k) || cache->rec[CACHE_EXACT][k].k < 0) continue;
+        restore_bin(cache, CACHE_EXACT, data, k, jrnl);
+        n++;
+    }
+    return n;
+}
+
+// @brief Restore the bins of an FFT block if the cache has the same block with all its bins
+// @return 1 if the block was restored
+int
+cache_restore_block (struct result_cache *cache, tDATA *data, tBLOCK *block, struct journal *jrnl)
+{
+    long int b, k, k0 = block->j0 - cache->jfirst, k1 = block->j1 - cache->jfirst;
+    if (!cache->dir[0]) return 0;
+
+    for (b = 0; b < cache->nblocks; b++)
+        if (cache->blocks[b][0] == block->j0 && cache->blocks[b][1] == block->j1
+            && cache->blocks[b][2] == block->nfft) break;
+    if (b == cache->nblocks) return 0;
+    for (k = k0; k < k1 && cache->rec[CACHE_FFT][k].k >= 0; k++);
+    if (k < k1) return 0;
+    for (k = k0; k < k1; k++) if (!journal_done(jrnl, k)) restore_bin(cache, CACHE_FFT, data, k, jrnl);
+    return 1;
+}
+
+// Append n items of size bytes to fn; a new file starts with the key, in the same write()
+static void
+append_file (const char *fn, const struct cache_key *key, const void *items, size_t size, long int n)
+{
+    size_t len = n * size;
+    char *buf = (char*) xmalloc(sizeof(struct cache_key) + len);
+    int fd = open(fn, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0644);
+    size_t head = 0;
+
+    if (fd >= 0) {
+        memcpy(buf, key, sizeof(struct cache_key));
+        head = sizeof(struct cache_key);
+    } else if (errno == EEXIST) {
+        fd = open(fn, O_WRONLY | O_APPEND);
+    }
+    if (fd < 0) gerror1("Error opening cache file %s", fn);
+    memcpy(buf + head, items, len);
+    if (write(fd, buf, head + len) != (ssize_t) (head + len)) gerror1("Error writing cache file %s", fn);
+    close(fd);
+    xfree(buf);
+}
+
+// Size of the files of one key (<stem>.bins, <stem>.blocks) and their latest use
+struct cache_entry {
+    char stem[FNLEN];
+    double bytes;
+    double mtime;
+};
+
+// Remove the least recently used keys until the cache is within max_bytes
+static void
+evict (struct result_cache *cache)
+{
+    DIR *dir = opendir(cache->dir);
+    struct dirent *e;
+    struct stat st;
+    char fn[2*FNLEN + 8];
+    long int n = 0, nmax = 0, i;
+    double total = 0;
+
+    if (!dir) return;
+    while (readdir(dir)) nmax++;
+    rewinddir(dir);
+    struct cache_entry *entries = (struct cache_entry*) xmalloc((nmax + 1) * sizeof(struct cache_entry));
+    while ((e = readdir(dir)) != NULL) {
+        char *dot = strrchr(e->d_name, '.');
+        if (!dot || (strcmp(dot, ".bins") != 0 && strcmp(dot, ".blocks") != 0)) continue;
+        snprintf(fn, sizeof(fn), "%s/%s", cache->dir, e->d_name);
+        if (stat(fn, &st) != 0) continue;
+        for (i = 0; i < n && (strncmp(entries[i].stem, e->d_name, dot - e->d_name) != 0
+                              || entries[i].stem[dot - e->d_name] != 0); i++);
+        if (i == n && n < nmax) {
+            snprintf(entries[n].stem, FNLEN, "%.*s", (int) (dot - e->d_name), e->d_name);
+            entries[n].bytes = 0;
+            entries[n++].mtime = 0;
+        }
+        if (i == n) continue;
+        entries[i].bytes += st.st_size;
+        double mtime = st.st_mtim.tv_sec + st.st_mtim.tv_nsec / 1e9;
+        if (mtime > entries[i].mtime) entries[i].mtime = mtime;
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    while (total > cache->max_bytes && n > 0) {
+        long int oldest = 0;
+        for (i = 1; i < n; i++) if (entries[i].mtime < entries[oldest].mtime) oldest = i;
+        snprintf(fn, sizeof(fn), "%s/%s.bins", cache->dir, entries[oldest].stem);
+        unlink(fn);
+        snprintf(fn, sizeof(fn), "%s/%s.blocks", cache->dir, entries[oldest].stem);
+        unlink(fn);
+        message1("Cache: evicted %s", entries[oldest].stem);
+        total -= entries[oldest].bytes;
+        entries[oldest] = entries[--n];
+    }
+    xfree(entries);
+}
+
+// @brief Append the bins of data that did not come from the cache, and the FFT blocks they
+// @brief belong to, then evict keys beyond the size limit
+// @brief Bins restored from the journal are stored only if it has the same input hash
+void
+cache_store (struct result_cache *cache, tDATA *data, struct journal *jrnl)
+{
+    long int k, b, n[2] = {0, 0};
+    int v;
+    if (!cache->dir[0]) return;
+
+    struct journal_record *rec = (struct journal_record*) xmalloc(cache->nspec * sizeof(struct journal_record));
+    for (v = CACHE_EXACT; v <= CACHE_FFT; v++) {
+        if (!cache->fn[v][0]) continue;
+        for (k = 0; k < cache->nspec; k++) {
+            if (cache->from_cache[k] || (data->method[k] == 0) != (v == CACHE_EXACT)) continue;
+            if (jrnl->done[k] == JOURNAL_RESTORED && !jrnl->verified) continue;
+            journal_record_fill(&rec[n[v]], data, k);
+            rec[n[v]].k = cache->jfirst + k;
+            journal_record_seal(&rec[n[v]++]);
+        }
+        if (n[v] > 0) append_file(cache->fn[v], &cache->key[v], rec, sizeof(struct journal_record), n[v]);
+    }
+    xfree(rec);
+
+    int64_t (*blocks)[3] = (int64_t (*)[3]) xmalloc((data->nblocks + 1) * sizeof(blocks[0]));
+    for (b = k = 0; b < data->nblocks && cache->fn[CACHE_FFT][0]; b++) {
+        tBLOCK *block = &data->blocks[b];
+        long int k0 = block->j0 - cache->jfirst;
+        if (block->method == 0 || cache->from_cache[k0]) continue;
+        if (jrnl->done[k0] == JOURNAL_RESTORED && !jrnl->verified) continue;
+        blocks[k][0] = block->j0;
+        blocks[k][1] = block->j1;
+        blocks[k++][2] = block->nfft;
+    }
+    if (k > 0) append_file(cache->blocks_fn, &cache->key[CACHE_FFT], blocks, sizeof(blocks[0]), k);
+    xfree(blocks);
+
+    if (n[0] + n[1] > 0) printf("Cache: stored %ld bins in %s\n", n[0] + n[1], cache->dir);
+    evict(cache);
+}
+
+void
+cache_close (struct result_cache *cache)
+{
+    if (!cache->dir[0]) return;
+    // Also after an error in cache_open, and once more (close_state, lpsd.c)
+    for (int v = CACHE_EXACT; v <= CACHE_FFT; v++) {
+        if (cache->rec[v]) xfree(cache->rec[v]);
+        cache->rec[v] = NULL;
+    }
+    if (cache->blocks) xfree(cache->blocks);
+    if (cache->from_cache) xfree(cache->from_cache);
+    cache->blocks = NULL;
+    cache->from_cache = NULL;
+}
@@ -0,0 +1,48 @@
+#ifndef __cache_h
+#define __cache_h
+
+#include <stdint.h>
+
+#define CACHE_MAGIC "LPSDCACH"
+#define CACHE_VERSION 1
+#define CACHE_EXACT 0		/* variants of cached bins: exact DFTs */
+#define CACHE_FFT 1		/* FFT approximation, valid only with the same block */
+#define FNV_OFFSET 14695981039346656037ULL
+
+// Everything the PSD of bin j depends on, apart from j (and the block for CACHE_FFT);
+// the cache file of a variant is named by the hash of its key, which is also its header
+struct cache_key {
+    char magic[8];
+    int32_t version, record_size;
+    int32_t variant, Jdes, WT, sample_type;
+    double fsamp, fmin, fmax, ovlp, reqPSLL, ulsb;
+    int64_t nread;
+    uint64_t input_hash;	/* of the samples 0..nread-1 */
+    int32_t interp, nthreads;	/* CACHE_FFT only */
+    int64_t max_samples_in_memory;
+};
+
+struct result_cache {
+    char dir[FNLEN];		/* empty if the cache is off */
+    char fn[2][FNLEN + 24];	/* bins of each variant, <dir>/<key hash>.bins */
+    char blocks_fn[FNLEN + 24];	/* blocks of the CACHE_FFT bins: j0, j1, nfft */
+    struct cache_key key[2];
+    long int jfirst, nspec;
+    struct journal_record *rec[2];	/* cached bin k of data, bin k = -1 if there is none */
+    int64_t (*blocks)[3];
+    long int nblocks;
+    char *from_cache;		/* 1 - bin k was restored from the cache */
+    long int restored;
+    double max_bytes;
+};
+
+uint64_t fnv1a(uint64_t h, const void *buf, size_t len);
+void cache_open(struct result_cache *cache, tCFG *cfg, const struct sample_buffer *input,
+                double fmin, double fmax, long int nread, int max_samples_in_memory);
+long int cache_restore_bins(struct result_cache *cache, tDATA *data, long int k0, long int k1,
+                            struct journal *jrnl);
+int cache_restore_block(struct result_cache *cache, tDATA *data, tBLOCK *block, struct journal *jrnl);
+void cache_store(struct result_cache *cache, tDATA *data, struct journal *jrnl);
+void cache_close(struct result_cache *cache);
+
+#endif
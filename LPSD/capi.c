@@ -0,0 +1,385 @@
+/********************************************************************************
+    capi.c
+
+    Flat interface of liblpsd for foreign function interfaces, used by the
+    Python bindings in python/lpsd.py through ctypes.
+
+    A run holds the parameters (a tCFG with the defaults of config.c), the
+    input and, once computed, the spectrum. Parameters are set by the name of
+    their tCFG member, as strings. The input is either samples in memory,
+    which are read in place and must stay valid during lpsd_run_compute, or
+    the dataset of the file "ifn". lpsd_run_compute fills in the parameters
+    left at their defaults as lpsd-exec does (tmax from the length of the
+    input, fmin, fmax, the overlap and sbin from the window), checks them and
+    calculates the spectrum; the result arrays stay valid until the next
+    lpsd_run_compute or lpsd_run_free. Invalid parameters make the call
+    return -1, errors during the calculation (gerror, through an error trap)
+    -2, with the message in lpsd_run_error. On the way back to the trap, the
+    calculation releases what it holds (push_cleanup, errors.h): open HDF5
+    files, temporary files, buffers, the HDF5 lock, the journal, the cache and
+    the segment store. Errors in the helper threads of a calculation
+    (--threads, read-ahead) are raised in the calling thread once they stopped,
+    --workers processes end on errors and are replaced or stopped by the
+    coordinator. Different runs may be computed at the same time in threads.
+
+    A run may instead stream (stream.c): lpsd_run_stream starts it, each
+    lpsd_run_push adds samples and lpsd_run_snapshot puts the spectrum of the
+    samples pushed so far into the result arrays.
+
+ ********************************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include "hdf5.h"
+
+#include "config.h"
+#include "misc.h"
+#include "errors.h"
+#include "IO.h"
+#include "lpsd.h"
+#include "stream.h"
+#include "capi.h"
+
+#define PAR_INT 0
+#define PAR_LONG 1
+#define PAR_DOUBLE 2
+#define PAR_STRING 3
+
+struct lpsd_run {
+    tCFG par;			/* parameters as set */
+    tCFG cfg;			/* parameters of the last computation, completed by lpsd_run_compute */
+    tDATA data;
+    struct lpsd_state st;
+    struct lpsd_stream stream;
+    int computed;		/* 1 - data holds a spectrum */
+    int streaming;		/* 1 - stream is open, data holds its last snapshot */
+    char error[ERRMSGLEN];
+    struct error_trap trap;	/* gerror returns to the entry point that set it */
+};
+
+static const struct {
+    const char *name;
+    size_t offset;
+    int type;
+} parameters[] = {
+    {"ifn",		offsetof(tCFG, ifn),		PAR_STRING},
+    {"dataset_name",	offsetof(tCFG, dataset_name),	PAR_STRING},
+    {"ofn",		offsetof(tCFG, ofn),		PAR_STRING},
+    {"WT",		offsetof(tCFG, WT),		PAR_INT},
+    {"LR",		offsetof(tCFG, LR),		PAR_INT},
+    {"nspec",		offsetof(tCFG, nspec),		PAR_LONG},
+    {"iter",		offsetof(tCFG, iter),		PAR_INT},
+    {"Jdes",		offsetof(tCFG, Jdes),		PAR_INT},
+    {"fsamp",		offsetof(tCFG, fsamp),		PAR_DOUBLE},
+    {"fres",		offsetof(tCFG, fres),		PAR_DOUBLE},
+    {"reqPSLL",		offsetof(tCFG, reqPSLL),	PAR_DOUBLE},
+    {"ovlp",		offsetof(tCFG, ovlp),		PAR_DOUBLE},
+    {"ulsb",		offsetof(tCFG, ulsb),		PAR_DOUBLE},
+    {"tmin",		offsetof(tCFG, tmin),		PAR_DOUBLE},
+    {"tmax",		offsetof(tCFG, tmax),		PAR_DOUBLE},
+    {"fmin",		offsetof(tCFG, fmin),		PAR_DOUBLE},
+    {"fmax",		offsetof(tCFG, fmax),		PAR_DOUBLE},
+    {"desAVG",		offsetof(tCFG, desAVG),		PAR_INT},
+    {"minAVG",		offsetof(tCFG, minAVG),		PAR_INT},
+    {"METHOD",		offsetof(tCFG, METHOD),		PAR_INT},
+    {"sbin",		offsetof(tCFG, sbin),		PAR_DOUBLE},
+    {"nthreads",	offsetof(tCFG, nthreads),	PAR_INT},
+    {"workers",		offsetof(tCFG, workers),	PAR_INT},
+    {"epsilon",		offsetof(tCFG, epsilon),	PAR_DOUBLE},
+    {"interp",		offsetof(tCFG, interp),		PAR_INT},
+    {"max_rel_error",	offsetof(tCFG, max_rel_error),	PAR_DOUBLE},
+    {"memory_budget",	offsetof(tCFG, memory_budget),	PAR_DOUBLE},
+    {"journal",		offsetof(tCFG, journal),	PAR_INT},
+    {"journal_fsync",	offsetof(tCFG, journal_fsync),	PAR_DOUBLE},
+    {"cache_dir",	offsetof(tCFG, cache_dir),	PAR_STRING},
+    {"cache_size",	offsetof(tCFG, cache_size),	PAR_DOUBLE},
+    {"state_fn",	offsetof(tCFG, state_fn),	PAR_STRING},
+    {"segments_fn",	offsetof(tCFG, segments_fn),	PAR_STRING}
+};
+static const int nparameters = sizeof (parameters) / sizeof (parameters[0]);
+
+// Result arrays of tDATA: 0 - double, 1 - int
+static const struct {
+    const char *name;
+    size_t offset;
+    int type;
+} results[] = {
+    {"fspec",		offsetof(tDATA, fspec),		0},
+    {"bins",		offsetof(tDATA, bins),		0},
+    {"psd",		offsetof(tDATA, psd),		0},
+    {"ps",		offsetof(tDATA, ps),		0},
+    {"varpsd",		offsetof(tDATA, varpsd),	0},
+    {"varps",		offsetof(tDATA, varps),		0},
+    {"psd_real",	offsetof(tDATA, psd_real),	0},
+    {"psd_imag",	offsetof(tDATA, psd_imag),	0},
+    {"avg",		offsetof(tDATA, avg),		1},
+    {"nffts",		offsetof(tDATA, nffts),		1},
+    {"method",		offsetof(tDATA, method),	1}
+};
+static const int nresults = sizeof (results) / sizeof (results[0]);
+
+// @brief New run with the defaults of config.c; no journal, no output files
+struct lpsd_run *
+lpsd_run_new (void)
+{
+    struct lpsd_run *run = (struct lpsd_run*) xmalloc(sizeof(struct lpsd_run));
+    memset(run, 0, sizeof(struct lpsd_run));
+    getConfig(&run->par);
+    run->par.usedefs = 1;
+    run->par.journal = 0;
+    return run;
+}
+
+// Free the spectrum and the stream of the last computation
+static void
+reset (struct lpsd_run *run)
+{
+    if (run->streaming) stream_close(&run->stream);
+    if (run->computed) memfree(&run->cfg, &run->data);
+    run->computed = run->streaming = 0;
+    run->error[0] = 0;
+}
+
+void
+lpsd_run_free (struct lpsd_run *run)
+{
+    reset(run);
+    xfree(run);
+}
+
+// @brief Set the parameter of tCFG member name to value
+// @return 0, -1 if there is no such parameter or value is not a number
+int
+lpsd_run_set (struct lpsd_run *run, const char *name, const char *value)
+{
+    char *end;
+    int i;
+
+    for (i = 0; i < nparameters && strcmp(parameters[i].name, name) != 0; i++);
+    if (i == nparameters) {
+        snprintf(run->error, ERRMSGLEN, "Unknown parameter %s", name);
+        return -1;
+    }
+    char *p = (char*) &run->par + parameters[i].offset;
+    if (parameters[i].type == PAR_STRING) {
+        if (strlen(value) >= FNLEN) {
+            snprintf(run->error, ERRMSGLEN, "Value of %s is too long", name);
+            return -1;
+        }
+        strcpy(p, value);
+        return 0;
+    }
+    double x = strtod(value, &end);
+    if (end == value || *end) {
+        snprintf(run->error, ERRMSGLEN, "Value of %s is not a number: %s", name, value);
+        return -1;
+    }
+    if (parameters[i].type == PAR_INT) *(int*) p = (int) x;
+    else if (parameters[i].type == PAR_LONG) *(long int*) p = (long int) x;
+    else *(double*) p = x;
+    return 0;
+}
+
+// @brief Name of parameter i, NULL after the last one
+const char *
+lpsd_run_parameter (int i)
+{
+    return i >= 0 && i < nparameters ? parameters[i].name : NULL;
+}
+
+// @brief Calculate the spectrum of the n samples (SAMPLE_*) at samples instead of the file ifn;
+// @brief samples NULL returns to the file
+void
+lpsd_run_set_samples (struct lpsd_run *run, const void *samples, int sample_type, long int n)
+{
+    run->st.input.samples = samples;
+    run->st.input.sample_type = sample_type;
+    run->st.input.n = n;
+}
+
+static int
+fail (struct lpsd_run *run, const char *err)
+{
+    snprintf(run->error, ERRMSGLEN, "%s", err);
+    return -1;
+}
+
+// gerror during a call: drop the spectrum and the stream, keep the message
+static int
+trapped (struct lpsd_run *run)
+{
+    reset(run);
+    fail(run, run->trap.msg);
+    return -2;
+}
+
+// Samples of the input
+static long int
+input_length (struct lpsd_run *run)
+{
+    struct hdf5_contents contents;
+    hsize_t n;
+
+    if (run->st.input.samples) return run->st.input.n;
+    open_samples(&contents, &run->cfg, NULL);
+    hdf5_enter();
+    H5Sget_simple_extent_dims(contents.dataspace, &n, NULL);
+    hdf5_leave();
+    close_hdf5_contents(&contents);
+    return n;
+}
+
+static int
+compute (struct lpsd_run *run)
+{
+    tCFG *cfg = &run->cfg;
+    tWinInfo wi;
+    struct window win;
+    double rov, xov, fm;
+    long int nread, ndata;
+
+    reset(run);
+    memcpy(cfg, &run->par, sizeof(tCFG));
+
+    if (!run->st.input.samples && !exists(cfg->ifn)) return fail(run, "Input file does not exist");
+    if (cfg->fsamp <= 0) return fail(run, "Sampling frequency must be positive");
+    ndata = input_length(run);
+    if (cfg->tmax < 0) cfg->tmax = (double) (ndata - 1) / cfg->fsamp;
+    nread = floor((cfg->tmax - cfg->tmin) * cfg->fsamp + 1);
+    if (nread < 2 || nread > ndata) return fail(run, "tmin..tmax is not inside the input");
+    if (cfg->nspec < 1) return fail(run, "nspec must be positive");
+    if (cfg->Jdes <= 0) cfg->Jdes = cfg->nspec;
+    set_window(&win, cfg->WT, cfg->reqPSLL, &wi.name[0], &wi.psll, &rov,
+               &wi.nenbw, &wi.w3db, &wi.flatness, &wi.sbin);
+    if (cfg->ovlp < 0) cfg->ovlp = rov;
+    if (cfg->sbin < 0) cfg->sbin = wi.sbin;
+    xov = (1. - cfg->ovlp / 100.);
+    fm = cfg->sbin / (nread / cfg->fsamp) * (1 + xov * (cfg->minAVG - 1));
+    if (cfg->fmin < 0) cfg->fmin = fm;
+    if (cfg->fres < 0) cfg->fres = 1. / (cfg->tmax - cfg->tmin) * (1 + xov * (cfg->minAVG - 1));
+    if (cfg->fmax < 0) cfg->fmax = cfg->fsamp / 2.0;
+
+    // checkParams of lpsd-exec
+    if (cfg->fmax > cfg->fsamp / 2.0) return fail(run, "Largest frequency cannot be bigger than fsamp/2!");
+    if (cfg->fmin * (1. + 1e-6) < fm) return fail(run, "Reduce minAVG or increase minimum frequency!");
+    if (cfg->METHOD < 0 || cfg->METHOD > 2) return fail(run, "Method not implemented.");
+
+    memalloc(cfg, &run->data);
+    run->computed = 1;
+    calculateSpectrum(&run->st, cfg, &run->data);
+    return 0;
+}
+
+// @brief Complete the parameters as lpsd-exec does with -u 1 and calculate the spectrum
+// @return 0, -1 if the parameters are invalid, -2 if the calculation failed (see lpsd_run_error)
+int
+lpsd_run_compute (struct lpsd_run *run)
+{
+    if (setjmp(run->trap.env)) return trapped(run);
+    set_error_trap(&run->trap);
+    int ret = compute(run);
+    set_error_trap(NULL);
+    return ret;
+}
+
+static int
+start_stream (struct lpsd_run *run)
+{
+    tCFG *cfg = &run->cfg;
+    tWinInfo wi;
+    struct window win;
+    double rov;
+
+    reset(run);
+    memcpy(cfg, &run->par, sizeof(tCFG));
+    if (cfg->fsamp <= 0) return fail(run, "Sampling frequency must be positive");
+    if (cfg->nspec < 1) return fail(run, "nspec must be positive");
+    if (cfg->Jdes <= 0) cfg->Jdes = cfg->nspec;
+    set_window(&win, cfg->WT, cfg->reqPSLL, &wi.name[0], &wi.psll, &rov,
+               &wi.nenbw, &wi.w3db, &wi.flatness, &wi.sbin);
+    if (cfg->ovlp < 0) cfg->ovlp = rov;
+    if (cfg->fmax < 0) cfg->fmax = cfg->fsamp / 2.0;
+    if (cfg->fmin <= 0) return fail(run, "A stream needs fmin");
+    if (cfg->fmax > cfg->fsamp / 2.0) return fail(run, "Largest frequency cannot be bigger than fsamp/2!");
+    if (cfg->METHOD != 0) return fail(run, "A stream calculates METHOD 0 only");
+
+    memalloc(cfg, &run->data);
+    run->computed = 1;
+    stream_open(&run->stream, cfg, &run->data);
+    run->streaming = 1;
+    stream_snapshot(&run->stream, &run->data);
+    return 0;
+}
+
+// @brief Start a stream of the bins of the parameters (ifn and the samples are not used);
+// @brief fmin must be set, as there is no length of the input to derive it from
+// @return 0, -1 if the parameters are invalid, -2 on errors
+int
+lpsd_run_stream (struct lpsd_run *run)
+{
+    if (setjmp(run->trap.env)) return trapped(run);
+    set_error_trap(&run->trap);
+    int ret = start_stream(run);
+    set_error_trap(NULL);
+    return ret;
+}
+
+// @brief Add the next n samples (SAMPLE_*) to the stream of the run
+// @return 0, -1 without a stream, -2 if the samples could not be added, which closes the stream
+int
+lpsd_run_push (struct lpsd_run *run, const void *samples, int sample_type, long int n)
+{
+    if (!run->streaming) return fail(run, "lpsd_run_push without lpsd_run_stream");
+    if (setjmp(run->trap.env)) return trapped(run);
+    set_error_trap(&run->trap);
+    stream_push(&run->stream, samples, sample_type, n);
+    set_error_trap(NULL);
+    return 0;
+}
+
+// @brief Results of the samples pushed so far
+// @return 0, -1 without a stream, -2 on errors
+int
+lpsd_run_snapshot (struct lpsd_run *run)
+{
+    if (!run->streaming) return fail(run, "lpsd_run_snapshot without lpsd_run_stream");
+    if (setjmp(run->trap.env)) return trapped(run);
+    set_error_trap(&run->trap);
+    stream_snapshot(&run->stream, &run->data);
+    set_error_trap(NULL);
+    return 0;
+}
+
+const char *
+lpsd_run_error (struct lpsd_run *run)
+{
+    return run->error;
+}
+
+// @brief Bins of the computed spectrum, 0 if there is none
+long int
+lpsd_run_nspec (struct lpsd_run *run)
+{
+    return run->computed ? run->cfg.nspec : 0;
+}
+
+// @brief Type of the result array name: 0 - double, 1 - int, -1 - no such result
+int
+lpsd_run_result_type (const char *name)
+{
+    for (int i = 0; i < nresults; i++) if (strcmp(results[i].name, name) == 0) return results[i].type;
+    return -1;
+}
+
+// @brief Result array name of the tDATA of the run (lpsd_run_nspec elements), NULL if there is none
+const void *
+lpsd_run_result (struct lpsd_run *run, const char *name)
+{
+    if (!run->computed) return NULL;
+    for (int i = 0; i < nresults; i++)
+        if (strcmp(results[i].name, name) == 0) return *(void**) ((char*) &run->data + results[i].offset);
+    return NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef __capi_h
+#define __capi_h
+
+// Flat interface of liblpsd for foreign function interfaces (python/lpsd.py): an opaque
+// run, parameters set by their tCFG name, results as pointers into memory owned by the run
+struct lpsd_run;
+
+struct lpsd_run *lpsd_run_new(void);
+void lpsd_run_free(struct lpsd_run *run);
+int lpsd_run_set(struct lpsd_run *run, const char *name, const char *value);
+const char *lpsd_run_parameter(int i);
+void lpsd_run_set_samples(struct lpsd_run *run, const void *samples, int sample_type, long int n);
+int lpsd_run_compute(struct lpsd_run *run);
+int lpsd_run_stream(struct lpsd_run *run);
+int lpsd_run_push(struct lpsd_run *run, const void *samples, int sample_type, long int n);
+int lpsd_run_snapshot(struct lpsd_run *run);
+const char *lpsd_run_error(struct lpsd_run *run);
+long int lpsd_run_nspec(struct lpsd_run *run);
+int lpsd_run_result_type(const char *name);
+const void *lpsd_run_result(struct lpsd_run *run, const char *name);
+
+#endif
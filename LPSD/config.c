@@ -69,6 +69,20 @@ static void act_colA(char *s);
 static void act_colB(char *s);
 static void act_format(char *s);
 static void act_gnuterm(char *s);
+static void act_nthreads(char *s);
+static void act_workers(char *s);
+static void act_epsilon(char *s);
+static void act_interp(char *s);
+static void act_maxrelerr(char *s);
+static void act_membudget(char *s);
+static void act_outfmt(char *s);
+static void act_compression(char *s);
+static void act_journal(char *s);
+static void act_journalfsync(char *s);
+static void act_cachedir(char *s);
+static void act_cachesize(char *s);
+static void act_state(char *s);
+static void act_segments(char *s);
 
 static tPARSEPAIR pplist [] = {
 	{"IFN",		act_ifn},
@@ -95,7 +109,21 @@ static tPARSEPAIR pplist [] = {
 	{"COLA",	act_colA},
 	{"COLB",	act_colB},
 	{"FORMAT",	act_format},
-	{"GNUTERM",	act_gnuterm}
+	{"GNUTERM",	act_gnuterm},
+	{"NTHREADS",	act_nthreads},
+	{"WORKERS",	act_workers},
+	{"EPSILON",	act_epsilon},
+	{"INTERP",	act_interp},
+	{"MAXRELERR",	act_maxrelerr},
+	{"MEMBUDGET",	act_membudget},
+	{"OUTFMT",	act_outfmt},
+	{"COMPRESSION",	act_compression},
+	{"JOURNAL",	act_journal},
+	{"JOURNALFSYNC",	act_journalfsync},
+	{"CACHEDIR",	act_cachedir},
+	{"CACHESIZE",	act_cachesize},
+	{"STATE",	act_state},
+	{"SEGMENTS",	act_segments}
 };
 
 static const int npplist = sizeof (pplist) / sizeof (tPARSEPAIR);
@@ -106,6 +134,8 @@ static tPARSEPAIR gtlist [] = {
 
 static const int ngtlist = sizeof (gtlist) / sizeof (tPARSEPAIR);
 
+/* Defaults, changed only by readConfigFile (lpsd-exec, before the run); getConfig copies
+   them, so runs in threads of liblpsd each have their own tCFG */
 static tCFG cfg={usedefs:0,
 		ifn:DEFIFN,
 		dataset_name:DEFDSET,
@@ -161,7 +191,21 @@ static tCFG cfg={usedefs:0,
 		colA:1,
 		askcolA:1,
 		colB:0,
-		askcolB:0};
+		askcolB:0,
+		nthreads:DEFNTHREADS,
+		workers:DEFWORKERS,
+		epsilon:DEFEPSILON,
+		interp:DEFINTERP,
+		max_rel_error:DEFMAXRELERR,
+		memory_budget:DEFMEMBUDGET,
+		output_format:DEFOUTFMT,
+		compression:DEFCOMPRESSION,
+		journal:DEFJOURNAL,
+		journal_fsync:DEFJOURNALFSYNC,
+		cache_dir:"",
+		cache_size:DEFCACHESIZE,
+		state_fn:"",
+		segments_fn:""};
 
 void getConfig(tCFG *c) {
 	memcpy(c,&cfg,sizeof(cfg));
@@ -335,6 +379,62 @@ static void act_fmax(char *s) {
 	else cfg.askfmax=0;
 }
 
+static void act_nthreads(char *s) {
+	cfg.nthreads=getIntValue(s);
+}
+
+static void act_workers(char *s) {
+	cfg.workers=getIntValue(s);
+}
+
+static void act_epsilon(char *s) {
+	cfg.epsilon=getDBLValue(s);
+}
+
+static void act_interp(char *s) {
+	cfg.interp=getIntValue(s);
+}
+
+static void act_maxrelerr(char *s) {
+	cfg.max_rel_error=getDBLValue(s);
+}
+
+static void act_membudget(char *s) {
+	cfg.memory_budget=getDBLValue(s);
+}
+
+static void act_outfmt(char *s) {
+	cfg.output_format=getIntValue(s);
+}
+
+static void act_compression(char *s) {
+	cfg.compression=getIntValue(s);
+}
+
+static void act_journal(char *s) {
+	cfg.journal=getIntValue(s);
+}
+
+static void act_journalfsync(char *s) {
+	cfg.journal_fsync=getDBLValue(s);
+}
+
+static void act_cachedir(char *s) {
+	getStringValue(&cfg.cache_dir[0],s);
+}
+
+static void act_cachesize(char *s) {
+	cfg.cache_size=getDBLValue(s);
+}
+
+static void act_state(char *s) {
+	getStringValue(&cfg.state_fn[0],s);
+}
+
+static void act_segments(char *s) {
+	getStringValue(&cfg.segments_fn[0],s);
+}
+
 static void act_format(char *s) {
 	getStringValue(&gt[gti].fmt[0],s);
 }
@@ -463,7 +563,7 @@ sprintf(&dest[strlen(dest)],"---Data--------------------------------------------
 }
 
 static void printOutput(char *dest, tCFG cfg, tGNUTERM gt, tDATA data) {
-	char meth[2][SLEN]={"LPSD","FFTW"};
+	char meth[3][SLEN]={"LPSD","FFTW","Hybrid"};
 	int avg;
 
 	avg=floor((data.nread-cfg.nfft)/(cfg.ovlp/100.)/cfg.nfft+1);
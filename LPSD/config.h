@@ -26,6 +26,50 @@
 #define DEFMETHOD 0		/* METHOD to calculate frequency METHOD */
 #define DEFFSAMP 1e4		/* lpsd.c	- default sampling frequency */
 #define DEFNSPEC 500		/* lpsd.c	- default number of frequencies in spectrum */
+#define DEFNTHREADS 1		/* lpsd.c	- default number of compute threads */
+#define DEFWORKERS 1		/* lpsd.c	- default number of worker processes, 1 - no workers */
+#define DEFEPSILON 0.1		/* lpsd.c	- METHOD 1: max. relative change of segment length within a block */
+#define DEFINTERP 0		/* lpsd.c	- METHOD 1: spectral interpolation, 0 linear, 1 cubic, 2 sinc */
+#define DEFMAXRELERR -1		/* lpsd.c	- METHOD 1: target relative error for block widths, -1 use epsilon */
+#define NREGIONS 8		/* lpsd.c	- METHOD 1: frequency regions with their own block width */
+#define NPROBE 2		/* lpsd.c	- METHOD 1: bins per probe block compared with exact DFTs */
+#define NPROBE_BLOCKS 3		/* lpsd.c	- METHOD 1: probe blocks per region and epsilon */
+#define DEFMEMBUDGET 16384	/* lpsd.c	- memory budget (MB) for in-core FFTs */
+#define DFTUNIT (5*6577770)	/* lpsd.c	- samples of a segment windowed and summed at a time (~500 MB) */
+#define PREFETCH_BUFFERS 2	/* lpsd.c	- buffers of input data read ahead of the computation */
+#define PREFETCH_SAMPLES 65536	/* lpsd.c	- min. samples per read ahead of the computation */
+#define COST_SINCOS 20.		/* lpsd.c	- METHOD 2: cost of a sin/cos pair, in multiply-adds */
+#define COST_READ 2.		/* lpsd.c	- METHOD 2: cost of reading one sample from file */
+#define COST_OOC 10.		/* lpsd.c	- METHOD 2: slowdown of an out-of-core FFT */
+#define PARTFN "partitions.txt"	/* lpsd.c	- partition table written by --plan-partitions */
+#define DAGFN "lpsd.dag"	/* lpsd.c	- HTCondor DAG written by --plan-partitions */
+#define DRYRUNTIME 0.1		/* lpsd.c	- s per kernel timed by --dry-run */
+#define OUTFMT_TEXT 0		/* IO.c		- output file format: text columns */
+#define OUTFMT_HDF5 1		/* IO.c		- output file format: HDF5 datasets */
+#define DEFOUTFMT OUTFMT_TEXT	/* IO.c		- default output file format */
+#define DEFCOMPRESSION 0	/* IO.c		- deflate level of HDF5 output, 0 - no compression */
+#define OUTCHUNK 65536		/* IO.c		- chunk size (bins) of HDF5 output datasets */
+#define DEFJOURNAL 1		/* journal.c	- 1 - keep a checkpoint journal of completed bins */
+#define DEFJOURNALFSYNC 10	/* journal.c	- s between fsyncs of the journal, 0 - every bin/block, -1 - never */
+#define DEFCACHESIZE 10240	/* cache.c	- default size limit (MB) of the result cache */
+#define CACHEHASHBLOCK (1L << 20)	/* cache.c	- samples hashed at a time */
+#define CACHEREAD 4096		/* cache.c	- cached bins read at a time */
+#define STREAMCHUNK 65536	/* stream.c	- samples of a pushed block processed at a time */
+#define STATESEGMENTS 4096	/* stream.c	- segments of a bin summed with one calculation of its window */
+#define SEGMENTCHUNK 1024	/* segments.c	- segments of one bin in a chunk of the segment store */
+#define INPUTHASH 65536		/* lpsd.c	- samples at the start and the end of the input hashed to recognise it (journal) */
+#define STATEHASH 65536		/* lpsd.c	- --state: samples before the end of the state hashed to recognise the series */
+#define MAXJOURNALS 64		/* journal.c	- journals open at the same time in one process (liblpsd threads) */
+#define WORKUNITS 16		/* workers.c	- work units queued per worker */
+#define WORKRETRIES 3		/* workers.c	- times a unit is re-issued after its worker died */
+#define RANKUNITS 2		/* ranks.c	- work units an MPI rank holds, covering the wait for the next one */
+#define INGESTBYTES (16L << 20)	/* ingest.c	- bytes of text parsed per thread and round */
+#define DEFINGESTCHUNK 1048576	/* ingest.c	- default chunk size (samples) of the strain dataset */
+#define REPACKBINS 256		/* repack.c	- bins of the band whose reads are modelled */
+#define REPACKMINCHUNK 4096	/* repack.c	- smallest chunk size (samples) considered */
+#define REPACKMAXCHUNK (1L << 24)	/* repack.c	- largest chunk size (samples) considered */
+#define REPACKCALLBYTES 65536	/* repack.c	- cost of one chunk read, in bytes decoded */
+#define REPACKBLOCK (1L << 22)	/* repack.c	- samples copied at a time */
 
 #define DATADEL " \t\n"		/* IO.c		- delimiters in datafiles: space, tab, and newline *** 28.06.2007 newline added */
 #define DATALEN 1000		/* IO.c		- length of a single line in ASCII data files */
@@ -76,6 +120,10 @@ typedef struct {
 	unsigned short int askWT;
 	int LR;				/* 0 no linear regression, 1 perform linear regression */
 	long int nspec;			/* number of samples in spectrum */
+	long int jfirst;		/* index of the first bin of this partition in 0..Jdes-1 */
+	long int binrange[2];		/* --bins: first bin, last bin + 1 of this partition; [1] = 0 - use -n/-N */
+	int plan_partitions;		/* --plan-partitions: number of partitions to plan, 0 - calculate */
+	int dry_run;			/* --dry-run: 1 - estimate the run instead of calculating it */
 	long int nfft;			/* FFTW: dimension of FFT */
 	int iter;			/* A reference number to show why step through a parallelised job. Set to zero for a single job run */
 	int Jdes;			/* Provides the total number of required frequencies */
@@ -122,8 +170,31 @@ typedef struct {
 	unsigned short int askcolA;
 	unsigned int colB;		/* process column B if B>0 & B>A */
 	unsigned short int askcolB;	
+	int nthreads;			/* number of compute threads */
+	int workers;			/* number of worker processes, 1 - calculate in this process */
+	double epsilon;			/* METHOD 1: block width parameter */
+	int interp;			/* METHOD 1: spectral interpolation method */
+	double max_rel_error;		/* METHOD 1: choose epsilon per region for this error, -1 off */
+	double memory_budget;		/* memory (MB) for in-core FFTs */
+	int output_format;		/* OUTFMT_TEXT or OUTFMT_HDF5 */
+	int compression;		/* deflate level (0-9) of HDF5 output */
+	int journal;			/* 1 - checkpoint completed bins to <ofn>.journal */
+	double journal_fsync;		/* s between fsyncs of the journal */
+	char cache_dir[FNLEN];		/* directory of the result cache, empty - no cache */
+	double cache_size;		/* size limit (MB) of the result cache */
+	char state_fn[FNLEN];		/* --state: running sums of the bins for a later run over more samples, empty - none */
+	char segments_fn[FNLEN];	/* --segments: DFTs of the single segments of the exact bins, empty - none */
 } tCFG;	
 
+typedef struct {
+	long int j0, j1;		/* block covers bins j0..j1-1 */
+	long int nfft;			/* segment length used for all bins of the block */
+	double epsilon;			/* block width parameter */
+	double err;			/* largest relative error of the probe blocks of its region, -1 if not probed */
+	int method;			/* 0 - exact DFT per bin, 1 - FFT approximation */
+	double cost_exact, cost_fft;	/* estimated cost of both methods (multiply-adds) */
+} tBLOCK;
+
 typedef struct {
 	double *fspec;			/* frequencies where spectra are calculated */
 	double *bins;			/* frequency bins in DFTs */
@@ -140,6 +211,9 @@ typedef struct {
 	long int ndata;			/* number of data in input file */
 	long int nread;			/* length of time series used for spectrum estimation */
 	int comma;			/* 1 - comma as decimal delimiter; 0 - decimal points */
+	int *method;			/* method used for each bin: 0 - exact DFT, 1 - FFT approximation */
+	tBLOCK *blocks;			/* METHOD 1 blocks */
+	int nblocks;			/* number of METHOD 1 blocks */
 
 } tDATA;
 
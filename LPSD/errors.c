@@ -1,8 +1,59 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <setjmp.h>
 #include "config.h"
 #include "errors.h"
 
+static __thread struct error_trap *trap = NULL;	/* of this thread, NULL - exit */
+static __thread struct error_cleanup *cleanups = NULL;	/* of this thread, last pushed first */
+
+// @brief Make the gerror* of this thread longjmp to t with the message instead of ending
+// @brief the process (capi.c); the trap is used once, t NULL removes it
+void set_error_trap(struct error_trap *t) {
+	trap = t;
+	if (t) t->cleanups = cleanups;
+}
+
+// @brief Have release(arg) called if gerror* of this thread returns to a trap set before,
+// @brief until pop_cleanup(c); c must stay valid until then
+void push_cleanup(struct error_cleanup *c, void (*release)(void*), void *arg) {
+	c->release = release;
+	c->arg = arg;
+	c->prev = cleanups;
+	c->next = NULL;
+	if (cleanups) cleanups->next = c;
+	cleanups = c;
+}
+
+// @brief Remove c, in any order, once its owner released what it holds; c of a
+// @brief zeroed struct or popped before is ignored
+void pop_cleanup(struct error_cleanup *c) {
+	if (!c->release) return;
+	if (c->next) c->next->prev = c->prev;
+	else cleanups = c->prev;
+	if (c->prev) c->prev->next = c->next;
+	c->release = NULL;
+}
+
+// End the process, or return to the trap of this thread, with error message errmsg; on the
+// way, what the functions between gerror and the trap hold is released
+static void fail(const char *errmsg) {
+	struct error_trap *t = trap;
+	if (t) {
+		trap = NULL;
+		snprintf(t->msg, ERRMSGLEN, "%s", errmsg);
+		while (cleanups && cleanups != t->cleanups) {
+			struct error_cleanup *c = cleanups;
+			void (*release)(void*) = c->release;
+			pop_cleanup(c);
+			release(c->arg);
+		}
+		longjmp(t->env, 1);
+	}
+	fprintf (stderr, "%s\n", errmsg);
+	exit(1);
+}
+
 void message (const char *err) {
 	fprintf (stderr, "%s\n", err);
 }
@@ -15,19 +66,17 @@ void message1 (const char *err, const char *s) {
 }
 
 void gerror(const char *err) {
-	fprintf (stderr, "%s\n", err);
-	exit(1);
+	fail(err);
 }
 
 void gerror1 (const char *err, const char *s) {
 	char errmsg[ERRMSGLEN];
 	sprintf (errmsg, err, s);
-	fputs (errmsg, stderr);
-	putc ('\n', stderr);
-	exit(1);
+	fail(errmsg);
 }
 
 void gerror2(const char *err,char *err2) {
-	fprintf (stderr, "%s %s\n", err,err2);
-	exit(1);
+	char errmsg[ERRMSGLEN];
+	snprintf (errmsg, ERRMSGLEN, "%s %s", err, err2);
+	fail(errmsg);
 }
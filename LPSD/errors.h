@@ -1,11 +1,32 @@
 #ifndef __errors_h
 #define __errors_h
 
+#include <setjmp.h>
+#include "config.h"
+
+// What a function holds (files, buffers, locks) and releases itself unless an error returns
+// to a trap past it, see push_cleanup
+struct error_cleanup {
+	void (*release)(void *arg);	/* NULL once popped */
+	void *arg;
+	struct error_cleanup *prev, *next;
+};
+
+// Where gerror* return to instead of ending the process, see set_error_trap
+struct error_trap {
+	jmp_buf env;
+	char msg[ERRMSGLEN];
+	struct error_cleanup *cleanups;	/* of the thread when the trap was set */
+};
+
 void message (const char *err);
 void message1 (const char *err, const char *s);
 
 void gerror(const char *err);
 void gerror1 (const char *err, const char *s);
 void gerror2(const char *err,char *err2);
+void set_error_trap(struct error_trap *t);
+void push_cleanup(struct error_cleanup *c, void (*release)(void*), void *arg);
+void pop_cleanup(struct error_cleanup *c);
 
 #endif
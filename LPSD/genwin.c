@@ -33,11 +33,13 @@ and some new flat-top windows." by G.Heinzel et al, available from:
 
 The two externally visible functions are:
 
-void set_window (int type, double req_psll, char *name, double *psll, 
-    double *rov, double *nenbw, double *w3db, double *flatness);
+void set_window (struct window *w, int type, double req_psll, char *name,
+    double *psll, double *rov, double *nenbw, double *w3db, double *flatness);
 
 set_window must be called at least once initially, and every time
-a new type of window is requested (but not if only NFFT changes)
+a new type of window is requested (but not if only NFFT changes).
+It stores the window in *w, which is passed to makewin; there is no
+global state, so different windows can be used at the same time.
 
 input:  type   0...30 = window by number (see list below)
 	           -1 = flat-top by PSL
@@ -58,8 +60,8 @@ output: char *name : Name of window function. space must be reserved
     	flatness: flatness for -0.5 <= f <=0.5 in dB
 	    
 	    
-void makewinsincos (int nfft, double bin, double *win, double *winsum, 
-    double *winsum2, double *nenbw);
+void makewinsincos (const struct window *w, int nfft, double bin, double *win,
+    double *winsum, double *winsum2, double *nenbw);
 
 makewin computes the actual window values and must be called
 after set_window. It must be re-called if either a new type
@@ -528,11 +530,8 @@ win_HFT248D (double z)
 	  0.000000132974 * cos (10 * z));
 }
 
-static int win_no = -2;
-static double win_alpha;
-
 void
-set_window (int type, double req_psll, char *name, double *psll, double *rov,
+set_window (struct window *w, int type, double req_psll, char *name, double *psll, double *rov,
 	    double *nenbw, double *w3db, double *flatness, double *sbin)
 {
   int i;
@@ -547,7 +546,7 @@ set_window (int type, double req_psll, char *name, double *psll, double *rov,
 	  *w3db = winlist[type].w3db;
 	  *flatness = winlist[type].flatness;
 	  *sbin = winlist[type].sbin;
-	  win_no = type;
+	  w->no = type;
 	  return;
 	}
       else
@@ -555,14 +554,14 @@ set_window (int type, double req_psll, char *name, double *psll, double *rov,
     }
   else if (type == -1)
     {				/* flat-top by PSLL */
-      win_no = -2;
+      w->no = -2;
       for (i = 0; i < nwinlist; i++)
 	{
 	  if (!(winlist[i].isft))
 	    continue;
 	  if (winlist[i].psll > req_psll)
 	    {
-	      win_no = i;
+	      w->no = i;
 	      strcpy (name, winlist[i].name);
 	      *psll = winlist[i].psll;
 	      *rov = winlist[i].rov;
@@ -573,22 +572,22 @@ set_window (int type, double req_psll, char *name, double *psll, double *rov,
 	      break;
 	    }
 	}
-      if (win_no == -2)
+      if (w->no == -2)
 	gerror ("no matching flat-top window found.");
     }
   else if (type == -2)
     {				/* Kaiser by PSLL */
       if (req_psll < 25 || req_psll > 250)
 	gerror ("Kaiser window requested PSLL outside range 25..250");
-      win_alpha = kaiser_alpha (req_psll);
-      sprintf (name, "Kaiser %.3f", win_alpha);
+      w->alpha = kaiser_alpha (req_psll);
+      sprintf (name, "Kaiser %.3f", w->alpha);
       *psll = req_psll;
-      *rov = kaiser_rov (win_alpha);
-      *nenbw = kaiser_nenbw (win_alpha);
-      *w3db = kaiser_w3db (win_alpha);
-      *flatness = kaiser_flatness (win_alpha);
-      *sbin = kaiser_sbin(win_alpha);
-      win_no = -1;
+      *rov = kaiser_rov (w->alpha);
+      *nenbw = kaiser_nenbw (w->alpha);
+      *w3db = kaiser_w3db (w->alpha);
+      *flatness = kaiser_flatness (w->alpha);
+      *sbin = kaiser_sbin(w->alpha);
+      w->no = -1;
     }
   else
     gerror ("illegal window type");
@@ -597,10 +596,10 @@ set_window (int type, double req_psll, char *name, double *psll, double *rov,
 // @brief Wrapper for makewinsincos_indexed
 // @brief Calling this function will simply create the window for the entire segment
 void
-makewinsincos (long int nfft, double bin, double *win, double *winsum,
+makewinsincos (const struct window *w, long int nfft, double bin, double *win, double *winsum,
                double *winsum2, double *nenbw)
 {
-    makewinsincos_indexed(nfft, bin, win, winsum, winsum2, nenbw, 0, nfft, true);
+    makewinsincos_indexed(w, nfft, bin, win, winsum, winsum2, nenbw, 0, nfft, true);
 }
 
 
@@ -608,7 +607,7 @@ makewinsincos (long int nfft, double bin, double *win, double *winsum,
 // @brief Other parameters are from legacy code
 // @param reset_sums Set winsum,winsum2 back to zero before loop
 void
-makewinsincos_indexed (long int nfft, double bin, double *win, double *winsum,
+makewinsincos_indexed (const struct window *w, long int nfft, double bin, double *win, double *winsum,
 	       double *winsum2, double *nenbw, int start_index, int count,
 	       bool reset_sums)
 {
@@ -620,18 +619,18 @@ makewinsincos_indexed (long int nfft, double bin, double *win, double *winsum,
 
   if (reset_sums) *winsum = *winsum2 = 0;
 
-  if (win_no == -2)
+  if (w->no == -2)
     gerror ("set_window has not been called.");
 
   fact = 2.0 * M_PI * bin / ((double) nfft);
-  if (win_no == -1)  /* Kaiser */
+  if (w->no == -1)  /* Kaiser */
   {
-    double kaiser_scal = netlibi0 (M_PI * win_alpha);
+    double kaiser_scal = netlibi0 (M_PI * w->alpha);
 
     for (j = start_index; j < start_index + count; j++)
     {
       z = 2. * (double) j / (double) nfft - 1.;
-      winval = netlibi0 (M_PI * win_alpha * sqrt (1 - z * z)) / kaiser_scal;
+      winval = netlibi0 (M_PI * w->alpha * sqrt (1 - z * z)) / kaiser_scal;
 
       *winsum += winval;
       *winsum2 += winval * winval;
@@ -644,7 +643,7 @@ makewinsincos_indexed (long int nfft, double bin, double *win, double *winsum,
     for (j = start_index; j < start_index + count; j++)
     {
       z = (double) j / (double) nfft;
-      winval = (*(winlist[win_no].winfun)) (z);
+      winval = (*(winlist[w->no].winfun)) (z);
 
       *winsum += winval;
       *winsum2 += winval * winval;
@@ -660,16 +659,16 @@ makewinsincos_indexed (long int nfft, double bin, double *win, double *winsum,
 
 // @brief Wrapper for makewin_indexed for standard window creation
 void
-makewin (long int nfft, double *win,
+makewin (const struct window *w, long int nfft, double *win,
          double *winsum, double *winsum2, double *nenbw)
 {
-    makewin_indexed(nfft, 0, nfft, win, winsum, winsum2, nenbw, true);
+    makewin_indexed(w, nfft, 0, nfft, win, winsum, winsum2, nenbw, true);
 }
 
 // @brief Similar to makewinsincos, but leave the exponential term calculation out
 // @brief It is not the responsibility of this function to make sure that the length of win is correct!
 void
-makewin_indexed (long int nfft, int offset, int count, double *win,
+makewin_indexed (const struct window *w, long int nfft, int offset, int count, double *win,
                  double *winsum, double *winsum2, double *nenbw,
                  bool reset_sums)
 {
@@ -678,15 +677,15 @@ makewin_indexed (long int nfft, int offset, int count, double *win,
   double factor = 2. / (double) nfft;  // Division here for speed gain in loop
   if (reset_sums) *winsum = *winsum2 = 0;
 
-  if (win_no == -2)
+  if (w->no == -2)
     gerror ("set_window has not been called.");
-  if (win_no == -1)  /* Kaiser */
+  if (w->no == -1)  /* Kaiser */
   {
-    double kaiser_scal = netlibi0 (M_PI * win_alpha);
+    double kaiser_scal = netlibi0 (M_PI * w->alpha);
     for (j = offset; j < offset + count; j++)
     {
       z = (double) j * factor - 1.;
-      winval = netlibi0 (M_PI * win_alpha * sqrt (1 - z * z)) / kaiser_scal;
+      winval = netlibi0 (M_PI * w->alpha * sqrt (1 - z * z)) / kaiser_scal;
 
       *winsum += winval;
       *winsum2 += winval * winval;
@@ -696,7 +695,7 @@ makewin_indexed (long int nfft, int offset, int count, double *win,
     for (j = offset; j < offset + count; j++)
     {
       z = 0.5 * (double) j * factor;
-	  winval = (*(winlist[win_no].winfun)) (z);
+	  winval = (*(winlist[w->no].winfun)) (z);
 
 	  *winsum += winval;
       *winsum2 += winval * winval;
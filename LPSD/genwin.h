@@ -3,20 +3,26 @@
 
 #include <stdbool.h>
 
+/* window chosen by set_window, passed to the makewin functions */
+struct window {
+  int no;			/* number in the window list, -1 Kaiser, -2 not set */
+  double alpha;			/* Kaiser parameter */
+};
+
 /* ANSI prototypes of externally visible functions: */
 
-void set_window (int type, double req_psll, char *name, double *psll,
+void set_window (struct window *w, int type, double req_psll, char *name, double *psll,
 		 double *rov, double *nenbw, double *w3db, double *flatness,
 		 double *sbin);
 
-void makewinsincos (long int nfft, double bin, double *win, double *winsum,
+void makewinsincos (const struct window *w, long int nfft, double bin, double *win, double *winsum,
 		            double *winsum2, double *nenbw);
-void makewinsincos_indexed (long int nfft, double bin, double *win, double *winsum,
+void makewinsincos_indexed (const struct window *w, long int nfft, double bin, double *win, double *winsum,
 		            double *winsum2, double *nenbw, int, int, bool);
 
-void makewin (long int nfft, double *win,
+void makewin (const struct window *w, long int nfft, double *win,
               double *winsum, double *winsum2, double *nenbw);
-void makewin_indexed (long int nfft, int offset, int count, double *win,
+void makewin_indexed (const struct window *w, long int nfft, int offset, int count, double *win,
               double *winsum, double *winsum2, double *nenbw,
               bool reset_sums);
 
@@ -0,0 +1,333 @@
+/********************************************************************************
+    ingest.c  -  lpsd-ingest
+
+    Converts an ASCII time series to the HDF5 input of lpsd.
+
+    usage: lpsd-ingest [-T] [-A col] [-B col] [-C] [-f fsamp] [-D dataset]
+                       [-t float64|float32] [-k chunk] [-z level] [-j threads]
+                       input output.h5
+
+    The columns are selected as in lpsd: -T - the first column is the time in s,
+    -A col - the data is column col (1-based, the time column counts; default
+    the first column after the time), -B col - the data is column B - column A,
+    -C - comma as decimal delimiter. Comment lines (#) and empty lines are skipped.
+
+    The input is memory mapped and cut into line aligned pieces of INGESTBYTES,
+    which are parsed by the threads in parallel with the fast path of
+    ascii_strtod. While the threads parse the next round of pieces, the main
+    thread appends the previous round to the chunked, extendible dataset, so
+    the text is read once and memory use is bounded by the round size.
+
+    -t float32 stores the samples in single precision, which lpsd reads without
+    converting them to double in memory (see read_samples).
+
+    The sampling frequency is -f, or else 1 / mean time step of the time column.
+    It is stored in the fsamp attribute of the dataset, next to t0 (first time,
+    with -T) and source (input file name).
+
+ ********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "hdf5.h"
+
+#include "config.h"
+#include "misc.h"
+#include "errors.h"
+#include "ascii.h"
+
+// One line aligned piece of the input, parsed by one thread
+struct piece {
+    const char *start, *end;
+    const struct ascii_columns *cols;
+    double *x;
+    long int n, cap;
+    double t_first, t_last;	/* time of the first and last sample */
+    double dts, dt2s;		/* sum of time steps and their squares within the piece */
+    const char *bad;		/* first line that could not be parsed, NULL if none */
+    pthread_t thread;
+};
+
+// Time steps over the whole file
+struct time_stats {
+    long int n;			/* samples with time */
+    double t0, t_last, dts, dt2s;
+};
+
+static void
+usage (void)
+{
+    gerror("usage: lpsd-ingest [-T] [-A col] [-B col] [-C] [-f fsamp] [-D dataset] "
+           "[-t float64|float32] [-k chunk] [-z level] [-j threads] input output.h5");
+}
+
+static double
+now_s (void)
+{
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *
+parse_piece (void *arg)
+{
+    struct piece *pc = (struct piece*) arg;
+    const char *p = pc->start, *nl;
+    double t = 0, x;
+
+    pc->n = 0;
+    pc->dts = pc->dt2s = 0;
+    pc->bad = NULL;
+    for (; p < pc->end; p = nl + 1) {
+        nl = memchr(p, '\n', pc->end - p);
+        int ok = ascii_parse_line(p, nl, pc->cols, &t, &x);
+        if (ok == 2) continue;
+        if (ok == 0) {
+            pc->bad = p;
+            break;
+        }
+        if (pc->n == pc->cap) {
+            pc->cap = pc->cap ? 2 * pc->cap : 1 << 16;
+            double *grown = (double*) xmalloc(pc->cap * sizeof(double));
+            if (pc->x) {
+                memcpy(grown, pc->x, pc->n * sizeof(double));
+                xfree(pc->x);
+            }
+            pc->x = grown;
+        }
+        if (pc->cols->timecol) {
+            if (pc->n == 0) pc->t_first = t;
+            else {
+                double dt = t - pc->t_last;
+                pc->dts += dt;
+                pc->dt2s += dt * dt;
+            }
+            pc->t_last = t;
+        }
+        pc->x[pc->n++] = x;
+    }
+    return NULL;
+}
+
+// Cut the next line aligned pieces off the input; the input must end with a newline
+static void
+cut_pieces (struct piece *pcs, int n, const char **pos, const char *stop)
+{
+    for (int i = 0; i < n; i++) {
+        pcs[i].start = *pos;
+        if (stop - *pos <= INGESTBYTES) *pos = stop;
+        else *pos = (const char*) memchr(*pos + INGESTBYTES, '\n', stop - *pos - INGESTBYTES) + 1;
+        pcs[i].end = *pos;
+    }
+}
+
+static void
+report_bad_line (const char *map, const char *bad, const char *fn)
+{
+    long int line = 1;
+    char msg[ERRMSGLEN];
+    for (const char *p = map; (p = memchr(p, '\n', bad - p)) != NULL; p++) line++;
+    snprintf(msg, ERRMSGLEN, "Cannot read line %ld of %s", line, fn);
+    gerror(msg);
+}
+
+// Append the samples of pcs to the dataset, at offset *ntotal
+static void
+append_pieces (hid_t dataset, struct piece *pcs, int n, long int *ntotal, struct time_stats *ts)
+{
+    for (int i = 0; i < n; i++) {
+        struct piece *pc = &pcs[i];
+        if (pc->n == 0) continue;
+
+        hsize_t dims[1] = {*ntotal + pc->n}, offset[1] = {*ntotal}, count[1] = {pc->n};
+        if (H5Dset_extent(dataset, dims) < 0) gerror("Error extending dataset");
+        hid_t space = H5Dget_space(dataset);
+        hid_t memspace = H5Screate_simple(1, count, NULL);
+        H5Sselect_hyperslab(space, H5S_SELECT_SET, offset, NULL, count, NULL);
+        if (H5Dwrite(dataset, H5T_NATIVE_DOUBLE, memspace, space, H5P_DEFAULT, pc->x) < 0)
+            gerror("Error writing dataset");
+        H5Sclose(memspace);
+        H5Sclose(space);
+        *ntotal += pc->n;
+
+        if (pc->cols->timecol) {
+            if (ts->n == 0) ts->t0 = pc->t_first;
+            else {
+                double dt = pc->t_first - ts->t_last;
+                ts->dts += dt;
+                ts->dt2s += dt * dt;
+            }
+            ts->dts += pc->dts;
+            ts->dt2s += pc->dt2s;
+            ts->t_last = pc->t_last;
+            ts->n += pc->n;
+        }
+    }
+}
+
+static void
+write_attr (hid_t loc, const char *name, double value)
+{
+    hid_t space = H5Screate(H5S_SCALAR);
+    hid_t attr = H5Acreate(loc, name, H5T_NATIVE_DOUBLE, space, H5P_DEFAULT, H5P_DEFAULT);
+    H5Awrite(attr, H5T_NATIVE_DOUBLE, &value);
+    H5Aclose(attr);
+    H5Sclose(space);
+}
+
+static void
+write_attr_string (hid_t loc, const char *name, const char *value)
+{
+    hid_t type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(type, strlen(value) + 1);
+    hid_t space = H5Screate(H5S_SCALAR);
+    hid_t attr = H5Acreate(loc, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+    H5Awrite(attr, type, value);
+    H5Aclose(attr);
+    H5Sclose(space);
+    H5Tclose(type);
+}
+
+int main(int argc, char *argv[])
+{
+    struct ascii_columns cols = {0, 0, 0, 0};
+    char *dataset_name = DEFDSET;
+    double fsamp = -1;
+    long int chunk = DEFINGESTCHUNK;
+    hid_t file_type = H5T_IEEE_F64LE;
+    int level = 0, nthreads = sysconf(_SC_NPROCESSORS_ONLN), opt, i;
+
+    while ((opt = getopt(argc, argv, "TA:B:Cf:D:t:k:z:j:h")) != -1) {
+        switch (opt) {
+        case 'T': cols.timecol = 1; break;
+        case 'A': cols.colA = atoi(optarg); break;
+        case 'B': cols.colB = atoi(optarg); break;
+        case 'C': cols.comma = 1; break;
+        case 'f': fsamp = atof(optarg); break;
+        case 'D': dataset_name = optarg; break;
+        case 't':
+            if (strcmp(optarg, "float64") == 0) file_type = H5T_IEEE_F64LE;
+            else if (strcmp(optarg, "float32") == 0) file_type = H5T_IEEE_F32LE;
+            else usage();
+            break;
+        case 'k': chunk = atol(optarg); break;
+        case 'z': level = atoi(optarg); break;
+        case 'j': nthreads = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (argc - optind != 2) usage();
+    char *ifn = argv[optind], *ofn = argv[optind + 1];
+    if (cols.colA == 0) cols.colA = cols.timecol ? 2 : 1;
+    if (cols.colB > 0 && cols.colB == cols.colA) gerror("Columns A and B must differ");
+    if (!cols.timecol && fsamp <= 0) gerror("No sampling frequency given (-f, or -T to use the time column)");
+    if (nthreads < 1) nthreads = 1;
+    if (chunk < 1 || level < 0 || level > 9) usage();
+
+    // Map the input
+    int fd = open(ifn, O_RDONLY);
+    if (fd < 0) gerror1("Error opening %s", ifn);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) gerror1("Cannot read %s or it is empty", ifn);
+    const char *map = (const char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) gerror1("Error mapping %s", ifn);
+    madvise((void*) map, st.st_size, MADV_SEQUENTIAL);
+
+    // A last line without newline is parsed from a copy, so the parser never reads past the map
+    const char *stop = map + st.st_size;
+    while (stop > map && stop[-1] != '\n') stop--;
+    long int taillen = map + st.st_size - stop;
+    char *tail = (char*) xmalloc(taillen + 2);
+    memcpy(tail, stop, taillen);
+    tail[taillen] = '\n';
+    tail[taillen + 1] = 0;
+
+    // Extendible output dataset
+    hid_t file = H5Fcreate(ofn, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (file < 0) gerror1("Error creating %s", ofn);
+    hsize_t dims[1] = {0}, maxdims[1] = {H5S_UNLIMITED}, chunkdims[1] = {chunk};
+    hid_t space = H5Screate_simple(1, dims, maxdims);
+    hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(dcpl, 1, chunkdims);
+    if (level > 0) H5Pset_deflate(dcpl, level);
+    hid_t dataset = H5Dcreate(file, dataset_name, file_type, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    if (dataset < 0) gerror1("Error creating dataset %s", dataset_name);
+    H5Pclose(dcpl);
+    H5Sclose(space);
+
+    // Two sets of pieces: the threads parse one while the other is written
+    struct piece *pcs = (struct piece*) xmalloc(2 * nthreads * sizeof(struct piece));
+    memset(pcs, 0, 2 * nthreads * sizeof(struct piece));
+    for (i = 0; i < 2 * nthreads; i++) pcs[i].cols = &cols;
+
+    double t_start = now_s();
+    struct time_stats ts = {0, 0, 0, 0, 0};
+    long int ntotal = 0;
+    const char *pos = map;
+    struct piece *parsing = pcs, *writing = pcs + nthreads;
+    int nwriting = 0;
+    while (pos < stop || nwriting > 0) {
+        int nparsing = 0;
+        if (pos < stop) {
+            cut_pieces(parsing, nthreads, &pos, stop);
+            nparsing = nthreads;
+            for (i = 0; i < nparsing; i++)
+                if (pthread_create(&parsing[i].thread, NULL, parse_piece, &parsing[i]) != 0)
+                    gerror("Error creating thread");
+        }
+        append_pieces(dataset, writing, nwriting, &ntotal, &ts);
+        for (i = 0; i < nparsing; i++) pthread_join(parsing[i].thread, NULL);
+        for (i = 0; i < nparsing; i++) if (parsing[i].bad) report_bad_line(map, parsing[i].bad, ifn);
+
+        struct piece *swap = writing;
+        writing = parsing;
+        parsing = swap;
+        nwriting = nparsing;
+    }
+    if (taillen > 0) {
+        struct piece *last = &pcs[0];
+        last->start = tail;
+        last->end = tail + taillen + 1;
+        parse_piece(last);
+        if (last->bad) report_bad_line(map, stop, ifn);
+        append_pieces(dataset, last, 1, &ntotal, &ts);
+    }
+    double elapsed = now_s() - t_start;
+    if (ntotal == 0) gerror1("No data in %s", ifn);
+
+    // Sampling frequency from the time column
+    if (cols.timecol && ts.n > 1) {
+        double mean = ts.dts / (ts.n - 1);
+        double rms = sqrt(fabs(ts.dt2s / (ts.n - 1) - mean * mean));
+        printf("Time column: t0 = %.10g s, mean step %.10g s, rms deviation %.3g s\n", ts.t0, mean, rms);
+        if (mean <= 0) gerror("Time column is not increasing");
+        if (rms > 1e-3 * mean) printf("Warning: time column is not evenly sampled\n");
+        if (fsamp <= 0) fsamp = 1. / mean;
+        else if (fabs(fsamp * mean - 1) > 1e-6)
+            printf("Warning: -f %g differs from the time column (%g Hz)\n", fsamp, 1. / mean);
+    }
+    if (fsamp <= 0) gerror("Cannot determine the sampling frequency, use -f");
+    write_attr(dataset, "fsamp", fsamp);
+    if (cols.timecol) write_attr(dataset, "t0", ts.t0);
+    write_attr_string(dataset, "source", ifn);
+
+    H5Dclose(dataset);
+    H5Fclose(file);
+    munmap((void*) map, st.st_size);
+    close(fd);
+    for (i = 0; i < 2 * nthreads; i++) if (pcs[i].x) xfree(pcs[i].x);
+    xfree(pcs);
+    xfree(tail);
+
+    printf("Wrote %ld samples (fsamp = %.10g Hz) to %s:%s in %.2f s, %.1f MB/s of text\n",
+           ntotal, fsamp, ofn, dataset_name, elapsed, st.st_size / 1e6 / (elapsed > 0 ? elapsed : 1e-9));
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,171 @@
+/********************************************************************************
+    interp.c
+
+    Interpolation of zero-padded FFT spectra at arbitrary frequencies,
+    used by METHOD 1 to evaluate the logarithmic frequency bins of a block.
+
+    All per-bin work (bin positions, kernel weights) is done once per block
+    in make_interp_plan, so that apply_interp_plan, which runs once per segment,
+    is a plain weighted sum.
+
+ ********************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "misc.h"
+#include "errors.h"
+#include "interp.h"
+
+#define SINC_HALF_TAPS 4	/* the Dirichlet kernel uses 2*SINC_HALF_TAPS FFT bins */
+
+// @brief Convert command line value (name or number) to interpolation method
+int
+parse_interp (const char *s)
+{
+    if (strcmp(s, "linear") == 0 || strcmp(s, "0") == 0) return INTERP_LINEAR;
+    if (strcmp(s, "cubic") == 0 || strcmp(s, "1") == 0) return INTERP_CUBIC;
+    if (strcmp(s, "sinc") == 0 || strcmp(s, "2") == 0) return INTERP_SINC;
+    gerror1("Unknown interpolation method %s (use linear, cubic or sinc)", s);
+    return -1;
+}
+
+const char*
+interp_name (int method)
+{
+    switch (method) {
+    case INTERP_LINEAR: return "linear";
+    case INTERP_CUBIC: return "cubic";
+    case INTERP_SINC: return "sinc";
+    default: return "unknown";
+    }
+}
+
+// Cubic convolution kernel (Keys, a = -0.5), x = distance in bins
+static double
+cubic_kernel (double x)
+{
+    double a = -0.5;
+    x = fabs(x);
+    if (x < 1) return ((a + 2)*x - (a + 3))*x*x + 1;
+    if (x < 2) return ((a*x - 5*a)*x + 8*a)*x - 4*a;
+    return 0;
+}
+
+// Dirichlet kernel of an N-point DFT, x = distance in bins, tapered with a Hann window
+// X(k0 + t) = sum_k X_k exp(-i pi x (N-1)/N) sin(pi x) / (N sin(pi x / N)),  x = k0 + t - k
+static void
+dirichlet_kernel (double x, long int N, double *re, double *im)
+{
+    double amp, phase, taper;
+    if (fabs(x) < 1e-12) {
+        *re = 1;
+        *im = 0;
+        return;
+    }
+    amp = sin(M_PI * x) / (N * sin(M_PI * x / N));
+    phase = -M_PI * x * (N - 1.) / N;
+    taper = 0.5 * (1 + cos(M_PI * x / SINC_HALF_TAPS));
+    *re = amp * cos(phase) * taper;
+    *im = amp * sin(phase) * taper;
+}
+
+// @brief Precompute FFT bin indices and weights for the frequencies freqs[0..nbins-1]
+// @param Nfft: length of the (zero-padded) FFT
+void
+make_interp_plan (struct interp_plan *plan, int method, long int Nfft,
+                  double fsamp, const double *freqs, int nbins)
+{
+    int i, t, first;
+
+    switch (method) {
+    case INTERP_LINEAR: plan->ntaps = 2; first = 0; break;
+    case INTERP_CUBIC: plan->ntaps = 4; first = -1; break;
+    case INTERP_SINC: plan->ntaps = 2*SINC_HALF_TAPS; first = 1 - SINC_HALF_TAPS; break;
+    default: gerror("Interpolation method not implemented."); return;
+    }
+    plan->method = method;
+    plan->nbins = nbins;
+    plan->Nfft = Nfft;
+    plan->k0 = (long int*) xmalloc(nbins*sizeof(long int));
+    plan->w_real = (double*) xmalloc(nbins*plan->ntaps*sizeof(double));
+    plan->w_imag = (double*) xmalloc(nbins*plan->ntaps*sizeof(double));
+    plan->kmin = Nfft;
+    plan->kmax = 0;
+
+    for (i = 0; i < nbins; i++) {
+        double pos = Nfft * freqs[i] / fsamp;  /* fractional FFT bin */
+        long int k = floor(pos);
+        double frac = pos - k;
+        double *w_real = &plan->w_real[i*plan->ntaps];
+        double *w_imag = &plan->w_imag[i*plan->ntaps];
+
+        plan->k0[i] = k + first;
+        for (t = 0; t < plan->ntaps; t++) {
+            double x = frac - (first + t);  /* distance from FFT bin k + first + t */
+            w_imag[t] = 0;
+            if (method == INTERP_LINEAR) w_real[t] = 1 - fabs(x);
+            else if (method == INTERP_CUBIC) w_real[t] = cubic_kernel(x);
+            else dirichlet_kernel(x, Nfft, &w_real[t], &w_imag[t]);
+        }
+        if (plan->k0[i] < plan->kmin) plan->kmin = plan->k0[i];
+        if (plan->k0[i] + plan->ntaps - 1 > plan->kmax) plan->kmax = plan->k0[i] + plan->ntaps - 1;
+    }
+}
+
+// @brief Interpolated complex value and power of frequency bin i of the plan
+// @param index_shift: see apply_interp_plan
+void
+interp_bin (const struct interp_plan *plan, int i, const double *fft_real,
+            const double *fft_imag, long int index_shift,
+            double *re, double *im, double *psd)
+{
+    int t;
+    int ntaps = plan->ntaps;
+    const double *w_real = &plan->w_real[i*ntaps];
+    const double *w_imag = &plan->w_imag[i*ntaps];
+    double _re = 0, _im = 0, _psd = 0;
+
+    for (t = 0; t < ntaps; t++) {
+        long int k = plan->k0[i] + t;
+        if (index_shift == 0) k = ((k % plan->Nfft) + plan->Nfft) % plan->Nfft;
+        else k -= index_shift;
+        double y = fft_real[k];
+        double z = fft_imag[k];
+        _re += w_real[t]*y - w_imag[t]*z;
+        _im += w_real[t]*z + w_imag[t]*y;
+        _psd += w_real[t]*(y*y + z*z);
+    }
+    *re = _re;
+    *im = _im;
+    *psd = plan->method == INTERP_SINC ? _re*_re + _im*_im : _psd;
+}
+
+// @brief Add the interpolated spectrum of one segment to the block totals
+// @param index_shift: FFT bin stored at fft_real[0]; 0 if the full FFT is in memory,
+//        in which case bins outside [0, Nfft) wrap around periodically
+// @param total: power; interpolated directly for linear/cubic, |X|^2 of the interpolated
+//        complex value for sinc
+void
+apply_interp_plan (const struct interp_plan *plan, const double *fft_real,
+                   const double *fft_imag, long int index_shift,
+                   double *total, double *total_real, double *total_imag)
+{
+    int i;
+    double re, im, psd;
+
+    for (i = 0; i < plan->nbins; i++) {
+        interp_bin(plan, i, fft_real, fft_imag, index_shift, &re, &im, &psd);
+        total_real[i] += re;
+        total_imag[i] += im;
+        total[i] += psd;
+    }
+}
+
+void
+free_interp_plan (struct interp_plan *plan)
+{
+    xfree(plan->k0);
+    xfree(plan->w_real);
+    xfree(plan->w_imag);
+}
@@ -0,0 +1,33 @@
+#ifndef __interp_h
+#define __interp_h
+
+/* Spectral interpolators for METHOD 1 */
+#define INTERP_LINEAR 0		/* linear on Re, Im and power (2 taps) */
+#define INTERP_CUBIC 1		/* cubic convolution on Re, Im and power (4 taps) */
+#define INTERP_SINC 2		/* Hann-tapered Dirichlet kernel on the complex spectrum */
+
+// Interpolation plan of one METHOD 1 block: which FFT bins and weights
+// contribute to every frequency bin of the block
+struct interp_plan {
+    int nbins;              /* number of frequency bins in the block */
+    int ntaps;              /* number of FFT bins per frequency bin */
+    int method;             /* INTERP_LINEAR, INTERP_CUBIC or INTERP_SINC */
+    long int Nfft;
+    long int *k0;           /* first FFT bin of each frequency bin */
+    double *w_real, *w_imag;  /* nbins x ntaps (complex) weights */
+    long int kmin, kmax;    /* range of FFT bins used by the block */
+};
+
+int parse_interp(const char *s);
+const char *interp_name(int method);
+void make_interp_plan(struct interp_plan *plan, int method, long int Nfft,
+                      double fsamp, const double *freqs, int nbins);
+void interp_bin(const struct interp_plan *plan, int i, const double *fft_real,
+                const double *fft_imag, long int index_shift,
+                double *re, double *im, double *psd);
+void apply_interp_plan(const struct interp_plan *plan, const double *fft_real,
+                       const double *fft_imag, long int index_shift,
+                       double *total, double *total_real, double *total_imag);
+void free_interp_plan(struct interp_plan *plan);
+
+#endif
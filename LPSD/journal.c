@@ -0,0 +1,342 @@
+/********************************************************************************
+    journal.c
+
+    Binary checkpoint journal <output file>.journal of completed frequency bins.
+
+    The journal is a header identifying the run followed by fixed-size records,
+    one per bin, each with its own crc32. Bins are appended with a single write()
+    per bin or block on a file opened with O_APPEND, so a crash can only leave a
+    partial last record, which is cut off on resume. Records carry their bin
+    index, so bins may be completed in any order.
+
+    On SIGUSR1 the journal is synced to disk. On SIGTERM (e.g. a Condor eviction)
+    it is synced and the program ends, losing at most the bin or block in
+    progress. The journal is removed once the output file has been written.
+    The signal handlers belong to the process and sync every journal open in
+    it; lpsd-exec installs them (journal_catch_signals), liblpsd alone leaves
+    the signals of its caller untouched.
+
+ ********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "misc.h"
+#include "errors.h"
+#include "journal.h"
+
+// Journals open in this process, for the signal handler: fd + 1, 0 if the slot is free
+static volatile int journal_fds[MAXJOURNALS];
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction old_term, old_usr1;	/* actions before journal_catch_signals */
+static int catching = 0;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void
+make_crc_table (void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int b = 0; b < 8; b++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t
+crc32 (const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char*) buf;
+    uint32_t crc = 0xffffffff;
+
+    pthread_once(&crc_once, make_crc_table);
+    while (len--) crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc ^ 0xffffffff;
+}
+
+static double
+now_s (void)
+{
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Sync all journals; SIGTERM then takes its previous action, which ends lpsd-exec
+static void
+journal_signal (int sig)
+{
+    for (int i = 0; i < MAXJOURNALS; i++) if (journal_fds[i]) fsync(journal_fds[i] - 1);
+    if (sig == SIGTERM) {
+        sigaction(SIGTERM, &old_term, NULL);
+        raise(SIGTERM);
+    }
+}
+
+// @brief Install the SIGTERM and SIGUSR1 handlers that sync the journals of the process,
+// @brief keeping the previous actions for journal_release_signals
+void
+journal_catch_signals (void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = journal_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, &old_term);
+    sigaction(SIGUSR1, &sa, &old_usr1);
+    catching = 1;
+}
+
+// @brief Restore the actions of SIGTERM and SIGUSR1 from before journal_catch_signals
+void
+journal_release_signals (void)
+{
+    if (!catching) return;
+    sigaction(SIGTERM, &old_term, NULL);
+    sigaction(SIGUSR1, &old_usr1, NULL);
+    catching = 0;
+}
+
+// Add fd to the journals synced on signals
+static void
+register_fd (int fd)
+{
+    int i;
+    pthread_mutex_lock(&journal_lock);
+    for (i = 0; i < MAXJOURNALS && journal_fds[i]; i++);
+    if (i < MAXJOURNALS) journal_fds[i] = fd + 1;
+    pthread_mutex_unlock(&journal_lock);
+    if (i == MAXJOURNALS) gerror("Too many journals open at the same time");
+}
+
+// Remove fd from the journals synced on signals
+static void
+unregister_fd (int fd)
+{
+    pthread_mutex_lock(&journal_lock);
+    for (int i = 0; i < MAXJOURNALS; i++)
+        if (journal_fds[i] == fd + 1) {
+            journal_fds[i] = 0;
+            break;
+        }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+static void
+make_header (struct journal_header *h, tCFG *cfg, long int nread, uint64_t input_id, uint64_t input_hash)
+{
+    memset(h, 0, sizeof(struct journal_header));
+    memcpy(h->magic, JOURNAL_MAGIC, 8);
+    h->version = JOURNAL_VERSION;
+    h->record_size = sizeof(struct journal_record);
+    h->nspec = cfg->nspec;
+    h->jfirst = cfg->jfirst;
+    h->nread = nread;
+    h->Jdes = cfg->Jdes;
+    h->iter = cfg->iter;
+    h->METHOD = cfg->METHOD;
+    h->interp = cfg->interp;
+    h->WT = cfg->WT;
+    h->LR = cfg->LR;
+    h->fsamp = cfg->fsamp;
+    h->fmin = cfg->fmin;
+    h->fmax = cfg->fmax;
+    h->ovlp = cfg->ovlp;
+    h->tmin = cfg->tmin;
+    h->tmax = cfg->tmax;
+    h->epsilon = cfg->epsilon;
+    h->max_rel_error = cfg->max_rel_error;
+    h->ulsb = cfg->ulsb;
+    h->reqPSLL = cfg->reqPSLL;
+    snprintf(h->ifn, sizeof(h->ifn), "%s", cfg->ifn);
+    snprintf(h->dataset_name, sizeof(h->dataset_name), "%s", cfg->dataset_name);
+    h->input_id = input_id;
+    h->input_hash = input_hash;
+    h->crc = crc32(h, offsetof(struct journal_header, crc));
+}
+
+// @brief Fill record r with bin k of data
+void
+journal_record_fill (struct journal_record *r, tDATA *data, long int k)
+{
+    memset(r, 0, sizeof(struct journal_record));
+    r->k = k;
+    r->avg = data->avg[k];
+    r->method = data->method[k];
+    r->psd = data->psd[k];
+    r->ps = data->ps[k];
+    r->varpsd = data->varpsd[k];
+    r->varps = data->varps[k];
+    r->psd_real = data->psd_real[k];
+    r->psd_imag = data->psd_imag[k];
+    r->crc = crc32(r, offsetof(struct journal_record, crc));
+}
+
+// @brief Recompute the crc of record r after changing it, e.g. its bin index
+void
+journal_record_seal (struct journal_record *r)
+{
+    r->crc = crc32(r, offsetof(struct journal_record, crc));
+}
+
+// @brief 1 if the crc of record r is valid
+int
+journal_record_valid (const struct journal_record *r)
+{
+    return r->crc == crc32(r, offsetof(struct journal_record, crc));
+}
+
+// @brief Store record r in data; returns its bin, or -1 if the crc or bin index is invalid
+long int
+journal_record_restore (const struct journal_record *r, tDATA *data, long int nspec)
+{
+    if (!journal_record_valid(r)) return -1;
+    if (r->k < 0 || r->k >= nspec) return -1;
+    long int k = r->k;
+    data->psd[k] = r->psd;
+    data->ps[k] = r->ps;
+    data->varpsd[k] = r->varpsd;
+    data->varps[k] = r->varps;
+    data->psd_real[k] = r->psd_real;
+    data->psd_imag[k] = r->psd_imag;
+    data->avg[k] = r->avg;
+    data->method[k] = r->method;
+    return k;
+}
+
+// Read the records of an existing journal into data; returns the size of the valid part
+static off_t
+restore (struct journal *jrnl, tDATA *data, long int nspec, off_t size)
+{
+    long int nrec = (size - sizeof(struct journal_header)) / sizeof(struct journal_record);
+    struct journal_record *rec = (struct journal_record*) xmalloc((nrec > 0 ? nrec : 1)*sizeof(struct journal_record));
+    long int i;
+
+    if (pread(jrnl->fd, rec, nrec*sizeof(struct journal_record), sizeof(struct journal_header))
+        != (ssize_t) (nrec*sizeof(struct journal_record)))
+        gerror1("Error reading journal %s", jrnl->fn);
+    for (i = 0; i < nrec; i++) {
+        long int k = journal_record_restore(&rec[i], data, nspec);
+        if (k < 0) break;
+        if (!jrnl->done[k]) jrnl->ndone++;
+        jrnl->done[k] = JOURNAL_RESTORED;
+    }
+    if (i < nrec) printf("Journal: dropping %ld corrupt or partial records\n", nrec - i);
+    xfree(rec);
+    return sizeof(struct journal_header) + i*sizeof(struct journal_record);
+}
+
+// @brief Open <ofn>.journal, restoring the bins of a previous run of the same configuration
+// @brief into data; the signal handlers of journal_catch_signals sync it
+// @brief The nread input samples are identified by input_id (input_identity, lpsd.c) and, if not 0,
+// @brief the hash of all samples input_hash
+// @brief With cfg->journal == 0, the journal is off and only tracks the bins done in this run
+void
+journal_open (struct journal *jrnl, tCFG *cfg, tDATA *data, long int nread, uint64_t input_id,
+              uint64_t input_hash)
+{
+    struct journal_header header, old;
+    struct stat st;
+
+    jrnl->fd = -1;
+    jrnl->ndone = 0;
+    jrnl->verified = 0;
+    jrnl->done = (char*) xmalloc(cfg->nspec);
+    memset(jrnl->done, 0, cfg->nspec);
+    jrnl->fsync_interval = cfg->journal_fsync;
+    jrnl->last_sync = now_s();
+    if (!cfg->journal) return;
+
+    snprintf(jrnl->fn, sizeof(jrnl->fn), "%s.journal", cfg->ofn);
+    make_header(&header, cfg, nread, input_id, input_hash);
+    jrnl->fd = open(jrnl->fn, O_RDWR | O_CREAT, 0644);
+    if (jrnl->fd < 0) gerror1("Error opening journal %s", jrnl->fn);
+
+    // Resume: the number of records follows from the file size
+    if (fstat(jrnl->fd, &st) == 0 && st.st_size >= (off_t) sizeof(struct journal_header)
+        && pread(jrnl->fd, &old, sizeof(old), 0) == sizeof(old)
+        && old.crc == crc32(&old, offsetof(struct journal_header, crc))
+        && memcmp(&old, &header, offsetof(struct journal_header, input_hash)) == 0
+        && !(old.input_hash && input_hash && old.input_hash != input_hash)) {
+        off_t valid = restore(jrnl, data, cfg->nspec, st.st_size);
+        if (valid < st.st_size && ftruncate(jrnl->fd, valid) != 0)
+            gerror1("Error truncating journal %s", jrnl->fn);
+        // All bins of a journal with an input_hash are of samples of that hash
+        jrnl->verified = input_hash != 0 && old.input_hash == input_hash;
+        if (old.input_hash != 0 && input_hash == 0
+            && pwrite(jrnl->fd, &header, sizeof(header), 0) != sizeof(header))
+            gerror1("Error writing journal %s", jrnl->fn);
+        printf("Journal: resuming with %ld of %ld bins from %s\n", jrnl->ndone, cfg->nspec, jrnl->fn);
+    } else {
+        if (st.st_size > 0) printf("Journal: %s belongs to a different run, starting over\n", jrnl->fn);
+        if (ftruncate(jrnl->fd, 0) != 0 || pwrite(jrnl->fd, &header, sizeof(header), 0) != sizeof(header))
+            gerror1("Error writing journal %s", jrnl->fn);
+        fsync(jrnl->fd);
+    }
+    close(jrnl->fd);
+    jrnl->fd = open(jrnl->fn, O_WRONLY | O_APPEND);
+    if (jrnl->fd < 0) gerror1("Error opening journal %s", jrnl->fn);
+
+    register_fd(jrnl->fd);
+}
+
+int
+journal_done (struct journal *jrnl, long int k)
+{
+    return jrnl->done[k];
+}
+
+// @brief Append bins k0..k1-1 of data to the journal with one write()
+// @brief They are marked done also when the journal is off
+void
+journal_append (struct journal *jrnl, tDATA *data, long int k0, long int k1)
+{
+    long int k, n = k1 - k0;
+    for (k = k0; k < k1; k++) jrnl->done[k] = 1;
+    if (jrnl->fd < 0 || n <= 0) return;
+
+    struct journal_record *rec = (struct journal_record*) xmalloc(n*sizeof(struct journal_record));
+    memset(rec, 0, n*sizeof(struct journal_record));
+    for (k = k0; k < k1; k++) journal_record_fill(&rec[k - k0], data, k);
+    if (write(jrnl->fd, rec, n*sizeof(struct journal_record)) != (ssize_t) (n*sizeof(struct journal_record)))
+        gerror1("Error writing journal %s", jrnl->fn);
+    xfree(rec);
+    jrnl->ndone += n;
+
+    if (jrnl->fsync_interval >= 0 && now_s() - jrnl->last_sync >= jrnl->fsync_interval) {
+        fsync(jrnl->fd);
+        jrnl->last_sync = now_s();
+    }
+}
+
+// @brief Sync and close the journal; the file stays until journal_remove
+void
+journal_close (struct journal *jrnl)
+{
+    if (jrnl->fd >= 0) {
+        unregister_fd(jrnl->fd);
+        fsync(jrnl->fd);
+        close(jrnl->fd);
+        jrnl->fd = -1;
+    }
+    if (jrnl->done) xfree(jrnl->done);
+    jrnl->done = NULL;
+}
+
+// @brief Remove the journal of a finished run
+void
+journal_remove (tCFG *cfg)
+{
+    char fn[FNLEN + 8];
+    snprintf(fn, sizeof(fn), "%s.journal", cfg->ofn);
+    unlink(fn);
+}
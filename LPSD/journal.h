@@ -0,0 +1,57 @@
+#ifndef __journal_h
+#define __journal_h
+
+#include <stdint.h>
+
+#define JOURNAL_MAGIC "LPSDJRNL"
+#define JOURNAL_VERSION 3
+#define JOURNAL_RESTORED 2	/* done[k] of a bin restored from the journal file */
+
+// Identifies the run a journal belongs to; a journal with a different header is discarded,
+// apart from an input_hash of 0, which keeps the bins of the journal out of the cache
+struct journal_header {
+    char magic[8];
+    int32_t version, record_size;
+    int64_t nspec, jfirst, nread;
+    int32_t Jdes, iter, METHOD, interp, WT, LR;
+    double fsamp, fmin, fmax, ovlp, tmin, tmax, epsilon, max_rel_error, ulsb, reqPSLL;
+    char ifn[FNLEN], dataset_name[FNLEN];
+    uint64_t input_id;		/* input_identity (lpsd.c) of the samples */
+    uint64_t input_hash;	/* of all samples, known with --cache (cache.c); 0 if unknown */
+    uint32_t crc;
+    uint32_t pad;
+};
+
+// One completed frequency bin
+struct journal_record {
+    int64_t k;                  /* index in the data arrays */
+    int32_t avg, method;
+    double psd, ps, varpsd, varps, psd_real, psd_imag;
+    uint32_t crc;               /* crc32 of the record up to here */
+    uint32_t pad;
+};
+
+struct journal {
+    int fd;                     /* -1 if journaling is off */
+    char fn[FNLEN + 8];         /* <ofn>.journal */
+    char *done;                 /* done[k] != 0 if bin k is in the journal */
+    long int ndone;
+    int verified;               /* the restored bins are of the same input_hash */
+    double fsync_interval;      /* s between fsyncs; 0 - after every append, < 0 - never */
+    double last_sync;
+};
+
+void journal_open(struct journal *jrnl, tCFG *cfg, tDATA *data, long int nread, uint64_t input_id,
+                  uint64_t input_hash);
+int journal_done(struct journal *jrnl, long int k);
+void journal_append(struct journal *jrnl, tDATA *data, long int k0, long int k1);
+void journal_close(struct journal *jrnl);
+void journal_remove(tCFG *cfg);
+void journal_catch_signals(void);
+void journal_release_signals(void);
+void journal_record_fill(struct journal_record *r, tDATA *data, long int k);
+long int journal_record_restore(const struct journal_record *r, tDATA *data, long int nspec);
+void journal_record_seal(struct journal_record *r);
+int journal_record_valid(const struct journal_record *r);
+
+#endif
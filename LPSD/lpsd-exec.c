@@ -31,6 +31,8 @@
 #include "lpsd-exec.h"
 #include "goodn.h"
 #include "errors.h"
+#include "journal.h"
+#include "ranks.h"
 
 extern double round(double x);
 /*
@@ -47,11 +49,6 @@ missing in math.h
 static char doc[] = "\nlpsd - a program to calculate spectral estimates by Michael Troebs\
   \nand Gerhard Heinzel, (c) 2003, 2004, 2006\n\n";
 
-tCFG cfg;			/* configuration data */
-tGNUTERM gt;			/* gnuplot terminal in use */
-tDATA data;			/* info on input data and results */
-tWinInfo wi;			/* info on window function */
-
 /********************************************************************************
  * 	functions								
  ********************************************************************************/
@@ -59,177 +56,177 @@ tWinInfo wi;			/* info on window function */
 /********************************************************************************
  *	read the user's input from the keyboard
  ********************************************************************************/
-void getUserInput()
+void getUserInput(tCFG *cfg, tDATA *data, tWinInfo *wi)
 {
 	tGNUTERM agt[MAXGNUTERM];		/* all gnuplot terminals */
 	double maxt;				/* maximum stop time */
 	double fsamp;
 	double xov;
 	double rov;
+	struct window win;			/* for wi; the calculation sets up its own */
 	int i;
 
-	if (cfg.askifn == 1)
-		asks("Input file", cfg.ifn);
-	if (!exists(cfg.ifn))
+	if (cfg->askifn == 1)
+		asks("Input file", cfg->ifn);
+	if (!exists(cfg->ifn))
 		gerror("Input file name does not exist");
 
-	if (cfg.asktime == 1)
-		aski("Time in column 1 (0 : no, 1 : yes)?", &cfg.time);
-	if (cfg.askcolA == 1)
-		aski("Number of column to process", &cfg.colA);
+	if (cfg->asktime == 1)
+		aski("Time in column 1 (0 : no, 1 : yes)?", &cfg->time);
+	if (cfg->askcolA == 1)
+		aski("Number of column to process", &cfg->colA);
 	
-	if ((cfg.askcolB>0) | (cfg.colB>0)) {
+	if ((cfg->askcolB>0) | (cfg->colB>0)) {
 		do {
-			if ((cfg.askcolB == 1) | (cfg.colB<cfg.colA)) {
-				if (cfg.colB<cfg.colA) printf("This column number must be larger than the previous one or zero!\n");
-				aski("Process difference to column (0 if none)", &cfg.colB);
+			if ((cfg->askcolB == 1) | (cfg->colB<cfg->colA)) {
+				if (cfg->colB<cfg->colA) printf("This column number must be larger than the previous one or zero!\n");
+				aski("Process difference to column (0 if none)", &cfg->colB);
 			}	
-		} while ((cfg.colB!=0) & (cfg.colB<cfg.colA));
+		} while ((cfg->colB!=0) & (cfg->colB<cfg->colA));
 	}
 
 	/* create output filename based on input file name, parameter */
-	parse_fgsC(cfg.ofn,cfg.ifn,cfg.param,cfg.colA,cfg.colB);
-	if (cfg.askofn == 1)
-		asks("Output file", cfg.ofn);
+	parse_fgsC(cfg->ofn,cfg->ifn,cfg->param,cfg->colA,cfg->colB);
+	if (cfg->askofn == 1)
+		asks("Output file", cfg->ofn);
 	/* create gnuplot filename based on input file name, parameter */
-	parse_fgsC(cfg.gfn,cfg.ifn,cfg.param,cfg.colA,cfg.colB);
+	parse_fgsC(cfg->gfn,cfg->ifn,cfg->param,cfg->colA,cfg->colB);
 	/* create gnuplot filename based on output file name */
-	parse_op(cfg.gfn,cfg.ofn);
-	if (cfg.askgfn == 1)
-		asks("Gnuplot file", cfg.gfn);
+	parse_op(cfg->gfn,cfg->ofn);
+	if (cfg->askgfn == 1)
+		asks("Gnuplot file", cfg->gfn);
 
-	data.mean = 0;  // Strange but ok..
-	probe_file(cfg.time, cfg.colA, cfg.colB);
+	data->mean = 0;  // Strange but ok..
 	/*
 		if time is contained in first column and sampling frequency is not given on command line
 		then raise error.
 	*/
-	if ((cfg.time==1) && (cfg.cmdfsamp==0)) gerror("No sampling frequency given!");
+	if ((cfg->time==1) && (cfg->cmdfsamp==0)) gerror("No sampling frequency given!");
 
-	if (cfg.askfsamp == 1)
-		askd("Sampling frequency (Hz)", &cfg.fsamp);
-	if (cfg.tmax < 0)
-		cfg.tmax = (double) (data.ndata - 1) / (double) cfg.fsamp;
-	maxt = cfg.tmax;
+	if (cfg->askfsamp == 1)
+		askd("Sampling frequency (Hz)", &cfg->fsamp);
+	if (cfg->tmax < 0)
+		cfg->tmax = (double) (data->ndata - 1) / (double) cfg->fsamp;
+	maxt = cfg->tmax;
 	do {
-		if (cfg.asktmin == 1)
-			askd("Start time for spectrum estimation (s)", &cfg.tmin);
-		if ((cfg.tmin < 0) || (cfg.tmin > maxt))
+		if (cfg->asktmin == 1)
+			askd("Start time for spectrum estimation (s)", &cfg->tmin);
+		if ((cfg->tmin < 0) || (cfg->tmin > maxt))
 			printf("  Please enter a value between 0 and %g\n", maxt);
 	}
-	while ((cfg.tmin < 0) || (cfg.tmin > maxt));
+	while ((cfg->tmin < 0) || (cfg->tmin > maxt));
 	do {
-		if (cfg.asktmax == 1)
-			askd("Stop time for spectrum estimation (s)", &cfg.tmax);
-		if ((cfg.tmax < 0) || (cfg.tmax > maxt))
+		if (cfg->asktmax == 1)
+			askd("Stop time for spectrum estimation (s)", &cfg->tmax);
+		if ((cfg->tmax < 0) || (cfg->tmax > maxt))
 			printf("  Please enter a value between 0 and %g\n", maxt);
 	}
-	while ((cfg.tmax < 0) || (cfg.tmax > maxt));
-	data.nread = floor((cfg.tmax - cfg.tmin) * cfg.fsamp + 1);
-	if (cfg.askWT == 1)
-		aski("Window type -2 = Kaiser window, -1 = flat-top, 0..30 window function by number", &cfg.WT);
-	if ((cfg.WT == -2) || (cfg.WT == -1))
-		if (cfg.askreqPSLL == 1)
-			askd("requested PSLL - peak side lobe level", &cfg.reqPSLL);
-	set_window(cfg.WT, cfg.reqPSLL, &wi.name[0], &wi.psll, &rov,
-		   &wi.nenbw, &wi.w3db, &wi.flatness, &wi.sbin);
-	if (cfg.sbin<0) cfg.sbin=wi.sbin;
+	while ((cfg->tmax < 0) || (cfg->tmax > maxt));
+	data->nread = floor((cfg->tmax - cfg->tmin) * cfg->fsamp + 1);
+	if (cfg->askWT == 1)
+		aski("Window type -2 = Kaiser window, -1 = flat-top, 0..30 window function by number", &cfg->WT);
+	if ((cfg->WT == -2) || (cfg->WT == -1))
+		if (cfg->askreqPSLL == 1)
+			askd("requested PSLL - peak side lobe level", &cfg->reqPSLL);
+	set_window(&win, cfg->WT, cfg->reqPSLL, &wi->name[0], &wi->psll, &rov,
+		   &wi->nenbw, &wi->w3db, &wi->flatness, &wi->sbin);
+	if (cfg->sbin<0) cfg->sbin=wi->sbin;
 	
-	if (cfg.askovlp == 1) {
-		askd("Overlap in %",&cfg.ovlp);
+	if (cfg->askovlp == 1) {
+		askd("Overlap in %",&cfg->ovlp);
 	}
 	/* 
 		if ovlp was not given on command line and automatic overlap calculation was selected, 
 		then use recommended overlap from set_window
 	*/
-	printf("cfg.cmdovlp=%d, cfg.ovlp=%f\n",cfg.cmdovlp,cfg.ovlp);
-	if ((cfg.cmdovlp==0) && (cfg.ovlp<0)) cfg.ovlp=rov;
+	printf("cfg.cmdovlp=%d, cfg.ovlp=%f\n",cfg->cmdovlp,cfg->ovlp);
+	if ((cfg->cmdovlp==0) && (cfg->ovlp<0)) cfg->ovlp=rov;
 	
-	if (cfg.askMETHOD == 1)
-		aski("METHOD for frequency nodes calculation (0 or 1)", &cfg.METHOD);
+	if (cfg->askMETHOD == 1)
+		aski("METHOD for frequency nodes calculation (0, 1 or 2)", &cfg->METHOD);
 	
-	if (cfg.fmin < 0) {
-		xov = (1. - cfg.ovlp / 100.);
-		cfg.fmin = cfg.sbin / (data.nread/cfg.fsamp) * (1 + xov * (cfg.minAVG - 1));
+	if (cfg->fmin < 0) {
+		xov = (1. - cfg->ovlp / 100.);
+		cfg->fmin = cfg->sbin / (data->nread/cfg->fsamp) * (1 + xov * (cfg->minAVG - 1));
 	}
-	if (cfg.fres < 0) {
-		xov = (1. - cfg.ovlp / 100.);
-		cfg.fres = 1. / (data.nread/cfg.fsamp) * (1 + xov * (cfg.minAVG - 1));
-		cfg.nfft=round_downl(cfg.fsamp/cfg.fres);	/* suitable nfft for FFTW */
-		cfg.fres = cfg.fsamp / (double) cfg.nfft;
+	if (cfg->fres < 0) {
+		xov = (1. - cfg->ovlp / 100.);
+		cfg->fres = 1. / (data->nread/cfg->fsamp) * (1 + xov * (cfg->minAVG - 1));
+		cfg->nfft=round_downl(cfg->fsamp/cfg->fres);	/* suitable nfft for FFTW */
+		cfg->fres = cfg->fsamp / (double) cfg->nfft;
 	}
-	if (cfg.fmax < 0)
-		cfg.fmax = cfg.fsamp / 2.0;
-	if (cfg.askfmin == 1)
-		askd("Min. frequency", &cfg.fmin);
-	if (cfg.asksbin == 1)
-		askd("Min. freq. bin", &cfg.sbin);
-	if (cfg.askfmax == 1)
-		askd("Max. frequency", &cfg.fmax);
-	if (cfg.METHOD == 0 || cfg.METHOD == 1) {	
-		if (cfg.asknspec == 1)
-			aski("Number of samples in spectrum", &cfg.nspec);
-		if (cfg.askminAVG == 1)
-			aski("Minimum number of averages", &cfg.minAVG);	
-		if (cfg.askdesAVG == 1)
-			aski("Desired number of averages", &cfg.desAVG);
+	if (cfg->fmax < 0)
+		cfg->fmax = cfg->fsamp / 2.0;
+	if (cfg->askfmin == 1)
+		askd("Min. frequency", &cfg->fmin);
+	if (cfg->asksbin == 1)
+		askd("Min. freq. bin", &cfg->sbin);
+	if (cfg->askfmax == 1)
+		askd("Max. frequency", &cfg->fmax);
+	if (cfg->METHOD == 0 || cfg->METHOD == 1 || cfg->METHOD == 2) {	
+		if (cfg->asknspec == 1)
+			aski("Number of samples in spectrum", &cfg->nspec);
+		if (cfg->askminAVG == 1)
+			aski("Minimum number of averages", &cfg->minAVG);	
+		if (cfg->askdesAVG == 1)
+			aski("Desired number of averages", &cfg->desAVG);
 	}
-	if (cfg.askulsb == 1)
-		askd("Scaling factor", &cfg.ulsb);
-	if ((cfg.ngnuterm > 0) && (cfg.askgt==1)) {
+	if (cfg->askulsb == 1)
+		askd("Scaling factor", &cfg->ulsb);
+	if ((cfg->ngnuterm > 0) && (cfg->askgt==1)) {
 		printf("Gnuplot terminals:\n");
-		for (i = 0; i < cfg.ngnuterm; i++) {
+		for (i = 0; i < cfg->ngnuterm; i++) {
 			getGNUTERM(i,&agt[i]);
 			printf("\t(%d) %s\n",i,agt[i].identifier);
 		}
-		aski("Gnuplot terminal", &cfg.gt);
+		aski("Gnuplot terminal", &cfg->gt);
 	}
 }
 
-void getDefaultValues()
+void getDefaultValues(tCFG *cfg, tDATA *data, tWinInfo *wi)
 {
 	double maxt;				/* maximum stop time */
 	double fsamp;
 	double xov;
 	double rov;
+	struct window win;			/* for wi; the calculation sets up its own */
 	
   	printf("Using defaults...\n");
 
-	if (!exists(cfg.ifn))
+	if (!exists(cfg->ifn))
 	    gerror("input file name does not exist");
 	/* handle output filename */
-	parse_fgsC(cfg.ofn,cfg.ifn,cfg.param,cfg.colA,cfg.colB);
-	parse_fgsC(cfg.gfn,cfg.ifn,cfg.param,cfg.colA,cfg.colB);
-	parse_op(cfg.gfn,cfg.ofn);
-    data.mean = 0;  // Strange but ok
-    probe_file(cfg.time, cfg.colA, cfg.colB);
+	parse_fgsC(cfg->ofn,cfg->ifn,cfg->param,cfg->colA,cfg->colB);
+	parse_fgsC(cfg->gfn,cfg->ifn,cfg->param,cfg->colA,cfg->colB);
+	parse_op(cfg->gfn,cfg->ofn);
+    data->mean = 0;  // Strange but ok
 	/*
 		if time is contained in first column and sampling frequency is not given on command line
 		then raise error.
 	*/
-	if ((cfg.time==1) && (cfg.cmdfsamp==0)) gerror("No sampling frequency given!");
+	if ((cfg->time==1) && (cfg->cmdfsamp==0)) gerror("No sampling frequency given!");
 
-	if (cfg.tmax < 0) {
-	    cfg.tmax = (double) (data.ndata - 1) / (double) cfg.fsamp;
+	if (cfg->tmax < 0) {
+	    cfg->tmax = (double) (data->ndata - 1) / (double) cfg->fsamp;
 	}    
-	maxt = cfg.tmax;
-	data.nread = floor((cfg.tmax - cfg.tmin) * cfg.fsamp + 1);
-	set_window(cfg.WT, cfg.reqPSLL, &wi.name[0], &wi.psll, &rov,
-		   &wi.nenbw, &wi.w3db, &wi.flatness, &wi.sbin);
-	if ((cfg.cmdovlp==1) && (cfg.ovlp<0))
-		cfg.ovlp=rov;
-	if (cfg.sbin<0)
-		cfg.sbin=wi.sbin;
-	if (cfg.fmin < 0) {
-		xov = (1. - cfg.ovlp / 100.);
-		cfg.fmin = cfg.sbin / (data.nread/cfg.fsamp) * (1 + xov * (cfg.minAVG - 1));
+	maxt = cfg->tmax;
+	data->nread = floor((cfg->tmax - cfg->tmin) * cfg->fsamp + 1);
+	set_window(&win, cfg->WT, cfg->reqPSLL, &wi->name[0], &wi->psll, &rov,
+		   &wi->nenbw, &wi->w3db, &wi->flatness, &wi->sbin);
+	if ((cfg->cmdovlp==1) && (cfg->ovlp<0))
+		cfg->ovlp=rov;
+	if (cfg->sbin<0)
+		cfg->sbin=wi->sbin;
+	if (cfg->fmin < 0) {
+		xov = (1. - cfg->ovlp / 100.);
+		cfg->fmin = cfg->sbin / (data->nread/cfg->fsamp) * (1 + xov * (cfg->minAVG - 1));
 	}
-	if (cfg.fres < 0) {
-		xov = (1. - cfg.ovlp / 100.);
-		cfg.fres = 1. / (cfg.tmax - cfg.tmin) * (1 + xov * (cfg.minAVG - 1));
+	if (cfg->fres < 0) {
+		xov = (1. - cfg->ovlp / 100.);
+		cfg->fres = 1. / (cfg->tmax - cfg->tmin) * (1 + xov * (cfg->minAVG - 1));
 	}    
-	if (cfg.fmax < 0)
-		cfg.fmax = cfg.fsamp / 2.0;
+	if (cfg->fmax < 0)
+		cfg->fmax = cfg->fsamp / 2.0;
 }
 
 /* for debugging */
@@ -244,48 +241,20 @@ double calculate_mean(double *segm, int nfft)
 	return (m / (double) nfft);
 }
 
-void memalloc(tCFG * cfg, tDATA * data)
-{
-	(*data).ps = (double *) xmalloc(((*cfg).nspec) * sizeof(double));
-	(*data).psd = (double *) xmalloc(((*cfg).nspec) * sizeof(double));
-	(*data).varps = (double *) xmalloc(((*cfg).nspec) * sizeof(double));
-	(*data).varpsd = (double *) xmalloc(((*cfg).nspec) * sizeof(double));
-	(*data).psd_real = (double *) xmalloc(((*cfg).nspec) * sizeof(double));
-	(*data).psd_imag = (double *) xmalloc(((*cfg).nspec) * sizeof(double));
-	(*data).fspec = (double *) xmalloc(((*cfg).nspec) * sizeof(double));
-	(*data).bins = (double *) xmalloc(((*cfg).nspec) * sizeof(double));
-	(*data).nffts = (int *) xmalloc(((*cfg).nspec) * sizeof(int));
-	(*data).avg = (int *) xmalloc(((*cfg).nspec) * sizeof(int));
-}
-
-void memfree(tCFG *cfg, tDATA * data)
-{
-	xfree((*data).ps);
-	xfree((*data).psd);
-	xfree((*data).varps);
-	xfree((*data).varpsd);
-	xfree((*data).psd_real);
-	xfree((*data).psd_imag);
-	xfree((*data).fspec);
-	xfree((*data).bins);
-	xfree((*data).nffts);
-	xfree((*data).avg);
-}
-
-void checkParams() {
+void checkParams(tCFG *cfg, tDATA *data) {
 	double xov, fm;
 	
-	xov = (1. - cfg.ovlp / 100.);
-	fm = cfg.sbin / (data.nread/cfg.fsamp) * (1 + xov * (cfg.minAVG - 1));
+	xov = (1. - cfg->ovlp / 100.);
+	fm = cfg->sbin / (data->nread/cfg->fsamp) * (1 + xov * (cfg->minAVG - 1));
 
-	if (cfg.fmax>cfg.fsamp/2.0)
+	if (cfg->fmax>cfg->fsamp/2.0)
 		gerror("Largest frequency cannot be bigger than fsamp/2!");
-	if ((cfg.fmin*(1.+1e-6))<fm) {
-		printf("min. req. freq:\t%.2e, min. poss. freq:\t%.2e\n",cfg.fmin,fm);
+	if ((cfg->fmin*(1.+1e-6))<fm) {
+		printf("min. req. freq:\t%.2e, min. poss. freq:\t%.2e\n",cfg->fmin,fm);
 		gerror("Reduce minAVG or increase minimum frequency!");
 	}
-	if (cfg.METHOD==0) {
-		if (cfg.cmdfres) message("frequency resolution parameter is ignored in LPSD mode!");
+	if (cfg->METHOD==0) {
+		if (cfg->cmdfres) message("frequency resolution parameter is ignored in LPSD mode!");
 	}
 }
 
@@ -296,23 +265,51 @@ void checkParams() {
 int main(int argc, char *argv[])
 {
 	char s[CLEN];
-	/* Wipe previous memory somehow? XhereX */	
+	tCFG cfg;			/* configuration data */
+	tGNUTERM gt;			/* gnuplot terminal in use */
+	tDATA data;			/* info on input data and results */
+	tWinInfo wi;			/* info on window function */
+	struct lpsd_state st;		/* state of the calculation */
+	/* With MPI, rank 0 prints, keeps the journal and writes the output */
+	int rank = ranks_init(&argc, &argv);
+	memset(&data, 0, sizeof(data));
 	readConfigFile();
 	getConfig(&cfg);
 	printf("%s",doc);
 	parseArgs(argc, argv, &cfg);
-	if (cfg.usedefs==0) getUserInput();
-	else getDefaultValues();
+	if (rank > 0) cfg.journal = 0;
+	if (rank > 0) cfg.cache_dir[0] = 0;
+	if (cfg.state_fn[0] && ranks_size() > 1) gerror("--state does not work with MPI");
+	if (cfg.segments_fn[0] && cfg.state_fn[0]) gerror("--segments does not work with --state");
+	if (cfg.usedefs==0) getUserInput(&cfg, &data, &wi);
+	else getDefaultValues(&cfg, &data, &wi);
 	getGNUTERM(cfg.gt, &gt);
 	printConfig(&s[0],cfg, wi, gt, data);
 	printf("%s",s);
 
-	checkParams();
+	checkParams(&cfg, &data);
+	if (cfg.plan_partitions > 0) {
+		if (rank == 0) plan_partitions(&st, &cfg, &data);
+		ranks_finalize();
+		return EXIT_SUCCESS;
+	}
 	memalloc(&cfg, &data);
-	calculateSpectrum(&cfg,&data);
-	saveResult(&cfg, &data, &gt, &wi, argc, argv);
+	if (cfg.dry_run) {
+		if (rank == 0) dry_run(&st, &cfg, &data);
+		memfree(&cfg, &data);
+		ranks_finalize();
+		return EXIT_SUCCESS;
+	}
+	journal_catch_signals();
+	calculateSpectrum(&st, &cfg, &data);
+	journal_release_signals();
+	if (rank == 0) {
+		saveResult(&cfg, &data, &gt, &wi, argc, argv);
+		journal_remove(&cfg);
+	}
 
 	memfree(&cfg, &data);
+	ranks_finalize();
 
 	return EXIT_SUCCESS;
 }
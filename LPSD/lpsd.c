@@ -17,17 +17,25 @@
 #include <string.h>
 #include <time.h>
 #include <assert.h>
+#include <unistd.h>
 #include <fftw3.h>
 #include "hdf5.h"
 
 #include "config.h"
-#include "ask.h"
 #include "IO.h"
 #include "genwin.h"
 #include "debug.h"
 #include "lpsd.h"
 #include "misc.h"
 #include "errors.h"
+#include "pipeline.h"
+#include "interp.h"
+#include "twiddle.h"
+#include "journal.h"
+#include "cache.h"
+#include "stream.h"
+#include "workers.h"
+#include "ranks.h"
 
 /*
 20.03.2004: http://www.caddr.com/macho/archives/iolanguage/2003-9/549.html
@@ -69,26 +77,32 @@ int round (double x) {
 #endif
 
 /********************************************************************************
- * 	global variables						   	
+ * 	types							   	
  ********************************************************************************/
-static long int nread;
-static double winsum;
-static double winsum2;
-static double nenbw;		/* normalized equivalent noise bandwidth */
-static double *dwin;		/* pointer to window function for FFT */
+// Statistics of a calculation, summed over the units of the worker processes
+enum { TOTAL_BLOCKS, TOTAL_FFTS, TOTAL_INTERP_ERR, TOTAL_INTERP_NORM, NTOTALS };
+
+// A calculation as seen by calculate_block and the worker processes, which open their own input
+struct lpsd_ctx {
+    struct lpsd_state *st;
+    tCFG *cfg;
+    tCFG band;			/* cfg on the frequency axis of all Jdes bins */
+    tDATA *data;
+    struct hdf5_contents contents;
+    long int jfirst;		/* first bin of this partition, data is indexed from here */
+    int max_samples_in_memory;
+    double totals[NTOTALS];
+    struct pipeline_stats io_stats;	/* stalls of the out-of-core FFT */
+};
+
+static int get_max_samples_in_memory(tCFG*);
+static double get_bin_cost_exact(tCFG*, long int, long int);
 
 /********************************************************************************
  * 	functions								
  ********************************************************************************/
 
 
-// Interpolate between x12, y12 points to x
-double
-interpolate(double x, double x1, double x2, double y1, double y2) {
-	return (y1*(x2 - x) - y2*(x1 - x)) / (x2 - x1);	
-}
-
-
 // Get mean over N first values of int sequence
 double
 get_mean (int* values, int N) {
@@ -166,32 +180,125 @@ fill_ordered_coefficients(int n, int *coefficients) {
 }
 
 
+// Add the windowed samples of one memory unit to the DFT sum re, im; the samples
+// stay in their storage type and are converted as they are loaded
+static void
+dft_accumulate (const double *window, const void *samples, int sample_type, int count,
+                double *re, double *im)
+{
+  register int i;
+  register double sre = 0, sim = 0;
+  switch (sample_type)
+  {
+    case SAMPLE_FLOAT: {
+      const float *x = (const float*) samples;
+      for (i = 0; i < count; i++) { sre += window[i*2] * x[i]; sim += window[i*2 + 1] * x[i]; }
+      break;
+    }
+    case SAMPLE_INT16: {
+      const short *x = (const short*) samples;
+      for (i = 0; i < count; i++) { sre += window[i*2] * x[i]; sim += window[i*2 + 1] * x[i]; }
+      break;
+    }
+    case SAMPLE_INT32: {
+      const int *x = (const int*) samples;
+      for (i = 0; i < count; i++) { sre += window[i*2] * x[i]; sim += window[i*2 + 1] * x[i]; }
+      break;
+    }
+    default: {
+      const double *x = (const double*) samples;
+      for (i = 0; i < count; i++) { sre += window[i*2] * x[i]; sim += window[i*2 + 1] * x[i]; }
+    }
+  }
+  *re += sre;
+  *im += sim;
+}
+
+// Segments of one memory unit in getDFT2, read ahead of the DFT by run_pipeline.
+// Short overlapping segments are read in batches of at least PREFETCH_SAMPLES samples,
+// which reads the overlap once and keeps the hand-over between the threads rare.
+struct dft_ctx {
+    struct hdf5_contents *contents;
+    const double *window;
+    const long int *starts;	/* first sample of each segment */
+    const int *batches;		/* first segment of each batch, and the number of segments */
+    long int window_offset;
+    int count;
+    double *dft_results;
+};
+
+static void
+dft_load (void *_ctx, long int unit, void *buf)
+{
+  struct dft_ctx *ctx = (struct dft_ctx*) _ctx;
+  long int first = ctx->starts[ctx->batches[unit]];
+  long int last = ctx->starts[ctx->batches[unit + 1] - 1];
+  read_samples(ctx->contents, first + ctx->window_offset, last - first + ctx->count, buf);
+}
+
+static void
+dft_compute (void *_ctx, long int unit, void *buf)
+{
+  struct dft_ctx *ctx = (struct dft_ctx*) _ctx;
+  long int first = ctx->starts[ctx->batches[unit]];
+  for (int k = ctx->batches[unit]; k < ctx->batches[unit + 1]; k++)
+    dft_accumulate(ctx->window, (char*) buf + (ctx->starts[k] - first) * ctx->contents->sample_size,
+                   ctx->contents->sample_type, ctx->count,
+                   &ctx->dft_results[k*2], &ctx->dft_results[k*2 + 1]);
+}
+
+// Number of segments of length nfft summed by getDFT2 in nread samples
+static int
+dft_nsum (long int nread, long int nfft, double ovlp)
+{
+  int nsum = floor(1+(nread - nfft) / floor(nfft * (1.0 - (double) (ovlp / 100.))));
+  long int tmp = (nsum-1)*floor(nfft * (1.0 - (double) (ovlp / 100.)))+nfft;
+  if (tmp == nread) nsum--;  /* Adjust for edge case */
+  return nsum;
+}
+
+// DFTs at bin of the nsum (dft_nsum) segments of length nfft in the first nread samples,
+// stored as real and imaginary parts in dft_results[0..2*nsum-1]
 static void
-getDFT2 (long int nfft, double bin, double fsamp, double ovlp, double *rslt,
-         int *avg, struct hdf5_contents *contents)
+dft_segments (struct lpsd_state *st, long int nfft, double bin, double ovlp, long int nread,
+              int nsum, struct hdf5_contents *contents, double *dft_results,
+              double *winsum, double *winsum2)
 {
+  double nenbw;
   /* Configure variables for DFT */
-  int max_samples_in_memory = 5*6577770;  // Around 500 MB //TODO: this shouldn't be hard-coded!
+  int max_samples_in_memory = DFTUNIT;
 //  int max_samples_in_memory = 512;  // tmp
   if (max_samples_in_memory > nfft) max_samples_in_memory = nfft; // Don't allocate more than you need
 
-  /* Allocate data and window memory segments */
-  double *strain_data_segment = (double*) xmalloc(max_samples_in_memory * sizeof(double));
-  double *window = (double*) xmalloc(2*max_samples_in_memory * sizeof(double));
-  assert(window != 0 && strain_data_segment != 0);
+  /* Allocate data and window memory segments; a mapped input needs no data buffers */
+  long int buffer_samples = max_samples_in_memory > PREFETCH_SAMPLES ? max_samples_in_memory : PREFETCH_SAMPLES;
+  int mapped = map_samples(contents, 0) != NULL;
+  struct buffer_set bufs;
+  buffers_init(&bufs);
+  void *strain_data_segments[PREFETCH_BUFFERS];
+  for (int b = 0; b < PREFETCH_BUFFERS; b++)
+    strain_data_segments[b] = mapped ? NULL : buffers_alloc(&bufs, buffer_samples * contents->sample_size);
+  double *window = (double*) buffers_alloc(&bufs, 2*max_samples_in_memory * sizeof(double));
+  assert(window != 0);
 
   //////////////////////////////////////////////////
   /* Calculate DFT over separate memory windows */
   int window_offset, count;
   int memory_unit_index = 0;
   long int remaining_samples = nfft;
-  int nsum = floor(1+(nread - nfft) / floor(nfft * (1.0 - (double) (ovlp / 100.))));
-  long int tmp = (nsum-1)*floor(nfft * (1.0 - (double) (ovlp / 100.)))+nfft;
-  if (tmp == nread) nsum--;  /* Adjust for edge case */
-
-  double dft_results[2*nsum];  /* Real and imaginary parts of DFTs */
   memset(dft_results, 0, 2*nsum*sizeof(double));
 
+  /* Start of each segment */
+  long int *starts = (long int*) buffers_alloc(&bufs, nsum * sizeof(long int));
+  int *batches = (int*) buffers_alloc(&bufs, (nsum + 1) * sizeof(int));
+  long int start = 0;
+  int nseg = 0;
+  while (start + nfft < nread && nseg < nsum)
+  {
+    starts[nseg++] = start;
+    start += nfft * (1.0 - (double) (ovlp / 100.));  /* go to next segment */
+  }
+
   while (remaining_samples > 0)
   {
     if (remaining_samples > max_samples_in_memory)
@@ -206,32 +313,44 @@ getDFT2 (long int nfft, double bin, double fsamp, double ovlp, double *rslt,
     memory_unit_index++;
 
     // Calculate window
-    makewinsincos_indexed(nfft, bin, window, &winsum, &winsum2, &nenbw,
+    makewinsincos_indexed(&st->win, nfft, bin, window, winsum, winsum2, &nenbw,
                           window_offset, count, window_offset == 0);
 
-    // Loop over data segments
-    long int start = 0;
-    register int _nsum = 0;
-    hsize_t data_count[1] = {count};
-    hsize_t data_rank = 1;
-    while (start + nfft < nread)
-    {
-      // Load data
-      hsize_t data_offset[1] = {start + window_offset};
-      read_from_dataset(contents, data_offset, data_count, data_rank, data_count, strain_data_segment);
-
-      // Calculate DFT
-      register int i;
-      for (i = 0; i < count; i++)
-      {
-        dft_results[_nsum*2] += window[i*2] * strain_data_segment[i];
-        dft_results[_nsum*2 + 1] += window[i*2 + 1] * strain_data_segment[i];
-      }
-      start += nfft * (1.0 - (double) (ovlp / 100.));  /* go to next segment */
-      _nsum++;
+    // A mapped input is summed in place, the page cache reads ahead
+    if (mapped) {
+      for (int k = 0; k < nseg; k++)
+        dft_accumulate(window, map_samples(contents, starts[k] + window_offset), contents->sample_type,
+                       count, &dft_results[k*2], &dft_results[k*2 + 1]);
+      continue;
     }
+
+    // Group segments into batches that fit a buffer
+    int nbatch = 0, k;
+    for (k = 0; k < nseg; k++)
+      if (k == 0 || starts[k] - starts[batches[nbatch - 1]] + count > buffer_samples) batches[nbatch++] = k;
+    batches[nbatch] = nseg;
+
+    // Loop over data segments, reading the next ones while the DFT of the current ones is summed
+    struct dft_ctx ctx = {contents, window, starts, batches, window_offset, count, dft_results};
+    run_pipeline(nbatch, PREFETCH_BUFFERS, 1, strain_data_segments,
+                 dft_load, dft_compute, NULL, &ctx, &st->prefetch_stats);
   }
 
+  /* clean up */
+  buffers_free(&bufs);
+}
+
+static void
+getDFT2 (struct lpsd_state *st, long int nfft, double bin, double fsamp, double ovlp, double *rslt,
+         int *avg, struct hdf5_contents *contents, long int store_bin)
+{
+  double winsum, winsum2;
+  int nsum = dft_nsum(st->nread, nfft, ovlp);
+  double dft_results[2*nsum];  /* Real and imaginary parts of DFTs */
+
+  dft_segments(st, nfft, bin, ovlp, st->nread, nsum, contents, dft_results, &winsum, &winsum2);
+
+  //////////////////////////////////////////////////
   /* Sum over dft_results to get total */
   register int i;
   double total = 0;  /* Running sum of DFTs */
@@ -239,10 +358,12 @@ getDFT2 (long int nfft, double bin, double fsamp, double ovlp, double *rslt,
   {
     total += dft_results[i*2]*dft_results[i*2] + dft_results[i*2+1]*dft_results[i*2+1];
   }
+  /* --segments: keep the DFTs of the segments of data bin store_bin */
+  if (store_bin >= 0) segments_write(&st->segs, store_bin, dft_results, nsum, winsum, winsum2);
   //////////////////////////////////////////////////
 
-  /* Return result */
-  rslt[0] = total / nsum;
+  /* Return result, scaled as the samples are (ulsb) */
+  rslt[0] = total / nsum * contents->scale * contents->scale;
   
   /* This sets the variance to zero. This is not true, but we are not using the variance. */
   rslt[1] = 0;
@@ -255,13 +376,21 @@ getDFT2 (long int nfft, double bin, double fsamp, double ovlp, double *rslt,
   rslt[3] *= 2. / (winsum * winsum);	/* variance of power spectrum */
 
   *avg = nsum;
-
-  /* clean up */
-  xfree(window);
-  xfree(strain_data_segment);
 }
 
 
+// Time the computation waited for input reads and the reads waited for free buffers,
+// and the number of compressed input chunks decoded
+static void
+print_prefetch_stats (struct lpsd_state *st)
+{
+  if (st->prefetch_stats.units > 0)
+    printf ("Prefetch: %ld reads, idle time (s): computation %5.3f, reader %5.3f\n",
+            st->prefetch_stats.units, st->prefetch_stats.compute_wait, st->prefetch_stats.load_wait);
+  if (st->chunk_decodes > 0)
+    printf ("Input chunks decoded: %ld\n", st->chunk_decodes);
+}
+
 /*
 	calculates paramaters for DFTs
 	output
@@ -275,7 +404,7 @@ getDFT2 (long int nfft, double bin, double fsamp, double ovlp, double *rslt,
         ndft	    L(j)
         bin		    m(j)
  */
-static void
+void
 calc_params (tCFG * cfg, tDATA * data)
 {
   double fres, f, bin, g;
@@ -283,9 +412,10 @@ calc_params (tCFG * cfg, tDATA * data)
 
   g = log ((*cfg).fmax / (*cfg).fmin);
   i = (*cfg).nspec * (*cfg).iter;
+  if ((*cfg).binrange[1] > 0) i = (*cfg).binrange[0];  /* --bins */
   i0 = i;
   f = (*cfg).fmin * exp (i * g / ((*cfg).Jdes - 1.));
-  while (f <= (*cfg).fmax && i / (*cfg).nspec < (*cfg).iter + 1)
+  while (f <= (*cfg).fmax && i - i0 < (*cfg).nspec)
    {
       fres = f * (exp (g / ((*cfg).Jdes - 1.)) - 1);
       ndft = round ((*cfg).fsamp / fres);
@@ -297,111 +427,204 @@ calc_params (tCFG * cfg, tDATA * data)
       f = (*cfg).fmin * exp (i * g / ((*cfg).Jdes - 1.));
   }
   (*cfg).nspec = i - i0;
+  (*cfg).jfirst = i0;
   (*cfg).fmin = (*data).fspec[0];
   (*cfg).fmax = (*data).fspec[(*cfg).nspec - 1];
 }
 
-void
-calculate_lpsd (tCFG * cfg, tDATA * data)
-{
-  int k;			/* 0..nspec */
-  int k_start = 0;		/* N. lines in save file. Post fail start point */
-  char ch;			/* For scanning through checkpointing file */
-  int Nsave = (*cfg).nspec / 100; /* Frequency of data checkpointing */
-  int j; 			/* Iteration variables for checkpointing data */
-  FILE * file1;			/* Output file, temp for checkpointing */
+// Open the input of the calculation, with a quarter of the memory budget as chunk cache
+static void
+open_input (struct lpsd_ctx *ctx)
+{
+  open_samples (&ctx->contents, ctx->cfg, &ctx->st->input);
+  ctx->contents.scale = ctx->cfg->ulsb;
+  set_chunk_cache (&ctx->contents, ctx->cfg->memory_budget * 1024. * 1024. / 4.);
+}
+
+static void
+close_input (struct lpsd_ctx *ctx)
+{
+  ctx->st->chunk_decodes += ctx->contents.chunk_decodes;
+  close_hdf5_contents (&ctx->contents);
+}
+
+static void
+init_ctx (struct lpsd_ctx *ctx, struct lpsd_state *st, tCFG * cfg, tDATA * data)
+{
+  memset (ctx, 0, sizeof (struct lpsd_ctx));
+  ctx->st = st;
+  ctx->cfg = cfg;
+  ctx->data = data;
+  // Bins are planned on the frequency axis of all Jdes bins (band); block bins j are global,
+  // data is indexed from the first bin of this partition (jfirst)
+  ctx->band = *cfg;
+  ctx->band.fmin = st->band_fmin;
+  ctx->band.fmax = st->band_fmax;
+  ctx->jfirst = (*cfg).jfirst;
+  ctx->max_samples_in_memory = get_max_samples_in_memory (cfg);
+}
+
+// Exact DFT of bin k of data, stored in data and the journal
+static void
+calculate_bin_exact (struct lpsd_ctx *ctx, long int k)
+{
+  tCFG *cfg = ctx->cfg;
+  tDATA *data = ctx->data;
   double rslt[4];		/* rslt[0]=PSD, rslt[1]=variance(PSD) rslt[2]=PS rslt[3]=variance(PS) */
+
+  getDFT2(ctx->st, (*data).nffts[k], (*data).bins[k], (*cfg).fsamp, (*cfg).ovlp,
+          &rslt[0], &(*data).avg[k], &ctx->contents, k);
+  (*data).psd[k] = rslt[0];
+  (*data).method[k] = 0;
+  (*data).varpsd[k] = rslt[1];
+  (*data).ps[k] = rslt[2];
+  (*data).varps[k] = rslt[3];
+  (*data).psd_real[k] = (*data).psd_imag[k] = 0;
+  journal_append(&ctx->st->jrnl, data, k, k + 1);
+}
+
+// @brief Split units 0..n-1 into P <= n consecutive groups of about equal cost
+// @brief Group p is cut[p]..cut[p+1]-1; each group gets at least one unit, and the last unit
+// @brief of a group when its middle stays below the target cost
+static void
+split_by_cost (const double *cost, long int n, long int P, long int *cut)
+{
+  double total = 0, sum = 0;
+  long int p, u;
+
+  for (u = 0; u < n; u++) total += cost[u];
+  cut[0] = 0;
+  for (p = 1, u = 0; p < P; p++) {
+    double target = total * p / P;
+    do sum += cost[u++];
+    while (u < n - (P - p) && sum + cost[u] / 2 <= target);
+    cut[p] = u;
+  }
+  cut[P] = n;
+}
+
+// --workers and MPI: a worker or rank opens its own input (with MPI, the samples of ranks_share_input)
+// and names its temporary files by its index
+static void
+worker_setup (void *_ctx, int worker)
+{
+  struct lpsd_ctx *ctx = (struct lpsd_ctx*) _ctx;
+  ctx->st->worker_index = worker;
+  open_input (ctx);
+}
+
+// @brief --workers or MPI: calculate items 0..nitems-1 (bins or blocks) in cfg->workers
+// @brief processes or the MPI ranks, which take precedence
+// @brief Item i starts at data bin first[i] (first[nitems] = nspec) and has the estimated
+// @brief cost cost[i]; the items are queued as WORKUNITS units of equal cost per worker or rank
+static void
+calculate_with_workers (struct lpsd_ctx *ctx, long int nitems, const long int *first,
+                        const double *cost, void (*compute)(void*, long int, long int))
+{
+  int nprocs = ranks_size () > 1 ? ranks_size () : ctx->cfg->workers;
+  long int p, P = (long int) nprocs * WORKUNITS;
+  if (P > nitems) P = nitems;
+
+  struct buffer_set bufs;
+  buffers_init (&bufs);
+  long int *cut = (long int*) buffers_alloc (&bufs, (P + 1) * sizeof (long int));
+  struct work_unit *units = (struct work_unit*) buffers_alloc (&bufs, P * sizeof (struct work_unit));
+  split_by_cost (cost, nitems, P, cut);
+  for (p = 0; p < P; p++) {
+    units[p].i0 = cut[p];
+    units[p].i1 = cut[p + 1];
+    units[p].k0 = first[cut[p]];
+    units[p].k1 = first[cut[p + 1]];
+  }
+  struct worker_ops ops = {worker_setup, compute, ctx->totals, NTOTALS};
+  if (ranks_size () > 1)
+    {
+      // Each rank opened its input in worker_setup
+      run_ranks (units, P, &ops, ctx, ctx->data, ctx->cfg->nspec, &ctx->st->jrnl);
+      close_input (ctx);
+    }
+  else run_workers (ctx->cfg->workers, units, P, &ops, ctx, ctx->data, ctx->cfg->nspec, &ctx->st->jrnl);
+  buffers_free (&bufs);
+}
+
+// Bins i0..i1-1 of data with exact DFTs
+static void
+compute_bins (void *_ctx, long int i0, long int i1)
+{
+  struct lpsd_ctx *ctx = (struct lpsd_ctx*) _ctx;
+  long int k;
+  for (k = i0; k < i1; k++)
+    if (!journal_done(&ctx->st->jrnl, k)) calculate_bin_exact(ctx, k);
+}
+
+void
+calculate_lpsd (struct lpsd_state *st, tCFG * cfg, tDATA * data)
+{
+  long int k;			/* 0..nspec */
   double progress;
 
   struct timeval tv;
   double start, now, print;
+  struct lpsd_ctx ctx;
 
-  /* Check output file for saved checkpoint */
-  file1 = fopen((*cfg).ofn, "r");
-  if (file1){
-      while((ch=fgetc(file1)) != EOF){
-          if(ch == '\n'){
-              k_start++;
-          }
-      }
-  fclose(file1);
-  printf("Backup collected. Starting from k = %i\n", k_start);
-  }
-  else{
-      printf("No backup file. Starting from fmin\n");
-      k_start = 0;
-  }
-  printf ("Checkpointing every %i iterations\n", Nsave);
   printf ("Computing output:  00.0%%");
   fflush (stdout);
   gettimeofday (&tv, NULL);
   start = tv.tv_sec + tv.tv_usec / 1e6;
   now = start;
   print = start;
-  
-  /* Start calculation of LPSD from saved checkpoint or zero */
-  struct hdf5_contents contents;
-  read_hdf5_file(&contents, (*cfg).ifn, (*cfg).dataset_name);
-  for (k = k_start; k < (*cfg).nspec; k++)
+  init_ctx (&ctx, st, cfg, data);
+
+  /* Calculate all bins that are not in the journal yet */
+  if ((*cfg).workers > 1 || ranks_size () > 1)
     {
-      getDFT2((*data).nffts[k], (*data).bins[k], (*cfg).fsamp, (*cfg).ovlp,
-	          &rslt[0], &(*data).avg[k], &contents);
-
-      (*data).psd[k] = rslt[0];
-      (*data).varpsd[k] = rslt[1];
-      (*data).ps[k] = rslt[2];
-      (*data).varps[k] = rslt[3];
-      gettimeofday (&tv, NULL);
-      now = tv.tv_sec + tv.tv_usec / 1e6;
-      if (now - print > PSTEP)
+      struct buffer_set bufs;
+      buffers_init (&bufs);
+      long int *first = (long int*) buffers_alloc (&bufs, ((*cfg).nspec + 1) * sizeof (long int));
+      double *cost = (double*) buffers_alloc (&bufs, (*cfg).nspec * sizeof (double));
+      for (k = 0; k < (*cfg).nspec; k++)
 	{
-	  print = now;
-	  progress = (100 * ((double) k)) / ((double) ((*cfg).nspec));
-	  printf ("\b\b\b\b\b\b%5.1f%%", progress);
-	  fflush (stdout);
+	  first[k] = k;
+	  cost[k] = get_bin_cost_exact (&ctx.band, st->nread, ctx.jfirst + k);
 	}
-
-      /* If k is a multiple of Nsave then write data to backup file */
-      if(k % Nsave  == 0 && k != k_start){
-          file1 = fopen((*cfg).ofn, "a");
-          for(j=k-Nsave; j<k; j++){
-		fprintf(file1, "%e	", (*data).psd[j]);
-		fprintf(file1, "%e	", (*data).ps[j]);
-		fprintf(file1, "%d	", (*data).avg[j]);
-		fprintf(file1, "\n");
-          }
-          fclose(file1);
-      }
-      else if(k == (*cfg).nspec - 1){
-          file1 = fopen((*cfg).ofn, "a");
-          for(j=Nsave*(k/Nsave); j<(*cfg).nspec; j++){
-		fprintf(file1, "%e	", (*data).psd[j]);
-		fprintf(file1, "%e	", (*data).ps[j]);
-		fprintf(file1, "%d	", (*data).avg[j]);
-		fprintf(file1, "\n");
-          }
-          fclose(file1);
-      }
+      first[(*cfg).nspec] = (*cfg).nspec;
+      calculate_with_workers (&ctx, (*cfg).nspec, first, cost, compute_bins);
+      buffers_free (&bufs);
+    }
+  else
+    {
+      open_input (&ctx);
+      for (k = 0; k < (*cfg).nspec; k++)
+	{
+	  if (journal_done(&st->jrnl, k)) continue;
+	  calculate_bin_exact (&ctx, k);
+	  gettimeofday (&tv, NULL);
+	  now = tv.tv_sec + tv.tv_usec / 1e6;
+	  if (now - print > PSTEP)
+	    {
+	      print = now;
+	      progress = (100 * ((double) k)) / ((double) ((*cfg).nspec));
+	      printf ("\b\b\b\b\b\b%5.1f%%", progress);
+	      fflush (stdout);
+	    }
+	}
+      close_input (&ctx);
     }
   /* finish */
-  close_hdf5_contents(&contents);
   printf ("\b\b\b\b\b\b  100%%\n");
   fflush (stdout);
   gettimeofday (&tv, NULL);
-  printf ("Duration (s)=%5.3f\n\n", tv.tv_sec - start + tv.tv_usec / 1e6);
+  printf ("Duration (s)=%5.3f\n", tv.tv_sec - start + tv.tv_usec / 1e6);
+  print_prefetch_stats (st);
+  printf ("\n");
 }
 
 
-// @brief Calculate FFT on data of length N
-// @brief This implementation puts everything in memory, serves as test
-// @brief Takes in real data
-// @param Custom bin number, necessary for logarithmic frequency spacing
-// @brief Memory contents reach 3N in main loop (+ 2N from recursion)
-// TODO: implement Bergland's algorithm
-// TODO: sin/cos optimisation
-void
-FFT(double *data_real, double *data_imag, int N,
-    double *output_real, double *output_imag)
+// Recursion of FFT(); twiddle factor i of this level is entry i*stride of tw
+static void
+fft_recursive(double *data_real, double *data_imag, int N,
+              double *output_real, double *output_imag,
+              const struct twiddle_table *tw, long int stride)
 {
     if (N == 1) {
         output_real[0] = data_real[0];
@@ -418,7 +641,7 @@ FFT(double *data_real, double *data_imag, int N,
     // Calculate FFT over halved arrays
     double *X_even_real = (double*) xmalloc(m*sizeof(double));
     double *X_even_imag = (double*) xmalloc(m*sizeof(double));
-    FFT(x_even_real, x_even_imag, m, X_even_real, X_even_imag);
+    fft_recursive(x_even_real, x_even_imag, m, X_even_real, X_even_imag, tw, 2*stride);
     // Clean up
     xfree(x_even_real);
     xfree(x_even_imag);
@@ -431,16 +654,15 @@ FFT(double *data_real, double *data_imag, int N,
     // Calculate FFT over halved arrays
     double *X_odd_real = (double*) xmalloc(m*sizeof(double));
     double *X_odd_imag = (double*) xmalloc(m*sizeof(double));
-    FFT(x_odd_real, x_odd_imag, m, X_odd_real, X_odd_imag);
+    fft_recursive(x_odd_real, x_odd_imag, m, X_odd_real, X_odd_imag, tw, 2*stride);
     // Clean up
     xfree(x_odd_real);
     xfree(x_odd_imag);
 
-    // Calculate exponential term to multiply to X_odd
-    double exp_factor = 2.0 * M_PI / ((double) N);
+    // Multiply X_odd with the exponential term
     for (int i = 0; i < m; i++) {
-        double y = cos(i*exp_factor);
-        double x = -sin(i*exp_factor);
+        double y = tw->cos[i*stride];
+        double x = -tw->sin[i*stride];
         double b = X_odd_real[i];
         double a = X_odd_imag[i];
         X_odd_real[i] = b*y - a*x;
@@ -462,153 +684,911 @@ FFT(double *data_real, double *data_imag, int N,
     xfree(X_odd_imag);
 }
 
+// @brief Calculate FFT on data of length N
+// @brief This implementation puts everything in memory, serves as test
+// @brief Takes in real data
+// @param Custom bin number, necessary for logarithmic frequency spacing
+// @brief Memory contents reach 3N in main loop (+ 2N from recursion)
+// @brief Twiddle factors come from the shared table cache (twiddle.c), so repeated FFTs
+// @brief of the same (or a smaller) size do not recompute any sin/cos
+// TODO: implement Bergland's algorithm
+void
+FFT(double *data_real, double *data_imag, int N,
+    double *output_real, double *output_imag)
+{
+    long int stride;
+    const struct twiddle_table *tw = twiddle_get(N, N > 1 ? N / 2 : 1, &stride);
+    fft_recursive(data_real, data_imag, N, output_real, output_imag, tw, stride);
+    twiddle_release(tw);
+}
+
+
+// Shared state of the pipeline stages in FFT_control_memory
+struct fft_memory_ctx {
+    long int Nj0, Nfft;
+    int Nmax, segment_offset;
+    int two_to_n_depth, n_mem_units;
+    long int Nj0_over_two_n_depth;
+    int *ordered_coefficients;
+    const struct twiddle_table *tw;  /* exp(-i 2 pi k / Nfft_over_two_n_depth), k < Nmax */
+    long int tw_stride;
+    long int Nfft_over_two_n_depth;
+    struct hdf5_contents *contents, *window_contents, *_contents;
+    struct hdf5_contents *strided_contents;  /* segment rearranged by residue, NULL to read strided */
+    const char *strided_fn;	/* its temporary file */
+};
+
+// Work buffer of one bottom-layer unit
+struct fft_leaf_buffer {
+    double *data_real, *data_imag, *fft_real, *fft_imag, *window;
+    int Ndata;
+};
+
+// Work buffer of one butterfly unit, holds Nmax even and odd terms
+struct fft_butterfly_buffer {
+    double *even_real, *even_imag, *odd_real, *odd_imag;
+};
+
+// Strided read of data and window samples for bottom-layer unit i
+static void
+fft_leaf_load (void *_ctx, long int i, void *_buf)
+{
+    struct fft_memory_ctx *ctx = (struct fft_memory_ctx*) _ctx;
+    struct fft_leaf_buffer *buf = (struct fft_leaf_buffer*) _buf;
+
+    hsize_t offset[1] = {ctx->ordered_coefficients[i] + ctx->segment_offset};
+    buf->Ndata = ctx->ordered_coefficients[i] + ctx->Nj0_over_two_n_depth*ctx->two_to_n_depth < ctx->Nj0 ?
+        ctx->Nj0_over_two_n_depth + 1 : ctx->Nj0_over_two_n_depth;
+    hsize_t count[1] = {buf->Ndata};
+    hsize_t stride[1] = {ctx->two_to_n_depth};
+    hsize_t rank = 1;
+    if (ctx->strided_contents) {
+        hsize_t row_offset[2] = {ctx->ordered_coefficients[i], 0};
+        hsize_t row_count[2] = {1, buf->Ndata};
+        read_from_dataset(ctx->strided_contents, row_offset, row_count, rank, count, buf->data_real);
+    } else {
+        read_from_dataset_stride(ctx->contents, offset, count, stride, rank, count, buf->data_real);
+    }
+
+    hsize_t window_offset[1] = {ctx->ordered_coefficients[i]};
+    read_from_dataset_stride(ctx->window_contents, window_offset, count, stride, rank, count, buf->window);
+}
+
+// Apply window, zero-pad and take the FFT of bottom-layer unit i
+static void
+fft_leaf_compute (void *_ctx, long int i __attribute__ ((unused)), void *_buf)
+{
+    struct fft_memory_ctx *ctx = (struct fft_memory_ctx*) _ctx;
+    struct fft_leaf_buffer *buf = (struct fft_leaf_buffer*) _buf;
+
+    for (int j = 0; j < buf->Ndata; j++) buf->data_real[j] *= buf->window[j];
+    for (int j = buf->Ndata; j < ctx->Nmax; j++) buf->data_real[j] = 0;
+    FFT(buf->data_real, buf->data_imag, ctx->Nmax, buf->fft_real, buf->fft_imag);
+}
+
+// Save real and imaginary part of bottom-layer unit i to the temporary file
+static void
+fft_leaf_store (void *_ctx, long int i, void *_buf)
+{
+    struct fft_memory_ctx *ctx = (struct fft_memory_ctx*) _ctx;
+    struct fft_leaf_buffer *buf = (struct fft_leaf_buffer*) _buf;
+
+    hsize_t _offset[2] = {0, i*ctx->Nmax};
+    hsize_t _count[2] = {1, ctx->Nmax};
+    hsize_t _data_rank = 1;
+    hsize_t _data_count[1] = {ctx->Nmax};
+    write_to_hdf5(ctx->_contents, buf->fft_real, _offset, _count, _data_rank, _data_count);
+    _offset[0] = 1;
+    write_to_hdf5(ctx->_contents, buf->fft_imag, _offset, _count, _data_rank, _data_count);
+}
+
+// Position of the even terms of butterfly unit u in the temporary file
+static hsize_t
+fft_butterfly_offset (struct fft_memory_ctx *ctx, long int u)
+{
+    int i_pyramid = u / ctx->n_mem_units;
+    int j = u % ctx->n_mem_units;
+    return (j + 2*i_pyramid*ctx->n_mem_units)*(hsize_t)ctx->Nmax;
+}
+
+static void
+fft_butterfly_load (void *_ctx, long int u, void *_buf)
+{
+    struct fft_memory_ctx *ctx = (struct fft_memory_ctx*) _ctx;
+    struct fft_butterfly_buffer *buf = (struct fft_butterfly_buffer*) _buf;
+
+    // Load even terms
+    hsize_t offset[2] = {0, fft_butterfly_offset(ctx, u)};
+    hsize_t count[2] = {1, ctx->Nmax};
+    hsize_t data_rank = 1;
+    hsize_t data_count[1] = {ctx->Nmax};
+    read_from_dataset(ctx->_contents, offset, count, data_rank, data_count, buf->even_real);
+    offset[0] = 1;
+    read_from_dataset(ctx->_contents, offset, count, data_rank, data_count, buf->even_imag);
+
+    // Load odd terms
+    offset[1] += ctx->n_mem_units*ctx->Nmax;
+    read_from_dataset(ctx->_contents, offset, count, data_rank, data_count, buf->odd_imag);
+    offset[0] = 0;
+    read_from_dataset(ctx->_contents, offset, count, data_rank, data_count, buf->odd_real);
+}
+
+// Combine even and odd terms in place: even <- even + w*odd, odd <- even - w*odd
+static void
+fft_butterfly_compute (void *_ctx, long int u, void *_buf)
+{
+    struct fft_memory_ctx *ctx = (struct fft_memory_ctx*) _ctx;
+    struct fft_butterfly_buffer *buf = (struct fft_butterfly_buffer*) _buf;
+    int j = u % ctx->n_mem_units;
+
+    // exp term of element k is exp(-i 2 pi (j*Nmax + k) / L): one sin/cos for the
+    // unit offset j*Nmax, times the fine table entry of k
+    double unit_angle = 2.0 * M_PI * (j*(long int)ctx->Nmax) / ((double) ctx->Nfft_over_two_n_depth);
+    double unit_cos = cos(unit_angle);
+    double unit_sin = sin(unit_angle);
+    for (int k = 0; k < ctx->Nmax; k++) {
+        // Piecewise (complex) multiply odd terms with exp term
+        double tw_cos = ctx->tw->cos[k*ctx->tw_stride];
+        double tw_sin = ctx->tw->sin[k*ctx->tw_stride];
+        double y = unit_cos*tw_cos - unit_sin*tw_sin;
+        double x = -(unit_sin*tw_cos + unit_cos*tw_sin);
+        double a = buf->odd_imag[k];
+        double b = buf->odd_real[k];
+        double odd_real = b*y - a*x;
+        double odd_imag = a*y + b*x;
+
+        double even_real = buf->even_real[k];
+        double even_imag = buf->even_imag[k];
+        buf->even_real[k] = even_real + odd_real;
+        buf->even_imag[k] = even_imag + odd_imag;
+        buf->odd_real[k] = even_real - odd_real;
+        buf->odd_imag[k] = even_imag - odd_imag;
+    }
+}
+
+static void
+fft_butterfly_store (void *_ctx, long int u, void *_buf)
+{
+    struct fft_memory_ctx *ctx = (struct fft_memory_ctx*) _ctx;
+    struct fft_butterfly_buffer *buf = (struct fft_butterfly_buffer*) _buf;
+
+    // Left side
+    hsize_t offset[2] = {0, fft_butterfly_offset(ctx, u)};
+    hsize_t count[2] = {1, ctx->Nmax};
+    hsize_t data_rank = 1;
+    hsize_t data_count[1] = {ctx->Nmax};
+    write_to_hdf5(ctx->_contents, buf->even_real, offset, count, data_rank, data_count);
+    offset[0] = 1;
+    write_to_hdf5(ctx->_contents, buf->even_imag, offset, count, data_rank, data_count);
+
+    // Right side
+    offset[1] += ctx->n_mem_units*ctx->Nmax;
+    write_to_hdf5(ctx->_contents, buf->odd_imag, offset, count, data_rank, data_count);
+    offset[0] = 0;
+    write_to_hdf5(ctx->_contents, buf->odd_real, offset, count, data_rank, data_count);
+}
+
+
+// Name of the temporary file <tmp_prefix><name>.h5; worker processes add their index
+static void
+tmp_file_name (struct lpsd_state *st, char *fn, const char *name)
+{
+  if (st->worker_index < 0) snprintf (fn, FNLEN, "%s%s.h5", st->tmp_prefix, name);
+  else snprintf (fn, FNLEN, "%s%s.%d.h5", st->tmp_prefix, name, st->worker_index);
+}
+
+// Remove temporary file fn when an error returns to a trap (push_cleanup)
+static void
+remove_tmp_file (void *fn)
+{
+  unlink ((const char*) fn);
+}
+
+static void
+release_twiddles (void *tw)
+{
+  twiddle_release ((const struct twiddle_table*) tw);
+}
+
+static void
+release_interp_plan (void *plan)
+{
+  free_interp_plan ((struct interp_plan*) plan);
+}
+
+// Rearrange the segment of a chunked input into a temporary file whose row r holds samples
+// r, r + 2^n_depth, r + 2*2^n_depth, ..., read in contiguous pieces of Nmax samples. Strided
+// reads from the input would decode every chunk of the segment once per bottom-layer unit;
+// this way each chunk is decoded once per segment.
+static void
+transpose_segment (struct fft_memory_ctx *ctx, struct hdf5_contents *strided_contents)
+{
+    long int stride = ctx->two_to_n_depth;
+    long int cols = ctx->Nj0_over_two_n_depth + 1;
+    long int block = ctx->Nmax > stride ? ctx->Nmax / stride * stride : stride;
+    hsize_t dims[2] = {stride, cols};
+    open_hdf5_file(strided_contents, (char*) ctx->strided_fn, "segment", 2, dims);
+
+    struct buffer_set bufs;
+    buffers_init(&bufs);
+    double *in = (double*) buffers_alloc(&bufs, block*sizeof(double));
+    double *out = (double*) buffers_alloc(&bufs, block*sizeof(double));
+    for (long int b0 = 0; b0 < ctx->Nj0; b0 += block) {
+        long int n = ctx->Nj0 - b0 < block ? ctx->Nj0 - b0 : block;
+        long int bcols = (n + stride - 1) / stride;
+        hsize_t offset[1] = {ctx->segment_offset + b0}, count[1] = {n};
+        read_from_dataset(ctx->contents, offset, count, 1, count, in);
+        for (long int r = 0; r < stride; r++)
+            for (long int k = 0; k < bcols; k++)
+                out[r*bcols + k] = k*stride + r < n ? in[k*stride + r] : 0;
+        hsize_t _offset[2] = {0, b0 / stride}, _count[2] = {stride, bcols};
+        write_to_hdf5(strided_contents, out, _offset, _count, 2, _count);
+    }
+    buffers_free(&bufs);
+}
 
 // Perform an FFT while controlling how much gets in memory by manually calculating the
 // top layers of the pyramid over sums
+// The units of each pyramid level are independent: they run through a load/compute/store
+// pipeline with nthreads compute threads, which keeps (nthreads + 2) units in memory.
+// A chunked input is rearranged in the temporary file strided_fn first (transpose_segment).
 void
 FFT_control_memory(long int Nj0, long int Nfft, int Nmax, int segment_offset, struct hdf5_contents *contents,
-                   struct hdf5_contents *window_contents, struct hdf5_contents *_contents)
+                   struct hdf5_contents *window_contents, struct hdf5_contents *_contents,
+                   const char *strided_fn, int nthreads, struct pipeline_stats *stats)
 {
     // Determine manual recursion depth
     // Nfft and Nmax must be powers of two!!
     int n_depth = round(log2(Nfft) - log2(Nmax));  // use round() to avoid float precision trouble
+    int n_buffers = nthreads + 2;
 
     // Get 2^n_depth data samples, then iteratively work down to n = 1
-    int two_to_n_depth = pow(2, n_depth);
-    long int Nj0_over_two_n_depth = Nj0 / two_to_n_depth;  // +1
-    int ordered_coefficients[two_to_n_depth];
-    fill_ordered_coefficients(n_depth, ordered_coefficients);
-
-    // Approx (5 * 16 * Nmax) bits in memory
-    double *data_subset_real = (double*)malloc(Nmax*sizeof(double));
-    double *data_subset_imag = (double*)malloc(Nmax*sizeof(double));
-    memset(data_subset_imag, 0, Nmax*sizeof(double));
-    double *fft_output_real = (double*)malloc(Nmax*sizeof(double));
-    double *fft_output_imag = (double*)malloc(Nmax*sizeof(double));
-    double *window_subset = (double*)malloc((Nj0_over_two_n_depth+1)*sizeof(double));
+    struct fft_memory_ctx ctx;
+    ctx.Nj0 = Nj0;
+    ctx.Nfft = Nfft;
+    ctx.Nmax = Nmax;
+    ctx.segment_offset = segment_offset;
+    ctx.contents = contents;
+    ctx.window_contents = window_contents;
+    ctx._contents = _contents;
+    ctx.two_to_n_depth = pow(2, n_depth);
+    ctx.Nj0_over_two_n_depth = Nj0 / ctx.two_to_n_depth;  // +1
+    struct buffer_set bufs;
+    buffers_init(&bufs);
+    ctx.ordered_coefficients = (int*) buffers_alloc(&bufs, ctx.two_to_n_depth*sizeof(int));
+    fill_ordered_coefficients(n_depth, ctx.ordered_coefficients);
+
+    // Chunked input that does not fit the chunk cache is rearranged first
+    struct hdf5_contents strided_contents;
+    struct error_cleanup strided_cleanup;
+    ctx.strided_contents = NULL;
+    ctx.strided_fn = strided_fn;
+    if (contents->chunk_bytes > 0 && Nj0 * contents->sample_size > contents->cache_bytes) {
+        push_cleanup(&strided_cleanup, remove_tmp_file, (void*) strided_fn);
+        transpose_segment(&ctx, &strided_contents);
+        ctx.strided_contents = &strided_contents;
+    }
 
-    // Perform FFTs on bottom layer of pyramid and save results to temporary file
-    for (int i = 0; i < two_to_n_depth; i++) {
-        // Read data
-        hsize_t offset[1] = {ordered_coefficients[i] + segment_offset};
-        int Ndata = ordered_coefficients[i] + Nj0_over_two_n_depth*two_to_n_depth < Nj0 ?
-            Nj0_over_two_n_depth + 1 : Nj0_over_two_n_depth;
-        hsize_t count[1] = {Ndata};
-        hsize_t stride[1] = {two_to_n_depth};
-        hsize_t rank = 1;
-        read_from_dataset_stride(contents, offset, count, stride, rank, count, data_subset_real);
-
-        // Zero-pad data
-        for (int j = Ndata; j < Nmax; j++) data_subset_real[j] = 0;
-
-        // Read window & apply to data (piecewise multiply)
-        hsize_t window_offset[1] = {ordered_coefficients[i]};
-        read_from_dataset_stride(window_contents, window_offset, count, stride, rank, count, window_subset);
-        for (int j = 0; j < Ndata; j++) data_subset_real[j] *= window_subset[j];
-
-        // Take FFT
-        FFT(data_subset_real, data_subset_imag, Nmax, fft_output_real, fft_output_imag);
-
-        // Save real part to file
-        hsize_t _offset[2] = {0, i*Nmax};
-        hsize_t _count[2] = {1, Nmax};
-        hsize_t _data_rank = 1;
-        hsize_t _data_count[1] = {Nmax};
-        write_to_hdf5(_contents, fft_output_real, _offset, _count, _data_rank, _data_count);
-        // Save imaginary part
-        _offset[0] = 1;
-        write_to_hdf5(_contents, fft_output_imag, _offset, _count, _data_rank, _data_count);
-        // Note: if I saved real/imag in one 2D array instead of two arrays,
-        // I would only need one call to write_to_hdf5 in this loop. Could save time?
+    // Approx (5 * 8 * Nmax) bytes in memory per buffer
+    struct fft_leaf_buffer leaves[n_buffers];
+    void *leaf_ptrs[n_buffers];
+    for (int b = 0; b < n_buffers; b++) {
+        leaves[b].data_real = (double*) buffers_alloc(&bufs, Nmax*sizeof(double));
+        leaves[b].data_imag = (double*) buffers_alloc(&bufs, Nmax*sizeof(double));
+        memset(leaves[b].data_imag, 0, Nmax*sizeof(double));
+        leaves[b].fft_real = (double*) buffers_alloc(&bufs, Nmax*sizeof(double));
+        leaves[b].fft_imag = (double*) buffers_alloc(&bufs, Nmax*sizeof(double));
+        leaves[b].window = (double*) buffers_alloc(&bufs, (ctx.Nj0_over_two_n_depth+1)*sizeof(double));
+        leaf_ptrs[b] = &leaves[b];
     }
+
+    // Perform FFTs on bottom layer of pyramid and save results to temporary file
+    run_pipeline(ctx.two_to_n_depth, n_buffers, nthreads, leaf_ptrs,
+                 fft_leaf_load, fft_leaf_compute, fft_leaf_store, &ctx, stats);
+
     // Clean-up
-    free(data_subset_real);
-    free(data_subset_imag);
-    free(window_subset);
-    free(fft_output_real);
-    free(fft_output_imag);
+    buffers_free(&bufs);
+    if (ctx.strided_contents) {
+        pop_cleanup(&strided_cleanup);
+        close_hdf5_contents(ctx.strided_contents);
+        unlink(strided_fn);
+    }
 
     // TODO: don't need to write the last iteration of the pyramid to file as I could work with it here directly, small speed-up
-    // Put 5 * 16 * Nmax bits in memory
-    double *even_terms_real = (double*)malloc(Nmax*sizeof(double));
-    double *even_terms_imag = (double*)malloc(Nmax*sizeof(double));
-    double *odd_terms_real = (double*)malloc(Nmax*sizeof(double));
-    double *odd_terms_imag = (double*)malloc(Nmax*sizeof(double));
-    double *write_vector = (double*)malloc(Nmax*sizeof(double));
+    // Put 4 * 8 * Nmax bytes in memory per buffer
+    struct fft_butterfly_buffer butterflies[n_buffers];
+    void *butterfly_ptrs[n_buffers];
+    buffers_init(&bufs);
+    for (int b = 0; b < n_buffers; b++) {
+        butterflies[b].even_real = (double*) buffers_alloc(&bufs, Nmax*sizeof(double));
+        butterflies[b].even_imag = (double*) buffers_alloc(&bufs, Nmax*sizeof(double));
+        butterflies[b].odd_real = (double*) buffers_alloc(&bufs, Nmax*sizeof(double));
+        butterflies[b].odd_imag = (double*) buffers_alloc(&bufs, Nmax*sizeof(double));
+        butterfly_ptrs[b] = &butterflies[b];
+    }
     // Now loop over the rest of the pyramid
     while (n_depth > 0) {
         // Iterate n_depth
         n_depth--;
-        two_to_n_depth = pow(2, n_depth);
-        Nj0_over_two_n_depth = floor(Nj0 / two_to_n_depth);
+        int two_to_n_depth = pow(2, n_depth);
         int Nfft_over_two_n_depth = round(Nfft / two_to_n_depth);
         // Number of memory units in lower-level pyramid segment
-        int n_mem_units = pow(2, (int)round(log2(Nfft) - log2(Nmax) - n_depth - 1));
-
-        // Loop over segments at this pyramid level
-        for (int i_pyramid = 0; i_pyramid < two_to_n_depth; i_pyramid++) {
-            // Loop over memory units (of length Nmax) in one lower-level segment
-            for (int j = 0; j < n_mem_units; j++) {
-                // Load even terms
-                hsize_t offset[2] = {0, (j + 2*i_pyramid*n_mem_units)*Nmax};
-                hsize_t count[2] = {1, Nmax};
-                hsize_t data_rank = 1;
-                hsize_t data_count[1] = {Nmax};
-                read_from_dataset(_contents, offset, count, data_rank, data_count, even_terms_real);
-                offset[0] = 1;
-                read_from_dataset(_contents, offset, count, data_rank, data_count, even_terms_imag);
-
-                // Load odd terms
-		        offset[1] += n_mem_units*Nmax;
-                read_from_dataset(_contents, offset, count, data_rank, data_count, odd_terms_imag);
-                offset[0] = 0;
-                read_from_dataset(_contents, offset, count, data_rank, data_count, odd_terms_real);
-
-                // Piecewise (complex) multiply odd terms with exp term
-                double exp_factor = 2.0 * M_PI / ((double) Nfft_over_two_n_depth);
-                for (int k = 0; k < Nmax; k++) {
-                    double y = cos((j*Nmax+k)*exp_factor);
-                    double x = -sin((j*Nmax+k)*exp_factor);
-                    double a = odd_terms_imag[k];
-                    double b = odd_terms_real[k];
-                    odd_terms_real[k] = b*y - a*x;
-                    odd_terms_imag[k] = a*y + b*x;
-                }
-
-                // Combine left side
-                for (int k = 0; k < Nmax; k++)
-                    write_vector[k] = even_terms_real[k] + odd_terms_real[k];
-		        hsize_t offset_left[2] = {0, (j + 2*i_pyramid*n_mem_units)*Nmax};
-                write_to_hdf5(_contents, write_vector, offset_left, count, data_rank, data_count);
-                for (int k = 0; k < Nmax; k++)
-                    write_vector[k] = even_terms_imag[k] + odd_terms_imag[k];
-                offset_left[0] = 1;
-                write_to_hdf5(_contents, write_vector, offset_left, count, data_rank, data_count);
-
-                // Combine right side
-                for (int k = 0; k < Nmax; k++)
-                    write_vector[k] = even_terms_real[k] - odd_terms_real[k];
-                hsize_t offset_right[2] = {0, (j + (2*i_pyramid + 1)*n_mem_units)*Nmax};
-                write_to_hdf5(_contents, write_vector, offset_right, count, data_rank, data_count);
-                for (int k = 0; k < Nmax; k++)
-                    write_vector[k] = even_terms_imag[k] - odd_terms_imag[k];
-                offset_right[0] = 1;
-                write_to_hdf5(_contents, write_vector, offset_right, count, data_rank, data_count);
-	        }
-        }
+        ctx.n_mem_units = pow(2, (int)round(log2(Nfft) - log2(Nmax) - n_depth - 1));
+        ctx.Nfft_over_two_n_depth = Nfft_over_two_n_depth;
+        ctx.tw = twiddle_get(Nfft_over_two_n_depth, Nmax, &ctx.tw_stride);
+        struct error_cleanup tw_cleanup;
+        push_cleanup(&tw_cleanup, release_twiddles, (void*) ctx.tw);
+
+        // Loop over segments at this pyramid level and memory units (of length Nmax)
+        // in one lower-level segment
+        run_pipeline(two_to_n_depth * ctx.n_mem_units, n_buffers, nthreads, butterfly_ptrs,
+                     fft_butterfly_load, fft_butterfly_compute, fft_butterfly_store, &ctx, stats);
+        pop_cleanup(&tw_cleanup);
+        twiddle_release(ctx.tw);
     }
     // Clean up
-    free(even_terms_real);
-    free(even_terms_imag);
-    free(odd_terms_real);
-    free(odd_terms_imag);
-    free(write_vector);
+    buffers_free(&bufs);
+}
+
+// Index of the first bin after the block that starts at j0, i.e. the frequency up to which
+// the segment length of bin j0 is within a factor (1 - epsilon) of the exact one
+static long int
+get_block_end (tCFG * cfg, long int j0, double epsilon)
+{
+    double g = log(cfg->fmax / cfg->fmin);
+    long int Nj0 = get_N_j(j0, cfg->fsamp, cfg->fmin, cfg->fmax, cfg->Jdes);
+    long int j = - (cfg->Jdes - 1.) / g * log(Nj0*(1. - epsilon) * cfg->fmin/cfg->fsamp * (exp(g / (cfg->Jdes - 1.)) - 1.));
+    if (j > cfg->Jdes) j = cfg->Jdes;
+    if (j <= j0) j = j0 + 1;  /* at least one bin per block */
+    return j;
+}
+
+// Relative PSD error of the METHOD 1 block [j0, j1) on NPROBE of its bins, the last one
+// (where the segment length is furthest from the exact one) and bins spread before it.
+// The block's result is formed as calculate_block does: the FFT bins of its zero-padded
+// segments of length Nj0 (DFTs at bins k * Nj0 / Nfft) combined by the interpolation plan,
+// compared with exact DFTs.
+static double
+probe_block_error (struct lpsd_state *st, tCFG * cfg, long int j0, long int j1,
+                   struct hdf5_contents *contents)
+{
+    long int Nj0 = get_N_j(j0, cfg->fsamp, cfg->fmin, cfg->fmax, cfg->Jdes);
+    long int Nfft = get_next_power_of_two(Nj0);
+    long int nread = st->nread;
+    int nsum = dft_nsum(nread, Nj0, cfg->ovlp);
+    double winsum, winsum2, max_err = 0;
+    struct interp_plan plan;
+    struct error_cleanup plan_cleanup;
+    struct buffer_set bufs;
+    int p, t, s;
+
+    buffers_init(&bufs);
+    for (p = 0; p < NPROBE; p++) {
+        long int js = j1 - 1 - p * (j1 - j0 - 1) / NPROBE;
+        double f = get_f_j(js, cfg->fmin, cfg->fmax, cfg->Jdes);
+        long int Nj = get_N_j(js, cfg->fsamp, cfg->fmin, cfg->fmax, cfg->Jdes);
+        double exact = 0, approx = 0, re, im, psd;
+
+        // Exact DFTs
+        int nsum_exact = dft_nsum(nread, Nj, cfg->ovlp);
+        double *dft = (double*) buffers_alloc(&bufs, 2*nsum_exact*sizeof(double));
+        dft_segments(st, Nj, f * Nj / cfg->fsamp, cfg->ovlp, nread, nsum_exact, contents, dft, &winsum, &winsum2);
+        for (s = 0; s < nsum_exact; s++) exact += dft[s*2]*dft[s*2] + dft[s*2+1]*dft[s*2+1];
+        exact /= nsum_exact * winsum2;
+        buffers_release(&bufs, dft);
+
+        // FFT bins used by the interpolator, then interpolated segment by segment
+        make_interp_plan(&plan, cfg->interp, Nfft, cfg->fsamp, &f, 1);
+        push_cleanup(&plan_cleanup, release_interp_plan, &plan);
+        double *taps = (double*) buffers_alloc(&bufs, 2*nsum*plan.ntaps*sizeof(double));
+        double *tap_real = (double*) buffers_alloc(&bufs, plan.ntaps*sizeof(double));
+        double *tap_imag = (double*) buffers_alloc(&bufs, plan.ntaps*sizeof(double));
+        for (t = 0; t < plan.ntaps; t++)
+            dft_segments(st, Nj0, (double) (plan.k0[0] + t) * Nj0 / Nfft, cfg->ovlp, nread, nsum,
+                         contents, &taps[2*nsum*t], &winsum, &winsum2);
+        for (s = 0; s < nsum; s++) {
+            for (t = 0; t < plan.ntaps; t++) {
+                tap_real[t] = taps[2*nsum*t + s*2];
+                tap_imag[t] = taps[2*nsum*t + s*2 + 1];
+            }
+            interp_bin(&plan, 0, tap_real, tap_imag, plan.k0[0], &re, &im, &psd);
+            approx += psd;
+        }
+        approx /= nsum * winsum2;
+        pop_cleanup(&plan_cleanup);
+        free_interp_plan(&plan);
+        buffers_release(&bufs, tap_imag);
+        buffers_release(&bufs, tap_real);
+        buffers_release(&bufs, taps);
+
+        if (exact > 0 && fabs(approx - exact) / exact > max_err) max_err = fabs(approx - exact) / exact;
+    }
+    buffers_free(&bufs);
+    return max_err;
+}
+
+// Block b of the NPROBE_BLOCKS blocks of width epsilon spread over region [jr, jr_end)
+// that probe its error; returns 0 if it has a single bin, which says nothing about the width
+static int
+get_probe_block (tCFG * cfg, long int jr, long int jr_end, int b, double epsilon, long int *j0, long int *j1)
+{
+    *j0 = jr + (2*b + 1) * (jr_end - jr) / (2*NPROBE_BLOCKS);
+    *j1 = get_block_end(cfg, *j0, epsilon);
+    if (*j1 > jr_end) *j1 = jr_end;
+    return *j1 - *j0 > 1;
+}
+
+// Largest relative error of the probe blocks of the region with more than one bin
+static double
+estimate_region_error (struct lpsd_state *st, tCFG * cfg, long int jr, long int jr_end, double epsilon,
+                       struct hdf5_contents *contents)
+{
+    double err, max_err = 0;
+    long int j0, j1;
+    for (int b = 0; b < NPROBE_BLOCKS; b++) {
+        if (!get_probe_block(cfg, jr, jr_end, b, epsilon, &j0, &j1)) continue;
+        err = probe_block_error(st, cfg, j0, j1, contents);
+        if (err > max_err) max_err = err;
+    }
+    return max_err;
+}
+
+// Whether a block of the region of width epsilon has more than one bin and can be probed
+static int
+region_can_be_probed (tCFG * cfg, long int jr, long int jr_end, double epsilon)
+{
+    long int j0, j1;
+    for (int b = 0; b < NPROBE_BLOCKS; b++)
+        if (get_probe_block(cfg, jr, jr_end, b, epsilon, &j0, &j1)) return 1;
+    return 0;
+}
+
+// @brief Split the spectrum into METHOD 1 blocks, stored in data->blocks
+// @brief With cfg->max_rel_error > 0, each of NREGIONS frequency regions gets the widest
+// @brief block (largest epsilon) whose probed error stays within the target, which
+// @brief minimises the number of FFTs. Otherwise cfg->epsilon is used everywhere.
+static void
+make_block_plan (struct lpsd_state *st, tCFG * cfg, tDATA * data, struct hdf5_contents *contents)
+{
+    static const double candidates[] = {0.5, 0.35, 0.25, 0.15, 0.1, 0.07, 0.05, 0.03, 0.02, 0.01};
+    const int ncandidates = sizeof(candidates) / sizeof(double);
+    double region_eps[NREGIONS], region_err[NREGIONS];
+    int r, nregions = cfg->Jdes < NREGIONS ? 1 : NREGIONS;
+    long int j0;
+
+    for (r = 0; r < nregions; r++) {
+        region_eps[r] = cfg->epsilon;
+        region_err[r] = -1;
+    }
+    if (cfg->max_rel_error > 0) {
+        printf ("Choosing block widths for max. relative error %g\n", cfg->max_rel_error);
+        for (r = 0; r < nregions; r++) {
+            long int jr = r * (long int) cfg->Jdes / nregions;
+            long int jr_end = (r + 1) * (long int) cfg->Jdes / nregions;
+            // Candidates whose blocks have more than one bin; narrower ones cannot be probed
+            int n = 0;
+            while (n < ncandidates && region_can_be_probed(cfg, jr, jr_end, candidates[n])) n++;
+            if (n == 0) {
+                printf ("  WARNING: region %d has blocks of single bins, using epsilon %g\n", r, region_eps[r]);
+                continue;
+            }
+            // Binary search for the largest epsilon within the target, assuming the error
+            // grows with the block width
+            int lo = 0, hi = n - 1;
+            double err_hi = estimate_region_error(st, cfg, jr, jr_end, candidates[hi], contents);
+            if (err_hi > cfg->max_rel_error) {
+                printf ("  WARNING: region %d cannot reach the target, using epsilon %g\n", r, candidates[hi]);
+                lo = hi;
+            }
+            while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                double err = estimate_region_error(st, cfg, jr, jr_end, candidates[mid], contents);
+                if (err <= cfg->max_rel_error) {
+                    hi = mid;
+                    err_hi = err;
+                } else lo = mid + 1;
+            }
+            region_eps[r] = candidates[hi];
+            region_err[r] = err_hi;
+            printf ("  region %d (from bin %ld, %.3e Hz): epsilon %g, probed rel. error %.2e\n", r, jr,
+                    get_f_j(jr, cfg->fmin, cfg->fmax, cfg->Jdes), region_eps[r], region_err[r]);
+        }
+    }
+
+    // Count, then fill the blocks of this partition; they start at its first bin and are the
+    // same as in a run over all bins if that is a block boundary there
+    long int jend = cfg->jfirst + cfg->nspec;
+    data->nblocks = 0;
+    for (j0 = cfg->jfirst; j0 < jend; data->nblocks++)
+        j0 = get_block_end(cfg, j0, region_eps[j0 * nregions / cfg->Jdes]);
+    data->blocks = (tBLOCK*) xmalloc(data->nblocks*sizeof(tBLOCK));
+    j0 = cfg->jfirst;
+    for (int b = 0; b < data->nblocks; b++) {
+        r = j0 * nregions / cfg->Jdes;
+        data->blocks[b].j0 = j0;
+        data->blocks[b].j1 = get_block_end(cfg, j0, region_eps[r]);
+        if (data->blocks[b].j1 > jend) data->blocks[b].j1 = jend;
+        data->blocks[b].nfft = get_N_j(j0, cfg->fsamp, cfg->fmin, cfg->fmax, cfg->Jdes);
+        data->blocks[b].epsilon = region_eps[r];
+        data->blocks[b].err = region_err[r];
+        data->blocks[b].method = 1;
+        data->blocks[b].cost_exact = data->blocks[b].cost_fft = -1;
+        j0 = data->blocks[b].j1;
+    }
+}
+
+
+// @brief Largest FFT length (power of two) that is computed in memory
+// @brief An in-core FFT keeps 4 arrays of Nfft doubles, its twiddle table (twiddle.c) of
+// @brief Nfft/2 cos and sin values, the window and PREFETCH_BUFFERS read-ahead segments of
+// @brief up to Nfft samples each
+static int
+get_max_samples_in_memory (tCFG * cfg)
+{
+    double max_samples = cfg->memory_budget * 1024. * 1024. / ((4 + 1 + 1 + PREFETCH_BUFFERS) * sizeof(double));
+    long int n = 1;
+    // Whatever the value of max is, make it less than 2^31 or ints will break
+    while (2*n <= max_samples && 2*n <= 1073741824) n *= 2;
+    return n;
+}
+
+// @brief Length (power of two) of the memory units of an out-of-core FFT
+// @brief Its pipeline keeps nthreads + 2 units in memory (one read, nthreads transformed, one
+// @brief written back) of 5 arrays of Nmax doubles each (struct fft_leaf_buffer), and the
+// @brief twiddle table of Nmax cos and sin values
+static int
+get_ooc_unit (tCFG * cfg)
+{
+    double max_samples = cfg->memory_budget * 1024. * 1024. / ((5 * (cfg->nthreads + 2) + 2) * sizeof(double));
+    int max = get_max_samples_in_memory (cfg);
+    int n = 1;
+    while (2*n <= max_samples && 2*n <= max) n *= 2;
+    return n;
+}
+
+// @brief Number of averaged segments of length nfft in nread samples
+int
+get_n_segments (long int nread, long int nfft, double ovlp)
+{
+    int delta_segment = floor(nfft * (1.0 - (double) (ovlp / 100.)));
+    int n_segments = floor(1 + (nread - nfft) / delta_segment);
+    /* Adjust for edge case */
+    long int tmp = (n_segments - 1)*delta_segment + nfft;
+    if (tmp == nread) n_segments--;
+    return n_segments;
+}
+
+// Estimated cost of the exact DFT of bin j (see estimate_block_cost)
+static double
+get_bin_cost_exact (tCFG * cfg, long int nread, long int j)
+{
+    long int Nj = get_N_j(j, cfg->fsamp, cfg->fmin, cfg->fmax, cfg->Jdes);
+    int n_segments = get_n_segments(nread, Nj, cfg->ovlp);
+    return Nj * (COST_SINCOS + (n_segments > 0 ? n_segments : 0) * (COST_READ + 2.));
+}
+
+// @brief Estimated cost (in multiply-adds) of a block with both methods
+// @brief exact: per bin, one window with sin/cos terms, then one read and complex
+// @brief multiply-add per sample and segment (getDFT2)
+// @brief FFT: per segment, one read, one FFT (one sin/cos pair per butterfly) and the
+// @brief interpolation; out-of-core FFTs are slower by COST_OOC
+static void
+estimate_block_cost (tCFG * cfg, long int nread, tBLOCK * block, int max_samples_in_memory)
+{
+    long int js;
+    int ntaps = cfg->interp == INTERP_LINEAR ? 2 : (cfg->interp == INTERP_CUBIC ? 4 : 8);
+    long int Nfft = get_next_power_of_two(block->nfft);
+    double fft_cost = Nfft * log2(Nfft) * (COST_SINCOS / 2. + 4.);
+
+    block->cost_exact = 0;
+    for (js = block->j0; js < block->j1; js++) block->cost_exact += get_bin_cost_exact(cfg, nread, js);
+    if (Nfft > max_samples_in_memory) fft_cost *= COST_OOC;
+    block->cost_fft = get_n_segments(nread, block->nfft, cfg->ovlp) *
+        (block->nfft * (COST_READ + 1.) + fft_cost + 4. * ntaps * (block->j1 - block->j0));
+}
+
+// @brief METHOD 2: choose the cheaper method for every block of the plan
+// @brief Exact DFTs win where bins are sparse (few bins share a segment length) or the FFT
+// @brief would run out of core, the FFT approximation where many bins share one FFT
+static void
+choose_block_methods (tCFG * cfg, long int nread, tDATA * data, int max_samples_in_memory)
+{
+    double cost_exact = 0, cost_fft = 0, cost_hybrid = 0;
+    long int bins_exact = 0;
+    int b, n_exact = 0;
+
+    for (b = 0; b < data->nblocks; b++) {
+        tBLOCK *block = &data->blocks[b];
+        estimate_block_cost(cfg, nread, block, max_samples_in_memory);
+        block->method = block->cost_exact < block->cost_fft ? 0 : 1;
+        cost_exact += block->cost_exact;
+        cost_fft += block->cost_fft;
+        cost_hybrid += block->method == 0 ? block->cost_exact : block->cost_fft;
+        if (block->method == 0) {
+            n_exact++;
+            bins_exact += block->j1 - block->j0;
+        }
+    }
+    printf ("Hybrid plan: %d of %d blocks (%ld of %ld bins) exact, the rest FFT\n",
+            n_exact, data->nblocks, bins_exact, cfg->nspec);
+    printf ("Estimated cost relative to METHOD 0: %.3f (METHOD 1: %.3f)\n",
+            cost_hybrid / cost_exact, cost_fft / cost_exact);
+}
+
+
+// In-core FFT of the segments of one block; the next segment is read while the
+// current one is transformed and interpolated
+struct segment_ctx {
+    struct hdf5_contents *contents;
+    long int Nj0, Nfft;
+    int delta_segment;
+    const double *window;
+    double *data_real, *data_imag, *fft_real, *fft_imag;
+    struct interp_plan *plan;
+    const double *freqs;
+    double fsamp;
+    int nbins;
+    double *total, *total_real, *total_imag;
+    double interp_err, interp_norm;
+};
+
+static void
+segment_load (void *_ctx, long int i_segment, void *buf)
+{
+    struct segment_ctx *ctx = (struct segment_ctx*) _ctx;
+    hsize_t offset[1] = {i_segment*ctx->delta_segment};
+    hsize_t count[1] = {ctx->Nj0};
+    hsize_t data_rank = 1;
+    read_from_dataset(ctx->contents, offset, count, data_rank, count, (double*) buf);
 }
 
+static void
+segment_compute (void *_ctx, long int i_segment, void *buf)
+{
+    struct segment_ctx *ctx = (struct segment_ctx*) _ctx;
+    const double *segment = (const double*) buf;
+    long int i;
+
+    for (i = 0; i < ctx->Nj0; i++) ctx->data_real[i] = segment[i] * ctx->window[i];
+    FFT(ctx->data_real, ctx->data_imag, ctx->Nfft, ctx->fft_real, ctx->fft_imag);
+    apply_interp_plan(ctx->plan, ctx->fft_real, ctx->fft_imag, 0, ctx->total, ctx->total_real, ctx->total_imag);
+
+    // Compare the middle bin of the first segment to the directly evaluated DFT
+    if (i_segment == 0) {
+        int mid = ctx->nbins / 2;
+        double re, im, psd, exact_re = 0, exact_im = 0;
+        double arg = 2.0 * M_PI * ctx->freqs[mid] / ctx->fsamp;
+        for (i = 0; i < ctx->Nj0; i++) {
+            exact_re += ctx->data_real[i] * cos(arg * i);
+            exact_im -= ctx->data_real[i] * sin(arg * i);
+        }
+        interp_bin(ctx->plan, mid, ctx->fft_real, ctx->fft_imag, 0, &re, &im, &psd);
+        ctx->interp_err += fabs(psd - exact_re*exact_re - exact_im*exact_im);
+        ctx->interp_norm += exact_re*exact_re + exact_im*exact_im;
+    }
+}
+
+// @brief Calculate block i_block of data->blocks into data and the journal
+// @brief With METHOD 2, a block of method 0 is calculated with exact DFTs
+static void
+calculate_block (struct lpsd_ctx *ctx, int i_block)
+{
+    struct lpsd_state *st = ctx->st;
+    tCFG *cfg = ctx->cfg;
+    tDATA *data = ctx->data;
+    struct hdf5_contents *contents = &ctx->contents;
+    long int jfirst = ctx->jfirst;
+    int max_samples_in_memory = ctx->max_samples_in_memory;
+    char tmp_fn[FNLEN], window_fn[FNLEN], strided_fn[FNLEN];
+    double winsum, winsum2, nenbw;
+    register int i, ji;
+    int j, j0;
+
+    // Block goes from index j0 to j
+    j0 = data->blocks[i_block].j0;
+    j = data->blocks[i_block].j1;
+    long int Nj0 = data->blocks[i_block].nfft;
+    tmp_file_name(st, tmp_fn, "tmp");
+    tmp_file_name(st, window_fn, "window");
+    tmp_file_name(st, strided_fn, "strided");
+
+    // Skip blocks restored from the journal
+    for (ji = j0; ji < j && journal_done(&st->jrnl, ji - jfirst); ji++);
+    if (ji == j) return;
+
+    if (data->blocks[i_block].method == 0) {
+        // Exact DFT for every bin of the block
+        for (ji = j0 - jfirst; ji < j - jfirst; ji++)
+            if (!journal_done(&st->jrnl, ji)) calculate_bin_exact(ctx, ji);
+        return;
+    }
+
+    // Prepare segment loop
+    int delta_segment = floor(Nj0 * (1.0 - (double) (cfg->ovlp / 100.)));
+    int n_segments = get_n_segments(st->nread, Nj0, cfg->ovlp);
+
+    // Allocate arrays used to store the results in between
+    struct buffer_set bufs;
+    buffers_init(&bufs);
+    double *total = (double*) buffers_alloc(&bufs, (j - j0)*sizeof(double));
+    double *total_real = (double*) buffers_alloc(&bufs, (j - j0)*sizeof(double));
+    double *total_imag = (double*) buffers_alloc(&bufs, (j - j0)*sizeof(double));
+    memset(total, 0, (j - j0)*sizeof(double));
+    memset(total_real, 0, (j - j0)*sizeof(double));
+    memset(total_imag, 0, (j - j0)*sizeof(double));
+
+    // Prepare FFT
+    long int Nfft = get_next_power_of_two(Nj0);
+    int Nmax = get_ooc_unit(cfg);
+    // Interpolation plan: FFT bins and weights of each frequency bin of the block
+    struct interp_plan plan;
+    struct error_cleanup plan_cleanup;
+    double *freqs = (double*) buffers_alloc(&bufs, (j - j0)*sizeof(double));
+    for (ji = j0; ji < j; ji++) freqs[ji - j0] = get_f_j(ji, ctx->band.fmin, ctx->band.fmax, cfg->Jdes);
+    make_interp_plan(&plan, cfg->interp, Nfft, cfg->fsamp, freqs, j - j0);
+    push_cleanup(&plan_cleanup, release_interp_plan, &plan);
+    // Relevant frequency range in full fft space
+    long int jfft_min = plan.kmin;
+    long int jfft_max = plan.kmax + 1;
+    if (Nfft > max_samples_in_memory && (jfft_min < 0 || jfft_max > Nfft))
+        gerror("Interpolation kernel reaches beyond the FFT range, use a smaller kernel.");
+
+    double *data_real, *data_imag, *fft_real, *fft_imag, *window;
+    data_real = data_imag = fft_real = fft_imag = window = NULL;
+    struct hdf5_contents _contents, window_contents;
+    struct hdf5_contents *_contents_ptr = NULL, *window_contents_ptr = NULL;
+    struct error_cleanup tmp_cleanup, window_cleanup;
+    // This if/else statement allocates variables for the steps to come
+    if (Nfft <= max_samples_in_memory) {
+        // For normal FFT
+        // Initialiase data/window arrays
+        data_real = (double*) buffers_alloc(&bufs, Nfft*sizeof(double));
+        data_imag = (double*) buffers_alloc(&bufs, Nfft*sizeof(double));
+        fft_real = (double*) buffers_alloc(&bufs, Nfft*sizeof(double));
+        fft_imag = (double*) buffers_alloc(&bufs, Nfft*sizeof(double));
+        memset(data_imag, 0, Nfft*sizeof(double));
+        for (i = Nj0; i < Nfft; i++) data_real[i] = 0;
+
+        // Calculate window
+        window = (double*) buffers_alloc(&bufs, Nj0*sizeof(double));
+        makewin(&st->win, Nj0, window, &winsum, &winsum2, &nenbw);
+    } else {
+        // For memory-controlled FFT
+        // Open temporary hdf5 file to temporarily store information to disk in the loop
+        hsize_t rank = 2;  // real + imaginary
+        hsize_t dims[2] = {2, Nfft};
+        _contents_ptr = &_contents;
+        push_cleanup(&tmp_cleanup, remove_tmp_file, tmp_fn);
+        open_hdf5_file(_contents_ptr, tmp_fn, "fft_contents", rank, dims);
+
+        // Initialise fft output, but only in relevant frequency range
+        fft_real = (double*) buffers_alloc(&bufs, (jfft_max - jfft_min)*sizeof(double));
+        fft_imag = (double*) buffers_alloc(&bufs, (jfft_max - jfft_min)*sizeof(double));
+
+        // Calculate window and put it in temporary file
+        hsize_t window_rank = 1;
+        hsize_t window_dims[1] = {Nj0};
+        window_contents_ptr = &window_contents;
+        push_cleanup(&window_cleanup, remove_tmp_file, window_fn);
+        open_hdf5_file(window_contents_ptr, window_fn, "window", window_rank, window_dims);
+
+        // Loop over Nmax segments to calculate window without exceeding max memory
+        window = (double*) buffers_alloc(&bufs, max_samples_in_memory*sizeof(double));
+        long int remaining_samples = Nj0;
+        int memory_unit_index = 0;
+        int iteration_samples;
+        while (remaining_samples > 0) {
+            // Calculate window
+            if (remaining_samples > max_samples_in_memory) iteration_samples = max_samples_in_memory;
+            else iteration_samples = remaining_samples;
+            makewin_indexed(&st->win, Nj0, memory_unit_index*max_samples_in_memory,
+                            iteration_samples, window,
+                            &winsum, &winsum2, &nenbw, memory_unit_index == 0);
+
+            // Save to file
+            hsize_t offset[1] = {memory_unit_index*max_samples_in_memory};
+            hsize_t count[1] = {iteration_samples};
+            write_to_hdf5(window_contents_ptr, window, offset, count, window_rank, count);
+
+            // Book-keeping
+            remaining_samples -= iteration_samples;
+            memory_unit_index++;
+        }
+        buffers_release(&bufs, window);
+        window = NULL;
+    }
+
+    register int i_segment;
+    // Loop over segments - this is the actual calculation step
+    if (Nfft <= max_samples_in_memory) {
+        // Run normal FFT
+        struct segment_ctx sctx = {contents, Nj0, Nfft, delta_segment, window,
+                                   data_real, data_imag, fft_real, fft_imag,
+                                   &plan, freqs, cfg->fsamp, j - j0,
+                                   total, total_real, total_imag, 0, 0};
+        double *segments[PREFETCH_BUFFERS];
+        for (i = 0; i < PREFETCH_BUFFERS; i++) segments[i] = (double*) buffers_alloc(&bufs, Nj0*sizeof(double));
+        run_pipeline(n_segments, PREFETCH_BUFFERS, 1, (void**) segments,
+                     segment_load, segment_compute, NULL, &sctx, &st->prefetch_stats);
+        ctx->totals[TOTAL_INTERP_ERR] += sctx.interp_err;
+        ctx->totals[TOTAL_INTERP_NORM] += sctx.interp_norm;
+        ctx->totals[TOTAL_FFTS] += n_segments;
+    } else for (i_segment = 0; i_segment < n_segments; i_segment++) {
+        // Run memory-controlled FFT, whose strided reads jump through the input
+        advise_access(contents, ACCESS_RANDOM);
+        FFT_control_memory(Nj0, Nfft, Nmax, i_segment*delta_segment,
+                           contents, &window_contents, &_contents,
+                           strided_fn, cfg->nthreads, &ctx->io_stats);
+        advise_access(contents, ACCESS_SEQUENTIAL);
+        // Load frequency domain results between j0 and j
+        hsize_t count[2] = {1, jfft_max - jfft_min};
+        hsize_t offset[2] = {0, jfft_min};
+        hsize_t data_rank = 1;
+        hsize_t data_count[1] = {count[1]};
+        read_from_dataset(&_contents, offset, count, data_rank, data_count, fft_real);
+        offset[0] = 1;
+        read_from_dataset(&_contents, offset, count, data_rank, data_count, fft_imag);
+
+        // Interpolate results
+        apply_interp_plan(&plan, fft_real, fft_imag, jfft_min, total, total_real, total_imag);
+
+        // Compare the middle bin of the first segment to the directly evaluated DFT;
+        // out of core, the windowed segment is not in memory and dft_segments reads it
+        if (i_segment == 0) {
+            int mid = (j - j0) / 2;
+            double re, im, psd, exact[2], exact_winsum, exact_winsum2;
+            dft_segments(st, Nj0, freqs[mid] * Nj0 / cfg->fsamp, cfg->ovlp, st->nread, 1, contents,
+                         exact, &exact_winsum, &exact_winsum2);
+            double exact_psd = (exact[0]*exact[0] + exact[1]*exact[1]) * contents->scale * contents->scale;
+            interp_bin(&plan, mid, fft_real, fft_imag, jfft_min, &re, &im, &psd);
+            ctx->totals[TOTAL_INTERP_ERR] += fabs(psd - exact_psd);
+            ctx->totals[TOTAL_INTERP_NORM] += exact_psd;
+        }
+        ctx->totals[TOTAL_FFTS]++;
+    }
+    // Normalise results and add to data->psd and data->ps
+    double norm_psd = 2. / (n_segments * cfg->fsamp * winsum2);
+    double norm_lin = sqrt (norm_psd);
+    double norm_ps = 2 / (n_segments * winsum*winsum);
+    for (ji = 0; ji < j - j0; ji++) {
+        data->psd[ji+j0-jfirst] = total[ji] * norm_psd;
+        data->ps[ji+j0-jfirst] = total[ji] * norm_ps;
+        data->avg[ji+j0-jfirst] = n_segments;
+        data->psd_real[ji+j0-jfirst] = total_real[ji] * norm_lin;
+        data->psd_imag[ji+j0-jfirst] = total_imag[ji] * norm_lin;
+        data->method[ji+j0-jfirst] = 1;
+    }
+    journal_append(&st->jrnl, data, j0 - jfirst, j - jfirst);
+
+    // Clean-up
+    ctx->totals[TOTAL_BLOCKS]++;
+    pop_cleanup(&plan_cleanup);
+    free_interp_plan(&plan);
+    if (_contents_ptr) {
+        pop_cleanup(&tmp_cleanup);
+        close_hdf5_contents(_contents_ptr);
+        unlink(tmp_fn);
+    }
+    if (window_contents_ptr) {
+        pop_cleanup(&window_cleanup);
+        close_hdf5_contents(window_contents_ptr);
+        unlink(window_fn);
+    }
+    buffers_free(&bufs);
+}
+
+// Blocks i0..i1-1 of data->blocks
+static void
+compute_blocks (void *_ctx, long int i0, long int i1)
+{
+    long int i_block;
+    for (i_block = i0; i_block < i1; i_block++) calculate_block((struct lpsd_ctx*) _ctx, i_block);
+}
 
 // @brief Use const. N approximation for a given epsilon
+// @brief With METHOD 2, blocks for which exact DFTs are cheaper are calculated with getDFT2
 void
-calculate_fft_approx (tCFG * cfg, tDATA * data)
+calculate_fft_approx (struct lpsd_state *st, tCFG * cfg, tDATA * data)
 {
     // Track time and progress
     struct timeval tv;
@@ -616,213 +1596,540 @@ calculate_fft_approx (tCFG * cfg, tDATA * data)
     fflush (stdout);
     gettimeofday (&tv, NULL);
     double start = tv.tv_sec + tv.tv_usec / 1e6;
-    double now, print, progress;
-    print = start;
-    now = start;
-
-    // Define variables
-    double epsilon = 0.1;  // TODO: pass arg
-    double g = log(cfg->fmax / cfg->fmin);
+    double progress;
 
     // Prepare data file
-    struct hdf5_contents contents;
-    read_hdf5_file(&contents, (*cfg).ifn, (*cfg).dataset_name);
+    struct lpsd_ctx ctx;
+    init_ctx(&ctx, st, cfg, data);
+    open_input(&ctx);
+
+    // Choose block boundaries and, for METHOD 2, the method of each block
+    // Twiddle tables of one in-core FFT take 8*Nfft bytes; keep unused ones within a
+    // quarter of the memory budget so they can be reused by later segments and blocks
+    twiddle_set_cache_limit(cfg->memory_budget * 1024. * 1024. / 4.);
+    make_block_plan(st, &ctx.band, data, &ctx.contents);
+    if (cfg->METHOD == 2) choose_block_methods(&ctx.band, st->nread, data, ctx.max_samples_in_memory);
+
+    // Take the bins of blocks calculated by earlier runs from the cache
+    int i_block;
+    for (i_block = 0; i_block < data->nblocks && st->cache.dir[0]; i_block++) {
+        tBLOCK *block = &data->blocks[i_block];
+        if (block->method == 0)
+            cache_restore_bins(&st->cache, data, block->j0 - ctx.jfirst, block->j1 - ctx.jfirst, &st->jrnl);
+        else cache_restore_block(&st->cache, data, block, &st->jrnl);
+    }
+    ranks_share_journal(&st->jrnl, cfg->nspec);
 
     // Loop over blocks
-    register int i;
-    int j, j0;
-    j = j0 = 0;
-    while (j < cfg->Jdes - 1) {
-        // Get index of the end of the block - the frequency at which the approximation is valid up to epsilon
-        // Block goes from index j0 to j
-        j0 = j;
-        long int Nj0 = get_N_j(j0, cfg->fsamp, cfg->fmin, cfg->fmax, cfg->Jdes);
-        j = - (cfg->Jdes - 1.) / g * log(Nj0*(1. - epsilon) * cfg->fmin/cfg->fsamp * (exp(g / (cfg->Jdes - 1.)) - 1.));
-        if (j >= cfg->Jdes) j = cfg->Jdes - 1; // TODO: take care of edge case
-
-        // Prepare segment loop
-        int delta_segment = floor(Nj0 * (1.0 - (double) (cfg->ovlp / 100.)));
-        int n_segments = floor(1 + (nread - Nj0) / delta_segment);
-        /* Adjust for edge case */
-        long int tmp = (n_segments - 1)*delta_segment + Nj0;
-        if (tmp == nread) n_segments--;
-
-	// Allocate arrays used to store the results in between
-        double *total = (double*) xmalloc((j - j0)*sizeof(double));
-	double *total_real = (double*) xmalloc((j - j0)*sizeof(double));
-	double *total_imag = (double*) xmalloc((j - j0)*sizeof(double));
-        memset(total, 0, (j - j0)*sizeof(double));
-	memset(total_real, 0, (j - j0)*sizeof(double));
-	memset(total_imag, 0, (j - j0)*sizeof(double));
-
-        // Prepare FFT
-	// Whatever the value of max is, make it less than 2^31 or ints will break
-	int max_samples_in_memory = 536870912;  // 2^29 b = 16 Gb if double  // TODO: pass arg
-	long int Nfft = get_next_power_of_two(Nj0);
-        // Relevant frequency range in full fft space
-        int jfft_min = floor(Nfft * cfg->fmin/cfg->fsamp * exp(j0*g/(cfg->Jdes - 1.)));
-        int jfft_max = ceil(Nfft * cfg->fmin/cfg->fsamp * exp(j*g/(cfg->Jdes - 1.)));
-
-        double *data_real, *data_imag, *fft_real, *fft_imag, *window;
-        data_real = data_imag = fft_real = fft_imag = window = NULL;
-        struct hdf5_contents _contents, window_contents;
-        struct hdf5_contents *_contents_ptr = NULL, *window_contents_ptr = NULL;
-        // This if/else statement allocates variables for the steps to come
-        if (Nfft <= max_samples_in_memory) {
-            // For normal FFT
-            // Initialiase data/window arrays
-            data_real = (double*) xmalloc(Nfft*sizeof(double));
-            data_imag = (double*) xmalloc(Nfft*sizeof(double));
-            fft_real = (double*) xmalloc(Nfft*sizeof(double));
-            fft_imag = (double*) xmalloc(Nfft*sizeof(double));
-            memset(data_imag, 0, Nfft*sizeof(double));
-            for (i = Nj0; i < Nfft; i++) data_real[i] = 0;
-
-            // Calculate window
-            window = (double*) xmalloc(Nj0*sizeof(double));
-            makewin(Nj0, window, &winsum, &winsum2, &nenbw);
-        } else {
-            // For memory-controlled FFT
-            // Open temporary hdf5 file to temporarily store information to disk in the loop
-            hsize_t rank = 2;  // real + imaginary
-            hsize_t dims[2] = {2, Nfft};
-            _contents_ptr = &_contents;
-            open_hdf5_file(_contents_ptr, "tmp.h5", "fft_contents", rank, dims);
-
-            // Initialise fft output, but only in relevant frequency range
-            fft_real = (double*) xmalloc((jfft_max - jfft_min)*sizeof(double));
-            fft_imag = (double*) xmalloc((jfft_max - jfft_min)*sizeof(double));
-
-            // Calculate window and put it in temporary file
-            hsize_t window_rank = 1;
-            hsize_t window_dims[1] = {Nj0};
-            window_contents_ptr = &window_contents;
-            open_hdf5_file(window_contents_ptr, "window.h5", "window", window_rank, window_dims);
-
-            // Loop over Nmax segments to calculate window without exceeding max memory
-            window = (double*) xmalloc(max_samples_in_memory*sizeof(double));
-            long int remaining_samples = Nj0;
-            int memory_unit_index = 0;
-            int iteration_samples;
-            while (remaining_samples > 0) {
-                // Calculate window
-                if (remaining_samples > max_samples_in_memory) iteration_samples = max_samples_in_memory;
-                else iteration_samples = remaining_samples;
-                makewin_indexed(Nj0, memory_unit_index*max_samples_in_memory,
-                                iteration_samples, window,
-                                &winsum, &winsum2, &nenbw, memory_unit_index == 0);
-
-                // Save to file
-                hsize_t offset[1] = {memory_unit_index*max_samples_in_memory};
-                hsize_t count[1] = {iteration_samples};
-                write_to_hdf5(window_contents_ptr, window, offset, count, window_rank, count);
-
-                // Book-keeping
-                remaining_samples -= iteration_samples;
-                memory_unit_index++;
-            }
-            xfree(window);
-            window = NULL;
+    if (cfg->workers > 1 || ranks_size() > 1) {
+        // The workers open their own input
+        close_input(&ctx);
+        struct buffer_set bufs;
+        buffers_init(&bufs);
+        long int *first = (long int*) buffers_alloc(&bufs, (data->nblocks + 1)*sizeof(long int));
+        double *cost = (double*) buffers_alloc(&bufs, data->nblocks*sizeof(double));
+        for (i_block = 0; i_block < data->nblocks; i_block++) {
+            tBLOCK *block = &data->blocks[i_block];
+            if (block->cost_fft < 0) estimate_block_cost(&ctx.band, st->nread, block, ctx.max_samples_in_memory);
+            first[i_block] = block->j0 - ctx.jfirst;
+            cost[i_block] = block->method == 0 ? block->cost_exact : block->cost_fft;
         }
+        first[data->nblocks] = cfg->nspec;
+        calculate_with_workers(&ctx, data->nblocks, first, cost, compute_blocks);
+        buffers_free(&bufs);
+    } else {
+        for (i_block = 0; i_block < data->nblocks; i_block++) {
+            calculate_block(&ctx, i_block);
 
-        register int i_segment, ji;
-        // Loop over segments - this is the actual calculation step
-        for (i_segment = 0; i_segment < n_segments; i_segment++) {
-            int index_shift = 0;
-
-            if (Nfft <= max_samples_in_memory) {
-                // Run normal FFT
-                hsize_t offset[1] = {i_segment*delta_segment};
-                hsize_t count[1] = {Nj0};
-                hsize_t data_rank = 1;
-                hsize_t data_count[1] = {count[0]};
-                read_from_dataset(&contents, offset, count, data_rank, data_count, data_real);
-                for (i = 0; i < Nj0; i++) data_real[i] *= window[i];
-                FFT(data_real, data_imag, Nfft, fft_real, fft_imag);
-            } else {
-                // Run memory-controlled FFT
-                FFT_control_memory(Nj0, Nfft, max_samples_in_memory, i_segment*delta_segment,
-                                   &contents, &window_contents, &_contents);
-                // Load frequency domain results between j0 and j
-                hsize_t count[2] = {1, jfft_max - jfft_min};
-                hsize_t offset[2] = {0, jfft_min};
-                hsize_t data_rank = 1;
-                hsize_t data_count[1] = {count[1]};
-                read_from_dataset(&_contents, offset, count, data_rank, data_count, fft_real);
-                offset[0] = 1;
-                read_from_dataset(&_contents, offset, count, data_rank, data_count, fft_imag);
-                index_shift = jfft_min;
-            }
-            // Interpolate results (linear)
-            for (ji = j0; ji < j; ji++) {
-                int jfft = floor(Nfft * cfg->fmin/cfg->fsamp * exp(ji*g/(cfg->Jdes - 1.)));
-                double x = get_f_j(ji, cfg->fmin, cfg->fmax, cfg->Jdes);
-                double x1 = cfg->fsamp / Nfft * jfft;
-                double x2 = cfg->fsamp / Nfft * (jfft+1);
-
-                // Real part
-                double y1 = fft_real[jfft-index_shift];
-                double y2 = fft_real[jfft-index_shift+1];
-                total_real[ji - j0] += interpolate(x, x1, x2, y1, y2);
-
-                // Imaginary part
-                double z1 = fft_imag[jfft-index_shift];
-                double z2 = fft_imag[jfft-index_shift+1];
-                total_imag[ji - j0] += interpolate(x, x1, x2, z1, z2);
-
-                // PSD
-                double psd1 = y1*y1 + z1*z1;
-                double psd2 = y2*y2 + z2*z2;
-                total[ji - j0] += interpolate(x, x1, x2, psd1, psd2);
-            }
+            // Progress tracking
+            progress = 100. * (double) (data->blocks[i_block].j1 - ctx.jfirst) / cfg->nspec;
+            printf ("\b\b\b\b\b\b%5.1f%%", progress);
+            fflush (stdout);
         }
-        // Normalise results and add to data->psd and data->ps
-        double norm_psd = 2. / (n_segments * cfg->fsamp * winsum2);
-	double norm_lin = sqrt (norm_psd);
-        double norm_ps = 2 / (n_segments * winsum*winsum);
-        for (ji = 0; ji < j - j0; ji++) {
-            data->psd[ji+j0] = total[ji] * norm_psd;
-            data->ps[ji+j0] = total[ji] * norm_ps;
-            data->avg[ji+j0] = n_segments;
-            data->psd_real[ji+j0] = total_real[ji] * norm_lin;
-            data->psd_imag[ji+j0] = total_imag[ji] * norm_lin;
-        }
-
-        // Progress tracking
-        progress = 100. * (double) j / cfg->Jdes;
-        printf ("\b\b\b\b\b\b%5.1f%%", progress);
-        fflush (stdout);
-
-        // Clean-up
-        if (_contents_ptr) close_hdf5_contents(_contents_ptr);
-        if (window_contents_ptr) close_hdf5_contents(window_contents_ptr);
-        xfree(total);
-        xfree(total_real);
-        xfree(total_imag);
-        xfree(fft_real);
-        xfree(fft_imag);
-        if (data_real) xfree(data_real);
-        if (data_imag) xfree(data_imag);
-        if (window) xfree(window);
+        close_input(&ctx);
     }
     /* finish */
-    close_hdf5_contents(&contents);
     printf ("\b\b\b\b\b\b  100%%\n");
     fflush (stdout);
     gettimeofday (&tv, NULL);
-    printf ("Duration (s)=%5.3f\n\n", tv.tv_sec - start + tv.tv_usec / 1e6);
+    printf ("Duration (s)=%5.3f\n", tv.tv_sec - start + tv.tv_usec / 1e6);
+    printf ("Blocks: %d\tFFTs: %ld\tinterpolation: %s",
+            (int) ctx.totals[TOTAL_BLOCKS], (long int) ctx.totals[TOTAL_FFTS], interp_name(cfg->interp));
+    if (ctx.totals[TOTAL_INTERP_NORM] > 0)
+        printf ("\trel. interpolation error: %.2e",
+                ctx.totals[TOTAL_INTERP_ERR] / ctx.totals[TOTAL_INTERP_NORM]);
+    printf ("\n");
+    print_prefetch_stats(st);
+    if (ctx.io_stats.units > 0)
+        printf ("Out-of-core FFT: %ld units, idle time (s): reader %5.3f, workers %5.3f, writer %5.3f\n",
+                ctx.io_stats.units, ctx.io_stats.load_wait, ctx.io_stats.compute_wait, ctx.io_stats.store_wait);
+    struct twiddle_stats tw_stats;
+    twiddle_get_stats(&tw_stats);
+    printf ("Twiddle tables: %ld built, %ld reused, %ld evicted\n",
+            tw_stats.built, tw_stats.reused, tw_stats.evicted);
+    twiddle_clear();
+    printf ("\n");
+}
+
+// Start a run of cfg in st: the samples used, the band of all Jdes bins, the window and the
+// prefix of its temporary files, unique among the runs of the process
+static void
+init_state (struct lpsd_state *st, tCFG * cfg)
+{
+  static long int nruns = 0;
+  tWinInfo wi;
+  double rov;
+
+  struct sample_buffer input = st->input;
+
+  memset (st, 0, sizeof (struct lpsd_state));
+  st->input = input;
+  st->jrnl.fd = -1;
+  st->segs.file = -1;
+  st->worker_index = -1;
+  snprintf (st->tmp_prefix, sizeof (st->tmp_prefix), "lpsd-%ld-%ld.", (long int) getpid (),
+            __sync_add_and_fetch (&nruns, 1));
+  st->nread = floor (((*cfg).tmax - (*cfg).tmin) * (*cfg).fsamp + 1);
+  st->band_fmin = (*cfg).fmin;
+  st->band_fmax = (*cfg).fmax;
+  set_window (&st->win, (*cfg).WT, (*cfg).reqPSLL, &wi.name[0], &wi.psll, &rov,
+              &wi.nenbw, &wi.w3db, &wi.flatness, &wi.sbin);
+}
+
+/*
+	--plan-partitions: splits the Jdes bins into cfg->plan_partitions bin ranges of equal
+	estimated cost (exact DFTs per bin for METHOD 0, the cost of the blocks for METHOD 1 and 2,
+	cut at block boundaries so that every partition plans the same blocks as a single run),
+	prints them and writes the partition table PARTFN and the HTCondor DAG DAGFN
+*/
+void
+plan_partitions (struct lpsd_state *st, tCFG * cfg, tDATA * data)
+{
+  long int nunits, u, j;
+  int p, P = (*cfg).plan_partitions;
+
+  init_state (st, cfg);
+
+  // Units that are not split: bins, or blocks
+  long int *first;
+  double *cost;
+  if ((*cfg).METHOD == 0) {
+    nunits = (*cfg).Jdes;
+    first = (long int*) xmalloc ((nunits + 1) * sizeof (long int));
+    cost = (double*) xmalloc (nunits * sizeof (double));
+    for (j = 0; j < nunits; j++) {
+      first[j] = j;
+      cost[j] = get_bin_cost_exact (cfg, st->nread, j);
+    }
+  } else {
+    struct hdf5_contents contents;
+    (*cfg).jfirst = 0;
+    (*cfg).nspec = (*cfg).Jdes;
+    if ((*cfg).max_rel_error > 0) {
+      open_samples (&contents, cfg, &st->input);
+      contents.scale = (*cfg).ulsb;
+    }
+    make_block_plan (st, cfg, data, &contents);
+    if ((*cfg).max_rel_error > 0) close_hdf5_contents (&contents);
+    nunits = (*data).nblocks;
+    first = (long int*) xmalloc ((nunits + 1) * sizeof (long int));
+    cost = (double*) xmalloc (nunits * sizeof (double));
+    for (u = 0; u < nunits; u++) {
+      tBLOCK *block = &(*data).blocks[u];
+      estimate_block_cost (cfg, st->nread, block, get_max_samples_in_memory (cfg));
+      first[u] = block->j0;
+      cost[u] = (*cfg).METHOD == 2 && block->cost_exact < block->cost_fft ? block->cost_exact : block->cost_fft;
+    }
+  }
+  first[nunits] = (*cfg).Jdes;
+  if (P > nunits) {
+    printf ("Only %ld units of work, planning %ld partitions\n", nunits, nunits);
+    P = nunits;
+  }
+
+  // Cut where the running cost is closest to p/P of the total
+  double total = 0;
+  for (u = 0; u < nunits; u++) total += cost[u];
+  long int *cut = (long int*) xmalloc ((P + 1) * sizeof (long int));
+  double *share = (double*) xmalloc (P * sizeof (double));
+  split_by_cost (cost, nunits, P, cut);
+  double share_max = 0;
+  for (p = 0; p < P; p++) {
+    share[p] = 0;
+    for (u = cut[p]; u < cut[p + 1]; u++) share[p] += cost[u];
+    if (share[p] > share_max) share_max = share[p];
+  }
+
+  // Partition table and DAG
+  FILE *tfp = fopen (PARTFN, "w"), *dfp = fopen (DAGFN, "w");
+  if (!tfp || !dfp) gerror ("Error creating the partition table or DAG");
+  fprintf (tfp, "# Partitions: %d of %d bins, METHOD %d (partition, first bin, last bin + 1, est. cost share)\n",
+           P, (*cfg).Jdes, (*cfg).METHOD);
+  printf ("Partitions: %d of %d bins, METHOD %d, estimated cost %.3e\n", P, (*cfg).Jdes, (*cfg).METHOD, total);
+  for (p = 0; p < P; p++) {
+    fprintf (tfp, "%d\t%ld\t%ld\t%.6f\n", p, first[cut[p]], first[cut[p + 1]], share[p] / total);
+    fprintf (dfp, "JOB PSD%d parallel.sub\n", p);
+  }
+  fprintf (dfp, "\n");
+  for (p = 0; p < P; p++)
+    fprintf (dfp, "VARS PSD%d iteration=\"%d\" bins=\"%ld:%ld\"\n", p, p, first[cut[p]], first[cut[p + 1]]);
+  fclose (tfp);
+  fclose (dfp);
+  printf ("Largest partition: %.2f of the mean cost. Wrote %s and %s\n",
+          P * share_max / total, PARTFN, DAGFN);
+
+  xfree (cut);
+  xfree (share);
+  xfree (first);
+  xfree (cost);
+}
+
+// Speed of the kernels of a run on this machine, measured by measure_speed
+struct machine_speed {
+    double win;			/* s per sample of a window with sin/cos terms (getDFT2) */
+    double dft;			/* s per sample and segment of the DFT sum */
+    double fft;			/* s per Nfft*log2(Nfft) of an in-core FFT */
+    double read;		/* bytes per s read from the input */
+};
+
+// Estimated work of a run with one method; memory is the peak, the rest is summed
+struct run_estimate {
+    double samples;		/* samples processed, segments times their length */
+    double flops;
+    double io_bytes;		/* read from the input and temporary files, and written to these */
+    double memory;		/* bytes of the largest bin or block, without the caches */
+    double seconds;
+    long int ooc_blocks;	/* FFTs beyond max_samples_in_memory */
+};
+
+// Time the kernels for at least DRYRUNTIME s each
+static void
+measure_speed (struct lpsd_ctx *ctx, struct machine_speed *speed)
+{
+    struct timeval tv;
+    long int i, n = 1L << 16, reps, nread = ctx->st->nread;
+    double t0, t, re, im, winsum, winsum2, nenbw;
+    double *window = (double*) xmalloc(2*n*sizeof(double));	/* sin and cos terms */
+    double *a = (double*) xmalloc(n*sizeof(double)), *b = (double*) xmalloc(n*sizeof(double));
+    double *c = (double*) xmalloc(n*sizeof(double)), *d = (double*) xmalloc(n*sizeof(double));
+    for (i = 0; i < n; i++) a[i] = sin(i);
+    memset(b, 0, n*sizeof(double));
+
+#define ELAPSED (gettimeofday(&tv, NULL), tv.tv_sec + tv.tv_usec / 1e6 - t0)
+    gettimeofday(&tv, NULL);
+    t0 = tv.tv_sec + tv.tv_usec / 1e6;
+    for (reps = 0; (t = ELAPSED) < DRYRUNTIME; reps++)
+        makewinsincos_indexed(&ctx->st->win, n, n / 10., window, &winsum, &winsum2, &nenbw, 0, n, 1);
+    speed->win = t / (reps * n);
+
+    t0 += t;
+    for (reps = 0; (t = ELAPSED) < DRYRUNTIME; reps++)
+        dft_accumulate(window, a, SAMPLE_DOUBLE, n, &re, &im);
+    speed->dft = t / (reps * n);
+
+    t0 += t;
+    for (reps = 0; (t = ELAPSED) < DRYRUNTIME; reps++) FFT(a, b, n, c, d);
+    speed->fft = t / (reps * n * log2(n));
+    twiddle_clear();
+
+    // Reads of up to PREFETCH_SAMPLES * 64 samples from the start of the input
+    long int nsamples = nread < PREFETCH_SAMPLES * 64 ? nread : PREFETCH_SAMPLES * 64;
+    void *buf = xmalloc(nsamples * ctx->contents.sample_size);
+    t0 += t;
+    read_samples(&ctx->contents, 0, nsamples, buf);
+    t = ELAPSED;
+    speed->read = nsamples * ctx->contents.sample_size / (t > 0 ? t : 1e-9);
+#undef ELAPSED
+
+    xfree(buf);
+    xfree(window);
+    xfree(a);
+    xfree(b);
+    xfree(c);
+    xfree(d);
+}
+
+// Add the exact DFT of data bin k (getDFT2) to est
+static void
+estimate_bin (struct lpsd_ctx *ctx, long int k, const struct machine_speed *speed, struct run_estimate *est)
+{
+    long int N = ctx->data->nffts[k];
+    size_t sample_size = ctx->contents.sample_size;
+    int n_segments = get_n_segments(ctx->st->nread, N, ctx->cfg->ovlp);
+    double delta = floor(N * (1.0 - ctx->cfg->ovlp / 100.));
+    if (n_segments < 1) return;
+
+    // Short segments are read in batches, which read the overlap once
+    double samples_read = N <= PREFETCH_SAMPLES / 2 ? (n_segments - 1) * delta + N : (double) n_segments * N;
+    long int in_memory = N < DFTUNIT ? N : DFTUNIT;
+    long int buffer = in_memory > PREFETCH_SAMPLES ? in_memory : PREFETCH_SAMPLES;
+    double memory = (map_samples(&ctx->contents, 0) ? 0 : PREFETCH_BUFFERS * buffer * sample_size)
+                    + 2. * in_memory * sizeof(double) + n_segments * (2 * sizeof(double) + sizeof(long int));
+
+    est->samples += (double) n_segments * N;
+    est->flops += N * (COST_SINCOS + 4. * n_segments);
+    est->io_bytes += samples_read * sample_size;
+    est->seconds += N * speed->win + (double) n_segments * N * speed->dft + samples_read * sample_size / speed->read;
+    if (memory > est->memory) est->memory = memory;
+}
+
+// Add the FFT approximation of a block to est
+static void
+estimate_fft_block (struct lpsd_ctx *ctx, tBLOCK * block, const struct machine_speed *speed,
+                    struct run_estimate *est)
+{
+    long int Nj0 = block->nfft, Nfft = get_next_power_of_two(Nj0);
+    size_t sample_size = ctx->contents.sample_size;
+    int n_segments = get_n_segments(ctx->st->nread, Nj0, ctx->cfg->ovlp);
+    int ntaps = ctx->cfg->interp == INTERP_LINEAR ? 2 : (ctx->cfg->interp == INTERP_CUBIC ? 4 : 8);
+    double io, memory, fft = Nfft * log2(Nfft);	/* the extra time out of core is in io */
+    if (n_segments < 1) return;
+
+    if (Nfft <= ctx->max_samples_in_memory) {
+        io = (double) Nj0 * sample_size;
+        memory = (4. * Nfft + (1 + PREFETCH_BUFFERS) * Nj0 + Nfft) * sizeof(double);
+    } else {
+        // Input and window, then the leaf FFTs and every butterfly level through tmp.h5
+        int Nmax = get_ooc_unit(ctx->cfg);
+        int n_depth = round(log2(Nfft) - log2(Nmax));
+        io = (double) Nj0 * (sample_size + sizeof(double)) + 2. * Nfft * sizeof(double) * (1 + 2 * n_depth);
+        memory = (5. * (ctx->cfg->nthreads + 2) + 2) * Nmax * sizeof(double);
+        est->ooc_blocks++;
+    }
+    est->samples += (double) n_segments * Nj0;
+    est->flops += n_segments * (5. * Nfft * log2(Nfft) + Nj0 + 8. * ntaps * (block->j1 - block->j0));
+    est->io_bytes += n_segments * io;
+    est->seconds += n_segments * (fft * speed->fft + io / speed->read);
+    if (memory > est->memory) est->memory = memory;
+}
+
+/*
+	--dry-run: plans the run like calculateSpectrum (bins, and the blocks of METHOD 1 and 2)
+	without calculating it, and prints for every method the samples processed, flops, I/O,
+	peak memory, out-of-core FFTs and the run time, from the speed of the kernels measured here
+*/
+void
+dry_run (struct lpsd_state *st, tCFG * cfg, tDATA * data)
+{
+  struct lpsd_ctx ctx;
+  struct machine_speed speed;
+  struct run_estimate est[3];
+  long int k;
+  int b, m;
+
+  init_state (st, cfg);
+  calc_params (cfg, data);
+  init_ctx (&ctx, st, cfg, data);
+  open_input (&ctx);
+  make_block_plan (st, &ctx.band, data, &ctx.contents);
+  measure_speed (&ctx, &speed);
+
+  // METHOD 0 calculates every bin exactly, METHOD 1 every block with FFTs, METHOD 2 the cheaper
+  memset (est, 0, sizeof (est));
+  for (k = 0; k < (*cfg).nspec; k++) estimate_bin (&ctx, k, &speed, &est[0]);
+  for (b = 0; b < (*data).nblocks; b++) {
+    tBLOCK *block = &(*data).blocks[b];
+    struct run_estimate exact, fft;
+    memset (&exact, 0, sizeof (exact));
+    memset (&fft, 0, sizeof (fft));
+    estimate_block_cost (&ctx.band, st->nread, block, ctx.max_samples_in_memory);
+    for (k = block->j0; k < block->j1; k++) estimate_bin (&ctx, k - ctx.jfirst, &speed, &exact);
+    estimate_fft_block (&ctx, block, &speed, &fft);
+    for (m = 1; m < 3; m++) {
+      struct run_estimate *e = m == 2 && block->cost_exact < block->cost_fft ? &exact : &fft;
+      est[m].samples += e->samples;
+      est[m].flops += e->flops;
+      est[m].io_bytes += e->io_bytes;
+      est[m].seconds += e->seconds;
+      est[m].ooc_blocks += e->ooc_blocks;
+      if (e->memory > est[m].memory) est[m].memory = e->memory;
+    }
+  }
+
+  // The result arrays and the journal are kept for the whole run
+  double arrays = (*cfg).nspec * (8. * sizeof (double) + 3. * sizeof (int) + 1);
+  double tw_cache = (*cfg).memory_budget * 1024. * 1024. / 4.;
+  int nprocs = ranks_size () > 1 ? ranks_size () : (*cfg).workers;
+  printf ("Dry run: bins %ld..%ld of %d, %ld blocks, %ld samples of %d bytes\n",
+          (*cfg).jfirst, (*cfg).jfirst + (*cfg).nspec - 1, (*cfg).Jdes, (long int) (*data).nblocks,
+          st->nread, (int) ctx.contents.sample_size);
+  printf ("Machine: window %.2f ns/sample, DFT %.2f ns/sample, FFT %.2f ns/(N log2 N), reads %.0f MB/s\n",
+          speed.win * 1e9, speed.dft * 1e9, speed.fft * 1e9, speed.read / 1e6);
+  printf ("Method    samples      flops        I/O (GB)   memory (MB)   out-of-core FFT blocks   time (s)\n");
+  for (m = 0; m < 3; m++)
+    printf ("%s %d     %.3e    %.3e    %9.3f   %11.1f   %22ld   %.3e\n", m == (*cfg).METHOD ? "*" : " ", m,
+            est[m].samples, est[m].flops, est[m].io_bytes / 1e9,
+            (est[m].memory + arrays) / (1024. * 1024.), est[m].ooc_blocks, est[m].seconds / nprocs);
+  printf ("Memory without the caches: up to %.1f MB of chunk cache, %.1f MB of twiddle tables (METHOD 1, 2)\n",
+          ctx.contents.cache_bytes / (1024. * 1024.), tw_cache / (1024. * 1024.));
+  if (nprocs > 1) printf ("Times are for %d worker processes or MPI ranks\n", nprocs);
+  close_input (&ctx);
+}
+
+// Hash of the samples i..i+n-1 of the input, as stored, continuing h
+static uint64_t
+hash_samples (struct hdf5_contents *contents, uint64_t h, long int i, long int n)
+{
+  struct buffer_set bufs;
+  buffers_init (&bufs);
+  void *buf = buffers_alloc (&bufs, (n > 0 ? n : 1) * contents->sample_size);
+  read_samples (contents, i, n, buf);
+  h = fnv1a (h, buf, n * contents->sample_size);
+  buffers_free (&bufs);
+  return h;
+}
+
+// Hash of the STATEHASH samples of the input before sample n, as stored
+static uint64_t
+hash_tail (struct hdf5_contents *contents, long int n)
+{
+  long int i = n > STATEHASH ? n - STATEHASH : 0;
+  return hash_samples (contents, FNV_OFFSET, i, n - i);
+}
+
+// Identity of the nread input samples of st for the journal and the segment store: their number and the hash of
+// the INPUTHASH samples at the start and at the end
+static uint64_t
+input_identity (struct lpsd_state *st, tCFG * cfg)
+{
+  struct hdf5_contents contents;
+  long int n = st->nread < INPUTHASH ? st->nread : INPUTHASH;
+  uint64_t h = fnv1a (FNV_OFFSET, &st->nread, sizeof (st->nread));
+
+  open_samples (&contents, cfg, &st->input);
+  h = hash_samples (&contents, h, 0, n);
+  h = hash_samples (&contents, h, st->nread - n, n);
+  close_hdf5_contents (&contents);
+  return h;
+}
+
+static void
+release_stream (void *s)
+{
+  stream_close ((struct lpsd_stream*) s);
 }
 
 /*
-	works on cfg, data structures of the calling program
+	--state: METHOD 0 as a stream (stream.c) that continues from the state file of an
+	earlier run over the first samples of the same series, so that only the samples
+	added since are read; the new state is saved for the next run. The result is the same
+	as that of calculate_lpsd.
+*/
+static void
+calculate_incremental (struct lpsd_state *st, tCFG * cfg, tDATA * data)
+{
+  struct lpsd_stream s;
+  struct error_cleanup stream_cleanup;
+  struct hdf5_contents contents;
+  struct timeval tv;
+  uint64_t tail_hash;
+  long int first;
+  double start;
+
+  if ((*cfg).METHOD != 0) gerror ("--state needs METHOD 0");
+  gettimeofday (&tv, NULL);
+  start = tv.tv_sec + tv.tv_usec / 1e6;
+  stream_open (&s, cfg, data);
+  push_cleanup (&stream_cleanup, release_stream, &s);
+  open_samples (&contents, cfg, &st->input);
+  contents.scale = (*cfg).ulsb;
+  set_chunk_cache (&contents, (*cfg).memory_budget * 1024. * 1024. / 4.);
+  if (stream_load (&s, (*cfg).state_fn, &tail_hash)
+      && (s.nsamples > st->nread || hash_tail (&contents, s.nsamples) != tail_hash))
+    {
+      message1 ("State file %s is of other samples, starting from the first sample", (*cfg).state_fn);
+      stream_reset (&s);
+    }
+  first = s.nsamples;
+  printf ("State: %ld samples from %s, %ld new\n", first, (*cfg).state_fn, st->nread - first);
+
+  stream_extend (&s, &contents, st->nread);
+  stream_snapshot (&s, data);
+  stream_save (&s, (*cfg).state_fn, hash_tail (&contents, st->nread));
+  close_hdf5_contents (&contents);
+  pop_cleanup (&stream_cleanup);
+  stream_close (&s);
+  gettimeofday (&tv, NULL);
+  printf ("Duration (s)=%5.3f\n\n", tv.tv_sec - start + tv.tv_usec / 1e6);
+}
+
+// Close the journal, the cache and the segment store of run st, at its end or when an error
+// returns to a trap
+static void
+close_state (void *_st)
+{
+  struct lpsd_state *st = (struct lpsd_state*) _st;
+  cache_close (&st->cache);
+  segments_close (&st->segs);
+  journal_close (&st->jrnl);
+}
+
+/*
+	works on cfg, data structures of the calling program; st holds the state of the run
 */
 void
-calculateSpectrum (tCFG * cfg, tDATA * data)
+calculateSpectrum (struct lpsd_state *st, tCFG * cfg, tDATA * data)
 {
-  nread = floor (((*cfg).tmax - (*cfg).tmin) * (*cfg).fsamp + 1);
+  struct error_cleanup cleanup;
 
+  init_state (st, cfg);
+  if ((*cfg).state_fn[0])
+    {
+      calculate_incremental (st, cfg, data);
+      return;
+    }
+  push_cleanup (&cleanup, close_state, st);
   calc_params (cfg, data);
-  if ((*cfg).METHOD == 0) calculate_lpsd (cfg, data);
-  else if ((*cfg).METHOD == 1) calculate_fft_approx (cfg, data);
+  // With MPI, the ranks read the samples that rank 0 read
+  ranks_share_input (cfg, &st->input, st->nread);
+  uint64_t input_id = (*cfg).journal || (*cfg).segments_fn[0] ? input_identity (st, cfg) : 0;
+  cache_open (&st->cache, cfg, &st->input, st->band_fmin, st->band_fmax, st->nread, get_max_samples_in_memory (cfg));
+  journal_open (&st->jrnl, cfg, data, st->nread, input_id, st->cache.key[CACHE_EXACT].input_hash);
+  segments_open (&st->segs, cfg, data, st->band_fmin, st->band_fmax, st->nread, input_id);
+  if ((*cfg).METHOD == 0) cache_restore_bins (&st->cache, data, 0, (*cfg).nspec, &st->jrnl);
+  ranks_share_journal (&st->jrnl, (*cfg).nspec);
+  if ((*cfg).METHOD == 0) calculate_lpsd (st, cfg, data);
+  else if ((*cfg).METHOD == 1 || (*cfg).METHOD == 2) calculate_fft_approx (st, cfg, data);
   else gerror("Method not implemented.");
+  if (st->cache.restored > 0) printf ("Cache: restored %ld of %ld bins\n", st->cache.restored, (*cfg).nspec);
+  cache_store (&st->cache, data, &st->jrnl);
+  pop_cleanup (&cleanup);
+  close_state (st);
+  ranks_release_input (&st->input);
+}
+
+// @brief Allocate the result arrays of data for cfg->nspec bins
+void
+memalloc (tCFG * cfg, tDATA * data)
+{
+  (*data).ps = (double *) xmalloc (((*cfg).nspec) * sizeof (double));
+  (*data).psd = (double *) xmalloc (((*cfg).nspec) * sizeof (double));
+  (*data).varps = (double *) xmalloc (((*cfg).nspec) * sizeof (double));
+  (*data).varpsd = (double *) xmalloc (((*cfg).nspec) * sizeof (double));
+  (*data).psd_real = (double *) xmalloc (((*cfg).nspec) * sizeof (double));
+  (*data).psd_imag = (double *) xmalloc (((*cfg).nspec) * sizeof (double));
+  (*data).fspec = (double *) xmalloc (((*cfg).nspec) * sizeof (double));
+  (*data).bins = (double *) xmalloc (((*cfg).nspec) * sizeof (double));
+  (*data).nffts = (int *) xmalloc (((*cfg).nspec) * sizeof (int));
+  (*data).avg = (int *) xmalloc (((*cfg).nspec) * sizeof (int));
+  (*data).method = (int *) xmalloc (((*cfg).nspec) * sizeof (int));
+  (*data).blocks = NULL;
+  (*data).nblocks = 0;
+}
+
+void
+memfree (tCFG * cfg, tDATA * data)
+{
+  xfree ((*data).ps);
+  xfree ((*data).psd);
+  xfree ((*data).varps);
+  xfree ((*data).varpsd);
+  xfree ((*data).psd_real);
+  xfree ((*data).psd_imag);
+  xfree ((*data).fspec);
+  xfree ((*data).bins);
+  xfree ((*data).nffts);
+  xfree ((*data).avg);
+  xfree ((*data).method);
+  if ((*data).blocks) xfree ((*data).blocks);
 }
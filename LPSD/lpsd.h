@@ -1,6 +1,31 @@
 #ifndef __lpsd_h
 #define __lpsd_h
 
+#include "IO.h"
+#include "pipeline.h"
+#include "genwin.h"
+#include "journal.h"
+#include "cache.h"
+#include "segments.h"
+
+// State of the calculation of one spectrum; liblpsd has no other mutable global state, so
+// spectra with their own lpsd_state, cfg and data can be calculated at the same time, e.g. in
+// threads. The entry points below (re)initialise it from cfg, except for input, which the
+// caller sets to calculate the spectrum of samples in memory instead of cfg->ifn.
+struct lpsd_state {
+    struct sample_buffer input;		/* samples in memory, input.samples NULL - read cfg->ifn */
+    long int nread;			/* samples of the time series used */
+    double band_fmin, band_fmax;	/* frequency band of all Jdes bins, cfg->fmin/fmax are this partition's */
+    struct window win;			/* window function cfg->WT */
+    struct journal jrnl;		/* checkpoint journal of completed bins */
+    struct result_cache cache;		/* bins of earlier runs, --cache */
+    struct segment_store segs;		/* DFTs of the single segments, --segments */
+    struct pipeline_stats prefetch_stats;	/* stalls of the reads ahead of the computation */
+    long int chunk_decodes;		/* compressed input chunks decoded */
+    int worker_index;			/* --workers: index of this worker process, -1 in the coordinator */
+    char tmp_prefix[48];		/* of the temporary files of out-of-core FFTs, see init_state */
+};
+
 double get_mean(int*, int);
 int count_set_bits(int);
 long int get_next_power_of_two(long int);
@@ -9,15 +34,19 @@ long int get_N_j(int, double, double, double, int);  // TODO: replace with nffts
 double get_f_j(int, double, double, int);  // TODO: replace with fspec
 void fill_ordered_coefficients(int, int*);
 
-void calculateSpectrum(tCFG *cfg, tDATA *data);
-void calculate_lpsd(tCFG*, tDATA*);
-static void calc_params(tCFG*, tDATA*);
-static void getDFT2(long int, double, double, double,
-                    double*, int*, struct hdf5_contents*);
+void memalloc(tCFG *cfg, tDATA *data);
+void calc_params(tCFG *cfg, tDATA *data);
+int get_n_segments(long int nread, long int nfft, double ovlp);
+void memfree(tCFG *cfg, tDATA *data);
+void calculateSpectrum(struct lpsd_state *st, tCFG *cfg, tDATA *data);
+void plan_partitions(struct lpsd_state *st, tCFG *cfg, tDATA *data);
+void dry_run(struct lpsd_state *st, tCFG *cfg, tDATA *data);
+void calculate_lpsd(struct lpsd_state*, tCFG*, tDATA*);
 
-void calculate_fft_approx(tCFG*, tDATA*);
+void calculate_fft_approx(struct lpsd_state*, tCFG*, tDATA*);
 void FFT(double*, double*, int, double*, double*);
 void FFT_control_memory(long int, long int, int, int, struct hdf5_contents*,
-                        struct hdf5_contents*, struct hdf5_contents*);
+                        struct hdf5_contents*, struct hdf5_contents*,
+                        const char*, int, struct pipeline_stats*);
 
 #endif
@@ -0,0 +1,433 @@
+/********************************************************************************
+    merge.c  -  lpsd-merge
+
+    Combines the outputs of a partitioned LPSD run (one job per -N iter, all with
+    the same -n and -J) into one spectrum.
+
+    usage: lpsd-merge [-o output] [-f text|hdf5] partition files...
+
+    Only the headers are read to order the partitions by their first bin (the
+    "# Bin range:" line of text output, the jfirst attribute of HDF5 output).
+    Merged text output with gaps has one "# Bin range:" line per run of bins,
+    each such file is read as one partition per line.
+    The data is then streamed in OUTCHUNK-bin chunks, so memory use does not
+    depend on the size of the spectrum. Text partitions merged to text are copied
+    line by line. Gaps and overlaps between partitions are reported; for
+    overlaps the bins of the partition with the smaller first bin are kept.
+    Missing bins are printed as the --bins ranges that calculate them, and
+    the exit status is 2 if any are missing.
+
+ ********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "hdf5.h"
+
+#include "config.h"
+#include "misc.h"
+#include "errors.h"
+
+// Quantities that can be merged into HDF5 output / from HDF5 input
+struct column {
+    const char *dataset;	/* dataset name in HDF5 files */
+    const char *header;		/* column name in text files (writeHeaderLine) */
+    int is_int;
+};
+static const struct column columns[] = {
+    {"fspec", "Frequency (Hz)", 0},
+    {"psd", "PSD", 0},
+    {"ps", "PS", 0},
+    {"avg", "AVG", 1},
+    {"psd_real", "Re(PSD)", 0},
+    {"psd_imag", "Im(PSD)", 0},
+    {"method", "Method", 1},
+};
+#define NCOLUMNS (sizeof(columns) / sizeof(struct column))
+
+struct partition {
+    char *fn;
+    int hdf5;
+    long int jfirst, nspec;
+    long int line0;		/* text: data lines of the file before bin jfirst */
+    int Jdes, iter;
+    int col[NCOLUMNS];		/* text column of each quantity, -1 if absent */
+};
+
+static void
+usage (void)
+{
+    gerror("usage: lpsd-merge [-o output] [-f text|hdf5] partition files...");
+}
+
+static long int
+read_h5_long_attr (hid_t file, const char *name, const char *fn)
+{
+    long int value;
+    if (!H5Aexists(file, name)) gerror2("Attribute missing (output of an older lpsd?):", (char*) fn);
+    hid_t attr = H5Aopen(file, name, H5P_DEFAULT);
+    H5Aread(attr, H5T_NATIVE_LONG, &value);
+    H5Aclose(attr);
+    return value;
+}
+
+// Map the text column header "# Frequency (Hz)	PSD	...", the last comment line, to the
+// known quantities
+static void
+parse_column_header (struct partition *p, char *line)
+{
+    char *tok, *save;
+    int c, i = 0;
+
+    for (c = 0; c < (int) NCOLUMNS; c++) p->col[c] = -1;
+    for (tok = strtok_r(line + 2, "\t\n", &save); tok; tok = strtok_r(NULL, "\t\n", &save), i++)
+        for (c = 0; c < (int) NCOLUMNS; c++)
+            if (strcmp(tok, columns[c].header) == 0) p->col[c] = i;
+}
+
+// Append a partition of file fn to parts[*nparts], growing parts with *maxparts
+static struct partition *
+add_partition (const char *fn, struct partition **parts, int *nparts, int *maxparts)
+{
+    if (*nparts == *maxparts) {
+        *maxparts *= 2;
+        *parts = (struct partition*) realloc(*parts, *maxparts * sizeof(struct partition));
+        if (!*parts) gerror("error in realloc");
+    }
+    struct partition *p = &(*parts)[(*nparts)++];
+    memset(p, 0, sizeof(struct partition));
+    p->fn = (char*) fn;
+    return p;
+}
+
+// Read the bin range (and, for text, the column layout) of the partitions in file fn
+static void
+read_partition_info (const char *fn, struct partition **parts, int *nparts, int *maxparts)
+{
+    struct partition *p;
+    int first = *nparts;
+
+    if (H5Fis_hdf5(fn) > 0) {
+        p = add_partition(fn, parts, nparts, maxparts);
+        p->hdf5 = 1;
+        hid_t file = H5Fopen(p->fn, H5F_ACC_RDONLY, H5P_DEFAULT);
+        if (file < 0) gerror1("Error opening %s", p->fn);
+        p->jfirst = read_h5_long_attr(file, "jfirst", p->fn);
+        p->nspec = read_h5_long_attr(file, "nspec", p->fn);
+        p->Jdes = read_h5_long_attr(file, "Jdes", p->fn);
+        p->iter = read_h5_long_attr(file, "iter", p->fn);
+        for (int c = 0; c < (int) NCOLUMNS; c++) p->col[c] = H5Lexists(file, columns[c].dataset, H5P_DEFAULT) > 0 ? c : -1;
+        H5Fclose(file);
+        return;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    long int jfirst, jend, line0 = 0;
+    int Jdes, iter;
+    FILE *fp = fopen(fn, "r");
+    if (!fp) gerror1("Error opening %s", (char*) fn);
+    while (getline(&line, &cap, fp) != -1 && line[0] == '#') {
+        if (sscanf(line, "# Bin range: %ld %ld %d %d", &jfirst, &jend, &Jdes, &iter) == 4) {
+            p = add_partition(fn, parts, nparts, maxparts);
+            p->jfirst = jfirst;
+            p->nspec = jend - jfirst;
+            p->Jdes = Jdes;
+            p->iter = iter;
+            p->line0 = line0;
+            line0 += p->nspec;
+        }
+        // The column header is the last comment line
+        if (*nparts > first) parse_column_header(&(*parts)[first], line);
+    }
+    free(line);
+    fclose(fp);
+    if (*nparts == first) gerror2("No \"# Bin range:\" line (output of an older lpsd?):", (char*) fn);
+    for (p = &(*parts)[first + 1]; p < &(*parts)[*nparts]; p++) memcpy(p->col, (*parts)[first].col, sizeof(p->col));
+}
+
+static int
+compare_partitions (const void *a, const void *b)
+{
+    const struct partition *p = (const struct partition*) a, *q = (const struct partition*) b;
+    if (p->jfirst != q->jfirst) return p->jfirst < q->jfirst ? -1 : 1;
+    return 0;
+}
+
+// Destination of the merged spectrum
+struct writer {
+    int hdf5;
+    FILE *fp;
+    hid_t file, dataset[NCOLUMNS];
+    int has[NCOLUMNS];
+};
+
+static void
+open_writer (struct writer *w, const char *fn, int hdf5, struct partition *parts, int nparts)
+{
+    int c, i;
+    long int Jdes = parts[0].Jdes;
+
+    // Quantities present in every partition
+    for (c = 0; c < (int) NCOLUMNS; c++) {
+        w->has[c] = 1;
+        for (i = 0; i < nparts; i++) if (parts[i].col[c] < 0) w->has[c] = 0;
+    }
+    w->hdf5 = hdf5;
+    if (!hdf5) {
+        w->fp = fopen(fn, "w");
+        if (!w->fp) gerror1("Error opening %s", fn);
+        fprintf(w->fp, "# output from lpsd-merge, %d partitions\n", nparts);
+        // The runs of bins that are present, in the order of the data
+        long int j0 = parts[0].jfirst, j1 = j0;
+        for (i = 0; i <= nparts; i++) {
+            if (i < nparts && parts[i].jfirst <= j1) {
+                if (parts[i].jfirst + parts[i].nspec > j1) j1 = parts[i].jfirst + parts[i].nspec;
+                continue;
+            }
+            if (j1 > j0)
+                fprintf(w->fp, "# Bin range: %ld %ld %ld 0 (first bin, last bin + 1, Jdes, iter)\n", j0, j1, Jdes);
+            if (i < nparts) j0 = parts[i].jfirst, j1 = j0 + parts[i].nspec;
+        }
+        return;
+    }
+
+    w->file = H5Fcreate(fn, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (w->file < 0) gerror1("Error opening %s", fn);
+    hsize_t dims[1] = {Jdes};
+    hsize_t chunk[1] = {Jdes < OUTCHUNK ? Jdes : OUTCHUNK};
+    hid_t space = H5Screate_simple(1, dims, NULL);
+    for (c = 0; c < (int) NCOLUMNS; c++) {
+        if (!w->has[c]) continue;
+        // Bins of missing partitions read as NaN (0 for integer quantities)
+        double nan_fill = NAN;
+        int zero_fill = 0;
+        hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+        H5Pset_chunk(dcpl, 1, chunk);
+        if (columns[c].is_int) H5Pset_fill_value(dcpl, H5T_NATIVE_INT, &zero_fill);
+        else H5Pset_fill_value(dcpl, H5T_NATIVE_DOUBLE, &nan_fill);
+        w->dataset[c] = H5Dcreate(w->file, columns[c].dataset,
+                                  columns[c].is_int ? H5T_NATIVE_INT : H5T_NATIVE_DOUBLE,
+                                  space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+        H5Pclose(dcpl);
+    }
+    H5Sclose(space);
+
+    hid_t aspace = H5Screate(H5S_SCALAR);
+    long int zero = 0;
+    const char *names[] = {"Jdes", "nspec", "jfirst", "iter"};
+    const long int *values[] = {&Jdes, &Jdes, &zero, &zero};
+    for (i = 0; i < 4; i++) {
+        hid_t attr = H5Acreate(w->file, names[i], H5T_NATIVE_LONG, aspace, H5P_DEFAULT, H5P_DEFAULT);
+        H5Awrite(attr, H5T_NATIVE_LONG, values[i]);
+        H5Aclose(attr);
+    }
+    H5Sclose(aspace);
+}
+
+// Write count bins starting at bin j0 of the full spectrum, buf[c] holds quantity c
+static void
+write_chunk (struct writer *w, double **buf, long int j0, long int count)
+{
+    int c;
+    if (!w->hdf5) {
+        for (long int k = 0; k < count; k++) {
+            for (c = 0; c < (int) NCOLUMNS; c++) {
+                if (!w->has[c]) continue;
+                if (columns[c].is_int) fprintf(w->fp, "%d\t", (int) buf[c][k]);
+                else fprintf(w->fp, "%e\t", buf[c][k]);
+            }
+            fprintf(w->fp, "\n");
+        }
+        return;
+    }
+    hsize_t offset[1] = {j0}, cnt[1] = {count};
+    hid_t memspace = H5Screate_simple(1, cnt, NULL);
+    for (c = 0; c < (int) NCOLUMNS; c++) {
+        if (!w->has[c]) continue;
+        hid_t space = H5Dget_space(w->dataset[c]);
+        H5Sselect_hyperslab(space, H5S_SELECT_SET, offset, NULL, cnt, NULL);
+        if (H5Dwrite(w->dataset[c], H5T_NATIVE_DOUBLE, memspace, space, H5P_DEFAULT, buf[c]) < 0)
+            gerror1("Error writing dataset %s", columns[c].dataset);
+        H5Sclose(space);
+    }
+    H5Sclose(memspace);
+}
+
+static void
+close_writer (struct writer *w)
+{
+    if (!w->hdf5) {
+        fclose(w->fp);
+        return;
+    }
+    for (int c = 0; c < (int) NCOLUMNS; c++) if (w->has[c]) H5Dclose(w->dataset[c]);
+    H5Fclose(w->file);
+}
+
+// Stream bins skip..nspec-1 of partition p to the writer
+static void
+copy_partition (struct partition *p, long int skip, struct writer *w, double **buf, int header_done)
+{
+    long int k, count;
+    int c;
+
+    if (!p->hdf5) {
+        char *line = NULL, *header = NULL;
+        size_t cap = 0, header_cap = 0;
+        ssize_t len;
+        FILE *fp = fopen(p->fn, "r");
+        if (!fp) gerror1("Error opening %s", p->fn);
+        k = -p->line0;
+        count = 0;
+        while ((len = getline(&line, &cap, fp)) != -1) {
+            if (line[0] == '#') {
+                // Keep the last comment line, the column header
+                if (len + 1 > (ssize_t) header_cap) {
+                    header_cap = len + 1;
+                    xfree(header);
+                    header = (char*) xmalloc(header_cap);
+                }
+                memcpy(header, line, len + 1);
+                continue;
+            }
+            // Text to text: the column header of the first partition, before its data
+            if (!w->hdf5 && !header_done && header) fputs(header, w->fp);
+            header_done = 1;
+            if (k >= p->nspec) break;
+            if (k++ < skip) continue;
+            if (!w->hdf5) {
+                fputs(line, w->fp);  /* verbatim */
+                continue;
+            }
+            // Parse the known columns
+            char *s = line, *end;
+            int i = 0;
+            double values[64];
+            while (i < 64) {
+                values[i] = strtod(s, &end);
+                if (end == s) break;
+                s = end;
+                i++;
+            }
+            for (c = 0; c < (int) NCOLUMNS; c++) {
+                if (!w->has[c]) continue;
+                if (p->col[c] >= i) gerror1("Line with too few columns in %s", p->fn);
+                buf[c][count] = values[p->col[c]];
+            }
+            if (++count == OUTCHUNK) {
+                write_chunk(w, buf, p->jfirst + k - count, count);
+                count = 0;
+            }
+        }
+        if (count > 0) write_chunk(w, buf, p->jfirst + k - count, count);
+        if (!w->hdf5 && !header_done && header) fputs(header, w->fp);
+        free(line);
+        xfree(header);
+        fclose(fp);
+        return;
+    }
+
+    if (!w->hdf5 && !header_done) {
+        fprintf(w->fp, "# ");
+        for (c = 0; c < (int) NCOLUMNS; c++) if (w->has[c]) fprintf(w->fp, "%s\t", columns[c].header);
+        fprintf(w->fp, "\n");
+    }
+    hid_t file = H5Fopen(p->fn, H5F_ACC_RDONLY, H5P_DEFAULT);
+    hid_t dataset[NCOLUMNS];
+    for (c = 0; c < (int) NCOLUMNS; c++) if (w->has[c]) dataset[c] = H5Dopen(file, columns[c].dataset, H5P_DEFAULT);
+    for (k = skip; k < p->nspec; k += count) {
+        count = p->nspec - k < OUTCHUNK ? p->nspec - k : OUTCHUNK;
+        hsize_t offset[1] = {k}, cnt[1] = {count};
+        hid_t memspace = H5Screate_simple(1, cnt, NULL);
+        for (c = 0; c < (int) NCOLUMNS; c++) {
+            if (!w->has[c]) continue;
+            hid_t space = H5Dget_space(dataset[c]);
+            H5Sselect_hyperslab(space, H5S_SELECT_SET, offset, NULL, cnt, NULL);
+            if (H5Dread(dataset[c], H5T_NATIVE_DOUBLE, memspace, space, H5P_DEFAULT, buf[c]) < 0)
+                gerror1("Error reading %s", p->fn);
+            H5Sclose(space);
+        }
+        H5Sclose(memspace);
+        write_chunk(w, buf, p->jfirst + k, count);
+    }
+    for (c = 0; c < (int) NCOLUMNS; c++) if (w->has[c]) H5Dclose(dataset[c]);
+    H5Fclose(file);
+}
+
+// Print the missing bins j0..j1-1 as the --bins range of a run that calculates them
+static void
+report_missing (long int j0, long int j1, long int *nmissing)
+{
+    printf("Gap: bins %ld to %ld missing, calculate them with --bins %ld:%ld\n", j0, j1 - 1, j0, j1);
+    *nmissing += j1 - j0;
+}
+
+int main(int argc, char *argv[])
+{
+    char *ofn = "merged.txt";
+    int hdf5_out = -1, opt, i, c;
+
+    while ((opt = getopt(argc, argv, "o:f:h")) != -1) {
+        switch (opt) {
+        case 'o': ofn = optarg; break;
+        case 'f':
+            if (strcmp(optarg, "text") == 0) hdf5_out = 0;
+            else if (strcmp(optarg, "hdf5") == 0) hdf5_out = 1;
+            else usage();
+            break;
+        default: usage();
+        }
+    }
+    int nfiles = argc - optind;
+    if (nfiles < 1) usage();
+    if (hdf5_out < 0) {
+        size_t len = strlen(ofn);
+        hdf5_out = (len > 3 && strcmp(ofn + len - 3, ".h5") == 0) || (len > 5 && strcmp(ofn + len - 5, ".hdf5") == 0);
+    }
+
+    // Headers only
+    int nparts = 0, maxparts = nfiles;
+    struct partition *parts = (struct partition*) malloc(maxparts*sizeof(struct partition));
+    if (!parts) gerror("error in malloc");
+    for (i = 0; i < nfiles; i++) read_partition_info(argv[optind + i], &parts, &nparts, &maxparts);
+    for (i = 0; i < nparts; i++) {
+        if (parts[i].Jdes != parts[0].Jdes) gerror2("Partitions have different Jdes:", parts[i].fn);
+        if (!hdf5_out && parts[i].hdf5 != parts[0].hdf5) gerror("Cannot merge text and HDF5 partitions to text");
+    }
+    qsort(parts, nparts, sizeof(struct partition), compare_partitions);
+
+    struct writer w;
+    open_writer(&w, ofn, hdf5_out, parts, nparts);
+    for (c = 0; c < (int) NCOLUMNS; c++)
+        if (w.has[c] == 0 && hdf5_out) printf("Column %s missing in some partitions, skipped\n", columns[c].dataset);
+    double *buf[NCOLUMNS];
+    for (c = 0; c < (int) NCOLUMNS; c++) buf[c] = (double*) xmalloc(OUTCHUNK*sizeof(double));
+
+    // Stream partitions in order of their first bin
+    long int expected = 0, nmissing = 0, noverlap = 0;
+    for (i = 0; i < nparts; i++) {
+        struct partition *p = &parts[i];
+        long int skip = 0;
+        if (p->jfirst > expected) report_missing(expected, p->jfirst, &nmissing);
+        if (p->jfirst < expected) {
+            skip = expected - p->jfirst < p->nspec ? expected - p->jfirst : p->nspec;
+            printf("Overlap: %s (bins %ld to %ld) repeats %ld bins, kept the earlier ones\n",
+                   p->fn, p->jfirst, p->jfirst + p->nspec - 1, skip);
+            noverlap += skip;
+        }
+        copy_partition(p, skip, &w, buf, i > 0);
+        if (p->jfirst + p->nspec > expected) expected = p->jfirst + p->nspec;
+    }
+    if (expected < parts[0].Jdes) report_missing(expected, parts[0].Jdes, &nmissing);
+    close_writer(&w);
+
+    printf("Merged %d partitions into %s: %ld of %d bins", nparts, ofn, parts[0].Jdes - nmissing, parts[0].Jdes);
+    if (noverlap) printf(", %ld overlapping bins dropped", noverlap);
+    printf("\n");
+
+    for (c = 0; c < (int) NCOLUMNS; c++) xfree(buf[c]);
+    free(parts);
+    return nmissing > 0 ? 2 : EXIT_SUCCESS;
+}
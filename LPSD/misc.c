@@ -10,15 +10,55 @@ void *xmalloc(size_t size) {
 	void *value;
 
 	value = malloc (size);
-	nallocs++;
+	__sync_fetch_and_add(&nallocs, 1);	/* xmalloc is called from worker threads */
 
 	if (value == 0) gerror ("\nerror in xmalloc\n");
 	return value;
 }
 
 void xfree(void *p) {
-	nallocs--;
+	__sync_fetch_and_sub(&nallocs, 1);
 	free(p);
 }
 
+// Header of a buffer of a buffer_set, 16 bytes on 64 bit, which keeps the buffer aligned
+struct buffer_link {
+	struct buffer_link *prev, *next;
+};
+
+static void release_buffers(void *b) {
+	struct buffer_set *set = (struct buffer_set*) b;
+	while (set->first) buffers_release(set, set->first + 1);
+}
+
+void buffers_init(struct buffer_set *b) {
+	b->first = NULL;
+	push_cleanup(&b->cleanup, release_buffers, b);
+}
+
+// @brief xmalloc a buffer of size bytes that belongs to b
+void *buffers_alloc(struct buffer_set *b, size_t size) {
+	struct buffer_link *l = (struct buffer_link*) xmalloc(sizeof(struct buffer_link) + size);
+	l->prev = NULL;
+	l->next = b->first;
+	if (b->first) b->first->prev = l;
+	b->first = l;
+	return l + 1;
+}
+
+// @brief Free buffer p of b before the others
+void buffers_release(struct buffer_set *b, void *p) {
+	struct buffer_link *l = (struct buffer_link*) p - 1;
+	if (l->prev) l->prev->next = l->next;
+	else b->first = l->next;
+	if (l->next) l->next->prev = l->prev;
+	xfree(l);
+}
+
+// @brief Free all buffers of b
+void buffers_free(struct buffer_set *b) {
+	pop_cleanup(&b->cleanup);
+	release_buffers(b);
+}
+
 extern inline double dMax  ( double x, double y ) { return x > y ? x : y; }
@@ -1,8 +1,23 @@
 #ifndef __misc_h
 #define __misc_h
 
+#include <stddef.h>
+#include "errors.h"
+
 void *xmalloc(size_t size);
 void xfree(void *p);
+
+// Buffers of one calculation, freed together by buffers_free, or when an error returns to a
+// trap (errors.h) past the function that holds them
+struct buffer_link;
+struct buffer_set {
+	struct buffer_link *first;
+	struct error_cleanup cleanup;
+};
+void buffers_init(struct buffer_set *b);
+void *buffers_alloc(struct buffer_set *b, size_t size);
+void buffers_release(struct buffer_set *b, void *p);
+void buffers_free(struct buffer_set *b);
 inline double dMax  ( double x, double y );
 //int round (double x);
 
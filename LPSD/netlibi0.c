@@ -42,10 +42,10 @@ calci0_ (double *arg, double *result, int *jint)
   /* Builtin functions */
   double exp (double), sqrt (double);
 
-  /* Local variables */
-  static double sump, sumq, a, b;
-  static int i__;
-  static double x, xx;
+  /* Local variables (automatic, f2c made them static, which is not reentrant) */
+  double sump, sumq, a, b;
+  int i__;
+  double x, xx;
 
 /* -------------------------------------------------------------------- */
 
@@ -247,10 +247,10 @@ besi0_ (double *x)
   double ret_val;
 
   /* Local variables */
-  static int jint;
+  int jint;
   extern /* Subroutine */ int calci0_ (double *arg, double *result,
 				       int *jint);
-  static double result;
+  double result;
 
 /* -------------------------------------------------------------------- */
 
@@ -274,10 +274,10 @@ besei0_ (double *x)
   double ret_val;
 
   /* Local variables */
-  static int jint;
+  int jint;
   extern /* Subroutine */ int calci0_ (double *arg, double *result,
 				       int *jint);
-  static double result;
+  double result;
 
 /* -------------------------------------------------------------------- */
 
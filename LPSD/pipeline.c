@@ -0,0 +1,287 @@
+/********************************************************************************
+    pipeline.c
+
+    Three-stage load -> compute -> store pipeline over a fixed pool of buffers.
+    One thread loads unit i+1 while n_workers threads compute unit i and one
+    thread stores unit i-1, so that I/O and computation overlap.
+
+    An error (gerror) in a stage stops all threads of the pipeline, which
+    run_pipeline then raises in the calling thread, so that it ends the
+    process or returns to the error trap of the caller (errors.h).
+
+ ********************************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "config.h"
+#include "misc.h"
+#include "errors.h"
+#include "pipeline.h"
+
+// FIFO of buffer indices, capacity n_buffers
+struct buffer_queue {
+    int *slots;
+    long int *units;
+    int head, size, capacity;
+};
+
+struct pipeline {
+    long int n_units;
+    void **buffers;
+    pipeline_fn load, compute, store;
+    void *ctx;
+
+    pthread_mutex_t lock;
+    pthread_cond_t free_cond, ready_cond, done_cond;
+    struct buffer_queue free_q, ready_q, done_q;
+    long int n_loaded;  /* units that left the load stage */
+    struct pipeline_stats stats;
+    int failed;         /* 1 - a stage raised error, the threads stop */
+    char error[ERRMSGLEN];
+};
+
+static double
+now_s (void)
+{
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+queue_init (struct buffer_queue *q, int capacity)
+{
+    q->slots = (int*) xmalloc(capacity*sizeof(int));
+    q->units = (long int*) xmalloc(capacity*sizeof(long int));
+    q->head = q->size = 0;
+    q->capacity = capacity;
+}
+
+static void
+queue_free (struct buffer_queue *q)
+{
+    xfree(q->slots);
+    xfree(q->units);
+}
+
+static void
+queue_push (struct buffer_queue *q, int slot, long int unit)
+{
+    int tail = (q->head + q->size) % q->capacity;
+    q->slots[tail] = slot;
+    q->units[tail] = unit;
+    q->size++;
+}
+
+static int
+queue_pop (struct buffer_queue *q, long int *unit)
+{
+    int slot = q->slots[q->head];
+    if (unit) *unit = q->units[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->size--;
+    return slot;
+}
+
+// Hand a finished buffer to the next stage (or back to the pool)
+static void
+release_buffer (struct pipeline *p, struct buffer_queue *q, pthread_cond_t *cond,
+                int slot, long int unit)
+{
+    pthread_mutex_lock(&p->lock);
+    queue_push(q, slot, unit);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Stop all stages after error message msg of one of them
+static void
+abort_pipeline (struct pipeline *p, const char *msg)
+{
+    pthread_mutex_lock(&p->lock);
+    if (!p->failed) snprintf(p->error, ERRMSGLEN, "%s", msg);
+    p->failed = 1;
+    pthread_cond_broadcast(&p->free_cond);
+    pthread_cond_broadcast(&p->ready_cond);
+    pthread_cond_broadcast(&p->done_cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void*
+load_thread (void *arg)
+{
+    struct pipeline *p = (struct pipeline*) arg;
+    struct error_trap trap;
+    if (setjmp(trap.env)) {
+        abort_pipeline(p, trap.msg);
+        return NULL;
+    }
+    set_error_trap(&trap);
+    for (long int unit = 0; unit < p->n_units; unit++) {
+        pthread_mutex_lock(&p->lock);
+        double t0 = now_s();
+        while (p->free_q.size == 0 && !p->failed) pthread_cond_wait(&p->free_cond, &p->lock);
+        p->stats.load_wait += now_s() - t0;
+        if (p->failed) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        int slot = queue_pop(&p->free_q, NULL);
+        pthread_mutex_unlock(&p->lock);
+
+        p->load(p->ctx, unit, p->buffers[slot]);
+
+        pthread_mutex_lock(&p->lock);
+        queue_push(&p->ready_q, slot, unit);
+        p->n_loaded++;
+        pthread_cond_signal(&p->ready_cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+    // Wake up idle workers so they can see that loading is done
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_broadcast(&p->ready_cond);
+    pthread_mutex_unlock(&p->lock);
+    set_error_trap(NULL);
+    return NULL;
+}
+
+static void*
+compute_thread (void *arg)
+{
+    struct pipeline *p = (struct pipeline*) arg;
+    struct error_trap trap;
+    if (setjmp(trap.env)) {
+        abort_pipeline(p, trap.msg);
+        return NULL;
+    }
+    set_error_trap(&trap);
+    while (1) {
+        long int unit;
+        pthread_mutex_lock(&p->lock);
+        double t0 = now_s();
+        while (p->ready_q.size == 0 && p->n_loaded < p->n_units && !p->failed)
+            pthread_cond_wait(&p->ready_cond, &p->lock);
+        p->stats.compute_wait += now_s() - t0;
+        if (p->ready_q.size == 0 || p->failed) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        int slot = queue_pop(&p->ready_q, &unit);
+        pthread_mutex_unlock(&p->lock);
+
+        p->compute(p->ctx, unit, p->buffers[slot]);
+
+        if (p->store) {
+            pthread_mutex_lock(&p->lock);
+            queue_push(&p->done_q, slot, unit);
+            pthread_cond_signal(&p->done_cond);
+            pthread_mutex_unlock(&p->lock);
+        } else {
+            release_buffer(p, &p->free_q, &p->free_cond, slot, unit);
+        }
+    }
+    set_error_trap(NULL);
+    return NULL;
+}
+
+static void*
+store_thread (void *arg)
+{
+    struct pipeline *p = (struct pipeline*) arg;
+    struct error_trap trap;
+    if (setjmp(trap.env)) {
+        abort_pipeline(p, trap.msg);
+        return NULL;
+    }
+    set_error_trap(&trap);
+    for (long int i = 0; i < p->n_units; i++) {
+        long int unit;
+        pthread_mutex_lock(&p->lock);
+        double t0 = now_s();
+        while (p->done_q.size == 0 && !p->failed) pthread_cond_wait(&p->done_cond, &p->lock);
+        p->stats.store_wait += now_s() - t0;
+        if (p->failed) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        int slot = queue_pop(&p->done_q, &unit);
+        pthread_mutex_unlock(&p->lock);
+
+        p->store(p->ctx, unit, p->buffers[slot]);
+
+        release_buffer(p, &p->free_q, &p->free_cond, slot, unit);
+    }
+    set_error_trap(NULL);
+    return NULL;
+}
+
+
+// @brief Run load(unit), compute(unit), store(unit) for unit = 0..n_units-1
+// @brief Units are loaded in order; with n_workers = 1 they are also computed and stored in order.
+// @param buffers: pool of n_buffers work buffers, n_buffers >= 1. Use n_workers + 2
+//                 to keep all stages busy.
+// @param store: may be NULL if compute is the last stage
+// @param stats: if not NULL, stall times are added to it
+// An error in a stage is raised (gerror) here once all threads stopped
+void
+run_pipeline (long int n_units, int n_buffers, int n_workers, void **buffers,
+              pipeline_fn load, pipeline_fn compute, pipeline_fn store,
+              void *ctx, struct pipeline_stats *stats)
+{
+    if (n_units <= 0) return;
+    if (n_buffers < 1 || n_workers < 1) gerror("run_pipeline: need at least one buffer and one worker");
+
+    struct pipeline p = {0};
+    p.n_units = n_units;
+    p.buffers = buffers;
+    p.load = load;
+    p.compute = compute;
+    p.store = store;
+    p.ctx = ctx;
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.free_cond, NULL);
+    pthread_cond_init(&p.ready_cond, NULL);
+    pthread_cond_init(&p.done_cond, NULL);
+    queue_init(&p.free_q, n_buffers);
+    queue_init(&p.ready_q, n_buffers);
+    queue_init(&p.done_q, n_buffers);
+    for (int i = 0; i < n_buffers; i++) queue_push(&p.free_q, i, -1);
+
+    pthread_t loader, storer;
+    pthread_t *workers = (pthread_t*) xmalloc(n_workers*sizeof(pthread_t));
+    int loading = 0, computing = 0, storing = 0;  /* threads started */
+    if (pthread_create(&loader, NULL, load_thread, &p) == 0) loading = 1;
+    else abort_pipeline(&p, "run_pipeline: could not create loader thread");
+    while (loading && computing < n_workers
+           && pthread_create(&workers[computing], NULL, compute_thread, &p) == 0) computing++;
+    if (computing < n_workers) abort_pipeline(&p, "run_pipeline: could not create worker thread");
+    if (store && computing == n_workers) {
+        if (pthread_create(&storer, NULL, store_thread, &p) == 0) storing = 1;
+        else abort_pipeline(&p, "run_pipeline: could not create writer thread");
+    }
+
+    if (loading) pthread_join(loader, NULL);
+    for (int i = 0; i < computing; i++) pthread_join(workers[i], NULL);
+    if (storing) pthread_join(storer, NULL);
+
+    if (stats) {
+        stats->load_wait += p.stats.load_wait;
+        stats->compute_wait += p.stats.compute_wait;
+        stats->store_wait += p.stats.store_wait;
+        stats->units += n_units;
+    }
+
+    // Clean up
+    xfree(workers);
+    queue_free(&p.free_q);
+    queue_free(&p.ready_q);
+    queue_free(&p.done_q);
+    pthread_cond_destroy(&p.free_cond);
+    pthread_cond_destroy(&p.ready_cond);
+    pthread_cond_destroy(&p.done_cond);
+    pthread_mutex_destroy(&p.lock);
+    if (p.failed) gerror(p.error);
+}
@@ -0,0 +1,19 @@
+#ifndef __pipeline_h
+#define __pipeline_h
+
+// Stage callback: process work unit `unit` using buffer `buf`
+typedef void (*pipeline_fn)(void *ctx, long int unit, void *buf);
+
+// Time (s) each stage spent blocked, accumulated over calls to run_pipeline
+struct pipeline_stats {
+    double load_wait;      /* loader waiting for a free buffer */
+    double compute_wait;   /* workers waiting for loaded data */
+    double store_wait;     /* writer waiting for computed data */
+    long int units;        /* number of processed work units */
+};
+
+void run_pipeline(long int n_units, int n_buffers, int n_workers, void **buffers,
+                  pipeline_fn load, pipeline_fn compute, pipeline_fn store,
+                  void *ctx, struct pipeline_stats *stats);
+
+#endif
@@ -0,0 +1,181 @@
+"""Python bindings of liblpsd (capi.c) through ctypes.
+
+Build the shared library with `cmake -DBUILD_SHARED_LIBS=ON`; it is found through the
+LPSD_LIBRARY environment variable or the library search path.
+The engine reads NumPy arrays in place and h5py datasets from their file, without copies.
+The GIL is released while the spectrum is computed.
+The result arrays are views of memory owned by the engine.
+Invalid parameters raise ValueError, errors of the calculation (e.g. I/O) RuntimeError.
+"""
+import os
+import ctypes
+import ctypes.util
+import numpy as np
+
+# SAMPLE_* of IO.h: the sample types the engine reads in place
+SAMPLE_TYPES = {np.dtype(np.float64): 0, np.dtype(np.float32): 1,
+                np.dtype(np.int16): 2, np.dtype(np.int32): 3}
+RESULTS = ("fspec", "bins", "psd", "ps", "varpsd", "varps",
+           "psd_real", "psd_imag", "avg", "nffts", "method")
+
+
+def _load():
+    """Load liblpsd and declare the functions of capi.h."""
+    path = os.environ.get("LPSD_LIBRARY") or ctypes.util.find_library("lpsd")
+    if path is None:
+        raise OSError("liblpsd not found, set LPSD_LIBRARY")
+    lib = ctypes.CDLL(path)  # CDLL calls release the GIL
+    run = ctypes.c_void_p
+    lib.lpsd_run_new.restype = run
+    lib.lpsd_run_new.argtypes = []
+    lib.lpsd_run_free.argtypes = [run]
+    lib.lpsd_run_set.argtypes = [run, ctypes.c_char_p, ctypes.c_char_p]
+    lib.lpsd_run_parameter.restype = ctypes.c_char_p
+    lib.lpsd_run_parameter.argtypes = [ctypes.c_int]
+    lib.lpsd_run_set_samples.argtypes = [run, ctypes.c_void_p, ctypes.c_int, ctypes.c_long]
+    lib.lpsd_run_compute.argtypes = [run]
+    lib.lpsd_run_stream.argtypes = [run]
+    lib.lpsd_run_push.argtypes = [run, ctypes.c_void_p, ctypes.c_int, ctypes.c_long]
+    lib.lpsd_run_snapshot.argtypes = [run]
+    lib.lpsd_run_error.restype = ctypes.c_char_p
+    lib.lpsd_run_error.argtypes = [run]
+    lib.lpsd_run_nspec.restype = ctypes.c_long
+    lib.lpsd_run_nspec.argtypes = [run]
+    lib.lpsd_run_result_type.argtypes = [ctypes.c_char_p]
+    lib.lpsd_run_result.restype = ctypes.c_void_p
+    lib.lpsd_run_result.argtypes = [run, ctypes.c_char_p]
+    return lib
+
+
+_lib = _load()
+
+
+def parameters():
+    """Return the names of the tCFG parameters that lpsd() accepts."""
+    names, i = [], 0
+    while _lib.lpsd_run_parameter(i) is not None:
+        names.append(_lib.lpsd_run_parameter(i).decode())
+        i += 1
+    return names
+
+
+class _View:
+    """Array interface of one result array; keeps the spectrum alive while viewed."""
+
+    def __init__(self, spectrum, address, dtype, n):
+        self.spectrum = spectrum
+        self.__array_interface__ = {"shape": (n,), "typestr": np.dtype(dtype).str,
+                                    "data": (address, True), "version": 3}
+
+
+class Spectrum:
+    """Spectrum of one lpsd() call; fspec, psd, ps, avg, ... are read-only views."""
+
+    def __init__(self, run):
+        self._run = run
+        n = _lib.lpsd_run_nspec(run)
+        for name in RESULTS:
+            dtype = np.float64 if _lib.lpsd_run_result_type(name.encode()) == 0 else np.intc
+            address = _lib.lpsd_run_result(run, name.encode())
+            setattr(self, name, np.asarray(_View(self, address, dtype, n)))
+
+    def __len__(self):
+        return len(self.fspec)
+
+    def __del__(self):
+        if self._run:
+            _lib.lpsd_run_free(self._run)
+            self._run = None
+
+
+def _samples(data):
+    """Return data as a 1D array the engine reads in place, and its SAMPLE_* type."""
+    data = np.asarray(data)
+    if data.ndim != 1:
+        raise ValueError("data must be one-dimensional")
+    if data.dtype not in SAMPLE_TYPES:
+        data = data.astype(np.float64)
+    data = np.ascontiguousarray(data)  # no copy if contiguous already
+    return data, SAMPLE_TYPES[data.dtype]
+
+
+def _check(run, ret):
+    """Raise the error of run if ret, the return value of a capi.c call, is not 0."""
+    if ret == -1:
+        raise ValueError(_lib.lpsd_run_error(run).decode())
+    if ret != 0:
+        raise RuntimeError(_lib.lpsd_run_error(run).decode())
+
+
+def _set(run, params):
+    """Set the tCFG parameters of run."""
+    for name, value in params.items():
+        _check(run, _lib.lpsd_run_set(run, name.encode(), str(value).encode()))
+
+
+def lpsd(data, fsamp, method=0, **params):
+    """Return the Spectrum of data sampled at fsamp Hz.
+
+    data is a 1D NumPy array (float64, float32, int16 or int32 are read in place, other
+    types are converted) or an h5py dataset, which the engine reads from its file.
+    method is METHOD 0 (exact DFTs) or 1 (FFT approximation); params are tCFG members
+    by name, see parameters(), e.g. fmin, fmax, Jdes, nspec, WT, reqPSLL, ovlp, nthreads.
+    """
+    run = _lib.lpsd_run_new()
+    spectrum = None
+    try:
+        params = dict(params, fsamp=fsamp, METHOD=method)
+        if hasattr(data, "file") and hasattr(data, "name"):  # h5py dataset
+            params.update(ifn=data.file.filename, dataset_name=data.name)
+        else:
+            data, sample_type = _samples(data)
+            _lib.lpsd_run_set_samples(run, data.ctypes.data, sample_type, len(data))
+        _set(run, params)
+        _check(run, _lib.lpsd_run_compute(run))
+        spectrum = Spectrum(run)
+    finally:
+        if spectrum is None:
+            _lib.lpsd_run_free(run)
+    return spectrum
+
+
+class Stream:
+    """Live LPSD (METHOD 0) of samples pushed one block at a time, see stream.c.
+
+    params are tCFG members as for lpsd(); fmin is required. snapshot() returns the
+    spectrum of the samples pushed so far, equal to lpsd() over the same samples.
+    """
+
+    def __init__(self, fsamp, fmin, **params):
+        self._run = None
+        run = _lib.lpsd_run_new()
+        try:
+            _set(run, dict(params, fsamp=fsamp, fmin=fmin))
+            _check(run, _lib.lpsd_run_stream(run))
+        except Exception:
+            _lib.lpsd_run_free(run)
+            raise
+        self._run = run
+        self.nsamples = 0
+
+    def push(self, data):
+        """Add the next samples of the time series."""
+        data, sample_type = _samples(data)
+        _check(self._run, _lib.lpsd_run_push(self._run, data.ctypes.data, sample_type, len(data)))
+        self.nsamples += len(data)
+
+    def snapshot(self):
+        """Return a dict of the result arrays (copies) for the samples pushed so far."""
+        _check(self._run, _lib.lpsd_run_snapshot(self._run))
+        n = _lib.lpsd_run_nspec(self._run)
+        result = {}
+        for name in RESULTS:
+            dtype = np.float64 if _lib.lpsd_run_result_type(name.encode()) == 0 else np.intc
+            address = _lib.lpsd_run_result(self._run, name.encode())
+            result[name] = np.array(_View(self, address, dtype, n))
+        return result
+
+    def __del__(self):
+        if self._run:
+            _lib.lpsd_run_free(self._run)
+            self._run = None
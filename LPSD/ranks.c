@@ -0,0 +1,340 @@
+/********************************************************************************
+    ranks.c
+
+    MPI mode (build option LPSD_MPI): the ranks of one mpirun share the bins of
+    a run. Rank 0 reads the input and sends it to the other ranks, which keep
+    one copy per node in memory shared by the ranks of the node and read it
+    from there. Every rank starts with RANKUNITS work units and gets the next
+    one from rank 0 for every result it sends, so faster ranks do more units.
+    Rank 0 calculates units too; it stores the journal records of every unit
+    finished elsewhere in data and in its journal, and alone prints and writes
+    the output.
+
+    Without LPSD_MPI there is a single rank and only the stubs are compiled.
+
+ ********************************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#ifdef LPSD_MPI
+#include <mpi.h>
+#endif
+
+#include "config.h"
+#include "misc.h"
+#include "errors.h"
+#include "IO.h"
+#include "journal.h"
+#include "workers.h"
+#include "ranks.h"
+
+#ifdef LPSD_MPI
+
+#define RESULT_TAG 1
+#define WORK_TAG 2		/* next unit of a rank, -1 if there is none left */
+
+static int rank = 0, size = 1;
+static MPI_Win input_win = MPI_WIN_NULL;	/* input samples shared by the ranks of a node */
+
+// Result of a unit, followed by ntotals doubles and nrec journal records
+struct result_header {
+    int64_t unit;
+    int64_t nrec;
+};
+
+// @brief Initialise MPI; ranks other than 0 print nothing
+// @return the rank of this process
+int
+ranks_init (int *argc, char ***argv)
+{
+    MPI_Init(argc, argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+    if (rank > 0 && !freopen("/dev/null", "w", stdout)) gerror("Error redirecting the output of a rank");
+    return rank;
+}
+
+int
+ranks_size (void)
+{
+    return size;
+}
+
+void
+ranks_finalize (void)
+{
+    MPI_Finalize();
+}
+
+// @brief Send the bins of the journal of rank 0 to all ranks, which then skip them
+// @brief MPI counts are ints, so more than INT_MAX bins are sent in pieces
+void
+ranks_share_journal (struct journal *jrnl, long int nspec)
+{
+    long int k, n;
+    if (size <= 1) return;
+    for (k = 0; k < nspec; k += n) {
+        n = nspec - k < INT_MAX ? nspec - k : INT_MAX;
+        MPI_Bcast(jrnl->done + k, (int) n, MPI_CHAR, 0, MPI_COMM_WORLD);
+    }
+}
+
+// @brief Read the nread input samples on rank 0 and send them to the other ranks, which
+// @brief then read them from input instead of cfg->ifn. Each node keeps one copy, in memory
+// @brief shared by its ranks. Samples that the caller already gave in input are used as they are.
+void
+ranks_share_input (tCFG *cfg, struct sample_buffer *input, long int nread)
+{
+    struct hdf5_contents contents;
+    MPI_Comm node, leaders;
+    MPI_Aint bytes, off, n;
+    int node_rank, type, disp;
+    void *samples;
+
+    if (size <= 1) return;
+    ranks_release_input(input);  /* left by a run that ended with an error */
+    if (input->samples) return;
+    if (rank == 0) {
+        open_samples(&contents, cfg, input);
+        type = contents.sample_type;
+    }
+    MPI_Bcast(&type, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    bytes = (MPI_Aint) nread * sample_size(type);
+
+    // The first rank of a node allocates the copy of the node; rank 0 is the first of its node
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+    MPI_Comm_rank(node, &node_rank);
+    MPI_Win_allocate_shared(node_rank == 0 ? bytes : 0, 1, MPI_INFO_NULL, node, &samples, &input_win);
+    if (node_rank > 0) MPI_Win_shared_query(input_win, 0, &n, &disp, &samples);
+    MPI_Win_fence(0, input_win);
+    if (rank == 0) {
+        read_samples(&contents, 0, nread, samples);
+        close_hdf5_contents(&contents);
+    }
+    // Rank 0 sends the samples to the first ranks of the other nodes, in pieces of at most INT_MAX bytes
+    MPI_Comm_split(MPI_COMM_WORLD, node_rank == 0 ? 0 : MPI_UNDEFINED, rank, &leaders);
+    if (leaders != MPI_COMM_NULL) {
+        for (off = 0; off < bytes; off += n) {
+            n = bytes - off < INT_MAX ? bytes - off : INT_MAX;
+            MPI_Bcast((char*) samples + off, (int) n, MPI_BYTE, 0, leaders);
+        }
+        MPI_Comm_free(&leaders);
+    }
+    MPI_Win_fence(0, input_win);
+    MPI_Comm_free(&node);
+
+    input->samples = samples;
+    input->sample_type = type;
+    input->n = nread;
+}
+
+// @brief Free the samples of ranks_share_input; all ranks call it at the end of the run
+void
+ranks_release_input (struct sample_buffer *input)
+{
+    if (input_win == MPI_WIN_NULL) return;
+    MPI_Win_free(&input_win);
+    input->samples = NULL;
+}
+
+static int
+unit_done (struct journal *jrnl, const struct work_unit *unit)
+{
+    long int k;
+    for (k = unit->k0; k < unit->k1 && journal_done(jrnl, k); k++);
+    return k == unit->k1;
+}
+
+// Append the bins k0..k1-1 that are not in the journal yet
+static void
+append_new (struct journal *jrnl, tDATA *data, long int k0, long int k1)
+{
+    long int k;
+    for (k = k0; k <= k1; k++) {
+        if (k < k1 && !journal_done(jrnl, k)) continue;
+        journal_append(jrnl, data, k0, k);
+        k0 = k + 1;
+    }
+}
+
+// Rank 0: receive one result and store it; blocks until one arrives if wait is set
+// @return the number of bins stored, 0 if there was no result; *source is the rank that sent it
+static long int
+receive (const struct work_unit *units, long int nunits, const struct worker_ops *ops, double *sum,
+         tDATA *data, long int nspec, struct journal *jrnl, int wait, int *source)
+{
+    MPI_Status status;
+    int flag = 1, count, i;
+    long int k;
+
+    if (wait) MPI_Probe(MPI_ANY_SOURCE, RESULT_TAG, MPI_COMM_WORLD, &status);
+    else MPI_Iprobe(MPI_ANY_SOURCE, RESULT_TAG, MPI_COMM_WORLD, &flag, &status);
+    if (!flag) return 0;
+
+    MPI_Get_count(&status, MPI_BYTE, &count);
+    char *buf = (char*) xmalloc(count);
+    MPI_Recv(buf, count, MPI_BYTE, status.MPI_SOURCE, RESULT_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    struct result_header *header = (struct result_header*) buf;
+    double *totals = (double*) (buf + sizeof(struct result_header));
+    struct journal_record *rec = (struct journal_record*) (totals + ops->ntotals);
+    if (header->unit < 0 || header->unit >= nunits) gerror("Invalid result from an MPI rank");
+    const struct work_unit *unit = &units[header->unit];
+    for (k = 0; k < header->nrec; k++)
+        if (journal_record_restore(&rec[k], data, nspec) != unit->k0 + k)
+            gerror("Corrupt result from an MPI rank");
+    append_new(jrnl, data, unit->k0, unit->k1);
+    for (i = 0; i < ops->ntotals; i++) sum[i] += totals[i];
+    xfree(buf);
+    *source = status.MPI_SOURCE;
+    return unit->k1 - unit->k0;
+}
+
+// Ranks other than 0: send the result of unit u to rank 0
+static void
+send_result (const struct work_unit *units, long int u, const struct worker_ops *ops, tDATA *data)
+{
+    long int k, n = units[u].k1 - units[u].k0;
+    int ntotals = ops->ntotals;
+    size_t len = sizeof(struct result_header) + ntotals*sizeof(double) + n*sizeof(struct journal_record);
+    if (len > INT_MAX) gerror("Result of a work unit too large for MPI, use more ranks");
+    char *buf = (char*) xmalloc(len);
+    struct result_header *header = (struct result_header*) buf;
+    struct journal_record *rec = (struct journal_record*) (buf + sizeof(struct result_header)
+                                                           + ntotals*sizeof(double));
+    header->unit = u;
+    header->nrec = n;
+    memcpy(buf + sizeof(struct result_header), ops->totals, ntotals*sizeof(double));
+    for (k = 0; k < n; k++) journal_record_fill(&rec[k], data, units[u].k0 + k);
+    MPI_Send(buf, len, MPI_BYTE, 0, RESULT_TAG, MPI_COMM_WORLD);
+    xfree(buf);
+}
+
+// @brief Calculate the units with the MPI ranks. The units that are not in the journal are
+// @brief dealt in turn, RANKUNITS to every rank; rank 0 then hands out the others in order,
+// @brief one for every result a rank sends, and takes the next one itself when it finished
+// @brief one. Rank 0 answers between its own units; the units a rank holds cover that wait.
+// @brief On rank 0 the results of all ranks end up in data and jrnl, and ops->totals holds
+// @brief their sum; the data of the other ranks is incomplete
+void
+run_ranks (const struct work_unit *units, long int nunits,
+           const struct worker_ops *ops, void *ctx,
+           tDATA *data, long int nspec, struct journal *jrnl)
+{
+    long int u, n, next, ntodo = 0, bins = 0, bins_done = 0;
+    long int held[RANKUNITS];	/* units of this rank, in the order they are calculated */
+    int i, source, nheld = 0, first = 0, pending = 0, ntotals = ops->ntotals;
+
+    double *sum = (double*) xmalloc((ntotals + 1)*sizeof(double));
+    memset(sum, 0, (ntotals + 1)*sizeof(double));
+    long int *todo = (long int*) xmalloc((nunits + 1)*sizeof(long int));
+    for (u = 0; u < nunits; u++) {
+        if (unit_done(jrnl, &units[u])) continue;
+        todo[ntodo++] = u;
+        bins += units[u].k1 - units[u].k0;
+    }
+    // Deal: unit i*size + r of todo goes to rank r; on rank 0, pending counts the units
+    // out at other ranks, on the others the answers still to come
+    next = (long int) RANKUNITS * size < ntodo ? (long int) RANKUNITS * size : ntodo;
+    for (u = 0; u < next; u++) {
+        if (u % size == rank) held[nheld++] = todo[u];
+        else if (rank == 0) pending++;
+    }
+
+    ops->setup(ctx, rank);
+    while (nheld > 0 || pending > 0) {
+        if (nheld > 0) {
+            u = held[first];
+            first = (first + 1) % RANKUNITS;
+            nheld--;
+            if (ntotals > 0) memset(ops->totals, 0, ntotals*sizeof(double));
+            ops->compute(ctx, units[u].i0, units[u].i1);
+            if (rank == 0) {
+                append_new(jrnl, data, units[u].k0, units[u].k1);
+                for (i = 0; i < ntotals; i++) sum[i] += ops->totals[i];
+                bins_done += units[u].k1 - units[u].k0;
+                if (next < ntodo) held[(first + nheld++) % RANKUNITS] = todo[next++];
+            } else {
+                send_result(units, u, ops, data);
+                pending++;
+            }
+        }
+
+        if (rank == 0) {
+            // Store what arrived in the meantime, so the journal follows the run, and answer
+            // every result with the next unit; wait for results once rank 0 has none left
+            while (pending > 0 && (n = receive(units, nunits, ops, sum, data, nspec, jrnl,
+                                               nheld == 0, &source)) > 0) {
+                long int v = next < ntodo ? todo[next++] : -1;
+                pending--;
+                if (v >= 0) pending++;
+                MPI_Send(&v, 1, MPI_LONG, source, WORK_TAG, MPI_COMM_WORLD);
+                bins_done += n;
+            }
+            printf("\b\b\b\b\b\b%5.1f%%", bins > 0 ? 100. * bins_done / bins : 100.);
+            fflush(stdout);
+        } else {
+            // Take the answers that arrived; wait for one when no unit is left to calculate
+            int flag = 1;
+            while (pending > 0) {
+                if (nheld > 0) MPI_Iprobe(0, WORK_TAG, MPI_COMM_WORLD, &flag, MPI_STATUS_IGNORE);
+                if (!flag) break;
+                long int v;
+                MPI_Recv(&v, 1, MPI_LONG, 0, WORK_TAG, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+                pending--;
+                if (v >= 0) held[(first + nheld++) % RANKUNITS] = v;
+            }
+        }
+    }
+
+    if (ntotals > 0) memcpy(ops->totals, sum, ntotals*sizeof(double));
+    xfree(todo);
+    xfree(sum);
+}
+
+#else
+
+int
+ranks_init (int *argc __attribute__ ((unused)), char ***argv __attribute__ ((unused)))
+{
+    return 0;
+}
+
+int
+ranks_size (void)
+{
+    return 1;
+}
+
+void
+ranks_finalize (void)
+{
+}
+
+void
+ranks_share_journal (struct journal *jrnl __attribute__ ((unused)), long int nspec __attribute__ ((unused)))
+{
+}
+
+void
+ranks_share_input (tCFG *cfg __attribute__ ((unused)), struct sample_buffer *input __attribute__ ((unused)),
+                   long int nread __attribute__ ((unused)))
+{
+}
+
+void
+ranks_release_input (struct sample_buffer *input __attribute__ ((unused)))
+{
+}
+
+void
+run_ranks (const struct work_unit *units __attribute__ ((unused)), long int nunits __attribute__ ((unused)),
+           const struct worker_ops *ops __attribute__ ((unused)), void *ctx __attribute__ ((unused)),
+           tDATA *data __attribute__ ((unused)), long int nspec __attribute__ ((unused)),
+           struct journal *jrnl __attribute__ ((unused)))
+{
+    gerror("lpsd was built without MPI");
+}
+
+#endif
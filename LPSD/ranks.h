@@ -0,0 +1,20 @@
+#ifndef __ranks_h
+#define __ranks_h
+
+struct journal;
+struct work_unit;
+struct worker_ops;
+struct sample_buffer;
+
+// MPI ranks of one run (build option LPSD_MPI); without MPI there is one rank, 0
+int ranks_init(int *argc, char ***argv);
+int ranks_size(void);
+void ranks_finalize(void);
+void ranks_share_journal(struct journal *jrnl, long int nspec);
+void ranks_share_input(tCFG *cfg, struct sample_buffer *input, long int nread);
+void ranks_release_input(struct sample_buffer *input);
+void run_ranks(const struct work_unit *units, long int nunits,
+               const struct worker_ops *ops, void *ctx,
+               tDATA *data, long int nspec, struct journal *jrnl);
+
+#endif
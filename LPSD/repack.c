@@ -0,0 +1,331 @@
+/********************************************************************************
+    repack.c  -  lpsd-repack
+
+    Rewrites the input dataset of lpsd with a chunk size chosen for the reads of
+    a planned run.
+
+    usage: lpsd-repack [-D dataset] [-f fsamp] -s fmin -t fmax -J Jdes [-l ovlp]
+                       [-h method] [-m MB] [-c chunk] [-z level] input.h5 [output.h5]
+
+    The segment lengths of the band follow from get_N_j (fsamp, fmin, fmax, Jdes);
+    fsamp defaults to the fsamp attribute of the dataset. For REPACKBINS bins
+    spread over the band, the reads of one pass over the data are modelled as
+    lpsd does them: batches of at least PREFETCH_SAMPLES for METHOD 0, one read
+    per segment for METHOD 1 and 2, and memory units of the DFT or out-of-core
+    FFT for long segments. Chunks of consecutive, overlapping reads are decoded
+    once if the overlap fits into the chunk cache (a quarter of -m, see
+    set_chunk_cache), otherwise once per read.
+
+    The read amplification is the number of samples decoded per sample
+    requested by lpsd; values below one mean that overlapping segments are served
+    from the cache. The chunk size (a power of two) minimises the bytes decoded
+    plus REPACKCALLBYTES per chunk read, unless it is given with -c.
+
+    Without an output file only the analysis is printed. Otherwise the samples
+    are copied in their storage type with deflate level -z (default 1, 0 for no
+    compression; other filters are not read by the chunk cache of lpsd), the
+    attributes of the dataset are copied, and the output is read back and
+    compared with the input.
+
+ ********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "hdf5.h"
+
+#include "config.h"
+#include "misc.h"
+#include "errors.h"
+
+// Parameters of the planned run
+struct plan {
+    long int nread;		/* samples in the dataset */
+    size_t sample_size;
+    double fsamp, fmin, fmax, ovlp;
+    int Jdes, method;
+    double memory_budget;	/* MB */
+};
+
+// Modelled cost of one pass over all bins
+struct cost {
+    double requested, decoded;	/* samples */
+    double chunk_reads;
+};
+
+static void
+usage (void)
+{
+    gerror("usage: lpsd-repack [-D dataset] [-f fsamp] -s fmin -t fmax -J Jdes [-l ovlp] "
+           "[-h method] [-m MB] [-c chunk] [-z level] input.h5 [output.h5]");
+}
+
+// Segment length of bin j, as get_N_j in lpsd.c
+static long int
+segment_length (int j, const struct plan *p)
+{
+    double g = log(p->fmax) - log(p->fmin);
+    return round(p->fsamp/p->fmin * exp(-j*g / (p->Jdes - 1.)) / (exp(g / (p->Jdes - 1.)) - 1.));
+}
+
+// Add nreads reads of length len, each step samples after the previous one, with chunks
+// of chunk samples and a cache of slots chunks
+static void
+add_reads (struct cost *c, double nreads, long int len, long int step, long int chunk, long int slots)
+{
+    double per_read = (len - 1.) / chunk + 1;	/* chunks touched at a random alignment */
+    long int overlap = len - step;
+
+    c->requested += nreads * len;
+    if (overlap > 0 && (overlap - 1) / chunk + 2 <= slots) {
+        // The next read finds the overlap in the cache and decodes the new part only
+        c->chunk_reads += per_read + (nreads - 1) * (double) step / chunk;
+    } else {
+        c->chunk_reads += nreads * per_read;
+    }
+    c->decoded = c->chunk_reads * chunk;
+}
+
+// Reads of one pass over the data for the segments of bin j
+static void
+add_bin (struct cost *c, int j, const struct plan *p, long int chunk, long int slots)
+{
+    long int nfft = segment_length(j, p);
+    long int step = floor(nfft * (1.0 - p->ovlp / 100.));
+    if (nfft < 1 || nfft >= p->nread || step < 1) return;
+    long int nseg = floor(1 + (p->nread - nfft) / step);
+
+    // Memory units: the DFT of METHOD 0 reads DFTUNIT samples of every segment at a time,
+    // out-of-core FFTs read the segment in units of a quarter of the budget
+    long int unit = p->method == 0 ? DFTUNIT : p->memory_budget * 1024. * 1024. / (4 * sizeof(double));
+    if (p->method != 0 && nfft > unit) {
+        add_reads(c, 1. * nseg * ((nfft + unit - 1) / unit), unit, unit, chunk, slots);
+        return;
+    }
+    if (nfft > unit) {
+        add_reads(c, 1. * nseg * ((nfft + unit - 1) / unit), unit, step, chunk, slots);
+        return;
+    }
+    // Short segments of METHOD 0 are read in batches
+    long int batch = 1;
+    if (p->method == 0 && nfft < PREFETCH_SAMPLES) batch = (PREFETCH_SAMPLES - nfft) / step + 1;
+    long int nbatch = (nseg + batch - 1) / batch;
+    add_reads(c, nbatch, nfft + (batch - 1) * step, batch * step, chunk, slots);
+}
+
+// Modelled reads of all bins of the band with the given chunk size
+static struct cost
+model_reads (const struct plan *p, long int chunk)
+{
+    struct cost c = {0, 0, 0};
+    long int slots = p->memory_budget * 1024. * 1024. / 4 / (chunk * p->sample_size);
+    int nbins = p->Jdes < REPACKBINS ? p->Jdes : REPACKBINS;
+    if (slots < 2) slots = 2;
+
+    for (int i = 0; i < nbins; i++) {
+        struct cost b = {0, 0, 0};
+        add_bin(&b, nbins > 1 ? (long int) i * (p->Jdes - 1) / (nbins - 1) : 0, p, chunk, slots);
+        c.requested += b.requested * p->Jdes / nbins;
+        c.decoded += b.decoded * p->Jdes / nbins;
+        c.chunk_reads += b.chunk_reads * p->Jdes / nbins;
+    }
+    // A dataset that fits into the cache is decoded once per run
+    if (slots * chunk >= p->nread) {
+        c.chunk_reads = (p->nread + chunk - 1) / chunk;
+        c.decoded = c.chunk_reads * chunk;
+    }
+    return c;
+}
+
+static void
+print_cost (const char *what, const struct plan *p, long int chunk, const struct cost *c)
+{
+    printf("%s: chunk %ld samples, read amplification %.3f, %.3g GB decoded in %.3g chunk reads\n",
+           what, chunk, c->requested > 0 ? c->decoded / c->requested : 0,
+           c->decoded * p->sample_size / 1e9, c->chunk_reads);
+}
+
+// Copy one attribute of the input dataset to the output dataset
+static herr_t
+copy_attr (hid_t loc, const char *name, const H5A_info_t *info, void *out)
+{
+    hid_t attr = H5Aopen(loc, name, H5P_DEFAULT);
+    hid_t type = H5Aget_type(attr);
+    hid_t space = H5Aget_space(attr);
+    size_t n = H5Sget_simple_extent_npoints(space);
+    void *buf = xmalloc((n > 0 ? n : 1) * H5Tget_size(type));
+
+    H5Aread(attr, type, buf);
+    hid_t copy = H5Acreate(*(hid_t*) out, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+    H5Awrite(copy, type, buf);
+    if (H5Tdetect_class(type, H5T_VLEN) > 0 || H5Tis_variable_str(type) > 0)
+        H5Dvlen_reclaim(type, space, H5P_DEFAULT, buf);
+    H5Aclose(copy);
+    xfree(buf);
+    H5Sclose(space);
+    H5Tclose(type);
+    H5Aclose(attr);
+    (void) info;
+    return 0;
+}
+
+// Read count samples from offset of a 1D dataset in the memory type
+static void
+read_block (hid_t dataset, hid_t mem_type, hsize_t offset, hsize_t count, void *buf)
+{
+    hid_t space = H5Dget_space(dataset);
+    hid_t memspace = H5Screate_simple(1, &count, NULL);
+    H5Sselect_hyperslab(space, H5S_SELECT_SET, &offset, NULL, &count, NULL);
+    if (H5Dread(dataset, mem_type, memspace, space, H5P_DEFAULT, buf) < 0)
+        gerror("Error reading dataset");
+    H5Sclose(memspace);
+    H5Sclose(space);
+}
+
+int main(int argc, char *argv[])
+{
+    struct plan p = {0, 0, -1, -1, -1, 50, 0, 0, DEFMEMBUDGET};
+    char *dataset_name = DEFDSET;
+    long int chunk = 0;
+    int level = 1, opt;
+
+    while ((opt = getopt(argc, argv, "D:f:s:t:J:l:h:m:c:z:")) != -1) {
+        switch (opt) {
+        case 'D': dataset_name = optarg; break;
+        case 'f': p.fsamp = atof(optarg); break;
+        case 's': p.fmin = atof(optarg); break;
+        case 't': p.fmax = atof(optarg); break;
+        case 'J': p.Jdes = atoi(optarg); break;
+        case 'l': p.ovlp = atof(optarg); break;
+        case 'h': p.method = atoi(optarg); break;
+        case 'm': p.memory_budget = atof(optarg); break;
+        case 'c': chunk = atol(optarg); break;
+        case 'z': level = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 2) usage();
+    char *ifn = argv[optind], *ofn = argc - optind == 2 ? argv[optind + 1] : NULL;
+    if (p.fmin <= 0 || p.fmax <= p.fmin || p.Jdes < 2) gerror("Give the band with -s fmin -t fmax -J Jdes");
+    if (p.ovlp < 0 || p.ovlp >= 100 || p.method < 0 || p.method > 2 || p.memory_budget <= 0
+        || chunk < 0 || level < 0 || level > 9) usage();
+
+    // Input dataset and its layout
+    hid_t file = H5Fopen(ifn, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (file < 0) gerror1("Error opening %s", ifn);
+    hid_t dataset = H5Dopen(file, dataset_name, H5P_DEFAULT);
+    if (dataset < 0) gerror1("Error opening dataset %s", dataset_name);
+    hid_t space = H5Dget_space(dataset);
+    hsize_t dims[1];
+    if (H5Sget_simple_extent_ndims(space) != 1) gerror1("Dataset %s is not one-dimensional", dataset_name);
+    H5Sget_simple_extent_dims(space, dims, NULL);
+    H5Sclose(space);
+    hid_t file_type = H5Dget_type(dataset);
+    hid_t mem_type = H5Tget_native_type(file_type, H5T_DIR_ASCEND);
+    p.nread = dims[0];
+    p.sample_size = H5Tget_size(mem_type);
+    if (p.fsamp <= 0 && H5Aexists(dataset, "fsamp") > 0) {
+        hid_t attr = H5Aopen(dataset, "fsamp", H5P_DEFAULT);
+        H5Aread(attr, H5T_NATIVE_DOUBLE, &p.fsamp);
+        H5Aclose(attr);
+    }
+    if (p.fsamp <= 0) gerror("No sampling frequency (-f or the fsamp attribute of the dataset)");
+    printf("%s:%s: %ld samples of %zu bytes, fsamp = %g Hz, segments of %ld to %ld samples\n",
+           ifn, dataset_name, p.nread, p.sample_size, p.fsamp,
+           segment_length(p.Jdes - 1, &p), segment_length(0, &p));
+
+    // Before
+    hid_t dcpl = H5Dget_create_plist(dataset);
+    if (H5Pget_layout(dcpl) == H5D_CHUNKED) {
+        hsize_t chunk_dims[1];
+        H5Pget_chunk(dcpl, 1, chunk_dims);
+        struct cost c = model_reads(&p, chunk_dims[0]);
+        print_cost("Before", &p, chunk_dims[0], &c);
+        for (int i = 0; i < H5Pget_nfilters(dcpl); i++) {
+            unsigned int flags, config;
+            size_t nelmts = 0;
+            char name[64];
+            H5Pget_filter2(dcpl, i, &flags, &nelmts, NULL, sizeof(name), name, &config);
+            printf("        filter %s\n", name);
+        }
+    } else {
+        printf("Before: not chunked, read without decoding (memory mapped if contiguous and unfiltered)\n");
+    }
+    H5Pclose(dcpl);
+
+    // Chunk size with the least decoded bytes plus chunk read overhead
+    if (chunk == 0) {
+        double best = -1;
+        // Two chunks at least have to fit into the cache
+        double max_chunk = p.memory_budget * 1024. * 1024. / 4 / 2 / p.sample_size;
+        for (long int c = REPACKMINCHUNK; c <= REPACKMAXCHUNK && (c == REPACKMINCHUNK || c <= max_chunk); c *= 2) {
+            struct cost m = model_reads(&p, c);
+            double cost = m.decoded * p.sample_size + m.chunk_reads * REPACKCALLBYTES;
+            if (best < 0 || cost < best) {
+                best = cost;
+                chunk = c;
+            }
+            if (c >= p.nread) break;
+        }
+    }
+    if (chunk > p.nread) chunk = p.nread;
+    struct cost after = model_reads(&p, chunk);
+    print_cost("After", &p, chunk, &after);
+    if (!ofn) return EXIT_SUCCESS;
+
+    // Output dataset with the new chunks
+    hid_t ofile = H5Fcreate(ofn, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (ofile < 0) gerror1("Error creating %s", ofn);
+    hsize_t chunk_dims[1] = {chunk};
+    hid_t ospace = H5Screate_simple(1, dims, NULL);
+    hid_t ocpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(ocpl, 1, chunk_dims);
+    if (level > 0) H5Pset_deflate(ocpl, level);
+    hid_t odataset = H5Dcreate(ofile, dataset_name, file_type, ospace, H5P_DEFAULT, ocpl, H5P_DEFAULT);
+    if (odataset < 0) gerror1("Error creating dataset %s", dataset_name);
+    H5Pclose(ocpl);
+    H5Aiterate2(dataset, H5_INDEX_NAME, H5_ITER_NATIVE, NULL, copy_attr, &odataset);
+
+    // Copy in blocks of whole chunks
+    long int block = chunk * ((REPACKBLOCK + chunk - 1) / chunk);
+    if (block > p.nread) block = p.nread;
+    char *buf = (char*) xmalloc(block * p.sample_size);
+    char *check = (char*) xmalloc(block * p.sample_size);
+    hsize_t offset;
+    for (offset = 0; offset < dims[0]; offset += block) {
+        hsize_t count = dims[0] - offset < (hsize_t) block ? dims[0] - offset : (hsize_t) block;
+        read_block(dataset, mem_type, offset, count, buf);
+        hid_t memspace = H5Screate_simple(1, &count, NULL);
+        H5Sselect_hyperslab(ospace, H5S_SELECT_SET, &offset, NULL, &count, NULL);
+        if (H5Dwrite(odataset, mem_type, memspace, ospace, H5P_DEFAULT, buf) < 0)
+            gerror1("Error writing %s", ofn);
+        H5Sclose(memspace);
+    }
+    H5Sclose(ospace);
+    H5Dclose(odataset);
+    H5Fclose(ofile);
+
+    // Verify the output
+    ofile = H5Fopen(ofn, H5F_ACC_RDONLY, H5P_DEFAULT);
+    odataset = H5Dopen(ofile, dataset_name, H5P_DEFAULT);
+    if (odataset < 0) gerror1("Error reopening %s", ofn);
+    for (offset = 0; offset < dims[0]; offset += block) {
+        hsize_t count = dims[0] - offset < (hsize_t) block ? dims[0] - offset : (hsize_t) block;
+        read_block(dataset, mem_type, offset, count, buf);
+        read_block(odataset, mem_type, offset, count, check);
+        if (memcmp(buf, check, count * p.sample_size) != 0)
+            gerror1("Verification failed: %s differs from the input", ofn);
+    }
+    H5Dclose(odataset);
+    H5Fclose(ofile);
+    xfree(buf);
+    xfree(check);
+
+    H5Tclose(mem_type);
+    H5Tclose(file_type);
+    H5Dclose(dataset);
+    H5Fclose(file);
+    printf("Wrote %s:%s (deflate level %d), contents verified\n", ofn, dataset_name, level);
+    return EXIT_SUCCESS;
+}
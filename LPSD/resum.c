@@ -0,0 +1,299 @@
+/********************************************************************************
+    resum.c  -  lpsd-resum
+
+    Calculates a spectrum again from the segment store of an earlier run
+    (lpsd-exec --segments, see segments.c), without reading the time series.
+
+    usage: lpsd-resum [-o output] [-f text|hdf5] [-a mean|median] [-t t0:t1]
+                      [-x t0:t1]... [-m min] store
+
+    -a	average of the powers |DFT|^2 of the segments: mean (as lpsd) or median,
+	divided by the bias of the median of exponentially distributed powers
+    -t	use only the segments within t0..t1 (s from the first sample,
+	t1 < 0 - up to the end)
+    -x	leave out the segments that overlap t0..t1, e.g. a glitch; repeatable
+    -m	bins with fewer segments left get NaN, default 1
+
+    The mean over all segments equals the spectrum of the run, bit for bit.
+    The output has the columns fspec, psd, ps and avg of lpsd output, text or
+    HDF5 as lpsd-merge writes them, so partitions can be merged.
+
+ ********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "hdf5.h"
+
+#include "config.h"
+#include "misc.h"
+#include "errors.h"
+
+struct interval {
+    double t0, t1;
+};
+
+// Segment selection and averaging rule
+struct rule {
+    int median;
+    struct interval keep;	/* keep.t1 < 0 - up to the end */
+    struct interval *exclude;
+    int nexclude;
+    int min_segments;
+};
+
+static void
+usage (void)
+{
+    gerror("usage: lpsd-resum [-o output] [-f text|hdf5] [-a mean|median] [-t t0:t1] [-x t0:t1]... [-m min] store");
+}
+
+static void
+parse_interval (const char *arg, struct interval *iv)
+{
+    if (sscanf(arg, "%lf:%lf", &iv->t0, &iv->t1) != 2) gerror1("Time interval %s must be t0:t1", (char*) arg);
+}
+
+static double
+read_attr (hid_t file, const char *name, const char *fn)
+{
+    double value;
+    if (H5Aexists(file, name) <= 0) gerror2("Attribute missing (not a segment store?):", (char*) fn);
+    hid_t attr = H5Aopen(file, name, H5P_DEFAULT);
+    H5Aread(attr, H5T_NATIVE_DOUBLE, &value);
+    H5Aclose(attr);
+    return value;
+}
+
+static void
+read_column (hid_t file, const char *name, hid_t type, void *values)
+{
+    hid_t dataset = H5Dopen(file, name, H5P_DEFAULT);
+    if (dataset < 0 || H5Dread(dataset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, values) < 0)
+        gerror1("Error reading dataset %s", (char*) name);
+    H5Dclose(dataset);
+}
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+// Median of n powers of exponential distribution over their mean (XLALMedianBias of LAL);
+// exact for odd n
+static double
+median_bias (int n)
+{
+    double bias = 1;
+    for (int i = 1; i <= (n - 1) / 2; i++) bias += 1. / (2*i + 1) - 1. / (2*i);
+    return bias;
+}
+
+// Power of the selected segments of one bin, averaged by rule; n gets their number.
+// The mean is summed in the order of getDFT2.
+static double
+average (const struct rule *rule, const double *dft, int nsum, long int nfft, long int step, double fsamp,
+         double *power, int *n)
+{
+    int i, e;
+    double total = 0;
+
+    *n = 0;
+    for (i = 0; i < nsum; i++) {
+        double t0 = i * step / fsamp, t1 = (i * step + nfft) / fsamp;
+        if (t0 < rule->keep.t0 || (rule->keep.t1 >= 0 && t1 > rule->keep.t1)) continue;
+        for (e = 0; e < rule->nexclude; e++)
+            if (t0 < rule->exclude[e].t1 && t1 > rule->exclude[e].t0) break;
+        if (e < rule->nexclude) continue;
+        power[(*n)++] = dft[i*2]*dft[i*2] + dft[i*2+1]*dft[i*2+1];
+    }
+    if (*n < rule->min_segments || *n == 0) return NAN;
+    if (!rule->median) {
+        for (i = 0; i < *n; i++) total += power[i];
+        return total / *n;
+    }
+    qsort(power, *n, sizeof(double), compare_doubles);
+    double median = *n % 2 ? power[*n / 2] : (power[*n / 2 - 1] + power[*n / 2]) / 2;
+    return median / median_bias(*n);
+}
+
+static void
+write_text (const char *fn, const char *store_fn, long int jfirst, long int nspec, long int Jdes,
+            long int iter, const double *fspec, const double *psd, const double *ps, const int *avg)
+{
+    FILE *fp = fopen(fn, "w");
+    if (!fp) gerror1("Error opening %s", (char*) fn);
+    fprintf(fp, "# output from lpsd-resum of %s\n", store_fn);
+    fprintf(fp, "# Bin range: %ld %ld %ld %ld (first bin, last bin + 1, Jdes, iter)\n",
+            jfirst, jfirst + nspec, Jdes, iter);
+    fprintf(fp, "# Frequency (Hz)\tPSD\tPS\tAVG\t\n");
+    for (long int k = 0; k < nspec; k++) fprintf(fp, "%e\t%e\t%e\t%d\t\n", fspec[k], psd[k], ps[k], avg[k]);
+    fclose(fp);
+}
+
+static void
+write_column (hid_t file, const char *name, hid_t type, const void *values, long int n)
+{
+    hsize_t dims[1] = {n};
+    hsize_t chunk[1] = {n < OUTCHUNK ? n : OUTCHUNK};
+    hid_t space = H5Screate_simple(1, dims, NULL);
+    hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(dcpl, 1, chunk);
+    hid_t dataset = H5Dcreate(file, name, type, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    if (dataset < 0 || H5Dwrite(dataset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, values) < 0)
+        gerror1("Error writing dataset %s", (char*) name);
+    H5Dclose(dataset);
+    H5Pclose(dcpl);
+    H5Sclose(space);
+}
+
+static void
+write_hdf5 (const char *fn, long int jfirst, long int nspec, long int Jdes, long int iter, double fsamp,
+            const double *fspec, const double *psd, const double *ps, const int *avg)
+{
+    hid_t file = H5Fcreate(fn, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (file < 0) gerror1("Error opening %s", (char*) fn);
+    write_column(file, "fspec", H5T_NATIVE_DOUBLE, fspec, nspec);
+    write_column(file, "psd", H5T_NATIVE_DOUBLE, psd, nspec);
+    write_column(file, "ps", H5T_NATIVE_DOUBLE, ps, nspec);
+    write_column(file, "avg", H5T_NATIVE_INT, avg, nspec);
+
+    hid_t aspace = H5Screate(H5S_SCALAR);
+    const char *names[] = {"Jdes", "nspec", "jfirst", "iter"};
+    const long int *values[] = {&Jdes, &nspec, &jfirst, &iter};
+    for (int i = 0; i < 4; i++) {
+        hid_t attr = H5Acreate(file, names[i], H5T_NATIVE_LONG, aspace, H5P_DEFAULT, H5P_DEFAULT);
+        H5Awrite(attr, H5T_NATIVE_LONG, values[i]);
+        H5Aclose(attr);
+    }
+    hid_t attr = H5Acreate(file, "fsamp", H5T_NATIVE_DOUBLE, aspace, H5P_DEFAULT, H5P_DEFAULT);
+    H5Awrite(attr, H5T_NATIVE_DOUBLE, &fsamp);
+    H5Aclose(attr);
+    H5Sclose(aspace);
+    H5Fclose(file);
+}
+
+int main(int argc, char *argv[])
+{
+    char *ofn = "resum.txt";
+    int hdf5_out = -1, opt;
+    struct rule rule = {0, {0, -1}, NULL, 0, 1};
+
+    while ((opt = getopt(argc, argv, "o:f:a:t:x:m:h")) != -1) {
+        switch (opt) {
+        case 'o': ofn = optarg; break;
+        case 'f':
+            if (strcmp(optarg, "text") == 0) hdf5_out = 0;
+            else if (strcmp(optarg, "hdf5") == 0) hdf5_out = 1;
+            else usage();
+            break;
+        case 'a':
+            if (strcmp(optarg, "mean") == 0) rule.median = 0;
+            else if (strcmp(optarg, "median") == 0) rule.median = 1;
+            else usage();
+            break;
+        case 't': parse_interval(optarg, &rule.keep); break;
+        case 'x':
+            rule.exclude = (struct interval*) realloc(rule.exclude, (rule.nexclude + 1) * sizeof(struct interval));
+            if (!rule.exclude) gerror("Out of memory");
+            parse_interval(optarg, &rule.exclude[rule.nexclude++]);
+            break;
+        case 'm':
+            rule.min_segments = atoi(optarg);
+            if (rule.min_segments < 1) gerror("Minimum number of segments must be at least 1");
+            break;
+        default: usage();
+        }
+    }
+    if (argc - optind != 1) usage();
+    const char *fn = argv[optind];
+    if (hdf5_out < 0) {
+        size_t len = strlen(ofn);
+        hdf5_out = (len > 3 && strcmp(ofn + len - 3, ".h5") == 0) || (len > 5 && strcmp(ofn + len - 5, ".hdf5") == 0);
+    }
+
+    hid_t file = H5Fopen(fn, H5F_ACC_RDONLY, H5P_DEFAULT);
+    if (file < 0) gerror1("Error opening %s", (char*) fn);
+    double fsamp = read_attr(file, "fsamp", fn);
+    double ovlp = read_attr(file, "ovlp", fn);
+    double ulsb = read_attr(file, "ulsb", fn);
+    long int nspec = read_attr(file, "nspec", fn);
+    long int maxseg = read_attr(file, "maxseg", fn);
+    long int jfirst = read_attr(file, "jfirst", fn);
+    long int Jdes = read_attr(file, "Jdes", fn);
+    long int iter = read_attr(file, "iter", fn);
+
+    double *fspec = (double*) xmalloc(nspec * sizeof(double));
+    double *winsum = (double*) xmalloc(nspec * sizeof(double));
+    double *winsum2 = (double*) xmalloc(nspec * sizeof(double));
+    long int *nfft = (long int*) xmalloc(nspec * sizeof(long int));
+    int *nsum = (int*) xmalloc(nspec * sizeof(int));
+    read_column(file, "fspec", H5T_NATIVE_DOUBLE, fspec);
+    read_column(file, "winsum", H5T_NATIVE_DOUBLE, winsum);
+    read_column(file, "winsum2", H5T_NATIVE_DOUBLE, winsum2);
+    read_column(file, "nfft", H5T_NATIVE_LONG, nfft);
+    read_column(file, "nsum", H5T_NATIVE_INT, nsum);
+
+    double *psd = (double*) xmalloc(nspec * sizeof(double));
+    double *ps = (double*) xmalloc(nspec * sizeof(double));
+    int *avg = (int*) xmalloc(nspec * sizeof(int));
+    double *dft = (double*) xmalloc(2 * maxseg * sizeof(double));
+    double *power = (double*) xmalloc(maxseg * sizeof(double));
+    hid_t dataset = H5Dopen(file, "dft", H5P_DEFAULT);
+    if (dataset < 0) gerror("Error reading dataset dft");
+    hid_t space = H5Dget_space(dataset);
+    long int k, missing = 0, empty = 0;
+
+    // One bin at a time; its segments are one row of chunks
+    for (k = 0; k < nspec; k++) {
+        avg[k] = 0;
+        psd[k] = ps[k] = NAN;
+        if (nsum[k] == 0) {
+            missing++;
+            continue;
+        }
+        hsize_t offset[3] = {k, 0, 0}, count[3] = {1, nsum[k], 2};
+        hid_t memspace = H5Screate_simple(3, count, NULL);
+        H5Sselect_hyperslab(space, H5S_SELECT_SET, offset, NULL, count, NULL);
+        if (H5Dread(dataset, H5T_NATIVE_DOUBLE, memspace, space, H5P_DEFAULT, dft) < 0)
+            gerror("Error reading dataset dft");
+        H5Sclose(memspace);
+
+        long int step = nfft[k] * (1.0 - (double) (ovlp / 100.));  /* as getDFT2 */
+        double p = average(&rule, dft, nsum[k], nfft[k], step, fsamp, power, &avg[k]);
+        if (isnan(p)) {
+            empty++;
+            continue;
+        }
+        // Scaled as in getDFT2
+        psd[k] = ps[k] = p * ulsb * ulsb;
+        psd[k] *= 2. / (fsamp * winsum2[k]);
+        ps[k] *= 2. / (winsum[k] * winsum[k]);
+    }
+    H5Sclose(space);
+    H5Dclose(dataset);
+    H5Fclose(file);
+
+    if (hdf5_out) write_hdf5(ofn, jfirst, nspec, Jdes, iter, fsamp, fspec, psd, ps, avg);
+    else write_text(ofn, fn, jfirst, nspec, Jdes, iter, fspec, psd, ps, avg);
+    printf("Resummed %ld bins of %s into %s", nspec - missing - empty, fn, ofn);
+    if (missing) printf(", %ld bins not in the store", missing);
+    if (empty) printf(", %ld bins with fewer than %d segments", empty, rule.min_segments);
+    printf("\n");
+
+    xfree(fspec);
+    xfree(winsum);
+    xfree(winsum2);
+    xfree(nfft);
+    xfree(nsum);
+    xfree(psd);
+    xfree(ps);
+    xfree(avg);
+    xfree(dft);
+    xfree(power);
+    free(rule.exclude);
+    return EXIT_SUCCESS;
+}
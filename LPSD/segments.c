@@ -0,0 +1,273 @@
+/********************************************************************************
+    segments.c
+
+    Store of the DFTs of the single segments of each bin (--segments file).
+
+    getDFT2 sums the segments of a bin to one average power. With --segments,
+    the complex DFT of every segment (unscaled, as summed in getDFT2) is also
+    written to the HDF5 file, so that lpsd-resum (resum.c) can average them
+    again, over other segments or with the median, without the time series.
+
+    dft		nspec x maxseg x 2 (re, im), chunked by SEGMENTCHUNK segments
+		of one bin; segment i of bin k starts at sample
+		i * (long) (nfft[k] * (1 - ovlp/100)), as in getDFT2
+    nsum	segments of each bin, 0 if the bin is not stored (bins of
+		METHOD 1, or restored from the journal or the cache)
+    fspec, bins, nfft, winsum, winsum2	per bin
+    attributes	fsamp, ovlp, ulsb, WT, reqPSLL, band fmin, fmax, Jdes,
+		jfirst, nspec, iter, nread, tmin, maxseg, version; the input
+		file ifn, dataset_name and input_id (input_identity, lpsd.c)
+
+    A rerun with the same configuration and input (e.g. resuming from the
+    journal) adds its bins to the existing file.
+
+ ********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "hdf5.h"
+
+#include "config.h"
+#include "misc.h"
+#include "errors.h"
+#include "IO.h"
+#include "lpsd.h"
+#include "ranks.h"
+#include "segments.h"
+
+static void
+write_attr (hid_t file, const char *name, hid_t type, const void *value)
+{
+    hid_t space = H5Screate(H5S_SCALAR);
+    hid_t attr = H5Acreate(file, name, type, space, H5P_DEFAULT, H5P_DEFAULT);
+    H5Awrite(attr, type, value);
+    H5Aclose(attr);
+    H5Sclose(space);
+}
+
+static double
+read_attr (hid_t file, const char *name)
+{
+    double value = NAN;
+    if (H5Aexists(file, name) <= 0) return value;
+    hid_t attr = H5Aopen(file, name, H5P_DEFAULT);
+    H5Aread(attr, H5T_NATIVE_DOUBLE, &value);
+    H5Aclose(attr);
+    return value;
+}
+
+static void
+write_string_attr (hid_t file, const char *name, const char *value)
+{
+    char buf[FNLEN] = {0};
+    hid_t type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(type, FNLEN);
+    snprintf(buf, sizeof(buf), "%s", value);
+    write_attr(file, name, type, buf);
+    H5Tclose(type);
+}
+
+// @brief 1 if the store was written from the same input samples as input_id of cfg->ifn
+static int
+same_input (hid_t file, tCFG *cfg, uint64_t input_id)
+{
+    char ifn[FNLEN] = {0}, dataset_name[FNLEN] = {0};
+    uint64_t id = 0;
+    hid_t type = H5Tcopy(H5T_C_S1);
+    H5Tset_size(type, FNLEN);
+    int ok = H5Aexists(file, "ifn") > 0 && H5Aexists(file, "dataset_name") > 0
+        && H5Aexists(file, "input_id") > 0;
+    if (ok) {
+        hid_t attr = H5Aopen(file, "ifn", H5P_DEFAULT);
+        H5Aread(attr, type, ifn);
+        H5Aclose(attr);
+        attr = H5Aopen(file, "dataset_name", H5P_DEFAULT);
+        H5Aread(attr, type, dataset_name);
+        H5Aclose(attr);
+        attr = H5Aopen(file, "input_id", H5P_DEFAULT);
+        H5Aread(attr, H5T_NATIVE_UINT64, &id);
+        H5Aclose(attr);
+    }
+    H5Tclose(type);
+    return ok && id == input_id && strncmp(ifn, cfg->ifn, FNLEN) == 0
+        && strncmp(dataset_name, cfg->dataset_name, FNLEN) == 0;
+}
+
+// Write n values of one bin quantity to a new dataset
+static hid_t
+create_column (hid_t file, const char *name, hid_t type, const void *values, long int n, const void *fill)
+{
+    hsize_t dims[1] = {n};
+    hsize_t chunk[1] = {n < OUTCHUNK ? n : OUTCHUNK};
+    hid_t space = H5Screate_simple(1, dims, NULL);
+    hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(dcpl, 1, chunk);
+    if (fill) H5Pset_fill_value(dcpl, type, fill);
+    hid_t dataset = H5Dcreate(file, name, type, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    if (dataset < 0) gerror1("Could not create dataset %s", (char*) name);
+    if (values && H5Dwrite(dataset, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, values) < 0)
+        gerror1("Error writing dataset %s", (char*) name);
+    H5Pclose(dcpl);
+    H5Sclose(space);
+    return dataset;
+}
+
+// Attributes that must be equal to add to an existing store
+struct store_attr {
+    const char *name;
+    double value;
+};
+
+// Open or create the store, with the HDF5 lock held (see segments_open)
+static void
+open_store (struct segment_store *store, tCFG *cfg, tDATA *data, double fmin, double fmax,
+            long int nread, uint64_t input_id)
+{
+    long int k, n;
+    int i;
+
+    store->nspec = cfg->nspec;
+    store->maxseg = 1;
+    for (k = 0; k < cfg->nspec; k++) {
+        n = get_n_segments(nread, data->nffts[k], cfg->ovlp);
+        if (n > store->maxseg) store->maxseg = n;
+    }
+    struct store_attr attrs[] = {
+        {"fsamp", cfg->fsamp}, {"ovlp", cfg->ovlp}, {"ulsb", cfg->ulsb}, {"WT", cfg->WT},
+        {"reqPSLL", cfg->reqPSLL}, {"fmin", fmin}, {"fmax", fmax}, {"Jdes", cfg->Jdes},
+        {"jfirst", cfg->jfirst}, {"nspec", cfg->nspec}, {"iter", cfg->iter}, {"nread", nread},
+        {"tmin", cfg->tmin}, {"maxseg", store->maxseg}, {"version", SEGMENTS_VERSION},
+    };
+    int nattrs = sizeof(attrs) / sizeof(struct store_attr);
+
+    // Add to the store of an earlier run with the same configuration and input
+    if (access(cfg->segments_fn, F_OK) == 0 && H5Fis_hdf5(cfg->segments_fn) > 0) {
+        store->file = H5Fopen(cfg->segments_fn, H5F_ACC_RDWR, H5P_DEFAULT);
+        for (i = 0; i < nattrs && store->file >= 0; i++)
+            if (read_attr(store->file, attrs[i].name) != attrs[i].value) {
+                H5Fclose(store->file);
+                store->file = -1;
+            }
+        if (store->file >= 0 && !same_input(store->file, cfg, input_id)) {
+            H5Fclose(store->file);
+            store->file = -1;
+        }
+        if (store->file >= 0) {
+            store->dft = H5Dopen(store->file, "dft", H5P_DEFAULT);
+            store->nsum = H5Dopen(store->file, "nsum", H5P_DEFAULT);
+            store->winsum = H5Dopen(store->file, "winsum", H5P_DEFAULT);
+            store->winsum2 = H5Dopen(store->file, "winsum2", H5P_DEFAULT);
+            printf("Segments: adding to %s\n", cfg->segments_fn);
+            return;
+        }
+        message1("Segment store %s is of another run, overwriting it", cfg->segments_fn);
+    }
+
+    store->file = H5Fcreate(cfg->segments_fn, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if (store->file < 0) gerror1("Error opening %s", cfg->segments_fn);
+    for (i = 0; i < nattrs; i++) write_attr(store->file, attrs[i].name, H5T_NATIVE_DOUBLE, &attrs[i].value);
+    write_string_attr(store->file, "ifn", cfg->ifn);
+    write_string_attr(store->file, "dataset_name", cfg->dataset_name);
+    write_attr(store->file, "input_id", H5T_NATIVE_UINT64, &input_id);
+
+    long int *nfft = (long int*) xmalloc(cfg->nspec * sizeof(long int));
+    for (k = 0; k < cfg->nspec; k++) nfft[k] = data->nffts[k];
+    double nan_fill = NAN;
+    int zero_fill = 0;
+    H5Dclose(create_column(store->file, "fspec", H5T_NATIVE_DOUBLE, data->fspec, cfg->nspec, NULL));
+    H5Dclose(create_column(store->file, "bins", H5T_NATIVE_DOUBLE, data->bins, cfg->nspec, NULL));
+    H5Dclose(create_column(store->file, "nfft", H5T_NATIVE_LONG, nfft, cfg->nspec, NULL));
+    store->nsum = create_column(store->file, "nsum", H5T_NATIVE_INT, NULL, cfg->nspec, &zero_fill);
+    store->winsum = create_column(store->file, "winsum", H5T_NATIVE_DOUBLE, NULL, cfg->nspec, &nan_fill);
+    store->winsum2 = create_column(store->file, "winsum2", H5T_NATIVE_DOUBLE, NULL, cfg->nspec, &nan_fill);
+    xfree(nfft);
+
+    // Only the chunks of stored segments are allocated
+    hsize_t dims[3] = {cfg->nspec, store->maxseg, 2};
+    hsize_t chunk[3] = {1, store->maxseg < SEGMENTCHUNK ? store->maxseg : SEGMENTCHUNK, 2};
+    hid_t space = H5Screate_simple(3, dims, NULL);
+    hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(dcpl, 3, chunk);
+    H5Pset_fill_value(dcpl, H5T_NATIVE_DOUBLE, &nan_fill);
+    if (cfg->compression > 0) {
+        if (!H5Zfilter_avail(H5Z_FILTER_DEFLATE)) gerror("HDF5 library has no deflate filter, use --compression 0");
+        H5Pset_shuffle(dcpl);
+        H5Pset_deflate(dcpl, cfg->compression);
+    }
+    store->dft = H5Dcreate(store->file, "dft", H5T_NATIVE_DOUBLE, space, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    if (store->dft < 0) gerror("Could not create dataset dft");
+    H5Pclose(dcpl);
+    H5Sclose(space);
+    printf("Segments: %ld bins, up to %ld segments, stored in %s\n", store->nspec, store->maxseg,
+           cfg->segments_fn);
+}
+
+// @brief Open the store cfg->segments_fn for the bins of data; fmin, fmax is the band of
+// @brief all Jdes bins, nread the number of samples and input_id their input_identity.
+// @brief Does nothing if --segments is not set.
+void
+segments_open (struct segment_store *store, tCFG *cfg, tDATA *data, double fmin, double fmax,
+               long int nread, uint64_t input_id)
+{
+    memset(store, 0, sizeof(struct segment_store));
+    store->file = store->dft = store->nsum = store->winsum = store->winsum2 = -1;
+    if (!cfg->segments_fn[0]) return;
+    if (cfg->METHOD == 1) gerror("--segments needs the exact DFTs of METHOD 0 or 2");
+    if (cfg->workers > 1 || ranks_size() > 1) gerror("--segments does not work with --workers or MPI");
+    hdf5_enter();
+    open_store(store, cfg, data, fmin, fmax, nread, input_id);
+    hdf5_leave();
+}
+
+static void
+write_value (hid_t dataset, hid_t type, long int k, const void *value)
+{
+    hsize_t offset[1] = {k}, count[1] = {1};
+    hid_t memspace = H5Screate_simple(1, count, NULL);
+    hid_t space = H5Dget_space(dataset);
+    H5Sselect_hyperslab(space, H5S_SELECT_SET, offset, NULL, count, NULL);
+    if (H5Dwrite(dataset, type, memspace, space, H5P_DEFAULT, value) < 0) gerror("Error writing segment store");
+    H5Sclose(space);
+    H5Sclose(memspace);
+}
+
+// @brief Store the nsum segment DFTs dft (re, im pairs) of bin k of data, and the window sums
+// @brief of the bin; nsum is written last, so an interrupted write leaves the bin not stored
+void
+segments_write (struct segment_store *store, long int k, const double *dft, int nsum,
+                double winsum, double winsum2)
+{
+    if (store->file < 0) return;
+    if (nsum > store->maxseg) gerror("More segments than planned for the segment store");
+    hdf5_enter();
+    if (nsum > 0) {
+        hsize_t offset[3] = {k, 0, 0}, count[3] = {1, nsum, 2};
+        hid_t memspace = H5Screate_simple(3, count, NULL);
+        hid_t space = H5Dget_space(store->dft);
+        H5Sselect_hyperslab(space, H5S_SELECT_SET, offset, NULL, count, NULL);
+        if (H5Dwrite(store->dft, H5T_NATIVE_DOUBLE, memspace, space, H5P_DEFAULT, dft) < 0)
+            gerror("Error writing segment store");
+        H5Sclose(space);
+        H5Sclose(memspace);
+    }
+    write_value(store->winsum, H5T_NATIVE_DOUBLE, k, &winsum);
+    write_value(store->winsum2, H5T_NATIVE_DOUBLE, k, &winsum2);
+    write_value(store->nsum, H5T_NATIVE_INT, k, &nsum);
+    hdf5_leave();
+    store->stored++;
+}
+
+void
+segments_close (struct segment_store *store)
+{
+    if (store->file < 0) return;
+    printf("Segments: stored %ld of %ld bins\n", store->stored, store->nspec);
+    hdf5_enter();
+    hid_t datasets[4] = {store->dft, store->nsum, store->winsum, store->winsum2};
+    for (int i = 0; i < 4; i++) if (datasets[i] >= 0) H5Dclose(datasets[i]);  /* also after errors in segments_open */
+    H5Fclose(store->file);
+    hdf5_leave();
+    store->file = -1;
+}
@@ -0,0 +1,22 @@
+#ifndef __segments_h
+#define __segments_h
+
+#include "hdf5.h"
+
+#define SEGMENTS_VERSION 2
+
+// --segments: the DFT of every segment of the exact bins, in an HDF5 file read by lpsd-resum
+struct segment_store {
+    hid_t file;			/* -1 if the store is off */
+    hid_t dft, nsum, winsum, winsum2;	/* datasets */
+    long int nspec, maxseg;
+    long int stored;		/* bins written by this run */
+};
+
+void segments_open(struct segment_store *store, tCFG *cfg, tDATA *data, double fmin, double fmax,
+                   long int nread, uint64_t input_id);
+void segments_write(struct segment_store *store, long int k, const double *dft, int nsum,
+                    double winsum, double winsum2);
+void segments_close(struct segment_store *store);
+
+#endif
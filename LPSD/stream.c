@@ -0,0 +1,418 @@
+/********************************************************************************
+    stream.c
+
+    Incremental LPSD of a time series that arrives in blocks, e.g. live data.
+
+    A stream calculates the exact DFTs (METHOD 0) of the bins of cfg. The
+    segments of a bin start every nfft*(1-ovlp) samples, as in getDFT2; a
+    segment is opened when its first sample is pushed, summed as its samples
+    arrive and folded into the sum of |DFT|^2 of the bin when its last sample
+    has arrived. Only the open segments are kept, a few per bin, and no
+    samples. The window is calculated for the samples of each push.
+
+    The state of a stream, the sums and open segments of its bins, can be
+    saved to a file and loaded again to continue it (--state). There the new
+    samples are read from the input by stream_extend, bin by bin as in getDFT2.
+
+    stream_snapshot gives the spectrum of the samples pushed so far. The sums
+    are taken in the same order as in getDFT2, so a snapshot equals a batch run
+    (METHOD 0) over the same samples. As there, only segments that end before
+    the last sample count, and a bin without any segment has no average.
+
+ ********************************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "config.h"
+#include "misc.h"
+#include "errors.h"
+#include "IO.h"
+#include "genwin.h"
+#include "lpsd.h"
+#include "stream.h"
+
+// @brief Start a stream of the bins of cfg (cfg->fmin, fmax, Jdes, nspec, iter), the
+// @brief window cfg->WT and the overlap cfg->ovlp; data, allocated by memalloc for
+// @brief cfg->nspec bins, gets the frequencies of the bins
+void
+stream_open (struct lpsd_stream *s, tCFG *cfg, tDATA *data)
+{
+    tWinInfo wi;
+    double rov, nenbw;
+    long int k, j, count;
+
+    memset(s, 0, sizeof(struct lpsd_stream));
+    calc_params(cfg, data);
+    memcpy(&s->cfg, cfg, sizeof(tCFG));
+    set_window(&s->win, cfg->WT, cfg->reqPSLL, &wi.name[0], &wi.psll, &rov,
+               &wi.nenbw, &wi.w3db, &wi.flatness, &wi.sbin);
+    s->nspec = cfg->nspec;
+    s->window = (double*) xmalloc(2 * STREAMCHUNK * sizeof(double));
+    s->bins = (struct stream_bin*) xmalloc(s->nspec * sizeof(struct stream_bin));
+    for (k = 0; k < s->nspec; k++) {
+        struct stream_bin *b = &s->bins[k];
+        memset(b, 0, sizeof(struct stream_bin));
+        b->nfft = data->nffts[k];
+        b->bin = data->bins[k];
+        long int step = b->nfft * (1.0 - (double) (cfg->ovlp / 100.));
+        if (step < 1) gerror("Overlap leaves no samples between segments");
+        b->nslots = b->nfft / step + 2;
+        b->seg = (struct stream_segment*) xmalloc(b->nslots * sizeof(struct stream_segment));
+        // Window sums over the whole segment, summed in the order of getDFT2
+        for (j = 0; j < b->nfft; j += count) {
+            count = b->nfft - j < STREAMCHUNK ? b->nfft - j : STREAMCHUNK;
+            makewinsincos_indexed(&s->win, b->nfft, b->bin, s->window, &b->winsum, &b->winsum2,
+                                  &nenbw, j, count, j == 0);
+        }
+        data->method[k] = 0;
+        data->psd_real[k] = data->psd_imag[k] = 0;
+    }
+}
+
+// Continue the sum of a memory unit with count windowed samples
+static void
+stream_accumulate (const double *window, const void *samples, int sample_type, long int count,
+                   double *re, double *im)
+{
+    long int i;
+    double sre = *re, sim = *im;
+    switch (sample_type)
+    {
+        case SAMPLE_FLOAT: {
+            const float *x = (const float*) samples;
+            for (i = 0; i < count; i++) { sre += window[i*2] * x[i]; sim += window[i*2 + 1] * x[i]; }
+            break;
+        }
+        case SAMPLE_INT16: {
+            const short *x = (const short*) samples;
+            for (i = 0; i < count; i++) { sre += window[i*2] * x[i]; sim += window[i*2 + 1] * x[i]; }
+            break;
+        }
+        case SAMPLE_INT32: {
+            const int *x = (const int*) samples;
+            for (i = 0; i < count; i++) { sre += window[i*2] * x[i]; sim += window[i*2 + 1] * x[i]; }
+            break;
+        }
+        default: {
+            const double *x = (const double*) samples;
+            for (i = 0; i < count; i++) { sre += window[i*2] * x[i]; sim += window[i*2 + 1] * x[i]; }
+        }
+    }
+    *re = sre;
+    *im = sim;
+}
+
+// Add the samples t0..t1-1 of one segment to it
+static void
+stream_segment_push (struct lpsd_stream *s, struct stream_bin *b, struct stream_segment *seg,
+                     const char *x, size_t sample_size, int sample_type, long int t0, long int t1)
+{
+    double winsum, winsum2, nenbw;
+    long int j, j0 = t0 - seg->start, j1 = t1 - seg->start;
+
+    while (j0 < j1) {
+        // getDFT2 adds the sum of each memory unit to the DFT of the segment
+        j = (j0 / DFTUNIT + 1) * DFTUNIT;
+        if (j > j1) j = j1;
+        makewinsincos_indexed(&s->win, b->nfft, b->bin, s->window, &winsum, &winsum2, &nenbw,
+                              j0, j - j0, true);
+        stream_accumulate(s->window, x + (seg->start + j0 - t0) * sample_size, sample_type, j - j0,
+                          &seg->ure, &seg->uim);
+        if (j % DFTUNIT == 0 || j == b->nfft) {
+            seg->re += seg->ure;
+            seg->im += seg->uim;
+            seg->ure = seg->uim = 0;
+        }
+        j0 = j;
+    }
+}
+
+// Add the samples t0..t1-1 (at x) to bin b, in pieces between the starts and ends of its
+// segments, so that no more segments are open than overlap at one time
+static void
+stream_bin_push (struct lpsd_stream *s, struct stream_bin *b, const char *x, size_t sample_size,
+                 int sample_type, long int t0, long int t1)
+{
+    long int t, end;
+    int i;
+
+    for (t = t0; t < t1; t = end) {
+        if (b->next == t) {
+            if (b->nopen == b->nslots) gerror("Too many open segments in a stream");
+            struct stream_segment *seg = &b->seg[(b->first + b->nopen++) % b->nslots];
+            memset(seg, 0, sizeof(struct stream_segment));
+            seg->start = b->next;
+            b->next += b->nfft * (1.0 - (double) (s->cfg.ovlp / 100.));  /* as getDFT2 */
+        }
+        end = b->next < t1 ? b->next : t1;
+        if (b->nopen > 0 && b->seg[b->first].start + b->nfft < end) end = b->seg[b->first].start + b->nfft;
+        for (i = 0; i < b->nopen; i++)
+            stream_segment_push(s, b, &b->seg[(b->first + i) % b->nslots], x + (t - t0) * sample_size,
+                                sample_size, sample_type, t, end);
+        // Fold the finished segment
+        if (b->nopen > 0 && b->seg[b->first].start + b->nfft == end) {
+            struct stream_segment *seg = &b->seg[b->first];
+            b->total_before = b->total;
+            b->total += seg->re*seg->re + seg->im*seg->im;
+            b->nsum++;
+            b->last_end = end;
+            b->first = (b->first + 1) % b->nslots;
+            b->nopen--;
+        }
+    }
+}
+
+// @brief Add the next n samples (SAMPLE_*) of the time series
+void
+stream_push (struct lpsd_stream *s, const void *samples, int sample_type, long int n)
+{
+    long int i, k, count;
+    size_t size = sample_size(sample_type);
+
+    for (i = 0; i < n; i += count) {
+        count = n - i < STREAMCHUNK ? n - i : STREAMCHUNK;
+        const char *x = (const char*) samples + i * size;
+        for (k = 0; k < s->nspec; k++)
+            stream_bin_push(s, &s->bins[k], x, size, sample_type, s->nsamples + i, s->nsamples + i + count);
+    }
+    s->nsamples += n;
+}
+
+// @brief Bring the stream from s->nsamples to the first nread samples of contents. Unlike
+// @brief stream_push, this goes bin by bin and calculates the window of a bin once for up to
+// @brief STATESEGMENTS of its segments, as getDFT2 does, so the cost is that of the segments
+// @brief that are new or were open.
+void
+stream_extend (struct lpsd_stream *s, struct hdf5_contents *contents, long int nread)
+{
+    double winsum, winsum2, nenbw;
+    long int k, j, u, maxlen = 1, n0 = s->nsamples;
+    int i, ng, iold, nold;
+
+    for (k = 0; k < s->nspec; k++)
+        if (s->bins[k].nfft > maxlen) maxlen = s->bins[k].nfft < DFTUNIT ? s->bins[k].nfft : DFTUNIT;
+    int mapped = map_samples(contents, 0) != NULL;
+    char *buf = mapped ? NULL : (char*) xmalloc(maxlen * contents->sample_size);
+    double *window = (double*) xmalloc(2 * maxlen * sizeof(double));
+    struct stream_segment *grp = (struct stream_segment*) xmalloc(STATESEGMENTS * sizeof(struct stream_segment));
+
+    for (k = 0; k < s->nspec; k++) {
+        struct stream_bin *b = &s->bins[k];
+        struct stream_segment *old = (struct stream_segment*) xmalloc(b->nslots * sizeof(struct stream_segment));
+        for (nold = 0; nold < b->nopen; nold++) old[nold] = b->seg[(b->first + nold) % b->nslots];
+        b->first = b->nopen = 0;
+        for (iold = 0;;) {
+            // The next segments: the open ones, then those starting before nread
+            for (ng = 0; ng < STATESEGMENTS && iold < nold; ng++) grp[ng] = old[iold++];
+            for (; ng < STATESEGMENTS && b->next < nread; ng++) {
+                memset(&grp[ng], 0, sizeof(struct stream_segment));
+                grp[ng].start = b->next;
+                b->next += b->nfft * (1.0 - (double) (s->cfg.ovlp / 100.));  /* as getDFT2 */
+            }
+            if (ng == 0) break;
+
+            // Samples j0..j1-1 of the segments are new
+            long int j0 = b->nfft, j1 = 0;
+            for (i = 0; i < ng; i++) {
+                long int from = n0 > grp[i].start ? n0 - grp[i].start : 0;
+                long int to = nread - grp[i].start < b->nfft ? nread - grp[i].start : b->nfft;
+                if (from < j0) j0 = from;
+                if (to > j1) j1 = to;
+            }
+            for (u = j0 / DFTUNIT * DFTUNIT; u < j1; u += DFTUNIT) {
+                long int w0 = j0 > u ? j0 : u;
+                long int w1 = u + DFTUNIT < j1 ? u + DFTUNIT : j1;
+                makewinsincos_indexed(&s->win, b->nfft, b->bin, window, &winsum, &winsum2, &nenbw,
+                                      w0, w1 - w0, true);
+                for (i = 0; i < ng; i++) {
+                    struct stream_segment *seg = &grp[i];
+                    long int from = n0 > seg->start ? n0 - seg->start : 0;
+                    long int to = nread - seg->start < b->nfft ? nread - seg->start : b->nfft;
+                    if (from < w0) from = w0;
+                    if (to > w1) to = w1;
+                    if (from >= to) continue;
+                    const void *x = mapped ? map_samples(contents, seg->start + from) : buf;
+                    if (!mapped) read_samples(contents, seg->start + from, to - from, buf);
+                    stream_accumulate(window + 2 * (from - w0), x, contents->sample_type, to - from,
+                                      &seg->ure, &seg->uim);
+                    j = to;
+                    if (j % DFTUNIT == 0 || j == b->nfft) {
+                        seg->re += seg->ure;
+                        seg->im += seg->uim;
+                        seg->ure = seg->uim = 0;
+                    }
+                }
+            }
+
+            // Fold the finished segments, keep the others open
+            for (i = 0; i < ng; i++) {
+                struct stream_segment *seg = &grp[i];
+                if (seg->start + b->nfft <= nread) {
+                    b->total_before = b->total;
+                    b->total += seg->re*seg->re + seg->im*seg->im;
+                    b->nsum++;
+                    b->last_end = seg->start + b->nfft;
+                } else {
+                    if (b->nopen == b->nslots) gerror("Too many open segments in a stream");
+                    b->seg[b->nopen++] = *seg;
+                }
+            }
+        }
+        xfree(old);
+    }
+    s->nsamples = nread;
+    xfree(grp);
+    xfree(window);
+    if (buf) xfree(buf);
+}
+
+// @brief Spectrum of the samples pushed so far, in the data of stream_open
+void
+stream_snapshot (struct lpsd_stream *s, tDATA *data)
+{
+    double rslt[4];
+    long int k;
+
+    for (k = 0; k < s->nspec; k++) {
+        struct stream_bin *b = &s->bins[k];
+        double total = b->total;
+        int nsum = b->nsum;
+        // getDFT2 takes the segments that end before the last sample
+        if (nsum > 0 && b->last_end == s->nsamples) {
+            total = b->total_before;
+            nsum--;
+        }
+        rslt[0] = total / nsum * s->cfg.ulsb * s->cfg.ulsb;
+        rslt[1] = 0;
+        rslt[2] = rslt[0];
+        rslt[3] = rslt[1];
+        rslt[0] *= 2. / (s->cfg.fsamp * b->winsum2);
+        rslt[1] *= 2. / (s->cfg.fsamp * b->winsum2);
+        rslt[2] *= 2. / (b->winsum * b->winsum);
+        rslt[3] *= 2. / (b->winsum * b->winsum);
+        data->psd[k] = rslt[0];
+        data->varpsd[k] = rslt[1];
+        data->ps[k] = rslt[2];
+        data->varps[k] = rslt[3];
+        data->avg[k] = nsum;
+    }
+}
+
+// @brief Forget all samples pushed so far
+void
+stream_reset (struct lpsd_stream *s)
+{
+    long int k;
+    for (k = 0; k < s->nspec; k++) {
+        struct stream_bin *b = &s->bins[k];
+        b->next = 0;
+        b->first = b->nopen = 0;
+        b->total = b->total_before = 0;
+        b->nsum = 0;
+        b->last_end = 0;
+    }
+    s->nsamples = 0;
+}
+
+// @brief Write the state of the stream to fn, replacing it only once it is complete
+void
+stream_save (struct lpsd_stream *s, const char *fn, uint64_t tail_hash)
+{
+    struct stream_state_header header;
+    struct stream_state_bin rec;
+    char tmp_fn[FNLEN + 4];
+    long int k;
+    int i;
+
+    snprintf(tmp_fn, sizeof(tmp_fn), "%s.tmp", fn);
+    FILE *fp = fopen(tmp_fn, "wb");
+    if (!fp) gerror1("Error writing state file %s", tmp_fn);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATE_MAGIC, 8);
+    header.version = STATE_VERSION;
+    header.WT = s->cfg.WT;
+    header.reqPSLL = s->cfg.reqPSLL;
+    header.ovlp = s->cfg.ovlp;
+    header.fsamp = s->cfg.fsamp;
+    header.ulsb = s->cfg.ulsb;
+    header.tmin = s->cfg.tmin;
+    snprintf(header.ifn, sizeof(header.ifn), "%s", s->cfg.ifn);
+    snprintf(header.dataset_name, sizeof(header.dataset_name), "%s", s->cfg.dataset_name);
+    header.nspec = s->nspec;
+    header.nsamples = s->nsamples;
+    header.tail_hash = tail_hash;
+    int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    for (k = 0; k < s->nspec && ok; k++) {
+        struct stream_bin *b = &s->bins[k];
+        memset(&rec, 0, sizeof(rec));
+        rec.nfft = b->nfft;
+        rec.bin = b->bin;
+        rec.total = b->total;
+        rec.total_before = b->total_before;
+        rec.nsum = b->nsum;
+        rec.last_end = b->last_end;
+        rec.next = b->next;
+        rec.nopen = b->nopen;
+        ok = fwrite(&rec, sizeof(rec), 1, fp) == 1;
+        for (i = 0; i < b->nopen && ok; i++)
+            ok = fwrite(&b->seg[(b->first + i) % b->nslots], sizeof(struct stream_segment), 1, fp) == 1;
+    }
+    if (fclose(fp) != 0 || !ok || rename(tmp_fn, fn) != 0) gerror1("Error writing state file %s", fn);
+}
+
+// @brief Continue the stream from the state in fn if it has the same bins, window, overlap and
+// @brief scaling, and is of the same input file and dataset
+// @return 1 if the state was loaded (and its tail_hash), 0 if there is none or it does not match
+int
+stream_load (struct lpsd_stream *s, const char *fn, uint64_t *tail_hash)
+{
+    struct stream_state_header header;
+    struct stream_state_bin rec;
+    long int k;
+    int i, ok;
+
+    FILE *fp = fopen(fn, "rb");
+    if (!fp) return 0;
+    ok = fread(&header, sizeof(header), 1, fp) == 1
+        && memcmp(header.magic, STATE_MAGIC, 8) == 0 && header.version == STATE_VERSION
+        && header.WT == s->cfg.WT && header.reqPSLL == s->cfg.reqPSLL && header.ovlp == s->cfg.ovlp
+        && header.fsamp == s->cfg.fsamp && header.ulsb == s->cfg.ulsb && header.tmin == s->cfg.tmin
+        && header.nspec == s->nspec && strncmp(header.ifn, s->cfg.ifn, FNLEN) == 0
+        && strncmp(header.dataset_name, s->cfg.dataset_name, FNLEN) == 0;
+    for (k = 0; k < s->nspec && ok; k++) {
+        struct stream_bin *b = &s->bins[k];
+        ok = fread(&rec, sizeof(rec), 1, fp) == 1
+            && rec.nfft == b->nfft && rec.bin == b->bin && rec.nopen >= 0 && rec.nopen <= b->nslots;
+        if (!ok) break;
+        b->total = rec.total;
+        b->total_before = rec.total_before;
+        b->nsum = rec.nsum;
+        b->last_end = rec.last_end;
+        b->next = rec.next;
+        b->first = 0;
+        b->nopen = rec.nopen;
+        for (i = 0; i < b->nopen && ok; i++)
+            ok = fread(&b->seg[i], sizeof(struct stream_segment), 1, fp) == 1;
+    }
+    fclose(fp);
+    if (!ok) {
+        message1("State file %s does not match this run, starting from the first sample", fn);
+        stream_reset(s);
+        return 0;
+    }
+    s->nsamples = header.nsamples;
+    *tail_hash = header.tail_hash;
+    return 1;
+}
+
+void
+stream_close (struct lpsd_stream *s)
+{
+    long int k;
+    for (k = 0; k < s->nspec; k++) xfree(s->bins[k].seg);
+    xfree(s->bins);
+    xfree(s->window);
+}
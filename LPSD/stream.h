@@ -0,0 +1,64 @@
+#ifndef __stream_h
+#define __stream_h
+
+#include <stdint.h>
+
+#define STATE_MAGIC "LPSDSTAT"
+#define STATE_VERSION 2
+
+// Header of a state file (--state): the stream it belongs to, followed by a
+// stream_state_bin and its open segments for every bin
+struct stream_state_header {
+    char magic[8];
+    int32_t version, WT;
+    double reqPSLL, ovlp, fsamp, ulsb, tmin;
+    int64_t nspec, nsamples;
+    uint64_t tail_hash;		/* of the STATEHASH samples before nsamples */
+    char ifn[FNLEN], dataset_name[FNLEN];	/* the series */
+};
+
+struct stream_state_bin {
+    int64_t nfft;
+    double bin, total, total_before;
+    int64_t nsum, last_end, next, nopen;
+};
+
+// Segment of a bin whose samples have not all arrived yet
+struct stream_segment {
+    long int start;		/* first sample */
+    double re, im;		/* DFT of the memory units (DFTUNIT samples) summed so far */
+    double ure, uim;		/* sum of the current memory unit */
+};
+
+struct stream_bin {
+    long int nfft;
+    double bin;
+    double winsum, winsum2;
+    long int next;		/* first sample of the next segment to open */
+    struct stream_segment *seg;	/* open segments, oldest first, in a ring of nslots */
+    int nslots, first, nopen;
+    double total, total_before;	/* sum of |DFT|^2 of the finished segments, and without the last one */
+    int nsum;			/* finished segments */
+    long int last_end;		/* sample after the last finished segment */
+};
+
+// Exact DFTs (METHOD 0) of the bins of cfg over samples pushed one block at a time
+struct lpsd_stream {
+    tCFG cfg;
+    struct window win;
+    struct stream_bin *bins;
+    long int nspec;
+    long int nsamples;		/* samples pushed so far */
+    double *window;		/* window of STREAMCHUNK samples */
+};
+
+void stream_open(struct lpsd_stream *s, tCFG *cfg, tDATA *data);
+void stream_push(struct lpsd_stream *s, const void *samples, int sample_type, long int n);
+void stream_extend(struct lpsd_stream *s, struct hdf5_contents *contents, long int nread);
+void stream_snapshot(struct lpsd_stream *s, tDATA *data);
+void stream_reset(struct lpsd_stream *s);
+void stream_save(struct lpsd_stream *s, const char *fn, uint64_t tail_hash);
+int stream_load(struct lpsd_stream *s, const char *fn, uint64_t *tail_hash);
+void stream_close(struct lpsd_stream *s);
+
+#endif
@@ -1,6 +1,191 @@
 #!/usr/bin/env sh
 #rm data_0.txt
 
+# Golden runs: ./testing.sh --golden [directory of lpsd-exec and the tools] [input.h5]
+# Every mode runs on the same input and its data lines must be identical to those of
+# the plain METHOD 0 or METHOD 1 run. The input is a 100 Hz series of at least 1000 s
+# in the dataset "strain"; without one a series of two sines in noise is generated.
+# MPIRUN (default: mpirun) starts the MPI run if lpsd-exec is built with MPI, the
+# Python runs need NumPy and a shared liblpsd (-DBUILD_SHARED_LIBS=ON).
+
+# run method output [options]: lpsd-exec on the golden input, $prefix runs it
+run() {
+	m=$1; o=$2; shift 2
+	$prefix "$bin/lpsd-exec" -A 2 -b 0 -e 999.99 -f 100 -h $m -i $dir/in.h5 -l 50 -n 200 -o $o \
+		-r 0 -s 1 -t 40 -T -w -2 -p 100 -x 1 -N 0 -J 200 -u 0 "$@" < /dev/null > $o.log 2>&1
+}
+
+# same a b: the data lines of a and b are identical
+same() {
+	grep -v '^#' $1 > $dir/same.a
+	grep -v '^#' $2 > $dir/same.b
+	[ -s $dir/same.a ] && cmp -s $dir/same.a $dir/same.b
+}
+
+# same4 a b: frequency, PSD, PS and AVG of a and b are identical
+same4() {
+	grep -v '^#' $1 | cut -f1-4 | sed 's/\t*$//' > $dir/same.a
+	grep -v '^#' $2 | cut -f1-4 | sed 's/\t*$//' > $dir/same.b
+	[ -s $dir/same.a ] && cmp -s $dir/same.a $dir/same.b
+}
+
+# check name command...: report whether command succeeds
+check() {
+	name=$1; shift
+	if "$@"; then echo "PASS $name"; else echo "FAIL $name"; fails=$((fails + 1)); fi
+}
+
+golden() {
+	bin=$(cd "${1:-.}" && pwd) || return 1
+	dir=$(mktemp -d) || return 1
+	fails=0
+	prefix=
+	if [ -n "$2" ]; then
+		ln -s "$(cd "$(dirname "$2")" && pwd)/$(basename "$2")" $dir/in.h5
+	else
+		# sin(2 pi 3.3 t) + 0.5 sin(2 pi 17.1 t) + Park-Miller noise, exact in awk
+		awk 'BEGIN { s = 1; pi = atan2(0, -1);
+			for (i = 0; i < 100000; i++) {
+				s = (s * 16807) % 2147483647; t = i / 100;
+				printf "%.2f %.9e\n", t, sin(2*pi*3.3*t) + 0.5*sin(2*pi*17.1*t) + s/2147483647 - 0.5 } }' \
+			> $dir/in.txt
+		"$bin/lpsd-ingest" -T -f 100 -j 1 $dir/in.txt $dir/in.h5 > $dir/ingest.log 2>&1 ||
+			{ cat $dir/ingest.log; return 1; }
+	fi
+	run 0 $dir/ref0.txt --no-journal || { cat $dir/ref0.txt.log; return 1; }
+	run 1 $dir/ref1.txt --no-journal || { cat $dir/ref1.txt.log; return 1; }
+
+	# journal: a METHOD 1 run stopped by SIGINT resumes from its journal
+	prefix="timeout -s INT 3"
+	run 1 $dir/jr.txt
+	prefix=
+	run 1 $dir/jr.txt
+	check "journal resume" same $dir/ref1.txt $dir/jr.txt
+	grep -q "Journal: resuming" $dir/jr.txt.log || echo "     (the first run ended before SIGINT)"
+
+	# lpsd-merge: a gap is reported as the --bins range to run, then filled
+	run 0 $dir/p0.txt --no-journal -n 80 -N 0
+	run 0 $dir/p2.txt --no-journal -n 80 -N 2
+	"$bin/lpsd-merge" -o $dir/mg.txt $dir/p2.txt $dir/p0.txt > $dir/mg.log 2>&1
+	check "lpsd-merge gap" [ $? -eq 2 ]
+	check "lpsd-merge gap range" grep -q -- "--bins 80:160" $dir/mg.log
+	run 0 $dir/p1.txt --no-journal -n 80 -N 1
+	"$bin/lpsd-merge" -o $dir/mg.txt $dir/p2.txt $dir/p1.txt $dir/p0.txt > $dir/mg.log 2>&1
+	check "lpsd-merge text" same $dir/ref0.txt $dir/mg.txt
+	for N in 0 1 2; do
+		run 0 $dir/p$N.h5 --no-journal -n 80 -N $N --output-format hdf5
+	done
+	"$bin/lpsd-merge" -o $dir/mgh.txt $dir/p2.h5 $dir/p0.h5 $dir/p1.h5 > $dir/mgh.log 2>&1
+	check "lpsd-merge HDF5" same4 $dir/ref0.txt $dir/mgh.txt
+
+	# lpsd-ingest: several threads, small chunks and compression give the same samples
+	if [ -f $dir/in.txt ]; then
+		"$bin/lpsd-ingest" -T -f 100 -j 4 -k 1000 -z 1 $dir/in.txt $dir/in4.h5 > $dir/in4.log 2>&1
+		run 0 $dir/in4.txt --no-journal -i $dir/in4.h5
+		check "lpsd-ingest threads" same $dir/ref0.txt $dir/in4.txt
+	fi
+
+	# lpsd-repack: the rechunked input gives the same spectrum
+	"$bin/lpsd-repack" -f 100 -s 1 -t 40 -J 200 -l 50 $dir/in.h5 $dir/rp.h5 > $dir/rp.log 2>&1
+	run 0 $dir/rp.txt --no-journal -i $dir/rp.h5
+	check "lpsd-repack" same $dir/ref0.txt $dir/rp.txt
+
+	# --workers: forked workers share the bins and blocks
+	run 0 $dir/w0.txt --no-journal --workers 3
+	check "workers METHOD 0" same $dir/ref0.txt $dir/w0.txt
+	run 1 $dir/w1.txt --no-journal --workers 3
+	check "workers METHOD 1" same $dir/ref1.txt $dir/w1.txt
+
+	# MPI: ranks share the bins and blocks; without MPI the stubs run the plain runs above
+	if ldd "$bin/lpsd-exec" 2>/dev/null | grep -q libmpi; then
+		export OMPI_ALLOW_RUN_AS_ROOT=1 OMPI_ALLOW_RUN_AS_ROOT_CONFIRM=1 OMPI_MCA_rmaps_base_oversubscribe=1
+		prefix="${MPIRUN:-mpirun} -np 3"
+		run 0 $dir/mp0.txt --no-journal
+		check "MPI METHOD 0" same $dir/ref0.txt $dir/mp0.txt
+		run 1 $dir/mp1.txt --no-journal
+		check "MPI METHOD 1" same $dir/ref1.txt $dir/mp1.txt
+		prefix=
+	else
+		echo "SKIP MPI (lpsd-exec is built without MPI)"
+	fi
+
+	# --cache: the second run restores every bin
+	for m in 0 1; do
+		run $m $dir/c$m.txt --no-journal --cache $dir/cache
+		run $m $dir/c$m.txt --no-journal --cache $dir/cache
+		check "cache METHOD $m" same $dir/ref$m.txt $dir/c$m.txt
+		check "cache METHOD $m restored" grep -q "Cache: restored 200 of 200 bins" $dir/c$m.txt.log
+	done
+
+	# Python: errors of a calculation raise RuntimeError and leave the library usable,
+	# a stream equals lpsd() of the same samples, and lpsd() equals lpsd-exec
+	if [ -f $dir/in.txt ] && [ -f "$bin/liblpsd.so" ] && python3 -c "import numpy" 2>/dev/null; then
+		printf 'not HDF5\n' > $dir/bad.h5
+		LPSD_LIBRARY="$bin/liblpsd.so" PYTHONPATH="$(cd "$(dirname "$0")" && pwd)/python" \
+			python3 - $dir > $dir/py.log 2>&1 <<'EOF' || { echo "FAIL Python"; fails=$((fails + 1)); }
+import sys
+import numpy as np
+import lpsd
+
+d = sys.argv[1]
+p = dict(fmin=1, fmax=40, ovlp=50, nspec=200, Jdes=200, WT=-2, reqPSLL=100, LR=0)
+x = np.loadtxt(d + "/in.txt")[:, 1]
+
+
+class File:
+    filename = d + "/bad.h5"
+
+
+class Dataset:  # read from its file, like an h5py dataset
+    file = File()
+    name = "/strain"
+
+
+try:
+    lpsd.lpsd(Dataset(), 100, **p)
+    print("FAIL capi error (no exception)")
+except RuntimeError:
+    print("PASS capi error")
+s = lpsd.lpsd(x, 100, **p)
+ref = [l.split("\t")[:4] for l in open(d + "/ref0.txt") if not l.startswith("#")]
+ok = [["%e" % f, "%e" % a, "%e" % b, "%d" % n] for f, a, b, n in zip(s.fspec, s.psd, s.ps, s.avg)] == ref
+print("PASS" if ok else "FAIL", "capi after error")
+st = lpsd.Stream(100, **p)
+ok = True
+for n in (50000, 100000):
+    for i in range(st.nsamples, n, 7777):
+        st.push(x[i:min(i + 7777, n)])
+    snap, s = st.snapshot(), lpsd.lpsd(x[:n], 100, **p)
+    ok = ok and all(np.array_equal(snap[k], getattr(s, k), equal_nan=True) for k in ("psd", "ps", "avg"))
+print("PASS" if ok else "FAIL", "stream")
+EOF
+		grep -E '^(PASS|FAIL)' $dir/py.log
+		fails=$((fails + $(grep -c '^FAIL' $dir/py.log)))
+	else
+		echo "SKIP Python (needs the generated input, liblpsd.so and NumPy)"
+	fi
+
+	# --state: a run over the first half, then one that adds the second half
+	run 0 $dir/st.txt --no-journal --state $dir/st.bin -e 499.99
+	run 0 $dir/st.txt --no-journal --state $dir/st.bin
+	check "state" same $dir/ref0.txt $dir/st.txt
+	check "state resumed" grep -q "State: 50000 samples" $dir/st.txt.log
+
+	# --segments: the store does not change the run, lpsd-resum of all segments is the mean
+	run 0 $dir/sg.txt --no-journal --segments $dir/sg.h5
+	check "segments" same $dir/ref0.txt $dir/sg.txt
+	"$bin/lpsd-resum" -o $dir/rs.txt $dir/sg.h5 > $dir/rs.log 2>&1
+	check "lpsd-resum" same4 $dir/ref0.txt $dir/rs.txt
+
+	if [ $fails -gt 0 ]; then echo "$fails failed, see $dir"; return 1; fi
+	rm -rf $dir
+}
+
+if [ "$1" = "--golden" ]; then
+	golden "$2" "$3"
+	exit $?
+fi
+
 tim=100
 full=500
 strt=4091.936
@@ -41,6 +226,6 @@ i=0
 	-N ${i} \
 	-J ${full} \
 
-#-i ~/projects/geo-dark-matter/testing/10000s_TS.txt \
+#-i ~/projects/geo-dark-matter/timeseries/testing_TS/1000s_TS_modified.txt \
 
 # If you forget a variable (N or J in particular) everything will break and fill up the out files with 1000000000000 lines
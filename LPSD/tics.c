@@ -5,9 +5,8 @@
 #include "config.h"
 #include "tics.h"
 
-static char tics[TICLEN];	/* contains gnuplot commands for nice tics */
-
-void label(int i, int last)
+/* tics: gnuplot commands for nice tics, appended to */
+void label(char *tics, int i, int last)
 {
 	if (abs(i)>1)
 		sprintf(&tics[strlen(tics)],"\"10^{%d}\" 1e%d", i, i);
@@ -22,7 +21,7 @@ void label(int i, int last)
 		sprintf(&tics[strlen(tics)],",\\\n");
 }
 
-void sublabel(int i)
+void sublabel(char *tics, int i)
 {
 	int j;
 	for (j = 2; j <= 9; j++)
@@ -38,20 +37,18 @@ void sublabel(int i)
 		min min exponent
 		max max exponent
 	result
-		string with gnuplot command for nice tics
+		s, string with gnuplot command for nice tics (TICLEN chars)
 */
 void maketics(char *s, char axis, int min, int max)
 {
 	int i;
-	memset(tics,0,TICLEN);
-	sprintf(tics, "set %ctics (\\\n", axis);
+	memset(s,0,TICLEN);
+	sprintf(s, "set %ctics (\\\n", axis);
 	for (i = min; i < max; i++) {
-		label(i, 0);
-		sublabel(i);
+		label(s, i, 0);
+		sublabel(s, i);
 	}
-	label(max, 1);
-		
-	strcpy(s,tics);
+	label(s, max, 1);
 }
 
 /*
@@ -1,8 +1,8 @@
 #ifndef __tics_h
 #define __tics_h
 
-void label (int i, int last);
-void sublabel (int i);
+void label (char *tics, int i, int last);
+void sublabel (char *tics, int i);
 void maketics(char *s, char axis, int min, int max);
 
 #endif
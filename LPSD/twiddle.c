@@ -0,0 +1,146 @@
+/********************************************************************************
+    twiddle.c
+
+    Cache of FFT twiddle factor tables.
+
+    A table holds cos/sin(2 pi k / n) for k < len. A table for (n', len') also
+    serves any request (n, len) with n' = s*n and s*(len-1) < len' by reading
+    every s-th entry, so one table of the largest FFT size serves all recursion
+    levels and all smaller FFTs. Tables are reference counted; tables that are
+    no longer used stay in the cache until the cache exceeds its size limit,
+    at which point the least recently used ones are freed. The cache is shared
+    by all spectra calculated in one process.
+
+ ********************************************************************************/
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "misc.h"
+#include "errors.h"
+#include "twiddle.h"
+
+static struct twiddle_table *tables = NULL;
+static size_t cache_limit = TWIDDLE_CACHE_DEFAULT;
+static unsigned long int use_counter = 0;
+static struct twiddle_stats stats = {0};
+static pthread_mutex_t twiddle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+table_bytes (const struct twiddle_table *t)
+{
+    return 2 * t->len * sizeof(double);
+}
+
+static void
+free_table (struct twiddle_table *t)
+{
+    stats.bytes -= table_bytes(t);
+    xfree(t->cos);
+    xfree(t->sin);
+    xfree(t);
+}
+
+// Free unused tables, least recently used first, until the cache fits its limit
+static void
+evict (void)
+{
+    while (stats.bytes > cache_limit) {
+        struct twiddle_table **p, **lru = NULL;
+        for (p = &tables; *p; p = &(*p)->next)
+            if ((*p)->refcount == 0 && (!lru || (*p)->last_use < (*lru)->last_use)) lru = p;
+        if (!lru) return;  /* everything left is in use */
+        struct twiddle_table *t = *lru;
+        *lru = t->next;
+        free_table(t);
+        stats.evicted++;
+    }
+}
+
+// @brief Get a twiddle table for angles 2 pi k / n, k < len
+// @param stride: set to s, entry k of the request is at index s*k of the returned table
+// @brief The table must be returned with twiddle_release
+const struct twiddle_table*
+twiddle_get (long int n, long int len, long int *stride)
+{
+    struct twiddle_table *t, *best = NULL;
+
+    pthread_mutex_lock(&twiddle_lock);
+    // Smallest cached table that covers the request
+    for (t = tables; t; t = t->next) {
+        if (t->n % n) continue;
+        long int s = t->n / n;
+        if (s * (len - 1) >= t->len) continue;
+        if (!best || t->len < best->len) best = t;
+    }
+    if (best) {
+        stats.reused++;
+    } else {
+        double exp_factor = 2.0 * M_PI / ((double) n);
+        best = (struct twiddle_table*) xmalloc(sizeof(struct twiddle_table));
+        best->n = n;
+        best->len = len;
+        best->cos = (double*) xmalloc(len*sizeof(double));
+        best->sin = (double*) xmalloc(len*sizeof(double));
+        for (long int k = 0; k < len; k++) {
+            best->cos[k] = cos(k*exp_factor);
+            best->sin[k] = sin(k*exp_factor);
+        }
+        best->refcount = 0;
+        best->next = tables;
+        tables = best;
+        stats.built++;
+        stats.bytes += table_bytes(best);
+    }
+    best->refcount++;
+    best->last_use = ++use_counter;
+    *stride = best->n / n;
+    evict();
+    pthread_mutex_unlock(&twiddle_lock);
+    return best;
+}
+
+void
+twiddle_release (const struct twiddle_table *table)
+{
+    pthread_mutex_lock(&twiddle_lock);
+    ((struct twiddle_table*) table)->refcount--;
+    evict();
+    pthread_mutex_unlock(&twiddle_lock);
+}
+
+// @brief Bytes of tables kept in the cache; tables in use are never freed
+void
+twiddle_set_cache_limit (size_t bytes)
+{
+    pthread_mutex_lock(&twiddle_lock);
+    cache_limit = bytes;
+    evict();
+    pthread_mutex_unlock(&twiddle_lock);
+}
+
+void
+twiddle_get_stats (struct twiddle_stats *_stats)
+{
+    pthread_mutex_lock(&twiddle_lock);
+    *_stats = stats;
+    pthread_mutex_unlock(&twiddle_lock);
+}
+
+// @brief Free all tables that are not in use; tables of FFTs running in other threads stay
+void
+twiddle_clear (void)
+{
+    struct twiddle_table **p = &tables;
+    pthread_mutex_lock(&twiddle_lock);
+    while (*p) {
+        struct twiddle_table *t = *p;
+        if (t->refcount) {
+            p = &t->next;
+            continue;
+        }
+        *p = t->next;
+        free_table(t);
+    }
+    pthread_mutex_unlock(&twiddle_lock);
+}
@@ -0,0 +1,29 @@
+#ifndef __twiddle_h
+#define __twiddle_h
+
+#include <stddef.h>
+
+#define TWIDDLE_CACHE_DEFAULT (256L << 20)	/* bytes of unused tables kept for reuse */
+
+// Twiddle factors cos(2 pi k / n), sin(2 pi k / n) for k = 0..len-1
+struct twiddle_table {
+    long int n, len;
+    double *cos, *sin;
+    int refcount;               /* users of the table, only unused tables are evicted */
+    unsigned long int last_use; /* for LRU eviction */
+    struct twiddle_table *next;
+};
+
+// Cache statistics
+struct twiddle_stats {
+    long int built, reused, evicted;
+    size_t bytes;               /* bytes currently held by the cache */
+};
+
+const struct twiddle_table *twiddle_get(long int n, long int len, long int *stride);
+void twiddle_release(const struct twiddle_table *table);
+void twiddle_set_cache_limit(size_t bytes);
+void twiddle_get_stats(struct twiddle_stats *stats);
+void twiddle_clear(void);
+
+#endif
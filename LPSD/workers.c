@@ -0,0 +1,394 @@
+/********************************************************************************
+    workers.c
+
+    Local multi-process coordinator for --workers. run_workers forks the
+    workers, each connected to this process by a Unix socket pair, and hands out
+    work units one at a time, so fast workers take more of them. A worker
+    calculates its unit and sends back the journal records of the unit's bins,
+    which the coordinator stores in data and in the journal as a serial run does.
+
+    A worker that dies is replaced and its unit issued again, up to WORKRETRIES
+    times; errors (gerror) end the worker, not the error trap of the caller that
+    the forked process inherited. Once no unit is left to issue, idle workers duplicate the unit that
+    has been in progress longest, so a slow worker does not hold up the end of
+    the run; the first result of a unit is kept.
+
+ ********************************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "config.h"
+#include "misc.h"
+#include "errors.h"
+#include "journal.h"
+#include "workers.h"
+
+enum { UNIT_PENDING, UNIT_ISSUED, UNIT_DONE };
+
+// Result of a unit, followed by ntotals doubles and nrec journal records
+struct result_header {
+    int64_t unit;
+    int64_t nrec;
+};
+
+struct worker {
+    pid_t pid;
+    int fd;			/* coordinator end of the socket pair, -1 if not running */
+    long int unit;		/* unit in progress, -1 if idle */
+    double issued;		/* time the unit was issued */
+};
+
+struct coordinator {
+    int nworkers;
+    struct worker *w;
+    const struct work_unit *units;
+    long int nunits, cursor, ndone;
+    char *state;		/* UNIT_PENDING, UNIT_ISSUED or UNIT_DONE */
+    int *copies;		/* workers calculating each unit */
+    int *failures;		/* workers lost on each unit */
+    long int bins, bins_done;
+    struct pollfd *fds;
+    int *index;			/* worker of fds[i] */
+    void (*old_sigpipe)(int);
+    struct error_cleanup cleanup;	/* stops the workers when an error returns to a trap */
+    const struct worker_ops *ops;
+    void *ctx;
+    tDATA *data;
+    long int nspec;
+    struct journal *jrnl;
+};
+
+static double
+now_s (void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int
+write_all (int fd, const void *buf, size_t n)
+{
+    const char *p = (const char*) buf;
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return 0;
+        p += w;
+        n -= w;
+    }
+    return 1;
+}
+
+// @return 0 on end of file or error
+static int
+read_all (int fd, void *buf, size_t n)
+{
+    char *p = (char*) buf;
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return 0;
+        p += r;
+        n -= r;
+    }
+    return 1;
+}
+
+// Calculate the units sent by the coordinator until it closes the socket
+static void
+worker_main (struct coordinator *c, int fd, int index)
+{
+    const struct worker_ops *ops = c->ops;
+    int64_t u;
+    struct error_trap trap;
+
+    if (setjmp(trap.env)) {
+        fprintf(stderr, "%s\n", trap.msg);
+        _exit(1);
+    }
+    set_error_trap(&trap);
+    ops->setup(c->ctx, index);
+    while (read_all(fd, &u, sizeof(u))) {
+        const struct work_unit *unit = &c->units[u];
+        long int k, n = unit->k1 - unit->k0;
+
+        if (ops->ntotals > 0) memset(ops->totals, 0, ops->ntotals*sizeof(double));
+        ops->compute(c->ctx, unit->i0, unit->i1);
+
+        struct result_header header = {u, n};
+        struct journal_record *rec = (struct journal_record*) xmalloc(n*sizeof(struct journal_record));
+        for (k = 0; k < n; k++) journal_record_fill(&rec[k], c->data, unit->k0 + k);
+        int ok = write_all(fd, &header, sizeof(header))
+                 && write_all(fd, ops->totals, ops->ntotals*sizeof(double))
+                 && write_all(fd, rec, n*sizeof(struct journal_record));
+        xfree(rec);
+        if (!ok) break;
+    }
+    _exit(0);
+}
+
+static void
+spawn (struct coordinator *c, int i)
+{
+    int j, sv[2];
+
+    fflush(stdout);
+    fflush(stderr);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) gerror("Error creating a worker socket");
+    pid_t pid = fork();
+    if (pid < 0) gerror("Error forking a worker process");
+    if (pid == 0) {
+        // The coordinator keeps the journal and handles the signals of the run
+        close(sv[0]);
+        for (j = 0; j < c->nworkers; j++) if (c->w[j].fd >= 0) close(c->w[j].fd);
+        if (c->jrnl->fd >= 0) close(c->jrnl->fd);
+        c->jrnl->fd = -1;
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGUSR1, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+#ifdef __linux__
+        // A worker must not outlive the coordinator, e.g. on SIGTERM
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() == 1) _exit(0);
+#endif
+        worker_main(c, sv[1], i);
+    }
+    close(sv[1]);
+    c->w[i].pid = pid;
+    c->w[i].fd = sv[0];
+    c->w[i].unit = -1;
+}
+
+// Pending units in order, then a second copy of the unit in progress for the longest time
+// (the first copy of a unit may still run after the second is done); -1 if there is none
+static long int
+next_unit (struct coordinator *c)
+{
+    long int best = -1;
+    double oldest = 0;
+    int i;
+
+    for (; c->cursor < c->nunits; c->cursor++)
+        if (c->state[c->cursor] == UNIT_PENDING) return c->cursor;
+    for (i = 0; i < c->nworkers; i++) {
+        long int u = c->w[i].unit;
+        if (u >= 0 && c->state[u] != UNIT_DONE && c->copies[u] == 1
+            && (best < 0 || c->w[i].issued < oldest)) {
+            best = u;
+            oldest = c->w[i].issued;
+        }
+    }
+    return best;
+}
+
+// Reap worker i, issue its unit again and start a new worker
+static void
+worker_lost (struct coordinator *c, int i)
+{
+    struct worker *w = &c->w[i];
+    int status = 0;
+
+    close(w->fd);
+    w->fd = -1;
+    kill(w->pid, SIGKILL);
+    waitpid(w->pid, &status, 0);
+    long int u = w->unit;
+    w->unit = -1;
+    if (u >= 0) {
+        printf("\nWorker %d (pid %d) stopped on bins %ld..%ld (%s %d), issuing them again\n",
+               i, (int) w->pid, c->units[u].k0, c->units[u].k1,
+               WIFSIGNALED(status) ? "signal" : "status",
+               WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+        c->copies[u]--;
+        if (c->state[u] != UNIT_DONE && c->copies[u] == 0) {
+            if (++c->failures[u] > WORKRETRIES) {
+                char bins[64];
+                snprintf(bins, sizeof(bins), "%ld..%ld", c->units[u].k0, c->units[u].k1);
+                gerror1("Bins %s failed on too many workers", bins);
+            }
+            c->state[u] = UNIT_PENDING;
+            if (u < c->cursor) c->cursor = u;
+        }
+    }
+    if (c->ndone < c->nunits) spawn(c, i);
+}
+
+static void
+issue (struct coordinator *c, int i)
+{
+    long int u = next_unit(c);
+    if (u < 0) return;
+
+    int64_t msg = u;
+    c->w[i].unit = u;
+    c->w[i].issued = now_s();
+    c->copies[u]++;
+    c->state[u] = UNIT_ISSUED;
+    if (!write_all(c->w[i].fd, &msg, sizeof(msg))) worker_lost(c, i);
+}
+
+// Read the result of worker i and store it, unless another copy of the unit was first
+static void
+receive (struct coordinator *c, int i)
+{
+    struct worker *w = &c->w[i];
+    struct result_header header;
+    long int u = w->unit, k, k0;
+    int ntotals = c->ops->ntotals;
+
+    if (u < 0 || !read_all(w->fd, &header, sizeof(header))
+        || header.unit != u || header.nrec != c->units[u].k1 - c->units[u].k0) {
+        worker_lost(c, i);
+        return;
+    }
+    long int n = header.nrec;
+    double *totals = (double*) xmalloc((ntotals + 1)*sizeof(double));
+    struct journal_record *rec = (struct journal_record*) xmalloc(n*sizeof(struct journal_record));
+    int ok = read_all(w->fd, totals, ntotals*sizeof(double))
+             && read_all(w->fd, rec, n*sizeof(struct journal_record));
+    for (k = 0; ok && k < n; k++)
+        ok = journal_record_restore(&rec[k], c->data, c->nspec) == c->units[u].k0 + k;
+    xfree(rec);
+    if (!ok) {
+        xfree(totals);
+        worker_lost(c, i);
+        return;
+    }
+    w->unit = -1;
+    c->copies[u]--;
+
+    if (c->state[u] != UNIT_DONE) {
+        // A copy of this unit may still run, the restored data is the same
+        for (k = 0; k < ntotals; k++) c->ops->totals[k] += totals[k];
+        for (k0 = k = c->units[u].k0; k <= c->units[u].k1; k++) {
+            if (k < c->units[u].k1 && !journal_done(c->jrnl, k)) continue;
+            journal_append(c->jrnl, c->data, k0, k);
+            k0 = k + 1;
+        }
+        c->state[u] = UNIT_DONE;
+        c->ndone++;
+        c->bins_done += n;
+    }
+    xfree(totals);
+}
+
+// Stop the workers that still run and free the coordinator, after the run or an error
+static void
+release_coordinator (void *_c)
+{
+    struct coordinator *c = (struct coordinator*) _c;
+    for (int i = 0; i < c->nworkers; i++) {
+        if (c->w[i].fd < 0) continue;
+        kill(c->w[i].pid, SIGKILL);
+        close(c->w[i].fd);
+        waitpid(c->w[i].pid, NULL, 0);
+        c->w[i].fd = -1;
+    }
+    signal(SIGPIPE, c->old_sigpipe);
+    xfree(c->fds);
+    xfree(c->index);
+    xfree(c->w);
+    xfree(c->state);
+    xfree(c->copies);
+    xfree(c->failures);
+}
+
+// @brief Calculate the units with nworkers forked processes; the results go to data and jrnl
+// @brief Units whose bins are all in the journal are skipped. ops->totals of the units are
+// @brief summed up
+void
+run_workers (int nworkers, const struct work_unit *units, long int nunits,
+             const struct worker_ops *ops, void *ctx,
+             tDATA *data, long int nspec, struct journal *jrnl)
+{
+    struct coordinator c;
+    long int u, k;
+    int i, n;
+
+    c.nworkers = nworkers;
+    c.units = units;
+    c.nunits = nunits;
+    c.cursor = c.ndone = 0;
+    c.bins = c.bins_done = 0;
+    c.ops = ops;
+    c.ctx = ctx;
+    c.data = data;
+    c.nspec = nspec;
+    c.jrnl = jrnl;
+    c.state = (char*) xmalloc(nunits + 1);
+    c.copies = (int*) xmalloc((nunits + 1)*sizeof(int));
+    c.failures = (int*) xmalloc((nunits + 1)*sizeof(int));
+    for (u = 0; u < nunits; u++) {
+        for (k = units[u].k0; k < units[u].k1 && journal_done(jrnl, k); k++);
+        c.state[u] = k < units[u].k1 ? UNIT_PENDING : UNIT_DONE;
+        if (c.state[u] == UNIT_DONE) c.ndone++;
+        else c.bins += units[u].k1 - units[u].k0;
+        c.copies[u] = c.failures[u] = 0;
+    }
+    if (c.ndone == nunits) {
+        xfree(c.state);
+        xfree(c.copies);
+        xfree(c.failures);
+        return;
+    }
+
+    // A worker that died must not stop the coordinator writing to its socket
+    c.old_sigpipe = signal(SIGPIPE, SIG_IGN);
+    c.w = (struct worker*) xmalloc(nworkers*sizeof(struct worker));
+    for (i = 0; i < nworkers; i++) c.w[i].fd = -1;
+    struct pollfd *fds = c.fds = (struct pollfd*) xmalloc(nworkers*sizeof(struct pollfd));
+    int *index = c.index = (int*) xmalloc(nworkers*sizeof(int));
+    push_cleanup(&c.cleanup, release_coordinator, &c);
+    for (i = 0; i < nworkers; i++) spawn(&c, i);
+
+    double print = now_s();
+    while (c.ndone < c.nunits) {
+        for (i = 0; i < nworkers; i++)
+            if (c.w[i].fd >= 0 && c.w[i].unit < 0) issue(&c, i);
+
+        for (i = n = 0; i < nworkers; i++) {
+            if (c.w[i].unit < 0) continue;
+            fds[n].fd = c.w[i].fd;
+            fds[n].events = POLLIN;
+            fds[n].revents = 0;
+            index[n++] = i;
+        }
+        if (poll(fds, n, -1) < 0) {
+            if (errno == EINTR) continue;
+            gerror("Error waiting for the workers");
+        }
+        for (i = 0; i < n; i++)
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) receive(&c, index[i]);
+
+        if (now_s() - print > PSTEP) {
+            print = now_s();
+            printf("\b\b\b\b\b\b%5.1f%%", 100. * c.bins_done / c.bins);
+            fflush(stdout);
+        }
+    }
+
+    // Idle workers exit when their socket is closed, copies of finished units are stopped
+    for (i = 0; i < nworkers; i++) {
+        if (c.w[i].fd < 0) continue;
+        if (c.w[i].unit >= 0) kill(c.w[i].pid, SIGKILL);
+        close(c.w[i].fd);
+        waitpid(c.w[i].pid, NULL, 0);
+        c.w[i].fd = -1;
+    }
+    pop_cleanup(&c.cleanup);
+    release_coordinator(&c);
+}
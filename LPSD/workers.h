@@ -0,0 +1,22 @@
+#ifndef __workers_h
+#define __workers_h
+
+// A unit of work: items i0..i1-1 (bins or blocks) that calculate the data bins k0..k1-1
+struct work_unit {
+    long int i0, i1;
+    long int k0, k1;
+};
+
+// Callbacks of run_workers; both are called in the worker processes
+struct worker_ops {
+    void (*setup)(void *ctx, int worker);              /* once per worker process, e.g. open the input */
+    void (*compute)(void *ctx, long int i0, long int i1);  /* calculate items i0..i1-1 into data */
+    double *totals;        /* statistics of the calculation, zeroed before and summed over the units */
+    int ntotals;
+};
+
+void run_workers(int nworkers, const struct work_unit *units, long int nunits,
+                 const struct worker_ops *ops, void *ctx,
+                 tDATA *data, long int nspec, struct journal *jrnl);
+
+#endif
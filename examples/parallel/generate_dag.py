@@ -10,7 +10,7 @@ with open("lpsd.dag", "w") as f:
         f.writelines([f"JOB PSD{idx} parallel.sub\n"])
     f.writelines(["\n"])
     for idx in range(opts.number):
-        f.writelines([f"VARS PSD{idx} iteration=\"{idx}\"\n"])
+        f.writelines([f"VARS PSD{idx} iteration=\"{idx}\" bins=\"\"\n"])
 
 if not os.path.isdir("dag_output/"):
     os.mkdir("dag_output/")
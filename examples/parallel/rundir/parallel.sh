@@ -1,12 +1,23 @@
 #!/usr/bin/env sh
 
-#Declare iteration flag variable
-for x in "$@"; do
-    case $x in
+#Declare iteration, bin range and planning flag variables
+while [ $# -gt 0 ]; do
+    case $1 in
         -i|--iteration)
         iter="$2"
         shift 2
         ;;
+        -b|--bins)
+        bins="$2"
+        shift 2
+        ;;
+        -p|--plan)
+        plan="--plan-partitions $2"
+        shift 2
+        ;;
+        *)
+        shift
+        ;;
     esac
 done
 
@@ -31,6 +42,11 @@ Nfreqs_full=5098893
 # Set iter=0 and n=${full}
 batch_size=5000
 
+# A bin range from the partition plan (lpsd.dag) replaces the equal batches
+if [ -n "${bins}" ]; then
+    range="--bins ${bins}"
+fi
+
 ../../../LPSD/lpsd-exec \
 	-A 2 \
 	-b 0 \
@@ -48,7 +64,8 @@ batch_size=5000
 	-w -2 \
 	-p 238.13 \
 	-x 1 \
-	-N ${iter} \
+	-N ${iter:-0} \
 	-J ${Nfreqs_full} \
+	${range} ${plan}
 
 # If you forget a variable (N or J in particular) everything will break and fill up the out files with 1000000000000 lines
@@ -16,6 +16,8 @@ TSlength=50000
 filename=/path/to/file/filename.txt
 # Declare the size of each batch
 batch_size=5000
+# Or set a number of partitions of equal estimated cost (lpsd-exec --plan-partitions)
+partitions=
 
 # Calculate the required number of bins for this resolution
 Nfreqs_full=`python3 Nfreqs.py --fmin ${fmin} --fmax ${fmax} --resolution ${resolution} --TSlength ${TSlength}`
@@ -34,6 +36,17 @@ sed -i "s;filename=.*;filename=${filename};" parallel.sh
 sed -i "s/Nfreqs_full=.*/Nfreqs_full=${Nfreqs_full}/" parallel.sh
 sed -i "s/batch_size=.*/batch_size=${batch_size}/" parallel.sh
 
+# Write lpsd.dag: equal batches, or partitions planned by lpsd-exec
+make_dag() {
+    if [ -z "${partitions}" ]; then
+        python3 ../generate_dag.py --number ${Nbatches}
+    else
+        sh parallel.sh --plan ${partitions}
+        mkdir -p dag_output/
+        for idx in $(seq 0 $((partitions - 1))); do mkdir -p dag_output/run_${idx}/; done
+    fi
+}
+
 # Check if restart is desired and generate run files/dir
 if [ -z "${rest}" ]; then
     if [ -f "lpsd.dag" ]; then
@@ -41,14 +54,14 @@ if [ -z "${rest}" ]; then
     else
         echo "Starting new run"    
         mkdir outputs/
-        python3 ../generate_dag.py --number ${Nbatches}
+        make_dag
     fi
 else
     echo "Restarting run"
     rm lpsd.dag*
     rm -r dag_output/*
     rm outputs/*
-    python3 ../generate_dag.py --number ${Nbatches}
+    make_dag
 fi
 
 # Submit job
@@ -35,17 +35,24 @@ def distr_var(x, y):
 
 
 # TODO: extract settings from nohup.out
-def main(filename):
-    """Find peaks in a block-approximation output file."""
+def main(filename, epsilon=None):
+    """
+    Find peaks in a block-approximation output file.
+
+    epsilon: block width of outputs written without a block table; otherwise the
+             epsilon of every block is read from the table.
+    """
     # Configure data
     fs = 16384  # Hz
     fmin = 10  # Hz
     fmax = 8192  # Hz
     resolution = 1e-6
-    epsilon = 0.1
     
     # Get data & block positions
-    pf = PeakFinder(fs=fs, resolution=resolution, fmin=fmin, fmax=fmax, epsilon=epsilon, name=filename)
+    settings = dict(fs=fs, resolution=resolution, fmin=fmin, fmax=fmax, name=filename)
+    if epsilon is not None:
+        settings["epsilon"] = epsilon
+    pf = PeakFinder(**settings)
     positions = np.fromiter(pf.block_position_gen(), dtype=int)
     
     # Configure analysis
@@ -1,5 +1,6 @@
 """Class to find peaks in LPSD output."""
 import csv
+import h5py
 import numpy as np
 from matplotlib import pyplot as plt
 from scipy.optimize import curve_fit as fit
@@ -19,6 +20,11 @@ class PeakFinder:
                 setattr(self, name, value)
             else:
                 print(f"[PeakFinder] Unknown parameter '{name}', ignoring..")
+        # The block table of the output gives epsilon per block; it is only required without one
+        self.blocks = utils.read_block_table(self.name) if "name" not in required_attrs else None
+        if self.blocks is not None and "epsilon" in required_attrs:
+            required_attrs.remove("epsilon")
+            self.epsilon = None
         # Check if all required attributes were set
         if len(required_attrs) > 0:
             raise ValueError("Missing attributes for PeakFinder.init: " + ", ".join(required_attrs))     
@@ -37,6 +43,10 @@ class PeakFinder:
         name(str): output file name.
         return: frequency & PSD arrays.
         """
+        if utils.is_hdf5_output(name):
+            with h5py.File(name, "r") as _file:
+                return np.array(_file["fspec"], dtype=dtype), np.array(_file["psd"], dtype=dtype)
+
         x, y = [], []
         with open(name, "r") as _file:
             data = csv.reader(_file, delimiter="\t")
@@ -49,8 +59,21 @@ class PeakFinder:
                     continue
         return np.array(x, dtype=dtype), np.array(y, dtype=dtype)
     
+    def block_epsilon(self, i_block):
+        """Return the epsilon of block i_block, from the block table if the output has one."""
+        if self.blocks is not None:
+            return self.blocks[i_block][3]
+        return self.epsilon
+
     def block_position_gen(self):
         """Generator for block positions."""
+        # Use the block table written by lpsd if present (e.g. with --max-rel-error)
+        if self.blocks is not None:
+            for block in self.blocks:
+                yield block[0]
+            yield self.J - 1
+            return
+
         j0 = 0
         j = utils.j(j0, self.J, self.g, self.epsilon, self.fmin, self.fmax, self.fs, self.resolution)
         yield 0  # Always start at 0
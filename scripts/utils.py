@@ -32,6 +32,41 @@ def j(j0, J, g, epsilon, fmin, fmax, fs, resolution):
     return - (J - 1.) / g * np.log(Nj0*(1 - epsilon) * fmin/fs * (np.exp(g / (J - 1.)) - 1.))
 
 
+def is_hdf5_output(filename):
+    """True if filename is an LPSD output file written with --output-format hdf5."""
+    return filename.endswith((".h5", ".hdf5"))
+
+
+def read_block_table(filename):
+    """
+    Return the METHOD 1 block table from the '# Block' header lines (or the 'blocks' dataset), or None.
+
+    Rows are (first bin, last bin + 1, segment length, epsilon, probed rel. error, method).
+    """
+    if is_hdf5_output(filename):
+        import h5py
+        with h5py.File(filename, "r") as _file:
+            if "blocks" not in _file:
+                return None
+            return [(int(row[0]), int(row[1]), int(row[2]), float(row[3]), float(row[4]), int(row[5]))
+                    for row in _file["blocks"]]
+    blocks = []
+    with open(filename, "r") as _file:
+        for line in _file:
+            if not line.startswith("#"):
+                break
+            if line.startswith("# Block\t"):
+                row = line.split("\t")
+                blocks.append((int(row[1]), int(row[2]), int(row[3]), float(row[4]), float(row[5]), int(row[6])))
+    return blocks if blocks else None
+
+
+def read_block_positions(filename):
+    """Return the first bin of every METHOD 1 block from the block table, or None."""
+    blocks = read_block_table(filename)
+    return [block[0] for block in blocks] if blocks is not None else None
+
+
 def getBinVars(y, nbins, log=True):
     if log:
         bins = np.logspace(np.log10(min(y)), np.log10(max(y)), nbins, base=10)